@@ -0,0 +1,598 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Offline denoiser for finished frame sequences.  Reads the beauty and the optional
+// albedo and normal AOVs of every frame, denoises them with a single Denoiser that is
+// reused for the whole sequence, and writes the result.
+//
+// Frames flow through a bounded pipeline of read -> denoise -> write stages, so the
+// following frames are mapped and faulted in and the previous ones written while the
+// filter runs.  The denoise stage hands the mapped files to the Denoiser as strided
+// images, which packs them into the backend's buffers itself, or with the OIDN CPU
+// device reads them in place without any copy.
+//
+// Images are Portable Float Maps (.pfm, RGB, bottom row first) or raw RGBA (any
+// other extension): the four bytes "RGBA", the width, the height and a zero as
+// little-endian 32-bit integers, then top-to-bottom rows of float RGBA.  Frames are
+// denoised in the row order of the beauty file and written in the order of the
+// output format.  Raw outputs take alpha from the beauty.
+//
+// usage: denoiser_batch -beauty <pattern> -output <pattern> -frames <first> <last>
+//                       [-albedo <pattern>] [-normals <pattern>] [-mode <name>]
+//                       [-quality <fast|balanced|high>] [-cpu-devices <n>]
+//                       [-memory <MB>] [-queue <frames>] [-weights <file.tza>]
+//   A run of '#' in a pattern is replaced by the zero-padded frame number.
+//   modes: oidn-cpu (default), oidn, oidn-cuda, optix, metal, atrous
+
+#include <mcrt_denoise/denoiser/Denoiser.h>
+
+#include <tbb/parallel_pipeline.h>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace moonray::denoiser;
+
+namespace {
+
+struct ModeInfo
+{
+    const char* name;
+    DenoiserMode mode;
+};
+
+const ModeInfo sModes[] = {
+    { "oidn-cpu",  OPEN_IMAGE_DENOISE_CPU },
+    { "oidn",      OPEN_IMAGE_DENOISE },
+    { "oidn-cuda", OPEN_IMAGE_DENOISE_CUDA },
+    { "optix",     OPTIX },
+    { "metal",     METAL },
+    { "atrous",    ATROUS },
+};
+
+// Indexed by DenoiserQuality
+const char* const sQualityNames[] = { "fast", "balanced", "high" };
+
+// Raw RGBA header: magic, then width, height and a reserved zero as int32
+const char sRawMagic[4] = { 'R', 'G', 'B', 'A' };
+constexpr size_t sRawHeaderSize = 16;
+
+// Headers written here are padded so the pixels of a mapped file are this aligned
+constexpr size_t sDataAlignment = 16;
+
+// Keeps the reads that fault in mapped pages from being optimized away
+volatile unsigned char sPrefaultSink;
+
+double
+elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool
+isPfm(const std::string& path)
+{
+    return path.size() >= 4 && !strcasecmp(path.c_str() + path.size() - 4, ".pfm");
+}
+
+// Replaces the first run of '#' with the frame number padded to the run's length
+std::string
+framePath(const std::string& pattern, int frame)
+{
+    const size_t first = pattern.find('#');
+    if (first == std::string::npos) {
+        return pattern;
+    }
+    size_t end = pattern.find_first_not_of('#', first);
+    if (end == std::string::npos) {
+        end = pattern.size();
+    }
+    std::string number = std::to_string(frame);
+    if (number.size() < end - first) {
+        number.insert(0, end - first - number.size(), '0');
+    }
+    return pattern.substr(0, first) + number + pattern.substr(end);
+}
+
+// "PF" <space> width <space> height <space> scale <one whitespace character> pixels.
+// A positive scale means big-endian pixels.
+bool
+parsePfmHeader(const char* bytes, size_t size, int* width, int* height, bool* bigEndian,
+               size_t* dataOffset)
+{
+    const std::string header(bytes, std::min<size_t>(size, 256));
+    if (header.compare(0, 2, "PF") != 0) {
+        return false;
+    }
+    size_t pos = 2;
+    auto token = [&](std::string* value) {
+        while (pos < header.size() && std::isspace(static_cast<unsigned char>(header[pos]))) pos++;
+        const size_t start = pos;
+        while (pos < header.size() && !std::isspace(static_cast<unsigned char>(header[pos]))) pos++;
+        *value = header.substr(start, pos - start);
+        return !value->empty() && pos < header.size();
+    };
+    std::string w, h, scale;
+    if (!token(&w) || !token(&h) || !token(&scale)) {
+        return false;
+    }
+    *width = std::atoi(w.c_str());
+    *height = std::atoi(h.c_str());
+    *bigEndian = std::atof(scale.c_str()) > 0;
+    *dataOffset = pos + 1;
+    return true;
+}
+
+// A float image read through a read-only memory map.  The pixels are used in place
+// unless they are misaligned or big-endian, in which case they are copied out.
+class MappedImage
+{
+public:
+    MappedImage() = default;
+    ~MappedImage() { close(); }
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    // Maps the file, parses its header and faults its pages in
+    bool open(const std::string& path, std::string* errorMsg);
+    void close();
+
+    bool valid() const { return mPixels != nullptr; }
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    int channels() const { return mChannels; }
+    bool bottomUp() const { return mBottomUp; }
+
+    InputImage image() const
+    {
+        InputImage image;
+        image.data = mPixels;
+        image.pixelStride = mChannels * sizeof(float);
+        image.rowStride = mWidth * image.pixelStride;
+        return image;
+    }
+    float alpha(size_t pixel) const { return mChannels == 4 ? mPixels[pixel * 4 + 3] : 1.f; }
+
+private:
+    void* mMap = nullptr;
+    size_t mMapSize = 0;
+    std::vector<float> mCopy;
+    const float* mPixels = nullptr;
+    int mWidth = 0;
+    int mHeight = 0;
+    int mChannels = 0;
+    bool mBottomUp = false;
+};
+
+bool
+MappedImage::open(const std::string& path, std::string* errorMsg)
+{
+    close();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *errorMsg = "Cannot open " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        *errorMsg = "Cannot read " + path;
+        ::close(fd);
+        return false;
+    }
+    mMapSize = status.st_size;
+    mMap = mmap(nullptr, mMapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mMap == MAP_FAILED) {
+        mMap = nullptr;
+        *errorMsg = "Cannot map " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    madvise(mMap, mMapSize, MADV_WILLNEED);
+
+    const char* bytes = static_cast<const char*>(mMap);
+    size_t dataOffset = sRawHeaderSize;
+    bool bigEndian = false;
+    if (isPfm(path)) {
+        if (!parsePfmHeader(bytes, mMapSize, &mWidth, &mHeight, &bigEndian, &dataOffset)) {
+            *errorMsg = path + " is not an RGB Portable Float Map";
+            close();
+            return false;
+        }
+        mChannels = 3;
+        mBottomUp = true;
+    } else {
+        int32_t dims[3];
+        if (mMapSize < sRawHeaderSize || std::memcmp(bytes, sRawMagic, sizeof(sRawMagic))) {
+            *errorMsg = path + " is not a raw RGBA image";
+            close();
+            return false;
+        }
+        std::memcpy(dims, bytes + sizeof(sRawMagic), sizeof(dims));
+        mWidth = dims[0];
+        mHeight = dims[1];
+        mChannels = 4;
+        mBottomUp = false;
+    }
+
+    const size_t numFloats = static_cast<size_t>(std::max(mWidth, 0)) * std::max(mHeight, 0) * mChannels;
+    if (mWidth <= 0 || mHeight <= 0 || dataOffset + numFloats * sizeof(float) > mMapSize) {
+        *errorMsg = path + " is truncated";
+        close();
+        return false;
+    }
+
+    if (bigEndian || dataOffset % alignof(float)) {
+        mCopy.resize(numFloats);
+        std::memcpy(mCopy.data(), bytes + dataOffset, numFloats * sizeof(float));
+        if (bigEndian) {
+            uint32_t* words = reinterpret_cast<uint32_t*>(mCopy.data());
+            for (size_t i = 0; i < numFloats; i++) {
+                words[i] = __builtin_bswap32(words[i]);
+            }
+        }
+        munmap(mMap, mMapSize);
+        mMap = nullptr;
+        mPixels = mCopy.data();
+        return true;
+    }
+
+    // Fault the pages in here so the denoise stage does not wait on the disk
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    unsigned char sum = 0;
+    for (size_t offset = 0; offset < mMapSize; offset += pageSize) {
+        sum += bytes[offset];
+    }
+    sPrefaultSink = sum;
+
+    mPixels = reinterpret_cast<const float*>(bytes + dataOffset);
+    return true;
+}
+
+void
+MappedImage::close()
+{
+    if (mMap) {
+        munmap(mMap, mMapSize);
+        mMap = nullptr;
+    }
+    mCopy = std::vector<float>();
+    mPixels = nullptr;
+}
+
+// Writes rows of RGB or RGBA pixels.  bottomUp tells whether the first row in pixels
+// is the bottom one; rows are reordered if the format stores them the other way.
+bool
+writeImage(const std::string& path, int width, int height, int channels, bool bottomUp,
+           const float* pixels, std::string* errorMsg)
+{
+    const bool pfm = isPfm(path);
+    std::string header;
+    if (pfm) {
+        header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0";
+        // Pad the scale with zeros so the pixels start aligned
+        while ((header.size() + 1) % sDataAlignment) {
+            header += '0';
+        }
+        header += '\n';
+    } else {
+        const int32_t dims[3] = { width, height, 0 };
+        header.assign(sRawMagic, sizeof(sRawMagic));
+        header.append(reinterpret_cast<const char*>(dims), sizeof(dims));
+    }
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        *errorMsg = "Cannot create " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+    const size_t rowFloats = static_cast<size_t>(width) * channels;
+    if (pfm == bottomUp) {
+        ok = ok && std::fwrite(pixels, rowFloats * sizeof(float), height, file) == static_cast<size_t>(height);
+    } else {
+        for (int y = height - 1; y >= 0 && ok; y--) {
+            ok = std::fwrite(pixels + y * rowFloats, rowFloats * sizeof(float), 1, file) == 1;
+        }
+    }
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok) {
+        *errorMsg = "Cannot write " + path;
+    }
+    return ok;
+}
+
+struct Settings
+{
+    std::string beauty;
+    std::string albedo;
+    std::string normals;
+    std::string output;
+    int first = 0;
+    int last = -1;
+    DenoiserMode mode = OPEN_IMAGE_DENOISE_CPU;
+    DenoiserOptions options;
+    int queue = 3; // frames in flight
+};
+
+// A frame moving through the pipeline
+struct Frame
+{
+    int number = 0;
+    MappedImage beauty;
+    MappedImage albedo;
+    MappedImage normals;
+    std::vector<float> output; // output format's channels, beauty's row order
+    bool bottomUp = false;
+    int width = 0;
+    int height = 0;
+    std::string error;
+    double readMs = 0;
+    double denoiseMs = 0;
+    double writeMs = 0;
+};
+
+class BatchDenoiser
+{
+public:
+    explicit BatchDenoiser(const Settings& settings) : mSettings(settings) {}
+
+    // Runs the pipeline over the whole sequence.  Returns false if any frame failed.
+    bool run();
+
+private:
+    Frame* read(int number);
+    void denoise(Frame* frame);
+    void write(Frame* frame);
+
+    const Settings& mSettings;
+    std::unique_ptr<Denoiser> mDenoiser;
+    std::atomic<bool> mFailed { false };
+
+    std::mutex mReportMutex;
+    int mFramesDone = 0;
+    double mReadMs = 0;
+    double mDenoiseMs = 0;
+    double mWriteMs = 0;
+};
+
+Frame*
+BatchDenoiser::read(int number)
+{
+    const auto start = std::chrono::steady_clock::now();
+    Frame* frame = new Frame;
+    frame->number = number;
+
+    if (frame->beauty.open(framePath(mSettings.beauty, number), &frame->error) &&
+        (mSettings.albedo.empty() ||
+         frame->albedo.open(framePath(mSettings.albedo, number), &frame->error)) &&
+        (mSettings.normals.empty() ||
+         frame->normals.open(framePath(mSettings.normals, number), &frame->error))) {
+        frame->width = frame->beauty.width();
+        frame->height = frame->beauty.height();
+        frame->bottomUp = frame->beauty.bottomUp();
+        for (const MappedImage* guide : { &frame->albedo, &frame->normals }) {
+            if (!guide->valid()) continue;
+            if (guide->width() != frame->width || guide->height() != frame->height) {
+                frame->error = "AOVs differ in size from the beauty";
+            } else if (guide->bottomUp() != frame->bottomUp) {
+                frame->error = "AOVs differ in row order from the beauty, use one file format";
+            }
+        }
+    }
+    frame->readMs = elapsedMs(start);
+    return frame;
+}
+
+void
+BatchDenoiser::denoise(Frame* frame)
+{
+    if (!frame->error.empty() || mFailed) {
+        return;
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    const bool useAlbedo = frame->albedo.valid();
+    const bool useNormals = frame->normals.valid();
+    if (!mDenoiser) {
+        mDenoiser.reset(new Denoiser(mSettings.mode, frame->width, frame->height, useAlbedo,
+                                     useNormals, mSettings.options, &frame->error));
+    } else if (mDenoiser->imageWidth() != frame->width || mDenoiser->imageHeight() != frame->height) {
+        mDenoiser->reconfigure(frame->width, frame->height, useAlbedo, useNormals, &frame->error);
+    }
+    if (!frame->error.empty()) {
+        return;
+    }
+
+    // Only RGB is written, so alpha for raw outputs comes from the beauty up front
+    const int channels = isPfm(mSettings.output) ? 3 : 4;
+    const size_t numPixels = static_cast<size_t>(frame->width) * frame->height;
+    frame->output.resize(numPixels * channels);
+    if (channels == 4) {
+        for (size_t i = 0; i < numPixels; i++) {
+            frame->output[i * 4 + 3] = frame->beauty.alpha(i);
+        }
+    }
+
+    OutputImage output;
+    output.data = frame->output.data();
+    output.pixelStride = channels * sizeof(float);
+    output.rowStride = frame->width * output.pixelStride;
+    mDenoiser->denoise(frame->beauty.image(), frame->albedo.image(), frame->normals.image(),
+                       output, &frame->error);
+
+    // The inputs are no longer needed
+    frame->beauty.close();
+    frame->albedo.close();
+    frame->normals.close();
+    frame->denoiseMs = elapsedMs(start);
+}
+
+void
+BatchDenoiser::write(Frame* frame)
+{
+    const auto start = std::chrono::steady_clock::now();
+    if (frame->error.empty() && !mFailed) {
+        writeImage(framePath(mSettings.output, frame->number), frame->width, frame->height,
+                   isPfm(mSettings.output) ? 3 : 4, frame->bottomUp, frame->output.data(),
+                   &frame->error);
+    }
+    frame->writeMs = elapsedMs(start);
+
+    std::lock_guard<std::mutex> lock(mReportMutex);
+    if (!frame->error.empty()) {
+        mFailed = true;
+        std::fprintf(stderr, "frame %d: %s\n", frame->number, frame->error.c_str());
+    } else if (!mFailed) {
+        mFramesDone++;
+        mReadMs += frame->readMs;
+        mDenoiseMs += frame->denoiseMs;
+        mWriteMs += frame->writeMs;
+        std::printf("frame %d: read %.1f ms, denoise %.1f ms, write %.1f ms\n", frame->number,
+                    frame->readMs, frame->denoiseMs, frame->writeMs);
+        std::fflush(stdout);
+    }
+    delete frame;
+}
+
+bool
+BatchDenoiser::run()
+{
+    const auto start = std::chrono::steady_clock::now();
+    int next = mSettings.first;
+
+    tbb::parallel_pipeline(mSettings.queue,
+        tbb::make_filter<void, Frame*>(tbb::filter_mode::serial_in_order,
+            [&](tbb::flow_control& control) -> Frame* {
+                if (next > mSettings.last || mFailed) {
+                    control.stop();
+                    return nullptr;
+                }
+                return read(next++);
+            }) &
+        // One frame at a time in sequence order: the Denoiser is not reentrant
+        tbb::make_filter<Frame*, Frame*>(tbb::filter_mode::serial_in_order,
+            [&](Frame* frame) {
+                denoise(frame);
+                return frame;
+            }) &
+        tbb::make_filter<Frame*, void>(tbb::filter_mode::parallel,
+            [&](Frame* frame) { write(frame); }));
+
+    const double totalMs = elapsedMs(start);
+    if (mFramesDone == 0) {
+        return !mFailed;
+    }
+
+    const double n = mFramesDone;
+    std::printf("%d frames in %.2f s: %.3f frames per second\n", mFramesDone, totalMs / 1000.0,
+                n * 1000.0 / totalMs);
+    std::printf("  per frame: read %.1f ms, denoise %.1f ms, write %.1f ms\n",
+                mReadMs / n, mDenoiseMs / n, mWriteMs / n);
+    if (mDenoiser) {
+        const DenoiserStats stats = mDenoiser->stats();
+        std::printf("  denoise split: pack %.1f ms, execute %.1f ms, unpack %.1f ms\n",
+                    stats.total.pack * 1000.0 / n, stats.total.execute * 1000.0 / n,
+                    stats.total.unpack * 1000.0 / n);
+        std::printf("  filter busy %.0f%% of the time\n", 100.0 * stats.total.execute * 1000.0 / totalMs);
+    }
+    return !mFailed;
+}
+
+void
+usage(const char* argv0)
+{
+    std::fprintf(stderr,
+                 "usage: %s -beauty <pattern> -output <pattern> -frames <first> <last>\n"
+                 "          [-albedo <pattern>] [-normals <pattern>] [-mode <name>]\n"
+                 "          [-quality <fast|balanced|high>] [-cpu-devices <n>]\n"
+                 "          [-memory <MB>] [-queue <frames>] [-weights <file.tza>]\n"
+                 "  A run of '#' in a pattern is replaced by the zero-padded frame number.\n"
+                 "  Files ending in .pfm are Portable Float Maps, others raw RGBA.\n"
+                 "  modes: oidn-cpu (default), oidn, oidn-cuda, optix, metal, atrous\n",
+                 argv0);
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+    Settings settings;
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-beauty") && i + 1 < argc) {
+            settings.beauty = argv[++i];
+        } else if (!std::strcmp(argv[i], "-albedo") && i + 1 < argc) {
+            settings.albedo = argv[++i];
+        } else if (!std::strcmp(argv[i], "-normals") && i + 1 < argc) {
+            settings.normals = argv[++i];
+        } else if (!std::strcmp(argv[i], "-output") && i + 1 < argc) {
+            settings.output = argv[++i];
+        } else if (!std::strcmp(argv[i], "-frames") && i + 2 < argc) {
+            settings.first = std::atoi(argv[++i]);
+            settings.last = std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-mode") && i + 1 < argc) {
+            const char* name = argv[++i];
+            auto it = std::find_if(std::begin(sModes), std::end(sModes),
+                                   [&](const ModeInfo& m) { return !std::strcmp(m.name, name); });
+            if (it == std::end(sModes)) {
+                std::fprintf(stderr, "unknown mode '%s'\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+            settings.mode = it->mode;
+        } else if (!std::strcmp(argv[i], "-quality") && i + 1 < argc) {
+            const char* name = argv[++i];
+            auto it = std::find_if(std::begin(sQualityNames), std::end(sQualityNames),
+                                   [&](const char* q) { return !std::strcmp(q, name); });
+            if (it == std::end(sQualityNames)) {
+                std::fprintf(stderr, "unknown quality '%s'\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+            settings.options.quality = static_cast<DenoiserQuality>(it - std::begin(sQualityNames));
+        } else if (!std::strcmp(argv[i], "-cpu-devices") && i + 1 < argc) {
+            settings.options.cpuDevices = std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-memory") && i + 1 < argc) {
+            settings.options.memoryBudget = static_cast<size_t>(std::max(0, std::atoi(argv[++i]))) << 20;
+        } else if (!std::strcmp(argv[i], "-queue") && i + 1 < argc) {
+            settings.queue = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-weights") && i + 1 < argc) {
+            settings.options.weightsPath = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (settings.beauty.empty() || settings.output.empty() || settings.first < 0 ||
+        settings.last < settings.first) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!settings.normals.empty() && settings.albedo.empty()) {
+        std::fprintf(stderr, "normals require albedo\n");
+        return 1;
+    }
+
+    BatchDenoiser batch(settings);
+    return batch.run() ? 0 : 1;
+}
+
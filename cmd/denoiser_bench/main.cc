@@ -0,0 +1,558 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// End-to-end benchmark of the public Denoiser API on synthetic noisy images.  For
+// each resolution and mode it measures construction time, first-call latency,
+// steady-state per-frame latency and peak memory, and writes the results as JSON
+// so runs can be compared across library and OIDN versions.  The per-phase split
+// comes from Denoiser::stats().
+//
+// With -load, a stand-in renderer keeps that many TBB threads busy while the frames
+// are denoised, and the rate at which it completes work is reported both with and
+// without denoising.  Combined with -threads, -affinity and -arena this measures how
+// much render throughput each CPU threading setting costs.  -quality selects the
+// DenoiserQuality tier, -preview denoises at 1/scale resolution and -temporal adds
+// temporal stabilization (with zero motion).  -cpu-devices splits oidn-cpu frames into
+// bands denoised by that many devices, -1 for one per NUMA node; comparing 1 against
+// -1 on a multi-socket node gives the NUMA scaling.
+//
+// usage: denoiser_bench [-res <width> <height>]... [-mode <name>]... [-frames <n>]
+//                       [-no-albedo] [-no-normals] [-threads <n>] [-affinity <0|1>]
+//                       [-load <threads>] [-arena] [-quality <fast|balanced|high>]
+//                       [-preview <scale>] [-temporal] [-cpu-devices <n>]
+//                       [-out <file.json>]
+//   modes: oidn-cpu (default), oidn, oidn-cuda, optix, metal, atrous
+
+#include <mcrt_denoise/denoiser/Denoiser.h>
+#include <mcrt_denoise/denoiser/PackKernels.h> // for the SIMD level in the report
+
+#include <OpenImageDenoise/oidn.h>
+#include <tbb/info.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace moonray::denoiser;
+
+namespace {
+
+struct ModeInfo
+{
+    const char* name;
+    DenoiserMode mode;
+};
+
+const ModeInfo sModes[] = {
+    { "oidn-cpu",  OPEN_IMAGE_DENOISE_CPU },
+    { "oidn",      OPEN_IMAGE_DENOISE },
+    { "oidn-cuda", OPEN_IMAGE_DENOISE_CUDA },
+    { "optix",     OPTIX },
+    { "metal",     METAL },
+    { "atrous",    ATROUS },
+};
+
+struct Resolution
+{
+    int width;
+    int height;
+};
+
+// Indexed by DenoiserQuality
+const char* const sQualityNames[] = { "fast", "balanced", "high" };
+
+struct Settings
+{
+    int frames = 10;
+    bool useAlbedo = true;
+    bool useNormals = true;
+    int numThreads = 0;   // DenoiserOptions::numThreads
+    int affinity = -1;    // DenoiserOptions::affinity
+    int loadThreads = 0;  // threads of the stand-in renderer, 0 for none
+    bool useArena = false; // denoise in the renderer's arena
+    DenoiserQuality quality = QUALITY_HIGH;
+    int previewScale = 1;
+    bool temporal = false; // denoiseTemporal() instead of denoise()
+    int cpuDevices = 0;    // DenoiserOptions::cpuDevices
+};
+
+struct Result
+{
+    std::string mode;
+    Resolution res;
+    std::string error;
+    double constructMs = 0;
+    double firstCallMs = 0;
+    double frameMinMs = 0;
+    double frameMedianMs = 0;
+    double frameMeanMs = 0;
+    double packMs = 0;
+    double executeMs = 0;
+    double unpackMs = 0;
+    double stagingMB = 0;
+    double peakRssMB = 0;
+    double peakRssDeltaMB = 0;
+    double renderRateIdle = 0;      // render tasks per second without denoising
+    double renderRateDenoising = 0; // render tasks per second while denoising
+};
+
+double
+elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reads a "<key>: <n> kB" line from /proc/self/status, in MB
+double
+procStatusMB(const char* key)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    const size_t keyLength = std::strlen(key);
+    while (std::getline(status, line)) {
+        if (line.compare(0, keyLength, key) == 0 && line[keyLength] == ':') {
+            return std::atof(line.c_str() + keyLength + 1) / 1024.0;
+        }
+    }
+    return 0;
+}
+
+// Resets VmHWM to the current RSS so peaks can be measured per mode (Linux 4.0+)
+void
+resetPeakRss()
+{
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+}
+
+// Stand-in for a renderer: keeps numThreads TBB threads busy in their own arena with
+// small compute tasks and counts how many complete
+class RenderLoad
+{
+public:
+    explicit RenderLoad(int numThreads) :
+        mArena(numThreads),
+        mStop(false),
+        mTasks(0),
+        mThread([this] { run(); })
+    {
+    }
+
+    ~RenderLoad()
+    {
+        mStop = true;
+        mThread.join();
+    }
+
+    tbb::task_arena& arena() { return mArena; }
+    uint64_t tasks() const { return mTasks.load(std::memory_order_relaxed); }
+
+    // Tasks completed per second over the next seconds, with nothing else running
+    double measureRate(double seconds)
+    {
+        const uint64_t start = tasks();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        return (tasks() - start) / seconds;
+    }
+
+private:
+    void run()
+    {
+        mArena.execute([this] {
+            while (!mStop) {
+                tbb::parallel_for(0, 256, [this](int i) {
+                    // About 10us of dependent floating point math, like shading a sample
+                    float x = 1.f + i * 1e-3f;
+                    for (int j = 0; j < 4000; j++) {
+                        x = x * 0.999f + 0.001f / x;
+                    }
+                    if (x > 0.f) {
+                        mTasks.fetch_add(1, std::memory_order_relaxed);
+                    }
+                });
+            }
+        });
+    }
+
+    tbb::task_arena mArena;
+    std::atomic<bool> mStop;
+    std::atomic<uint64_t> mTasks;
+    std::thread mThread;
+};
+
+// Smooth shading, a few hard edges and per-pixel noise, so the filter has both
+// detail to keep and noise to remove
+void
+makeImages(int width, int height, std::vector<float>* beauty, std::vector<float>* albedo,
+           std::vector<float>* normals)
+{
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    beauty->resize(numPixels * 4);
+    albedo->resize(numPixels * 4);
+    normals->resize(numPixels * 4);
+
+    std::mt19937 rng(1234);
+    std::exponential_distribution<float> noise(1.f);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const size_t i = (static_cast<size_t>(y) * width + x) * 4;
+            const float u = (x + 0.5f) / width * 2.f - 1.f;
+            const float v = (y + 0.5f) / height * 2.f - 1.f;
+            const bool checker = ((x / 64) + (y / 64)) & 1;
+
+            float* a = &(*albedo)[i];
+            a[0] = checker ? 0.8f : 0.2f;
+            a[1] = checker ? 0.6f : 0.3f;
+            a[2] = checker ? 0.4f : 0.7f;
+            a[3] = 1.f;
+
+            // Sphere in the middle of the frame, a flat floor elsewhere
+            const float r2 = u * u + v * v;
+            float* n = &(*normals)[i];
+            if (r2 < 0.5f) {
+                n[0] = u;
+                n[1] = v;
+                n[2] = std::sqrt(1.f - r2);
+            } else {
+                n[0] = 0.f;
+                n[1] = 1.f;
+                n[2] = 0.f;
+            }
+            n[3] = 1.f;
+
+            const float shade = 0.25f + 0.75f * std::max(0.f, n[2] * 0.7f + n[1] * 0.3f);
+            float* b = &(*beauty)[i];
+            for (int c = 0; c < 3; c++) {
+                b[c] = a[c] * shade * noise(rng);
+            }
+            b[3] = 1.f;
+        }
+    }
+}
+
+Result
+runMode(const ModeInfo& modeInfo, const Resolution& res, const Settings& settings,
+        RenderLoad* load, const std::vector<float>& beauty, const std::vector<float>& albedo,
+        const std::vector<float>& normals)
+{
+    Result result;
+    result.mode = modeInfo.name;
+    result.res = res;
+
+    const int frames = settings.frames;
+    std::vector<float> output(beauty.size());
+    const float* albedoData = settings.useAlbedo ? albedo.data() : nullptr;
+    const float* normalsData = settings.useNormals ? normals.data() : nullptr;
+
+    DenoiserOptions options;
+    options.numThreads = settings.numThreads;
+    options.affinity = settings.affinity;
+    options.quality = settings.quality;
+    options.previewScale = settings.previewScale;
+    options.cpuDevices = settings.cpuDevices;
+    if (load && settings.useArena) {
+        tbb::task_arena& arena = load->arena();
+        options.executor = [&arena](const std::function<void()>& func) { arena.execute(func); };
+        if (options.numThreads <= 0) {
+            options.numThreads = arena.max_concurrency();
+        }
+    }
+    if (load) {
+        result.renderRateIdle = load->measureRate(0.5);
+    }
+
+    const double rssBefore = procStatusMB("VmRSS");
+    resetPeakRss();
+
+    std::string errorMsg;
+    auto denoiseFrame = [&](Denoiser& denoiser) {
+        if (settings.temporal) {
+            denoiser.denoiseTemporal(beauty.data(), albedoData, normalsData, nullptr,
+                                     output.data(), &errorMsg);
+        } else {
+            denoiser.denoise(beauty.data(), albedoData, normalsData, output.data(), &errorMsg);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    Denoiser denoiser(modeInfo.mode, res.width, res.height, settings.useAlbedo,
+                      settings.useNormals, options, &errorMsg);
+    result.constructMs = elapsedMs(start);
+    if (!errorMsg.empty()) {
+        result.error = errorMsg;
+        return result;
+    }
+
+    start = std::chrono::steady_clock::now();
+    denoiseFrame(denoiser);
+    result.firstCallMs = elapsedMs(start);
+    if (!errorMsg.empty()) {
+        result.error = errorMsg;
+        return result;
+    }
+
+    denoiser.resetStats();
+    std::vector<double> frameMs;
+    const uint64_t tasksBefore = load ? load->tasks() : 0;
+    const auto framesStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        start = std::chrono::steady_clock::now();
+        denoiseFrame(denoiser);
+        frameMs.push_back(elapsedMs(start));
+        if (!errorMsg.empty()) {
+            result.error = errorMsg;
+            return result;
+        }
+    }
+    if (load) {
+        result.renderRateDenoising = (load->tasks() - tasksBefore) * 1e3 / elapsedMs(framesStart);
+    }
+
+    result.peakRssMB = procStatusMB("VmHWM");
+    result.peakRssDeltaMB = std::max(0.0, result.peakRssMB - rssBefore);
+
+    std::sort(frameMs.begin(), frameMs.end());
+    result.frameMinMs = frameMs.front();
+    result.frameMedianMs = frameMs[frameMs.size() / 2];
+    for (double ms : frameMs) result.frameMeanMs += ms;
+    result.frameMeanMs /= frameMs.size();
+
+    const DenoiserStats stats = denoiser.stats();
+    result.packMs = stats.total.pack * 1e3 / frames;
+    result.executeMs = stats.total.execute * 1e3 / frames;
+    result.unpackMs = stats.total.unpack * 1e3 / frames;
+    result.stagingMB = stats.stagingBytes / (1024.0 * 1024.0);
+
+    return result;
+}
+
+std::string
+jsonEscape(const std::string& s)
+{
+    std::string escaped;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void
+writeJson(std::FILE* out, const std::vector<Result>& results, const Settings& settings)
+{
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+    char timestamp[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"host\": \"%s\",\n", jsonEscape(hostname).c_str());
+    std::fprintf(out, "  \"timestamp\": \"%s\",\n", timestamp);
+    std::fprintf(out, "  \"oidn_version\": \"%d.%d.%d\",\n",
+                 OIDN_VERSION_MAJOR, OIDN_VERSION_MINOR, OIDN_VERSION_PATCH);
+    std::fprintf(out, "  \"simd\": \"%s\",\n", simdLevelName(detectSimdLevel()));
+    std::fprintf(out, "  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+    std::fprintf(out, "  \"numa_nodes\": %zu,\n", tbb::info::numa_nodes().size());
+    std::fprintf(out, "  \"frames\": %d,\n", settings.frames);
+    std::fprintf(out, "  \"albedo\": %s,\n", settings.useAlbedo ? "true" : "false");
+    std::fprintf(out, "  \"normals\": %s,\n", settings.useNormals ? "true" : "false");
+    std::fprintf(out, "  \"num_threads\": %d,\n", settings.numThreads);
+    std::fprintf(out, "  \"affinity\": %d,\n", settings.affinity);
+    std::fprintf(out, "  \"load_threads\": %d,\n", settings.loadThreads);
+    std::fprintf(out, "  \"arena\": %s,\n", settings.useArena ? "true" : "false");
+    std::fprintf(out, "  \"quality\": \"%s\",\n", sQualityNames[settings.quality]);
+    std::fprintf(out, "  \"preview_scale\": %d,\n", settings.previewScale);
+    std::fprintf(out, "  \"temporal\": %s,\n", settings.temporal ? "true" : "false");
+    std::fprintf(out, "  \"cpu_devices\": %d,\n", settings.cpuDevices);
+    std::fprintf(out, "  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::fprintf(out, "%s\n    {\n", i ? "," : "");
+        std::fprintf(out, "      \"mode\": \"%s\",\n", r.mode.c_str());
+        std::fprintf(out, "      \"width\": %d,\n", r.res.width);
+        std::fprintf(out, "      \"height\": %d,\n", r.res.height);
+        if (!r.error.empty()) {
+            std::fprintf(out, "      \"error\": \"%s\"\n    }", jsonEscape(r.error).c_str());
+            continue;
+        }
+        std::fprintf(out, "      \"construct_ms\": %.3f,\n", r.constructMs);
+        std::fprintf(out, "      \"first_call_ms\": %.3f,\n", r.firstCallMs);
+        std::fprintf(out, "      \"frame_min_ms\": %.3f,\n", r.frameMinMs);
+        std::fprintf(out, "      \"frame_median_ms\": %.3f,\n", r.frameMedianMs);
+        std::fprintf(out, "      \"frame_mean_ms\": %.3f,\n", r.frameMeanMs);
+        std::fprintf(out, "      \"pack_ms\": %.3f,\n", r.packMs);
+        std::fprintf(out, "      \"execute_ms\": %.3f,\n", r.executeMs);
+        std::fprintf(out, "      \"unpack_ms\": %.3f,\n", r.unpackMs);
+        std::fprintf(out, "      \"staging_mb\": %.1f,\n", r.stagingMB);
+        std::fprintf(out, "      \"peak_rss_mb\": %.1f,\n", r.peakRssMB);
+        if (settings.loadThreads > 0) {
+            std::fprintf(out, "      \"render_rate_idle\": %.0f,\n", r.renderRateIdle);
+            std::fprintf(out, "      \"render_rate_denoising\": %.0f,\n", r.renderRateDenoising);
+            std::fprintf(out, "      \"render_throughput\": %.3f,\n",
+                         r.renderRateIdle > 0 ? r.renderRateDenoising / r.renderRateIdle : 0.0);
+        }
+        std::fprintf(out, "      \"peak_rss_delta_mb\": %.1f\n    }", r.peakRssDeltaMB);
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+void
+usage(const char* argv0)
+{
+    std::fprintf(stderr,
+                 "usage: %s [-res <width> <height>]... [-mode <name>]... [-frames <n>]\n"
+                 "          [-no-albedo] [-no-normals] [-threads <n>] [-affinity <0|1>]\n"
+                 "          [-load <threads>] [-arena] [-quality <fast|balanced|high>]\n"
+                 "          [-preview <scale>] [-temporal] [-cpu-devices <n>]\n"
+                 "          [-out <file.json>]\n"
+                 "  modes: oidn-cpu (default), oidn, oidn-cuda, optix, metal, atrous\n",
+                 argv0);
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+    std::vector<Resolution> resolutions;
+    std::vector<ModeInfo> modes;
+    Settings settings;
+    const char* outPath = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-res") && i + 2 < argc) {
+            const int width = std::atoi(argv[++i]);
+            const int height = std::atoi(argv[++i]);
+            resolutions.push_back({ width, height });
+        } else if (!std::strcmp(argv[i], "-mode") && i + 1 < argc) {
+            const char* name = argv[++i];
+            auto it = std::find_if(std::begin(sModes), std::end(sModes),
+                                   [&](const ModeInfo& m) { return !std::strcmp(m.name, name); });
+            if (it == std::end(sModes)) {
+                std::fprintf(stderr, "unknown mode '%s'\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+            modes.push_back(*it);
+        } else if (!std::strcmp(argv[i], "-frames") && i + 1 < argc) {
+            settings.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-no-albedo")) {
+            settings.useAlbedo = false;
+        } else if (!std::strcmp(argv[i], "-no-normals")) {
+            settings.useNormals = false;
+        } else if (!std::strcmp(argv[i], "-threads") && i + 1 < argc) {
+            settings.numThreads = std::max(0, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-affinity") && i + 1 < argc) {
+            settings.affinity = std::atoi(argv[++i]) ? 1 : 0;
+        } else if (!std::strcmp(argv[i], "-load") && i + 1 < argc) {
+            settings.loadThreads = std::max(0, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-arena")) {
+            settings.useArena = true;
+        } else if (!std::strcmp(argv[i], "-quality") && i + 1 < argc) {
+            const char* name = argv[++i];
+            auto it = std::find_if(std::begin(sQualityNames), std::end(sQualityNames),
+                                   [&](const char* q) { return !std::strcmp(q, name); });
+            if (it == std::end(sQualityNames)) {
+                std::fprintf(stderr, "unknown quality '%s'\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+            settings.quality = static_cast<DenoiserQuality>(it - std::begin(sQualityNames));
+        } else if (!std::strcmp(argv[i], "-preview") && i + 1 < argc) {
+            settings.previewScale = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-temporal")) {
+            settings.temporal = true;
+        } else if (!std::strcmp(argv[i], "-cpu-devices") && i + 1 < argc) {
+            settings.cpuDevices = std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-out") && i + 1 < argc) {
+            outPath = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (settings.useNormals && !settings.useAlbedo) {
+        std::fprintf(stderr, "normals require albedo\n");
+        return 1;
+    }
+    if (resolutions.empty()) {
+        resolutions = { { 1920, 1080 }, { 3840, 2160 } };
+    }
+    if (modes.empty()) {
+        modes.push_back(sModes[0]);
+    }
+    if (settings.useArena && settings.loadThreads == 0) {
+        std::fprintf(stderr, "-arena requires -load\n");
+        return 1;
+    }
+
+    std::unique_ptr<RenderLoad> load;
+    if (settings.loadThreads > 0) {
+        load.reset(new RenderLoad(settings.loadThreads));
+    }
+
+    std::vector<Result> results;
+    std::vector<float> beauty, albedo, normals;
+    for (const Resolution& res : resolutions) {
+        makeImages(res.width, res.height, &beauty, &albedo, &normals);
+        for (const ModeInfo& mode : modes) {
+            results.push_back(runMode(mode, res, settings, load.get(), beauty, albedo, normals));
+            const Result& r = results.back();
+            if (r.error.empty()) {
+                std::fprintf(stderr, "%-10s %5d x %-5d  construct %8.2f ms  first %8.2f ms  "
+                             "frame %8.2f ms  peak +%.1f MB",
+                             r.mode.c_str(), res.width, res.height, r.constructMs, r.firstCallMs,
+                             r.frameMedianMs, r.peakRssDeltaMB);
+                if (load) {
+                    std::fprintf(stderr, "  render throughput %.1f%%",
+                                 r.renderRateIdle > 0 ? 100 * r.renderRateDenoising / r.renderRateIdle : 0.0);
+                }
+                std::fprintf(stderr, "\n");
+            } else {
+                std::fprintf(stderr, "%-10s %5d x %-5d  %s\n",
+                             r.mode.c_str(), res.width, res.height, r.error.c_str());
+            }
+        }
+    }
+
+    std::FILE* out = stdout;
+    if (outPath) {
+        out = std::fopen(outPath, "w");
+        if (!out) {
+            std::fprintf(stderr, "unable to write %s\n", outPath);
+            return 1;
+        }
+    }
+    writeJson(out, results, settings);
+    if (out != stdout) {
+        std::fclose(out);
+    }
+
+    return 0;
+}
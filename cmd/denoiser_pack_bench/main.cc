@@ -0,0 +1,129 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+// Microbenchmark for the RGBA <-> RGB pack/unpack kernels used by the OIDN backend.
+// Reports throughput in GB/s for the original scalar loops, each supported SIMD
+// level on one thread, and the multithreaded entry points.
+//
+// usage: denoiser_pack_bench [-res <width> <height>] [-iterations <n>]
+
+#include <mcrt_denoise/denoiser/PackKernels.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+using namespace moonray::denoiser;
+
+namespace {
+
+// The loops OIDNDenoiserImpl::denoise() used before the kernels were introduced
+void
+legacyPack(const float* src, float* dst, int numPixels)
+{
+    for (int i = 0; i < numPixels; i++) {
+        dst[i * 3] = src[i * 4];
+        dst[i * 3 + 1] = src[i * 4 + 1];
+        dst[i * 3 + 2] = src[i * 4 + 2];
+    }
+}
+
+void
+legacyUnpack(const float* src, const float* alphaSrc, float* dst, int numPixels)
+{
+    for (int i = 0; i < numPixels; i++) {
+        dst[i * 4] = src[i * 3];
+        dst[i * 4 + 1] = src[i * 3 + 1];
+        dst[i * 4 + 2] = src[i * 3 + 2];
+        dst[i * 4 + 3] = alphaSrc[i * 4 + 3];
+    }
+}
+
+// Returns the best time in seconds over the given number of iterations
+double
+timeBest(int iterations, const std::function<void()>& func)
+{
+    func(); // warm up caches and the TBB thread pool
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+void
+report(const char* name, double packSec, double unpackSec, size_t numPixels)
+{
+    // pack reads RGBA and writes RGB, unpack reads RGB plus the RGBA alpha source and writes RGBA
+    const double packBytes = numPixels * (4 + 3) * sizeof(float);
+    const double unpackBytes = numPixels * (3 + 4 + 4) * sizeof(float);
+    std::printf("%-24s pack %8.3f ms %7.2f GB/s   unpack %8.3f ms %7.2f GB/s\n",
+                name,
+                packSec * 1e3, packBytes / packSec * 1e-9,
+                unpackSec * 1e3, unpackBytes / unpackSec * 1e-9);
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+    int width = 3840;
+    int height = 2160;
+    int iterations = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-res") && i + 2 < argc) {
+            width = std::atoi(argv[++i]);
+            height = std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-iterations") && i + 1 < argc) {
+            iterations = std::atoi(argv[++i]);
+        } else {
+            std::fprintf(stderr, "usage: %s [-res <width> <height>] [-iterations <n>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    std::vector<float> rgba(numPixels * 4);
+    std::vector<float> rgb(numPixels * 3);
+    std::vector<float> result(numPixels * 4);
+    for (size_t i = 0; i < rgba.size(); i++) {
+        rgba[i] = static_cast<float>(i % 1021) / 1021.f;
+    }
+
+    std::printf("%d x %d, best of %d, detected %s\n",
+                width, height, iterations, simdLevelName(detectSimdLevel()));
+
+    report("legacy loops",
+           timeBest(iterations, [&] { legacyPack(rgba.data(), rgb.data(), numPixels); }),
+           timeBest(iterations, [&] { legacyUnpack(rgb.data(), rgba.data(), result.data(), numPixels); }),
+           numPixels);
+
+    for (SimdLevel level : { SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+        if (level > detectSimdLevel()) break;
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s (1 thread)", simdLevelName(level));
+        report(name,
+               timeBest(iterations, [&] { packRGBAtoRGBSpan(level, rgba.data(), rgb.data(), numPixels); }),
+               timeBest(iterations, [&] {
+                   unpackRGBtoRGBASpan(level, rgb.data(), rgba.data(), result.data(), numPixels);
+               }),
+               numPixels);
+    }
+
+    report("parallel",
+           timeBest(iterations, [&] { packRGBAtoRGB(rgba.data(), rgb.data(), width, height); }),
+           timeBest(iterations, [&] { unpackRGBtoRGBA(rgb.data(), rgba.data(), result.data(), width, height); }),
+           numPixels);
+
+    return 0;
+}
+
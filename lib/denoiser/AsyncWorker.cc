@@ -0,0 +1,58 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "AsyncWorker.h"
+
+namespace moonray {
+namespace denoiser {
+
+AsyncWorker::AsyncWorker() :
+    mStop(false),
+    mThread([this] { run(); })
+{
+}
+
+AsyncWorker::~AsyncWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_one();
+    mThread.join();
+}
+
+std::shared_future<std::string>
+AsyncWorker::submit(std::function<std::string()> task)
+{
+    std::packaged_task<std::string()> packaged(std::move(task));
+    std::shared_future<std::string> result = packaged.get_future().share();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTasks.push_back(std::move(packaged));
+    }
+    mWake.notify_one();
+    return result;
+}
+
+void
+AsyncWorker::run()
+{
+    while (true) {
+        std::packaged_task<std::string()> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWake.wait(lock, [this] { return mStop || !mTasks.empty(); });
+            if (mTasks.empty()) {
+                return;
+            }
+            task = std::move(mTasks.front());
+            mTasks.pop_front();
+        }
+        task();
+    }
+}
+
+} // namespace denoiser
+} // namespace moonray
+
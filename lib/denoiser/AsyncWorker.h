@@ -0,0 +1,45 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace moonray {
+namespace denoiser {
+
+// One thread, started once, that runs the denoises of Denoiser::denoiseAsync() one
+// at a time in the order they were submitted.  Each task returns an error message,
+// empty on success.
+
+class AsyncWorker
+{
+public:
+    AsyncWorker();
+    // Finishes the tasks already submitted
+    ~AsyncWorker();
+
+    AsyncWorker(const AsyncWorker& other) = delete;
+    AsyncWorker &operator=(const AsyncWorker& other) = delete;
+
+    std::shared_future<std::string> submit(std::function<std::string()> task);
+
+private:
+    void run();
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<std::packaged_task<std::string()>> mTasks;
+    bool mStop;
+    std::thread mThread;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,548 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "AtrousDenoiserImpl.h"
+#include "GuideWeights.h"
+#include "PackKernels.h"
+#include "RowRanges.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// B3 spline kernel by distance in taps: 3/8, 1/4, 1/16
+constexpr float sKernel[3] = { 0.375f, 0.25f, 0.0625f };
+
+// Luminance tolerance of the first iteration, in tone-mapped units l / (1 + l)
+constexpr float sColorSigma = 0.25f;
+
+// Tasks filter at least this many output rows per tap spacing, so the rows they pass
+// horizontally twice, once for each of two neighbouring tasks, stay a small share
+constexpr int sMinRowsPerStep = 16;
+
+// A neighbour of every pixel in a span: its offsets in floats within the color planes
+// and within the guide planes, which differ where the color comes from a ring of
+// rows, and its kernel weight
+struct Tap
+{
+    ptrdiff_t colorOffset;
+    ptrdiff_t guideOffset;
+    float weight;
+};
+
+// Planes one span of a pass reads and writes, each pointing at the span's first
+// pixel: RGB and the tone-mapped luminance of the color, and the guides, which are
+// null when not used
+struct PassPlanes
+{
+    const float *color[4];
+    float *output[4];
+    const float *albedo[3];
+    const float *normals[3];
+    float colorFalloff; // 1 / (2 sigma^2) of this iteration's luminance tolerance
+};
+
+// Luminance mapped to [0, 1) so the color tolerance works the same for any exposure
+inline float
+tone(float r, float g, float b)
+{
+    const float l = std::max(0.2126f * r + 0.7152f * g + 0.0722f * b, 0.f);
+    return l / (1.f + l);
+}
+
+// Scales the vectors in rows of three planes to unit length, leaving zero ones zero
+void
+normalizeRows(int width, int firstRow, int endRow, size_t planeSize, float *planes)
+{
+    float *x = planes + static_cast<size_t>(firstRow) * width;
+    float *y = x + planeSize;
+    float *z = y + planeSize;
+    const size_t count = static_cast<size_t>(endRow - firstRow) * width;
+    for (size_t i = 0; i < count; i++) {
+        const float length = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+        const float scale = length > 0.f ? 1.f / std::sqrt(length) : 0.f;
+        x[i] *= scale;
+        y[i] *= scale;
+        z[i] *= scale;
+    }
+}
+
+// Fills the fourth plane of rows of RGB planes with tone()
+void
+toneRows(int width, int firstRow, int endRow, size_t planeSize, float *planes)
+{
+    const size_t begin = static_cast<size_t>(firstRow) * width;
+    const size_t end = static_cast<size_t>(endRow) * width;
+    for (size_t i = begin; i < end; i++) {
+        planes[3 * planeSize + i] = tone(planes[i], planes[planeSize + i], planes[2 * planeSize + i]);
+    }
+}
+
+// The planes moved on by colorIndex, guideIndex and outputIndex pixels
+PassPlanes
+offsetPlanes(const PassPlanes& p, size_t colorIndex, size_t guideIndex, size_t outputIndex)
+{
+    PassPlanes span = p;
+    for (int c = 0; c < 4; c++) {
+        span.color[c] += colorIndex;
+        span.output[c] += outputIndex;
+    }
+    for (int c = 0; c < 3; c++) {
+        if (span.albedo[c]) span.albedo[c] += guideIndex;
+        if (span.normals[c]) span.normals[c] += guideIndex;
+    }
+    return span;
+}
+
+// Filters count pixels of the span with the given taps
+void
+filterScalar(const PassPlanes& p, size_t count, const Tap *taps, int numTaps)
+{
+    for (size_t i = 0; i < count; i++) {
+        const float c[3] = { p.color[0][i], p.color[1][i], p.color[2][i] };
+        const float t = p.color[3][i];
+        float a[3], n[3];
+        for (int ch = 0; ch < 3; ch++) {
+            a[ch] = p.albedo[0] ? p.albedo[ch][i] : 0.f;
+            n[ch] = p.normals[0] ? p.normals[ch][i] : 0.f;
+        }
+        const float lengthN = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+
+        float sum[3] = { sKernel[0] * c[0], sKernel[0] * c[1], sKernel[0] * c[2] };
+        float weightSum = sKernel[0];
+        for (int k = 0; k < numTaps; k++) {
+            const size_t q = i + taps[k].colorOffset;
+            const size_t g = i + taps[k].guideOffset;
+            const float qc[3] = { p.color[0][q], p.color[1][q], p.color[2][q] };
+            const float dt = t - p.color[3][q];
+            float w = 1.f / (1.f + p.colorFalloff * dt * dt);
+            w = taps[k].weight * w * w;
+            if (p.albedo[0]) {
+                const float qa[3] = { p.albedo[0][g], p.albedo[1][g], p.albedo[2][g] };
+                w *= albedoWeight(a, qa, sAlbedoFalloff);
+            }
+            if (p.normals[0]) {
+                const float qn[3] = { p.normals[0][g], p.normals[1][g], p.normals[2][g] };
+                w *= normalWeight(n, lengthN, qn);
+            }
+            sum[0] += w * qc[0];
+            sum[1] += w * qc[1];
+            sum[2] += w * qc[2];
+            weightSum += w;
+        }
+        const float norm = 1.f / weightSum;
+        p.output[0][i] = sum[0] * norm;
+        p.output[1][i] = sum[1] * norm;
+        p.output[2][i] = sum[2] * norm;
+        p.output[3][i] = tone(p.output[0][i], p.output[1][i], p.output[2][i]);
+    }
+}
+
+// 1 / x for x >= 1: the hardware estimate refined by one Newton-Raphson step, accurate
+// to about 1e-7 and several times the throughput of a division
+__attribute__((target("avx2,fma"))) inline __m256
+reciprocalAVX2(__m256 x)
+{
+    const __m256 r = _mm256_rcp_ps(x);
+    return _mm256_mul_ps(r, _mm256_fnmadd_ps(x, r, _mm256_set1_ps(2.f)));
+}
+
+__attribute__((target("avx2,fma"))) inline __m256
+toneAVX2(__m256 r, __m256 g, __m256 b)
+{
+    __m256 l = _mm256_mul_ps(b, _mm256_set1_ps(0.0722f));
+    l = _mm256_fmadd_ps(g, _mm256_set1_ps(0.7152f), l);
+    l = _mm256_fmadd_ps(r, _mm256_set1_ps(0.2126f), l);
+    l = _mm256_max_ps(l, _mm256_setzero_ps());
+    // l / (1 + l) = 1 - 1 / (1 + l)
+    const __m256 one = _mm256_set1_ps(1.f);
+    return _mm256_sub_ps(one, reciprocalAVX2(_mm256_add_ps(l, one)));
+}
+
+__attribute__((target("avx2,fma"))) inline __m256
+dotAVX2(__m256 x0, __m256 x1, __m256 x2, __m256 y0, __m256 y1, __m256 y2)
+{
+    return _mm256_fmadd_ps(x0, y0, _mm256_fmadd_ps(x1, y1, _mm256_mul_ps(x2, y2)));
+}
+
+// 8 pixels per iteration, the remainder goes to filterScalar().  The normals are unit
+// length or zero, so normalWeight() needs no division by their lengths.
+__attribute__((target("avx2,fma"))) void
+filterAVX2(const PassPlanes& p, size_t count, const Tap *taps, int numTaps)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 center = _mm256_set1_ps(sKernel[0]);
+    const __m256 colorFalloff = _mm256_set1_ps(p.colorFalloff);
+    const __m256 albedoFalloff = _mm256_set1_ps(sAlbedoFalloff);
+    const bool useAlbedo = p.albedo[0] != nullptr;
+    const bool useNormals = p.normals[0] != nullptr;
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 c0 = _mm256_loadu_ps(p.color[0] + i);
+        const __m256 c1 = _mm256_loadu_ps(p.color[1] + i);
+        const __m256 c2 = _mm256_loadu_ps(p.color[2] + i);
+        const __m256 t = _mm256_loadu_ps(p.color[3] + i);
+        __m256 a0 = zero, a1 = zero, a2 = zero;
+        __m256 n0 = zero, n1 = zero, n2 = zero, nLength = zero;
+        if (useAlbedo) {
+            a0 = _mm256_loadu_ps(p.albedo[0] + i);
+            a1 = _mm256_loadu_ps(p.albedo[1] + i);
+            a2 = _mm256_loadu_ps(p.albedo[2] + i);
+        }
+        if (useNormals) {
+            n0 = _mm256_loadu_ps(p.normals[0] + i);
+            n1 = _mm256_loadu_ps(p.normals[1] + i);
+            n2 = _mm256_loadu_ps(p.normals[2] + i);
+            nLength = dotAVX2(n0, n1, n2, n0, n1, n2);
+        }
+
+        __m256 sum0 = _mm256_mul_ps(center, c0);
+        __m256 sum1 = _mm256_mul_ps(center, c1);
+        __m256 sum2 = _mm256_mul_ps(center, c2);
+        __m256 weightSum = center;
+        for (int k = 0; k < numTaps; k++) {
+            const size_t q = i + taps[k].colorOffset;
+            const size_t g = i + taps[k].guideOffset;
+            const __m256 q0 = _mm256_loadu_ps(p.color[0] + q);
+            const __m256 q1 = _mm256_loadu_ps(p.color[1] + q);
+            const __m256 q2 = _mm256_loadu_ps(p.color[2] + q);
+            const __m256 dt = _mm256_sub_ps(t, _mm256_loadu_ps(p.color[3] + q));
+            __m256 w = reciprocalAVX2(_mm256_fmadd_ps(colorFalloff, _mm256_mul_ps(dt, dt), one));
+            w = _mm256_mul_ps(_mm256_mul_ps(w, w), _mm256_set1_ps(taps[k].weight));
+            if (useAlbedo) {
+                const __m256 d0 = _mm256_sub_ps(a0, _mm256_loadu_ps(p.albedo[0] + g));
+                const __m256 d1 = _mm256_sub_ps(a1, _mm256_loadu_ps(p.albedo[1] + g));
+                const __m256 d2 = _mm256_sub_ps(a2, _mm256_loadu_ps(p.albedo[2] + g));
+                const __m256 d = dotAVX2(d0, d1, d2, d0, d1, d2);
+                const __m256 wa = reciprocalAVX2(_mm256_fmadd_ps(albedoFalloff, d, one));
+                w = _mm256_mul_ps(w, _mm256_mul_ps(wa, wa));
+            }
+            if (useNormals) {
+                const __m256 m0 = _mm256_loadu_ps(p.normals[0] + g);
+                const __m256 m1 = _mm256_loadu_ps(p.normals[1] + g);
+                const __m256 m2 = _mm256_loadu_ps(p.normals[2] + g);
+                const __m256 lengths = _mm256_mul_ps(nLength, dotAVX2(m0, m1, m2, m0, m1, m2));
+                const __m256 cosine = _mm256_max_ps(dotAVX2(n0, n1, n2, m0, m1, m2), zero);
+                __m256 wn = _mm256_mul_ps(cosine, cosine);
+                wn = _mm256_mul_ps(wn, wn);
+                wn = _mm256_mul_ps(wn, wn);
+                wn = _mm256_mul_ps(wn, wn);
+                wn = _mm256_blendv_ps(one, wn, _mm256_cmp_ps(lengths, zero, _CMP_GT_OQ));
+                w = _mm256_mul_ps(w, wn);
+            }
+            sum0 = _mm256_fmadd_ps(w, q0, sum0);
+            sum1 = _mm256_fmadd_ps(w, q1, sum1);
+            sum2 = _mm256_fmadd_ps(w, q2, sum2);
+            weightSum = _mm256_add_ps(weightSum, w);
+        }
+        const __m256 norm = _mm256_div_ps(one, weightSum);
+        sum0 = _mm256_mul_ps(sum0, norm);
+        sum1 = _mm256_mul_ps(sum1, norm);
+        sum2 = _mm256_mul_ps(sum2, norm);
+        _mm256_storeu_ps(p.output[0] + i, sum0);
+        _mm256_storeu_ps(p.output[1] + i, sum1);
+        _mm256_storeu_ps(p.output[2] + i, sum2);
+        _mm256_storeu_ps(p.output[3] + i, toneAVX2(sum0, sum1, sum2));
+    }
+    filterScalar(offsetPlanes(p, i, i, i), count - i, taps, numTaps);
+}
+
+void
+filterSpan(const PassPlanes& p, size_t count, const Tap *taps, int numTaps, bool avx2)
+{
+    if (avx2) {
+        filterAVX2(p, count, taps, numTaps);
+    } else {
+        filterScalar(p, count, taps, numTaps);
+    }
+}
+
+// Taps at the given spacing of a pixel at position along a side of size pixels.  Taps
+// that fall outside the image are dropped.  colorStride and guideStride are the
+// offsets of the next pixel along the side, colorOffsets, if given, the offsets of
+// each tap's color instead.  Returns the number of taps.
+int
+gatherTaps(int position, int size, int step, ptrdiff_t colorStride, ptrdiff_t guideStride,
+           const ptrdiff_t *colorOffsets, Tap *taps)
+{
+    int numTaps = 0;
+    for (int k = -2; k <= 2; k++) {
+        const int neighbour = position + k * step;
+        if (k != 0 && neighbour >= 0 && neighbour < size) {
+            const ptrdiff_t colorOffset = colorOffsets ? colorOffsets[k + 2] : k * step * colorStride;
+            taps[numTaps++] = { colorOffset, k * step * guideStride, sKernel[std::abs(k)] };
+        }
+    }
+    return numTaps;
+}
+
+// One horizontal pass over a row with the given tap spacing.  p points at the row.
+void
+filterRow(const PassPlanes& p, int width, int step, bool avx2)
+{
+    Tap taps[4];
+    // Only pixels within two taps of the left and right edges lose taps
+    const int interiorBegin = std::min(2 * step, width);
+    const int interiorEnd = std::max(interiorBegin, width - 2 * step);
+    for (int x = 0; x < interiorBegin; x++) {
+        filterScalar(offsetPlanes(p, x, x, x), 1, taps,
+                     gatherTaps(x, width, step, 1, 1, nullptr, taps));
+    }
+    if (interiorEnd > interiorBegin) {
+        const int numTaps = gatherTaps(interiorBegin, width, step, 1, 1, nullptr, taps);
+        filterSpan(offsetPlanes(p, interiorBegin, interiorBegin, interiorBegin),
+                   interiorEnd - interiorBegin, taps, numTaps, avx2);
+    }
+    for (int x = interiorEnd; x < width; x++) {
+        filterScalar(offsetPlanes(p, x, x, x), 1, taps,
+                     gatherTaps(x, width, step, 1, 1, nullptr, taps));
+    }
+}
+
+} // namespace
+
+AtrousDenoiserImpl::AtrousDenoiserImpl(int width,
+                                       int height,
+                                       bool useAlbedo,
+                                       bool useNormals,
+                                       const DenoiserOptions& options) :
+    DenoiserImpl(width, height, useAlbedo, useNormals),
+    mIterations(iterations(options.quality))
+{
+    // The filter works on tone-mapped luminance and needs no exposure, so only
+    // sanitizing applies
+    setInputConditioning(options);
+    scene_rdl2::logging::Logger::info("Creating a-trous denoiser (",
+                                      simdLevelName(detectSimdLevel()), ", ", mIterations,
+                                      " iterations)");
+    allocate();
+}
+
+int
+AtrousDenoiserImpl::iterations(DenoiserQuality quality)
+{
+    switch (quality) {
+    case QUALITY_FAST:     return 1;
+    case QUALITY_BALANCED: return 2;
+    case QUALITY_HIGH:     return 3;
+    }
+    return 3;
+}
+
+void
+AtrousDenoiserImpl::allocate()
+{
+    const size_t numFloats = static_cast<size_t>(mWidth) * mHeight * 3;
+    mColor.resize(numFloats + numFloats / 3);
+    mScratch.resize(mColor.size());
+    mAlbedo.resize(mUseAlbedo ? numFloats : 0);
+    mNormals.resize(mUseNormals ? numFloats : 0);
+    invalidateGuides();
+}
+
+bool
+AtrousDenoiserImpl::reconfigure(int width,
+                                int height,
+                                bool useAlbedo,
+                                bool useNormals,
+                                std::string* errorMsg)
+{
+    mWidth = width;
+    mHeight = height;
+    mUseAlbedo = useAlbedo;
+    mUseNormals = useNormals;
+    allocate();
+    return true;
+}
+
+int
+AtrousDenoiserImpl::tileOverlap() const
+{
+    // Two taps at spacings 1, 2, 4, ...
+    return 2 * ((1 << mIterations) - 1);
+}
+
+void
+AtrousDenoiserImpl::setQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    mIterations = iterations(quality);
+}
+
+void
+AtrousDenoiserImpl::releaseMemory()
+{
+    // The planes are allocated again by the next denoise
+    std::vector<float>().swap(mColor);
+    std::vector<float>().swap(mScratch);
+    std::vector<float>().swap(mAlbedo);
+    std::vector<float>().swap(mNormals);
+    mRings.clear();
+}
+
+size_t
+AtrousDenoiserImpl::stagingBytes() const
+{
+    size_t floats = mColor.capacity() + mScratch.capacity() + mAlbedo.capacity() +
+                    mNormals.capacity();
+    for (const std::vector<float>& ring : mRings) {
+        floats += ring.capacity();
+    }
+    return floats * sizeof(float);
+}
+
+void
+AtrousDenoiserImpl::filter()
+{
+    const bool avx2 = detectSimdLevel() >= SimdLevel::AVX2;
+    const int width = mWidth;
+    const int height = mHeight;
+    const size_t numPixels = static_cast<size_t>(width) * height;
+
+    for (int i = 0; i < mIterations; i++) {
+        const int step = 1 << i;
+        const int reach = 2 * step;
+        const float sigma = sColorSigma / step;
+
+        // Each iteration filters mColor into mScratch, then they swap
+        PassPlanes image;
+        for (int c = 0; c < 4; c++) {
+            image.color[c] = &mColor[c * numPixels];
+            image.output[c] = &mScratch[c * numPixels];
+        }
+        for (int c = 0; c < 3; c++) {
+            image.albedo[c] = mUseAlbedo ? &mAlbedo[c * numPixels] : nullptr;
+            image.normals[c] = mUseNormals ? &mNormals[c * numPixels] : nullptr;
+        }
+        image.colorFalloff = 1.f / (2.f * sigma * sigma);
+
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            // The horizontal pass of the rows within reach of the current one, in a
+            // ring of rows that stays in the cache for the vertical pass
+            const int ringRows = std::min(2 * reach + 1, height);
+            const size_t ringPlane = static_cast<size_t>(ringRows) * width;
+            std::vector<float>& ring = mRings.local();
+            ring.resize(4 * ringPlane);
+            auto ringRow = [&](int y) { return static_cast<size_t>(y % ringRows) * width; };
+
+            PassPlanes horizontal = image;
+            PassPlanes vertical = image;
+            for (int c = 0; c < 4; c++) {
+                horizontal.output[c] = &ring[c * ringPlane];
+                vertical.color[c] = &ring[c * ringPlane];
+            }
+
+            int nextRow = std::max(firstRow - reach, 0);
+            for (int y = firstRow; y < endRow; y++) {
+                for (; nextRow <= std::min(y + reach, height - 1); nextRow++) {
+                    const size_t row = static_cast<size_t>(nextRow) * width;
+                    filterRow(offsetPlanes(horizontal, row, row, ringRow(nextRow)), width, step,
+                              avx2);
+                }
+                ptrdiff_t colorOffsets[5];
+                for (int k = -2; k <= 2; k++) {
+                    const int neighbour = y + k * step;
+                    colorOffsets[k + 2] = neighbour >= 0 && neighbour < height ?
+                        static_cast<ptrdiff_t>(ringRow(neighbour)) - static_cast<ptrdiff_t>(ringRow(y)) : 0;
+                }
+                Tap taps[4];
+                const int numTaps = gatherTaps(y, height, step, 0, width, colorOffsets, taps);
+                const size_t row = static_cast<size_t>(y) * width;
+                filterSpan(offsetPlanes(vertical, ringRow(y), row, row), width, taps, numTaps, avx2);
+            }
+        }, sMinRowsPerStep * step);
+        std::swap(mColor, mScratch);
+    }
+}
+
+void
+AtrousDenoiserImpl::denoise(const float *inputBeauty,
+                            const float *inputAlbedo,
+                            const float *inputNormals,
+                            float *output,
+                            std::string* errorMsg)
+{
+    denoiseStrided({inputBeauty}, {inputAlbedo}, {inputNormals}, {output}, errorMsg);
+    if (errorMsg->empty() && output != inputBeauty) {
+        PhaseTimer timer(&mTimes.unpack);
+        copyAlpha(inputBeauty, output, mWidth, mHeight);
+    }
+}
+
+void
+AtrousDenoiserImpl::denoiseStrided(const InputImage& beauty,
+                                   const InputImage& albedo,
+                                   const InputImage& normals,
+                                   const OutputImage& output,
+                                   std::string* errorMsg)
+{
+    if (mColor.empty()) {
+        allocate();
+    }
+
+    const size_t numPixels = static_cast<size_t>(mWidth) * mHeight;
+    const size_t planesBytes = numPixels * 3 * sizeof(float);
+
+    // The planes as an image, which images of any layout are copied to and from
+    auto planesView = [&](std::vector<float>& planes) {
+        ImageView view;
+        view.data = planes.data();
+        view.layout = IMAGE_LAYOUT_PLANAR;
+        view.pixelStride = sizeof(float);
+        view.rowStride = mWidth * sizeof(float);
+        view.planeStride = numPixels * sizeof(float);
+        return view;
+    };
+
+    // finish, if given, completes the planes of the rows once they are deinterleaved
+    using FinishRows = void (*)(int, int, int, size_t, float*);
+    auto pack = [&](const ImageView& image, std::vector<float>& planes, FinishRows finish,
+                    bool sanitize) {
+        const ImageView dst = planesView(planes);
+        forEachRowRange(mWidth, mHeight, [&](int firstRow, int endRow) {
+            BeautyConditioning conditioning;
+            conditioning.sanitize = sanitize;
+            copyImageRGB(image, 0, firstRow, dst, 0, firstRow, mWidth, endRow - firstRow,
+                         &conditioning);
+            if (finish) {
+                finish(mWidth, firstRow, endRow, numPixels, planes.data());
+            }
+        });
+        mBytesUploaded += planesBytes;
+    };
+
+    const ImageView albedoView = imageView(albedo, mWidth, mHeight);
+    const ImageView normalsView = imageView(normals, mWidth, mHeight);
+    {
+        PhaseTimer timer(&mTimes.pack);
+        pack(imageView(beauty, mWidth, mHeight), mColor, toneRows, mSanitizeInput);
+        if (mUseAlbedo && guideChanged(albedoView, &mAlbedoHash)) {
+            pack(albedoView, mAlbedo, nullptr, false);
+        }
+        if (mUseNormals && guideChanged(normalsView, &mNormalsHash)) {
+            pack(normalsView, mNormals, normalizeRows, false);
+        }
+    }
+
+    {
+        PhaseTimer timer(&mTimes.execute);
+        filter();
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    copyImageRGB(planesView(mColor), 0, 0, imageView(output, mWidth, mHeight), 0, 0,
+                 mWidth, mHeight);
+    mBytesDownloaded += planesBytes;
+}
+
+} // namespace denoiser
+} // namespace moonray
@@ -0,0 +1,88 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "DenoiserImpl.h"
+
+#include <tbb/enumerable_thread_specific.h>
+
+#include <string>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by albedo and
+// normals, for live previews on machines where a network is too slow to start or to
+// run.  Each iteration applies the 5-tap B3 spline kernel with a tap spacing that
+// doubles every iteration, as a horizontal then a vertical pass.  Taps are weighted
+// down where their tone-mapped luminance, albedo or normal differs from the center
+// pixel's, and the luminance tolerance halves every iteration so the later, wider
+// passes only remove what is left of the noise.  The passes work on planar copies of
+// the inputs so they run 8 pixels at a time with AVX2.  Each task runs the horizontal
+// pass of its rows into a ring just tall enough for the vertical pass's taps, which
+// then reads it while it is still in the cache, so an iteration streams the planes
+// through memory once.  There are no weights to load, so creation is just an
+// allocation.
+
+class AtrousDenoiserImpl : public DenoiserImpl
+{
+public:
+    AtrousDenoiserImpl(int width,
+                       int height,
+                       bool useAlbedo,
+                       bool useNormals,
+                       const DenoiserOptions& options);
+
+    void denoise(const float *inputBeauty,  // RGBA
+                 const float *inputAlbedo,  // RGBA
+                 const float *inputNormals, // RGBA
+                 float *output,       // RGBA
+                 std::string* errorMsg) override;
+
+    void denoiseStrided(const InputImage& beauty,
+                        const InputImage& albedo,
+                        const InputImage& normals,
+                        const OutputImage& output,
+                        std::string* errorMsg) override;
+
+    bool reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg) override;
+
+    int tileOverlap() const override;
+    void setQuality(DenoiserQuality quality, std::string* errorMsg) override;
+    void releaseMemory() override;
+
+    // Iterations run at a quality tier: 1, 2 or 3, reaching 2, 6 or 14 pixels out.  A
+    // fourth iteration doubles the reach again but leaves more error on the test images
+    // than three, for a third more time.
+    static int iterations(DenoiserQuality quality);
+
+protected:
+    size_t stagingBytes() const override;
+
+private:
+    void allocate();
+    // Runs the iterations on mColor, leaving the result there
+    void filter();
+
+    int mIterations;
+
+    // Planar images of mWidth * mHeight floats per plane: RGB and its tone-mapped
+    // luminance for the colors, XYZ for the guides.  Normals are normalized, or zero
+    // where the input is.  The guides are empty when not used.
+    std::vector<float> mColor;
+    std::vector<float> mScratch; // result of each iteration, swapped with mColor
+    std::vector<float> mAlbedo;
+    std::vector<float> mNormals;
+    // Rings of horizontally filtered rows, one per thread
+    tbb::enumerable_thread_specific<std::vector<float>> mRings;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
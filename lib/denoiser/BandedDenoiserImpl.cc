@@ -0,0 +1,361 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "BandedDenoiserImpl.h"
+#include "OIDNDenoiserImpl.h"
+#include "PackKernels.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#include <tbb/info.h>
+#include <tbb/task_group.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace moonray {
+namespace denoiser {
+
+BandedDenoiserImpl::BandedDenoiserImpl(int width,
+                                       int height,
+                                       bool useAlbedo,
+                                       bool useNormals,
+                                       int numDevices,
+                                       const DenoiserOptions& options,
+                                       std::string* errorMsg) :
+    DenoiserImpl(width, height, useAlbedo, useNormals),
+    mOverlap(0)
+{
+    setInputConditioning(options);
+
+    // Without hwloc support in TBB this is a single node with an automatic id
+    const std::vector<tbb::numa_node_id> nodes = tbb::info::numa_nodes();
+    numDevices = std::max(1, std::min(numDevices, height));
+
+    std::vector<int> devicesOnNode(nodes.size(), 0);
+    for (int i = 0; i < numDevices; i++) {
+        devicesOnNode[i % nodes.size()]++;
+    }
+
+    mBands.resize(numDevices);
+    for (int i = 0; i < numDevices; i++) {
+        const size_t node = i % nodes.size();
+        const int concurrency =
+            std::max(1, tbb::info::default_concurrency(nodes[node]) / devicesOnNode[node]);
+        Band& band = mBands[i];
+        band.numaId = nodes[node];
+        band.arena.reset(new tbb::task_arena(tbb::task_arena::constraints(band.numaId, concurrency)));
+    }
+
+    // Each device sizes its thread pool to its arena, or takes its share of an explicit
+    // thread count.  OIDN's own pinning would put every device on the same cores.
+    DenoiserOptions bandOptions = options;
+    bandOptions.numThreads = options.numThreads > 0 ? std::max(1, options.numThreads / numDevices) : 0;
+    bandOptions.affinity = 0;
+
+    // Devices are created inside their arenas so their buffers are first touched there.
+    // They are never shared, as bands denoise concurrently and work on a shared device
+    // is serialized.  Until their filters are committed they report the default
+    // overlap, so each one is created at its padded height right away; setupBands()
+    // only resizes them if the filter reports another overlap.
+    mOverlap = OIDNDenoiserImpl::sDefaultTileOverlap;
+    splitRows();
+    forEachBand([&](Band& band, std::string* bandError) {
+        DenoiserOptions deviceOptions = bandOptions;
+        if (deviceOptions.numThreads <= 0) {
+            deviceOptions.numThreads = band.arena->max_concurrency();
+        }
+        deviceOptions.shareDevice = false;
+        band.impl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_CPU, mWidth, band.paddedHeight,
+                                             mUseAlbedo, mUseNormals, deviceOptions, nullptr,
+                                             bandError));
+    }, errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    setupBands(errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    std::string placement;
+    for (const Band& band : mBands) {
+        placement += (placement.empty() ? "" : ", ") +
+                     (band.numaId == tbb::task_arena::automatic ? std::string("any") :
+                                                                  std::to_string(band.numaId));
+    }
+    scene_rdl2::logging::Logger::info("Denoising in ", numDevices, " bands with ", mOverlap,
+                                      " pixels of overlap on NUMA nodes ", placement);
+}
+
+int
+BandedDenoiserImpl::numDevices(int cpuDevices)
+{
+    if (cpuDevices < 0) {
+        return static_cast<int>(tbb::info::numa_nodes().size());
+    }
+    return std::max(1, cpuDevices);
+}
+
+void
+BandedDenoiserImpl::forEachBand(const std::function<void(Band&, std::string*)>& func,
+                                std::string* errorMsg)
+{
+    // A task group per arena: the tasks are started in every arena before waiting on
+    // any of them, so the bands run concurrently
+    const size_t numBands = mBands.size();
+    std::vector<std::string> errors(numBands);
+    std::unique_ptr<tbb::task_group[]> groups(new tbb::task_group[numBands]);
+    for (size_t i = 0; i < numBands; i++) {
+        mBands[i].arena->execute([&, i] {
+            groups[i].run([&, i] { func(mBands[i], &errors[i]); });
+        });
+    }
+    for (size_t i = 0; i < numBands; i++) {
+        mBands[i].arena->execute([&, i] { groups[i].wait(); });
+    }
+
+    for (const std::string& error : errors) {
+        if (!error.empty()) {
+            *errorMsg = error;
+            return;
+        }
+    }
+}
+
+void
+BandedDenoiserImpl::splitRows()
+{
+    const int numBands = static_cast<int>(mBands.size());
+    for (int i = 0; i < numBands; i++) {
+        mBands[i].y0 = static_cast<int>(static_cast<int64_t>(mHeight) * i / numBands);
+        mBands[i].y1 = static_cast<int>(static_cast<int64_t>(mHeight) * (i + 1) / numBands);
+        mBands[i].paddedY = std::max(0, mBands[i].y0 - mOverlap);
+        mBands[i].paddedHeight = std::min(mHeight, mBands[i].y1 + mOverlap) - mBands[i].paddedY;
+    }
+}
+
+void
+BandedDenoiserImpl::setupBands(std::string* errorMsg)
+{
+    const int overlap = mBands[0].impl->tileOverlap();
+    if (overlap != mOverlap) {
+        mOverlap = overlap;
+        splitRows();
+    }
+    forEachBand([&](Band& band, std::string* bandError) {
+        DenoiserImpl& impl = *band.impl;
+        if (impl.imageWidth() != mWidth || impl.imageHeight() != band.paddedHeight ||
+            impl.useAlbedo() != mUseAlbedo || impl.useNormals() != mUseNormals) {
+            if (!impl.reconfigure(mWidth, band.paddedHeight, mUseAlbedo, mUseNormals, bandError)) {
+                *bandError = "Band backend cannot be resized";
+            }
+        }
+        band.output.resize(static_cast<size_t>(mWidth) * band.paddedHeight * 3);
+    }, errorMsg);
+}
+
+void
+BandedDenoiserImpl::releaseMemory()
+{
+    for (Band& band : mBands) {
+        std::vector<float>().swap(band.output);
+        std::vector<float>().swap(band.beauty);
+        std::vector<float>().swap(band.albedo);
+        std::vector<float>().swap(band.normals);
+        band.impl->releaseMemory();
+    }
+}
+
+bool
+BandedDenoiserImpl::reconfigure(int width,
+                                int height,
+                                bool useAlbedo,
+                                bool useNormals,
+                                std::string* errorMsg)
+{
+    if (height < static_cast<int>(mBands.size())) {
+        return false;
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mUseAlbedo = useAlbedo;
+    mUseNormals = useNormals;
+    splitRows();
+    setupBands(errorMsg);
+    return true;
+}
+
+void
+BandedDenoiserImpl::setMaxMemory(size_t bytes)
+{
+    for (Band& band : mBands) {
+        band.impl->setMaxMemory(bytes / mBands.size());
+    }
+}
+
+void
+BandedDenoiserImpl::setQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    forEachBand([&](Band& band, std::string* bandError) {
+        band.impl->setQuality(quality, bandError);
+    }, errorMsg);
+    // Tiers may differ in their receptive field
+    if (errorMsg->empty() && mBands[0].impl->tileOverlap() != mOverlap) {
+        setupBands(errorMsg);
+    }
+}
+
+void
+BandedDenoiserImpl::setGuideGeneration(uint64_t generation)
+{
+    // Every band reads the same rows of the guides on every call
+    DenoiserImpl::setGuideGeneration(generation);
+    for (Band& band : mBands) {
+        band.impl->setGuideGeneration(generation);
+    }
+}
+
+void
+BandedDenoiserImpl::warmUp(std::string* errorMsg)
+{
+    forEachBand([&](Band& band, std::string* bandError) {
+        band.impl->warmUp(bandError);
+    }, errorMsg);
+}
+
+void
+BandedDenoiserImpl::accumulateStats(DenoiserStats* stats) const
+{
+    DenoiserImpl::accumulateStats(stats);
+    for (const Band& band : mBands) {
+        band.impl->accumulateStats(stats);
+    }
+}
+
+void
+BandedDenoiserImpl::resetStats()
+{
+    DenoiserImpl::resetStats();
+    for (Band& band : mBands) {
+        band.impl->resetStats();
+    }
+}
+
+size_t
+BandedDenoiserImpl::stagingBytes() const
+{
+    size_t bytes = 0;
+    for (const Band& band : mBands) {
+        bytes += (band.output.capacity() + band.beauty.capacity() + band.albedo.capacity() +
+                  band.normals.capacity()) * sizeof(float);
+    }
+    return bytes;
+}
+
+void
+BandedDenoiserImpl::denoise(const float *inputBeauty,
+                            const float *inputAlbedo,
+                            const float *inputNormals,
+                            float *output,
+                            std::string* errorMsg)
+{
+    denoiseStrided({inputBeauty}, {inputAlbedo}, {inputNormals}, {output}, errorMsg);
+    if (errorMsg->empty() && output != inputBeauty) {
+        PhaseTimer timer(&mTimes.unpack);
+        copyAlpha(inputBeauty, output, mWidth, mHeight);
+    }
+}
+
+void
+BandedDenoiserImpl::denoiseStrided(const InputImage& beauty,
+                                   const InputImage& albedo,
+                                   const InputImage& normals,
+                                   const OutputImage& output,
+                                   std::string* errorMsg)
+{
+    const size_t rgbStride = 3 * sizeof(float);
+    const ImageView outputView = imageView(output, mWidth, mHeight);
+
+    {
+        // Bands metered on their own would each get a different exposure, with or
+        // without autoExposure, since OIDN meters every image it is given
+        PhaseTimer timer(&mTimes.pack);
+        const float exposure = meterExposure(imageView(beauty, mWidth, mHeight));
+        for (Band& band : mBands) {
+            band.impl->setExposure(exposure);
+        }
+    }
+
+    // In place, a band's padding overlaps its neighbours' rows, so nothing is written
+    // back until every band has read its inputs
+    const bool inPlace = output.data == beauty.data;
+    auto writeBack = [&](Band& band) {
+        // Write back only the unpadded rows
+        PhaseTimer timer(&band.times.unpack);
+        copyImageRGB(imageView(band.output.data(), rgbStride, mWidth * rgbStride), 0, band.y0 - band.paddedY,
+                     outputView, 0, band.y0,
+                     mWidth, band.y1 - band.y0);
+    };
+
+    forEachBand([&](Band& band, std::string* bandError) {
+        // Released in low memory mode
+        const int paddedHeight = band.impl->imageHeight();
+        band.output.resize(static_cast<size_t>(mWidth) * paddedHeight * 3);
+
+        // Each band's backend reads its padded rows straight out of linear and planar
+        // inputs.  Tiles don't split at arbitrary rows, so tiled inputs are untiled into
+        // the band's own buffers instead, on the band's node.
+        auto window = [&](const InputImage& image, std::vector<float>& untiled) {
+            InputImage bandImage;
+            if (!image.data) {
+                return bandImage;
+            }
+            const ImageView view = imageView(image, mWidth, mHeight);
+            if (view.layout == IMAGE_LAYOUT_TILED) {
+                untiled.resize(static_cast<size_t>(mWidth) * paddedHeight * 3);
+                PhaseTimer timer(&band.times.pack);
+                copyImageRGB(view, 0, band.paddedY,
+                             imageView(untiled.data(), rgbStride, mWidth * rgbStride), 0, 0,
+                             mWidth, paddedHeight);
+                bandImage.data = untiled.data();
+                bandImage.pixelStride = rgbStride;
+                return bandImage;
+            }
+            bandImage.data = reinterpret_cast<const float*>(
+                reinterpret_cast<const char*>(view.data) + band.paddedY * view.rowStride);
+            bandImage.pixelStride = view.pixelStride;
+            bandImage.rowStride = view.rowStride;
+            bandImage.layout = view.layout;
+            bandImage.planeStride = view.planeStride;
+            return bandImage;
+        };
+        OutputImage bandOutput;
+        bandOutput.data = band.output.data();
+        bandOutput.pixelStride = rgbStride;
+        bandOutput.rowStride = mWidth * rgbStride;
+        band.impl->denoiseStrided(window(beauty, band.beauty), window(albedo, band.albedo),
+                                  window(normals, band.normals), bandOutput, bandError);
+        if (bandError->empty() && !inPlace) {
+            writeBack(band);
+        }
+    }, errorMsg);
+    if (inPlace && errorMsg->empty()) {
+        forEachBand([&](Band& band, std::string*) { writeBack(band); }, errorMsg);
+    }
+
+    for (Band& band : mBands) {
+        mTimes.pack += band.times.pack;
+        mTimes.unpack += band.times.unpack;
+        band.times = DenoiserTimes();
+    }
+    if (errorMsg->empty()) {
+        mBytesDownloaded += static_cast<uint64_t>(mWidth) * mHeight * rgbStride;
+    }
+}
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,112 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "DenoiserImpl.h"
+
+#include <tbb/task_arena.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+// Denoises a frame with several OIDN CPU devices in parallel, one per NUMA node on
+// multi-socket machines.  The frame is split into horizontal bands padded by the
+// network's tileOverlap() and each device denoises one band.  Every device works in
+// a task arena constrained to its node, so its packing, unpacking and the first touch
+// of its staging buffers happen on that node's cores and memory, and OIDN sizes its
+// thread pool to the node.  OIDN runs the filter on threads of its own that are not
+// pinned to the node, so the network's evaluation and working memory may land on any
+// node.  All bands share one exposure metered over the whole frame.
+
+class BandedDenoiserImpl : public DenoiserImpl
+{
+public:
+    // Devices are assigned to the NUMA nodes round-robin.  Devices that share a node
+    // split its threads.
+    BandedDenoiserImpl(int width,
+                       int height,
+                       bool useAlbedo,
+                       bool useNormals,
+                       int numDevices,
+                       const DenoiserOptions& options,
+                       std::string* errorMsg);
+
+    // Number of devices DenoiserOptions::cpuDevices asks for
+    static int numDevices(int cpuDevices);
+
+    void denoise(const float *inputBeauty,  // RGBA
+                 const float *inputAlbedo,  // RGBA
+                 const float *inputNormals, // RGBA
+                 float *output,       // RGBA
+                 std::string* errorMsg) override;
+
+    void denoiseStrided(const InputImage& beauty,
+                        const InputImage& albedo,
+                        const InputImage& normals,
+                        const OutputImage& output,
+                        std::string* errorMsg) override;
+
+    bool reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg) override;
+
+    int tileOverlap() const override { return mOverlap; }
+    // The first band's, see DenoiserRegistry.h
+    std::shared_ptr<SharedOIDNDevice> oidnDevice() const override
+    {
+        return mBands.front().impl->oidnDevice();
+    }
+    bool autoExposes() const override { return true; }
+    void setMaxMemory(size_t bytes) override;
+    void setQuality(DenoiserQuality quality, std::string* errorMsg) override;
+    void setGuideGeneration(uint64_t generation) override;
+    void warmUp(std::string* errorMsg) override;
+    void releaseMemory() override;
+
+    void accumulateStats(DenoiserStats* stats) const override;
+    void resetStats() override;
+
+protected:
+    size_t stagingBytes() const override;
+
+private:
+    struct Band
+    {
+        int numaId = tbb::task_arena::automatic;
+        std::unique_ptr<tbb::task_arena> arena;
+        std::unique_ptr<DenoiserImpl> impl;
+        int y0 = 0;      // rows the band outputs, [y0, y1)
+        int y1 = 0;
+        int paddedY = 0; // first row the band's backend reads
+        int paddedHeight = 0;
+        std::vector<float> output; // packed RGB, padded rows
+        std::vector<float> beauty; // untiled tiled inputs, packed RGB, padded rows
+        std::vector<float> albedo;
+        std::vector<float> normals;
+        DenoiserTimes times;
+    };
+
+    // Runs func for every band in parallel, each in its band's arena, and reports the
+    // first band's error
+    void forEachBand(const std::function<void(Band&, std::string*)>& func, std::string* errorMsg);
+    // Splits the rows among the bands and pads them by mOverlap
+    void splitRows();
+    // Takes the overlap the backends report, pads the bands by it and reconfigures
+    // the backends and output buffers that don't match
+    void setupBands(std::string* errorMsg);
+
+    std::vector<Band> mBands;
+    int mOverlap;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
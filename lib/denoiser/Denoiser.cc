@@ -1,16 +1,19 @@
 // Copyright 2023-2024 DreamWorks Animation LLC
 // SPDX-License-Identifier: Apache-2.0
 
-#ifdef MOONRAY_USE_OPTIX
-
-#include "OIDNDenoiserImpl.h"
-#include "OptixDenoiserImpl.h"
 #include "Denoiser.h"
+#include "AsyncWorker.h"
+#include "DenoiserRegistry.h"
+#include "DirtyTileTracker.h"
+#include "PackKernels.h"
+#include "PreviewScaler.h"
+#include "TemporalStabilizer.h"
+#include "TiledDenoiserImpl.h"
 
+#include <scene_rdl2/common/rec_time/RecTime.h>
 #include <scene_rdl2/render/logging/logging.h>
 
-// This header must be included in exactly one .cc file for the link to succeed
-// #include <optix_function_table_definition.h>
+#include <algorithm>
 
 namespace moonray {
 namespace denoiser {
@@ -21,205 +24,1198 @@ Denoiser::Denoiser(DenoiserMode mode,
                    bool useAlbedo,
                    bool useNormals,
                    std::string* errorMsg) :
-    mMode(mode)
+    Denoiser(mode, width, height, useAlbedo, useNormals, DenoiserOptions(), errorMsg)
 {
-    switch (mode) {
-    case OPTIX:
-        mImpl.reset(new OptixDenoiserImpl(width, height, useAlbedo, useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
-            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-            mImpl.reset();
-        }
-    break;
-    case OPEN_IMAGE_DENOISE:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_DEFAULT, width, height, useAlbedo,
-                                         useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
-            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-            mImpl.reset();
-        }
-    break;
-    case OPEN_IMAGE_DENOISE_CPU:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_CPU, width, height, useAlbedo,
-                                         useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
-            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-            mImpl.reset();
-        }
-    break;
-#ifdef PLATFORM_APPLE
-    case OIDN_DEVICE_TYPE_METAL:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_METAL, width, height, useAlbedo,
-                                         useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
-            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-            mImpl.reset();
-        }
-    break;
-#endif
-    case OPEN_IMAGE_DENOISE_CUDA:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_CUDA, width, height, useAlbedo,
-                                         useNormals, errorMsg));
+}
+
+Denoiser::Denoiser(DenoiserMode mode,
+                   int width,
+                   int height,
+                   bool useAlbedo,
+                   bool useNormals,
+                   const DenoiserOptions& options,
+                   std::string* errorMsg) :
+    mMode(mode),
+    mOptions(options),
+    mGuideGeneration(0),
+    mPreviewGuideGeneration(0),
+    mIncrementalOutput(nullptr),
+    mNextAsyncSlot(0),
+    mCalls(0),
+    mSetupKind(nullptr),
+    mSetupTime(0.0),
+    mTierExecuteTime{},
+    mPendingQuality(-1),
+    mBytesAllocated(0),
+    mPeakBytesAllocated(0)
+{
+    if (mOptions.backgroundInit) {
+        // Every call waits for mInit before touching the backend
+        mInit = std::async(std::launch::async, [this, width, height, useAlbedo, useNormals] {
+            std::string initError;
+            init(width, height, useAlbedo, useNormals, &initError);
+            return initError;
+        }).share();
+        return;
+    }
+    init(width, height, useAlbedo, useNormals, errorMsg);
+}
+
+void
+Denoiser::init(int width,
+               int height,
+               bool useAlbedo,
+               bool useNormals,
+               std::string* errorMsg)
+{
+    scene_rdl2::rec_time::RecTime timer;
+    timer.start();
+
+    runInExecutor([&] {
+        mImpl = createImpl(width, height, useAlbedo, useNormals, nullptr, errorMsg);
+    });
+    if (!mImpl) {
+        return;
+    }
+    mSetupKind = "created";
+    mSetupTime = timer.end();
+    scene_rdl2::logging::Logger::info("Denoiser created in ", mSetupTime * 1000.0, " ms");
+
+    if (mOptions.warmUp) {
+        timer.start();
+        runInExecutor([&] { mImpl->warmUp(errorMsg); });
         if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
             scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
             mImpl.reset();
+            return;
         }
-    break;
-    };
+        scene_rdl2::logging::Logger::info("Denoiser warmed up in ", timer.end() * 1000.f, " ms");
+    }
+    updateBytesAllocated();
+}
+
+std::unique_ptr<DenoiserImpl>
+Denoiser::createImpl(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     const DenoiserImpl* owner,
+                     std::string* errorMsg) const
+{
+    // With a memory budget the backend is created at the tile size and fed by a
+    // TiledDenoiserImpl
+    int implWidth = width;
+    int implHeight = height;
+    if (mOptions.memoryBudget) {
+        TiledDenoiserImpl::chooseTileSize(width, height, useAlbedo, useNormals,
+                                          mOptions.memoryBudget, &implWidth, &implHeight);
+    }
+
+    std::unique_ptr<DenoiserImpl> impl =
+        createDenoiserImpl(mMode, implWidth, implHeight, useAlbedo, useNormals, mOptions, owner,
+                           errorMsg);
+    if (!errorMsg->empty()) {
+        // Something went wrong so free everything
+        // Output the error to Logger::error so we are guaranteed to see it
+        scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+        impl.reset();
+    }
+
+    if (impl && mOptions.memoryBudget) {
+        applyMemoryBudget(width, height, useAlbedo, useNormals, &impl, errorMsg);
+    }
+    return impl;
 }
 
 Denoiser::~Denoiser()
 {
+    // Finish the queued denoises while everything they use is still here
+    waitForInit();
+    mWorker.reset();
 }
 
-void 
+void
 Denoiser::denoise(const float *inputBeauty,
                   const float *inputAlbedo,
                   const float *inputNormals,
                   float *output,
                   std::string* errorMsg)
 {
-    mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        if (mOptions.previewScale > 1) {
+            denoisePreview(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        } else {
+            mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        }
+    });
+    endCall(before);
+    updateAutoQuality(mLastCall.execute);
 }
 
-int 
+void
+Denoiser::denoise(const InputImage& beauty,
+                  const InputImage& albedo,
+                  const InputImage& normals,
+                  const OutputImage& output,
+                  std::string* errorMsg)
+{
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    auto checkLayout = [&](ImageLayout layout, int tileWidth, int tileHeight) {
+        if (layout == IMAGE_LAYOUT_TILED && (tileWidth < 1 || tileHeight < 1)) {
+            *errorMsg = "Tiled images need a tile size of at least 1x1";
+        } else if (layout != IMAGE_LAYOUT_LINEAR && mOptions.previewScale > 1) {
+            *errorMsg = "Preview denoising needs linear images";
+        }
+    };
+    checkLayout(beauty.layout, beauty.tileWidth, beauty.tileHeight);
+    checkLayout(albedo.layout, albedo.tileWidth, albedo.tileHeight);
+    checkLayout(normals.layout, normals.tileWidth, normals.tileHeight);
+    checkLayout(output.layout, output.tileWidth, output.tileHeight);
+    if (!errorMsg->empty()) {
+        scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+        return;
+    }
+
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        if (mOptions.previewScale > 1) {
+            denoisePreview(beauty, albedo, normals, output, errorMsg);
+        } else {
+            mImpl->denoiseStrided(beauty, albedo, normals, output, errorMsg);
+        }
+    });
+    endCall(before);
+    updateAutoQuality(mLastCall.execute);
+}
+
+int
 Denoiser::imageWidth() const
 {
+    waitForInit();
     return mImpl->imageWidth();
 }
 
-int 
+int
 Denoiser::imageHeight() const
 {
+    waitForInit();
     return mImpl->imageHeight();
 }
 
 bool
 Denoiser::useAlbedo() const
 {
+    waitForInit();
     return mImpl->useAlbedo();
 }
 
 bool
 Denoiser::useNormals() const
 {
+    waitForInit();
     return mImpl->useNormals();
 }
 
-} // namespace denoiser
-} // namespace moonray
-
-#else // not MOONRAY_USE_OPTIX
+void
+Denoiser::applyMemoryBudget(int width,
+                            int height,
+                            bool useAlbedo,
+                            bool useNormals,
+                            std::unique_ptr<DenoiserImpl>* impl,
+                            std::string* errorMsg) const
+{
+    // The tile staging buffers take up to half of the budget, the backend gets the rest
+    (*impl)->setMaxMemory(mOptions.memoryBudget / 2);
 
-#include "OIDNDenoiserImpl.h"
-#include "Denoiser.h"
+    if ((*impl)->imageWidth() != width || (*impl)->imageHeight() != height) {
+        impl->reset(new TiledDenoiserImpl(width, height, useAlbedo, useNormals,
+                                          mOptions, std::move(*impl), errorMsg));
+        if (!errorMsg->empty()) {
+            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+            impl->reset();
+        }
+    }
+}
 
-#include <scene_rdl2/render/logging/logging.h>
+void
+Denoiser::reconfigure(int width,
+                      int height,
+                      bool useAlbedo,
+                      bool useNormals,
+                      std::string* errorMsg)
+{
+    waitForAsync();
+    mAsyncSlots.reset();
+    mLastAsync = std::shared_future<std::string>();
+    resetRegionState();
+    retireImpl(&mPreviewImpl);
+    // The downsampled guides may have the same size in a different layout
+    mPreviewGuideGeneration = 0;
+    resetTemporal();
+    // Execute times of the old size no longer apply
+    std::fill(std::begin(mTierExecuteTime), std::end(mTierExecuteTime), 0.0);
 
-namespace moonray {
-namespace denoiser {
+    scene_rdl2::rec_time::RecTime timer;
+    timer.start();
 
-Denoiser::Denoiser(DenoiserMode mode,
-                   int width,
-                   int height,
-                   bool useAlbedo,
-                   bool useNormals,
-                   std::string* errorMsg) :
-    mMode(mode)
-{
-    switch (mode) {
-    case OPTIX:
-        *errorMsg = "Optix mode not supported in this build";
-        scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-    break;
-#ifdef PLATFORM_APPLE
-    case METAL:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_METAL, width, height, useAlbedo,
-                                             useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-                // Something went wrong so free everything
-                // Output the error to Logger::error so we are guaranteed to see it
-                scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-                mImpl.reset();
-        }
-    break;
-#endif
-    case OPEN_IMAGE_DENOISE:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_DEFAULT, width, height, useAlbedo,
-                                         useNormals, errorMsg));
+    bool reconfigured = false;
+    runInExecutor([&] {
+        reconfigured = mImpl && mImpl->reconfigure(width, height, useAlbedo, useNormals, errorMsg);
+    });
+    if (reconfigured) {
         if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
             scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
             mImpl.reset();
+            return;
         }
-    break;
-    case OPEN_IMAGE_DENOISE_CPU:
-        mImpl.reset(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_CPU, width, height, useAlbedo,
-                                         useNormals, errorMsg));
-        if (!errorMsg->empty()) {
-            // Something went wrong so free everything
-            // Output the error to Logger::error so we are guaranteed to see it
+        mSetupKind = "reconfigured in place";
+        mSetupTime = timer.end();
+        scene_rdl2::logging::Logger::info("Denoiser reconfigured in place to ", width, "x", height,
+                                          " in ", mSetupTime * 1000.0, " ms");
+        updateBytesAllocated();
+        return;
+    }
+
+    // The backend cannot change in place, so build a new one
+    retireImpl(&mImpl);
+    runInExecutor([&] {
+        mImpl = createImpl(width, height, useAlbedo, useNormals, nullptr, errorMsg);
+    });
+    if (mImpl) {
+        mSetupKind = "rebuilt";
+        mSetupTime = timer.end();
+        scene_rdl2::logging::Logger::info("Denoiser rebuilt for ", width, "x", height,
+                                          " in ", mSetupTime * 1000.0, " ms");
+    }
+    updateBytesAllocated();
+}
+
+void
+Denoiser::denoiseBatch(const float *inputAlbedo,
+                       const float *inputNormals,
+                       int numImages,
+                       const float * const *inputColors,
+                       float * const *outputs,
+                       std::string* errorMsg)
+{
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        mImpl->denoiseBatch(inputAlbedo, inputNormals, numImages, inputColors, outputs, errorMsg);
+    });
+    endCall(before);
+    if (numImages > 0) {
+        updateAutoQuality(mLastCall.execute / numImages);
+    }
+}
+
+void
+Denoiser::denoiseHalf(const uint16_t *inputBeauty,
+                      const uint16_t *inputAlbedo,
+                      const uint16_t *inputNormals,
+                      uint16_t *output,
+                      std::string* errorMsg)
+{
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        mImpl->denoiseHalf(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+    });
+    endCall(before);
+    updateAutoQuality(mLastCall.execute);
+}
+
+namespace {
+
+// Padded regions are rounded up to multiples of this so that regions of similar
+// size reuse the region backend without reconfiguring it
+constexpr int sRegionAlignment = 64;
+
+// Number of region backends kept, so that alternating region sizes don't reconfigure
+// a backend on every call
+constexpr size_t sRegionBackends = 4;
+
+// Pads [first, end) by apron on both sides, rounds it up to sRegionAlignment and
+// keeps it inside [0, size)
+void
+padRange(int first, int end, int apron, int size, int* paddedFirst, int* paddedSize)
+{
+    // Sizes grow in steps of 1.5x and 4/3x from sRegionAlignment (64, 96, 128, 192,
+    // 256, ...), so that regions of similar size share a backend
+    const int padded = end - first + 2 * apron;
+    int bucket = sRegionAlignment;
+    while (bucket < padded) {
+        bucket = bucket % 3 ? bucket / 2 * 3 : bucket / 3 * 4;
+    }
+    *paddedSize = std::min(size, bucket);
+    *paddedFirst = std::max(0, std::min(first - (*paddedSize - (end - first)) / 2, size - *paddedSize));
+}
+
+} // namespace
+
+void
+Denoiser::denoiseRegion(const float *inputBeauty,
+                        const float *inputAlbedo,
+                        const float *inputNormals,
+                        float *output,
+                        const DenoiseRegion& region,
+                        std::string* errorMsg)
+{
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        denoiseRegionImpl(inputBeauty, inputAlbedo, inputNormals, output, region,
+                          regionExposure(inputBeauty), errorMsg);
+    });
+    endCall(before);
+}
+
+float
+Denoiser::regionExposure(const float *inputBeauty)
+{
+    if (!mImpl->autoExposes()) {
+        return 0.f;
+    }
+    PhaseTimer timer(&mLocalTimes.pack);
+    InputImage beauty;
+    beauty.data = inputBeauty;
+    return mImpl->meterExposure(imageView(beauty, mImpl->imageWidth(), mImpl->imageHeight()));
+}
+
+void
+Denoiser::denoiseRegionImpl(const float *inputBeauty,
+                            const float *inputAlbedo,
+                            const float *inputNormals,
+                            float *output,
+                            const DenoiseRegion& region,
+                            float exposure,
+                            std::string* errorMsg)
+{
+    const int width = mImpl->imageWidth();
+    const int height = mImpl->imageHeight();
+    const int x0 = std::max(0, region.x0);
+    const int y0 = std::max(0, region.y0);
+    const int x1 = std::min(width, region.x1);
+    const int y1 = std::min(height, region.y1);
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    const int apron = mImpl->tileOverlap();
+    int px, py, pw, ph;
+    padRange(x0, x1, apron, width, &px, &pw);
+    padRange(y0, y1, apron, height, &py, &ph);
+
+    if (static_cast<size_t>(pw) * ph * 2 > static_cast<size_t>(width) * height) {
+        mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        return;
+    }
+
+    const bool useAlbedo = mImpl->useAlbedo();
+    const bool useNormals = mImpl->useNormals();
+    auto cached = std::find_if(mRegionImpls.begin(), mRegionImpls.end(),
+                               [&](const std::unique_ptr<DenoiserImpl>& impl) {
+        return impl->imageWidth() == pw && impl->imageHeight() == ph;
+    });
+    if (cached == mRegionImpls.end() && mRegionImpls.size() == sRegionBackends) {
+        // Resize the least recently used backend
+        cached = mRegionImpls.end() - 1;
+        if (!(*cached)->reconfigure(pw, ph, useAlbedo, useNormals, errorMsg)) {
+            retireImpl(&*cached);
+            *cached = createImpl(pw, ph, useAlbedo, useNormals, mImpl.get(), errorMsg);
+        } else if (!errorMsg->empty()) {
             scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-            mImpl.reset();
+            retireImpl(&*cached);
+        }
+        if (!*cached) {
+            mRegionImpls.erase(cached);
+            return;
+        }
+    } else if (cached == mRegionImpls.end()) {
+        std::unique_ptr<DenoiserImpl> impl = createImpl(pw, ph, useAlbedo, useNormals, mImpl.get(),
+                                                        errorMsg);
+        if (!impl) {
+            return;
         }
-    break;
-    case OPEN_IMAGE_DENOISE_CUDA:
-        *errorMsg = "Open Image Denoise CUDA mode not supported in this build";
+        cached = mRegionImpls.insert(mRegionImpls.end(), std::move(impl));
+    }
+    std::rotate(mRegionImpls.begin(), cached, cached + 1);
+    DenoiserImpl& regionImpl = *mRegionImpls.front();
+    regionImpl.setExposure(exposure);
+
+    // The region backend reads the padded window straight out of the full-frame inputs
+    const size_t rgbaStride = 4 * sizeof(float);
+    const size_t frameRowStride = width * rgbaStride;
+    auto window = [&](const float *data) {
+        InputImage image;
+        image.data = data ? data + (static_cast<size_t>(py) * width + px) * 4 : nullptr;
+        image.pixelStride = rgbaStride;
+        image.rowStride = frameRowStride;
+        return image;
+    };
+    mRegionOutput.resize(static_cast<size_t>(pw) * ph * 4);
+    OutputImage regionOutput;
+    regionOutput.data = mRegionOutput.data();
+    regionImpl.denoiseStrided(window(inputBeauty), window(inputAlbedo), window(inputNormals),
+                              regionOutput, errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    // Composite the unpadded region into the output
+    const size_t frameOffset = (static_cast<size_t>(y0) * width + x0) * 4;
+    copyStridedRGB(mRegionOutput.data() + (static_cast<size_t>(y0 - py) * pw + (x0 - px)) * 4,
+                   rgbaStride, pw * rgbaStride,
+                   output + frameOffset, rgbaStride, frameRowStride,
+                   x1 - x0, y1 - y0);
+    if (output != inputBeauty) {
+        for (int y = 0; y < y1 - y0; y++) {
+            const size_t rowOffset = frameOffset + static_cast<size_t>(y) * width * 4;
+            copyAlpha(inputBeauty + rowOffset, output + rowOffset, x1 - x0, 1);
+        }
+    }
+}
+
+void
+Denoiser::denoiseIncremental(const float *inputBeauty,
+                             const float *inputAlbedo,
+                             const float *inputNormals,
+                             float *output,
+                             std::string* errorMsg)
+{
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    if (output == inputBeauty) {
+        *errorMsg = "Incremental denoising cannot write over the input beauty";
         scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
-    break;
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+
+    runInExecutor([&] {
+        const int width = mImpl->imageWidth();
+        const int height = mImpl->imageHeight();
+        if (!mDirtyTracker) {
+            mDirtyTracker.reset(new DirtyTileTracker);
+        }
+        const bool tracked = mDirtyTracker->update(width, height, inputBeauty,
+                                                   mImpl->useAlbedo() ? inputAlbedo : nullptr,
+                                                   mImpl->useNormals() ? inputNormals : nullptr,
+                                                   &mDirtyRegions);
+
+        // Output within the network's reach of a changed tile changes as well, so
+        // each tile is denoised and composited with a ring of that width around it
+        const int reach = mImpl->tileOverlap();
+        for (DenoiseRegion& region : mDirtyRegions) {
+            region.x0 = std::max(0, region.x0 - reach);
+            region.y0 = std::max(0, region.y0 - reach);
+            region.x1 = std::min(width, region.x1 + reach);
+            region.y1 = std::min(height, region.y1 + reach);
+        }
+
+        size_t dirtyPixels = 0;
+        for (const DenoiseRegion& region : mDirtyRegions) {
+            dirtyPixels += static_cast<size_t>(region.x1 - region.x0) * (region.y1 - region.y0);
+        }
+
+        if (!tracked || output != mIncrementalOutput ||
+            dirtyPixels * 2 > static_cast<size_t>(width) * height) {
+            mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        } else {
+            const float exposure = regionExposure(inputBeauty);
+            for (const DenoiseRegion& region : mDirtyRegions) {
+                denoiseRegionImpl(inputBeauty, inputAlbedo, inputNormals, output, region,
+                                  exposure, errorMsg);
+                if (!errorMsg->empty()) {
+                    break;
+                }
+            }
+        }
+    });
+
+    // After a failure the output no longer matches the tracked inputs
+    mIncrementalOutput = errorMsg->empty() ? output : nullptr;
+    endCall(before);
+}
+
+void
+Denoiser::resetRegionState()
+{
+    for (std::unique_ptr<DenoiserImpl>& impl : mRegionImpls) {
+        retireImpl(&impl);
+    }
+    mRegionImpls.clear();
+    mRegionOutput = std::vector<float>();
+    if (mDirtyTracker) {
+        mDirtyTracker->reset();
+    }
+    mIncrementalOutput = nullptr;
+}
+
+void
+Denoiser::setPreviewScale(int scale, std::string* errorMsg)
+{
+    if (scale < 1) {
+        *errorMsg = "Preview scale must be at least 1";
+        scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+        return;
+    }
+    waitForAsync();
+    mOptions.previewScale = scale;
+}
+
+void
+Denoiser::denoisePreview(const float *inputBeauty,
+                         const float *inputAlbedo,
+                         const float *inputNormals,
+                         float *output,
+                         std::string* errorMsg)
+{
+    auto rgba = [](const float *data) {
+        InputImage image;
+        image.data = data;
+        return image;
     };
+    OutputImage outputImage;
+    outputImage.data = output;
+    denoisePreview(rgba(inputBeauty), rgba(inputAlbedo), rgba(inputNormals), outputImage, errorMsg);
+    if (errorMsg->empty() && output != inputBeauty) {
+        PhaseTimer timer(&mLocalTimes.unpack);
+        copyAlpha(inputBeauty, output, mImpl->imageWidth(), mImpl->imageHeight());
+    }
 }
 
-Denoiser::~Denoiser()
+void
+Denoiser::denoisePreview(const InputImage& beauty,
+                         const InputImage& albedo,
+                         const InputImage& normals,
+                         const OutputImage& output,
+                         std::string* errorMsg)
+{
+    const int width = mImpl->imageWidth();
+    const int height = mImpl->imageHeight();
+    const bool useAlbedo = mImpl->useAlbedo();
+    const bool useNormals = mImpl->useNormals();
+    const int scale = mOptions.previewScale;
+    const int pw = previewSize(width, scale);
+    const int ph = previewSize(height, scale);
+
+    if (mPreviewImpl && (mPreviewImpl->imageWidth() != pw || mPreviewImpl->imageHeight() != ph)) {
+        if (!mPreviewImpl->reconfigure(pw, ph, useAlbedo, useNormals, errorMsg)) {
+            retireImpl(&mPreviewImpl);
+        } else if (!errorMsg->empty()) {
+            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+            retireImpl(&mPreviewImpl);
+            return;
+        }
+    }
+    if (!mPreviewImpl) {
+        mPreviewImpl = createImpl(pw, ph, useAlbedo, useNormals, mImpl.get(), errorMsg);
+        if (!mPreviewImpl) {
+            return;
+        }
+    }
+
+    // Zero strides follow the InputImage/OutputImage defaults
+    auto pixelStride = [](size_t stride) { return stride ? stride : 4 * sizeof(float); };
+    auto rowStride = [&](size_t pixel, size_t row) { return row ? row : width * pixelStride(pixel); };
+
+    // The downsampled images are packed RGB, which the preview backend binds or copies
+    // as strided images, so the downsample is the only pass over the full-size inputs
+    const size_t rgbStride = 3 * sizeof(float);
+    const size_t previewFloats = static_cast<size_t>(pw) * ph * 3;
+    auto previewImage = [&](const std::vector<float>& buffer) {
+        InputImage preview;
+        preview.data = buffer.data();
+        preview.pixelStride = rgbStride;
+        preview.rowStride = pw * rgbStride;
+        return preview;
+    };
+    auto downsample = [&](const InputImage& image, std::vector<float>* buffer) {
+        buffer->resize(previewFloats);
+        downsampleToRGB(image.data, pixelStride(image.pixelStride),
+                        rowStride(image.pixelStride, image.rowStride),
+                        width, height, scale, buffer->data());
+        return previewImage(*buffer);
+    };
+    // Guides of an unchanged generation are downsampled already, unless the buffers
+    // were resized or freed since
+    const uint64_t generation = mImpl->guideGeneration();
+    auto downsampleGuide = [&](const InputImage& image, std::vector<float>* buffer) {
+        const bool staged = generation && generation == mPreviewGuideGeneration &&
+                            buffer->size() == previewFloats;
+        return staged ? previewImage(*buffer) : downsample(image, buffer);
+    };
+
+    InputImage previewBeauty, previewAlbedo, previewNormals;
+    {
+        PhaseTimer timer(&mLocalTimes.pack);
+        previewBeauty = downsample(beauty, &mPreviewBeauty);
+        if (useAlbedo) previewAlbedo = downsampleGuide(albedo, &mPreviewAlbedo);
+        if (useNormals) previewNormals = downsampleGuide(normals, &mPreviewNormals);
+    }
+    mPreviewGuideGeneration = generation;
+
+    mPreviewOutput.resize(previewFloats);
+    OutputImage previewOutput;
+    previewOutput.data = mPreviewOutput.data();
+    previewOutput.pixelStride = rgbStride;
+    previewOutput.rowStride = pw * rgbStride;
+    mPreviewImpl->setGuideGeneration(generation);
+    mPreviewImpl->denoiseStrided(previewBeauty, previewAlbedo, previewNormals, previewOutput, errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    PhaseTimer timer(&mLocalTimes.unpack);
+    upsampleGuided(mPreviewOutput.data(),
+                   useAlbedo ? mPreviewAlbedo.data() : nullptr,
+                   useNormals ? mPreviewNormals.data() : nullptr,
+                   useAlbedo ? albedo.data : nullptr,
+                   pixelStride(albedo.pixelStride), rowStride(albedo.pixelStride, albedo.rowStride),
+                   useNormals ? normals.data : nullptr,
+                   pixelStride(normals.pixelStride), rowStride(normals.pixelStride, normals.rowStride),
+                   scale,
+                   output.data,
+                   pixelStride(output.pixelStride), rowStride(output.pixelStride, output.rowStride),
+                   width, height);
+}
+
+void
+Denoiser::denoiseTemporal(const float *inputBeauty,
+                          const float *inputAlbedo,
+                          const float *inputNormals,
+                          const float *motion,
+                          float *output,
+                          std::string* errorMsg)
 {
+    if (!waitForBackend(errorMsg)) {
+        return;
+    }
+    mImpl->setGuideGeneration(mGuideGeneration);
+    const DenoiserTimes before = collectTimes();
+    runInExecutor([&] {
+        if (mOptions.previewScale > 1) {
+            denoisePreview(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        } else {
+            mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+        }
+        if (!errorMsg->empty()) {
+            // The output cannot be blended into the next frame
+            resetTemporal();
+            return;
+        }
+
+        PhaseTimer timer(&mLocalTimes.unpack);
+        if (!mTemporal) {
+            mTemporal.reset(new TemporalStabilizer);
+        }
+        mTemporal->apply(mImpl->imageWidth(), mImpl->imageHeight(),
+                         mImpl->useAlbedo() ? inputAlbedo : nullptr,
+                         mImpl->useNormals() ? inputNormals : nullptr,
+                         motion, mOptions.temporalBlend, output);
+    });
+    endCall(before);
+    updateAutoQuality(mLastCall.execute);
 }
 
 void
-Denoiser::denoise(const float *inputBeauty,
-                  const float *inputAlbedo,
-                  const float *inputNormals,
-                  float *output,
-                  std::string* errorMsg)
+Denoiser::resetTemporal()
 {
-    mImpl->denoise(inputBeauty, inputAlbedo, inputNormals, output, errorMsg);
+    if (mTemporal) {
+        mTemporal->reset();
+    }
 }
 
-int
-Denoiser::imageWidth() const
+struct Denoiser::AsyncSlot
 {
-    return mImpl->imageWidth();
+    std::vector<float> mBeauty;
+    std::vector<float> mAlbedo;
+    std::vector<float> mNormals;
+    uint64_t mGuideGeneration = 0; // of mAlbedo and mNormals, 0 if unknown
+    std::shared_future<std::string> mResult;
+    // Times of the denoise, written by the worker before mResult is ready, and whether
+    // they still have to be added to the statistics
+    DenoiserTimes mTimes;
+    bool mUnfinished = false;
+};
+
+DenoiseFuture
+Denoiser::denoiseAsync(const float *inputBeauty,
+                       const float *inputAlbedo,
+                       const float *inputNormals,
+                       float *output)
+{
+    // Only the slot being reused is waited for below, so the previous frame keeps
+    // executing while this one is staged
+    waitForInit();
+    if (!mImpl) {
+        std::string errorMsg;
+        waitUntilReady(&errorMsg);
+        std::promise<std::string> failed;
+        failed.set_value(errorMsg);
+        return DenoiseFuture(failed.get_future().share());
+    }
+    if (mPendingQuality >= 0) {
+        // A quality switch needs the backend idle
+        waitForAsync();
+    }
+
+    const int width = mImpl->imageWidth();
+    const int height = mImpl->imageHeight();
+    const bool useAlbedo = mImpl->useAlbedo();
+    const bool useNormals = mImpl->useNormals();
+
+    if (!mAsyncSlots) {
+        const size_t numFloats = static_cast<size_t>(width) * height * 4;
+        mAsyncSlots.reset(new AsyncSlot[2]);
+        for (int i = 0; i < 2; i++) {
+            mAsyncSlots[i].mBeauty.resize(numFloats);
+            if (useAlbedo) mAsyncSlots[i].mAlbedo.resize(numFloats);
+            if (useNormals) mAsyncSlots[i].mNormals.resize(numFloats);
+        }
+    }
+
+    // The slot is free once the denoise from two calls ago has finished
+    AsyncSlot& slot = mAsyncSlots[mNextAsyncSlot];
+    if (slot.mResult.valid()) {
+        slot.mResult.wait();
+    }
+    finishAsync();
+    mNextAsyncSlot ^= 1;
+
+    const uint64_t generation = mGuideGeneration;
+    const bool copyGuides = !generation || generation != slot.mGuideGeneration;
+    runInExecutor([&] {
+        copyRGBA(inputBeauty, slot.mBeauty.data(), width, height);
+        if (useAlbedo && copyGuides) copyRGBA(inputAlbedo, slot.mAlbedo.data(), width, height);
+        if (useNormals && copyGuides) copyRGBA(inputNormals, slot.mNormals.data(), width, height);
+    });
+    slot.mGuideGeneration = generation;
+
+    // The worker runs one denoise at a time and touches only the backend and the
+    // slot; the statistics and quality switches are left to finishAsync() on this thread
+    if (!mWorker) {
+        mWorker.reset(new AsyncWorker);
+    }
+    slot.mUnfinished = true;
+    slot.mResult = mWorker->submit([this, &slot, output, generation] {
+        std::string errorMsg;
+        const DenoiserTimes before = collectTimes();
+        mImpl->setGuideGeneration(generation);
+        runInExecutor([&] {
+            const float *albedo = slot.mAlbedo.empty() ? nullptr : slot.mAlbedo.data();
+            const float *normals = slot.mNormals.empty() ? nullptr : slot.mNormals.data();
+            if (mOptions.previewScale > 1) {
+                denoisePreview(slot.mBeauty.data(), albedo, normals, output, &errorMsg);
+            } else {
+                mImpl->denoise(slot.mBeauty.data(), albedo, normals, output, &errorMsg);
+            }
+        });
+        const DenoiserTimes after = collectTimes();
+        slot.mTimes.pack = after.pack - before.pack;
+        slot.mTimes.execute = after.execute - before.execute;
+        slot.mTimes.unpack = after.unpack - before.unpack;
+        if (!errorMsg.empty()) {
+            scene_rdl2::logging::Logger::error("Denoiser: " + errorMsg);
+        }
+        return errorMsg;
+    });
+
+    mLastAsync = slot.mResult;
+    return DenoiseFuture(slot.mResult);
 }
 
-int
-Denoiser::imageHeight() const
+namespace {
+
+// An unmeasured tier is assumed to take this much longer than the tier below it
+constexpr double sTierCostRatio = 2.0;
+
+// Step up only if the next tier is expected to stay this far below the target
+constexpr double sStepUpHeadroom = 0.8;
+
+const char*
+qualityName(DenoiserQuality quality)
 {
-    return mImpl->imageHeight();
+    switch (quality) {
+    case QUALITY_FAST:     return "fast";
+    case QUALITY_BALANCED: return "balanced";
+    default:               return "high";
+    }
+}
+
+} // namespace
+
+void
+Denoiser::setQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    waitForAsync();
+    applyQuality(quality, errorMsg);
+}
+
+void
+Denoiser::applyQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    if (quality == mOptions.quality || !mImpl) {
+        return;
+    }
+
+    runInExecutor([&] { mImpl->setQuality(quality, errorMsg); });
+    if (!errorMsg->empty()) {
+        scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+        return;
+    }
+    mOptions.quality = quality;
+
+    // The region backends are recreated at the new tier when they are next needed, the
+    // preview backend keeps its filters like the main one
+    for (std::unique_ptr<DenoiserImpl>& impl : mRegionImpls) {
+        retireImpl(&impl);
+    }
+    mRegionImpls.clear();
+    if (mPreviewImpl) {
+        runInExecutor([&] { mPreviewImpl->setQuality(quality, errorMsg); });
+        if (!errorMsg->empty()) {
+            scene_rdl2::logging::Logger::error("Denoiser: " + *errorMsg);
+            retireImpl(&mPreviewImpl);
+            errorMsg->clear();
+        }
+    }
+    updateBytesAllocated();
+}
+
+void
+Denoiser::setLatencyTarget(double seconds)
+{
+    waitForAsync();
+    mOptions.latencyTarget = seconds;
+}
+
+void
+Denoiser::updateAutoQuality(double executeTime)
+{
+    // Preview execute times say little about the full-resolution tiers
+    if (mOptions.latencyTarget <= 0 || !mImpl || executeTime <= 0 || mOptions.previewScale > 1) {
+        return;
+    }
+
+    const int tier = mOptions.quality;
+    double& measured = mTierExecuteTime[tier];
+    measured = measured > 0 ? 0.5 * (measured + executeTime) : executeTime;
+
+    int next = tier;
+    if (measured > mOptions.latencyTarget) {
+        next = std::max<int>(QUALITY_FAST, tier - 1);
+    } else if (tier < QUALITY_HIGH) {
+        const double expected = mTierExecuteTime[tier + 1] > 0 ? mTierExecuteTime[tier + 1]
+                                                               : measured * sTierCostRatio;
+        if (expected < mOptions.latencyTarget * sStepUpHeadroom) {
+            next = tier + 1;
+        }
+    }
+
+    mPendingQuality = next != tier ? next : -1;
+    if (!asyncBusy()) {
+        applyPendingQuality();
+    }
+}
+
+void
+Denoiser::applyPendingQuality()
+{
+    if (mPendingQuality < 0) {
+        return;
+    }
+    const DenoiserQuality tier = mOptions.quality;
+    const DenoiserQuality next = static_cast<DenoiserQuality>(mPendingQuality);
+    mPendingQuality = -1;
+
+    std::string errorMsg;
+    applyQuality(next, &errorMsg);
+    if (errorMsg.empty()) {
+        scene_rdl2::logging::Logger::info("Denoiser switched to ", qualityName(next),
+                                          " quality, ", mTierExecuteTime[tier] * 1000.0,
+                                          " ms at ", qualityName(tier));
+    }
+}
+
+void
+Denoiser::runInExecutor(const std::function<void()>& func) const
+{
+    if (mOptions.executor) {
+        mOptions.executor(func);
+    } else {
+        func();
+    }
 }
 
 bool
-Denoiser::useAlbedo() const
+Denoiser::isReady() const
 {
-    return mImpl->useAlbedo();
+    return !mInit.valid() || mInit.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void
+Denoiser::waitUntilReady(std::string* errorMsg)
+{
+    waitForInit();
+    if (!mImpl) {
+        *errorMsg = mInit.valid() && !mInit.get().empty() ? mInit.get()
+                                                          : "Denoiser backend could not be created";
+    }
+}
+
+void
+Denoiser::waitForInit() const
+{
+    if (mInit.valid()) {
+        mInit.wait();
+    }
+}
+
+void
+Denoiser::waitForAsync()
+{
+    waitForInit();
+    if (mLastAsync.valid()) {
+        mLastAsync.wait();
+        finishAsync();
+    }
+}
+
+void
+Denoiser::finishAsync()
+{
+    if (!mAsyncSlots) {
+        return;
+    }
+    // mNextAsyncSlot holds the older of the two calls
+    for (int i = 0; i < 2; i++) {
+        AsyncSlot& slot = mAsyncSlots[mNextAsyncSlot ^ i];
+        if (!slot.mUnfinished) {
+            continue;
+        }
+        if (slot.mResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            break;
+        }
+        slot.mUnfinished = false;
+        recordCall(slot.mTimes);
+        updateAutoQuality(slot.mTimes.execute);
+    }
+    // The worker uses the backends until it is idle
+    if (!asyncBusy()) {
+        applyPendingQuality();
+        updateBytesAllocated();
+    }
 }
 
 bool
-Denoiser::useNormals() const
+Denoiser::asyncBusy() const
 {
-    return mImpl->useNormals();
+    return mLastAsync.valid() &&
+           mLastAsync.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool
+Denoiser::waitForBackend(std::string* errorMsg)
+{
+    waitForAsync();
+    if (!mImpl) {
+        waitUntilReady(errorMsg);
+        return false;
+    }
+    return true;
+}
+
+void
+Denoiser::retireImpl(std::unique_ptr<DenoiserImpl>* impl)
+{
+    if (*impl) {
+        // Keep the cumulative counters of the backend being replaced
+        DenoiserStats stats;
+        (*impl)->accumulateStats(&stats);
+        mRetiredStats.total.pack += stats.total.pack;
+        mRetiredStats.total.execute += stats.total.execute;
+        mRetiredStats.total.unpack += stats.total.unpack;
+        mRetiredStats.bytesUploaded += stats.bytesUploaded;
+        mRetiredStats.bytesDownloaded += stats.bytesDownloaded;
+        mRetiredStats.guidesSkipped += stats.guidesSkipped;
+        impl->reset();
+    }
+}
+
+DenoiserTimes
+Denoiser::collectTimes() const
+{
+    DenoiserStats stats;
+    stats.total = mRetiredStats.total;
+    if (mImpl) mImpl->accumulateStats(&stats);
+    for (const auto& impl : mRegionImpls) impl->accumulateStats(&stats);
+    if (mPreviewImpl) mPreviewImpl->accumulateStats(&stats);
+    stats.total.pack += mLocalTimes.pack;
+    stats.total.unpack += mLocalTimes.unpack;
+    return stats.total;
+}
+
+DenoiserStats
+Denoiser::collectStats() const
+{
+    DenoiserStats stats = mRetiredStats;
+    if (mImpl) mImpl->accumulateStats(&stats);
+    for (const auto& impl : mRegionImpls) impl->accumulateStats(&stats);
+    if (mPreviewImpl) mPreviewImpl->accumulateStats(&stats);
+    stats.total.pack += mLocalTimes.pack;
+    stats.total.unpack += mLocalTimes.unpack;
+
+    stats.stagingBytes += mRegionOutput.capacity() * sizeof(float);
+    if (mDirtyTracker) stats.stagingBytes += mDirtyTracker->bytesAllocated();
+    if (mTemporal) stats.stagingBytes += mTemporal->bytesAllocated();
+    stats.stagingBytes += (mPreviewBeauty.capacity() + mPreviewAlbedo.capacity() +
+                           mPreviewNormals.capacity() + mPreviewOutput.capacity()) * sizeof(float);
+    if (mAsyncSlots) {
+        for (int i = 0; i < 2; i++) {
+            const AsyncSlot& slot = mAsyncSlots[i];
+            stats.stagingBytes += (slot.mBeauty.capacity() + slot.mAlbedo.capacity() +
+                                   slot.mNormals.capacity()) * sizeof(float);
+        }
+    }
+
+    stats.lastCall = mLastCall;
+    stats.calls = mCalls;
+    return stats;
+}
+
+void
+Denoiser::endCall(const DenoiserTimes& before)
+{
+    const DenoiserTimes after = collectTimes();
+    DenoiserTimes times;
+    times.pack = after.pack - before.pack;
+    times.execute = after.execute - before.execute;
+    times.unpack = after.unpack - before.unpack;
+    recordCall(times);
+    updateBytesAllocated();
+}
+
+void
+Denoiser::recordCall(const DenoiserTimes& times)
+{
+    mLastCall = times;
+    mCalls++;
+
+    if (mSetupKind) {
+        // OIDN commits the filter for a new size or configuration in the first denoise,
+        // so setup costs are only comparable including that call
+        const double firstCall = times.pack + times.execute + times.unpack;
+        scene_rdl2::logging::Logger::info("Denoiser first call after it was ", mSetupKind,
+                                          " took ", firstCall * 1000.0, " ms, ",
+                                          (mSetupTime + firstCall) * 1000.0,
+                                          " ms with the setup");
+        mSetupKind = nullptr;
+    }
+
+    if (mOptions.logStats) {
+        scene_rdl2::logging::Logger::info("Denoiser call ", mCalls,
+                                          ": pack ", mLastCall.pack * 1000.0,
+                                          " ms, execute ", mLastCall.execute * 1000.0,
+                                          " ms, unpack ", mLastCall.unpack * 1000.0, " ms");
+    }
+}
+
+void
+Denoiser::updateBytesAllocated()
+{
+    // Everything the call needed is still allocated at this point, so the peak is
+    // taken before lowMemory frees it
+    const size_t bytes = collectStats().stagingBytes;
+    size_t peak = mPeakBytesAllocated;
+    while (bytes > peak && !mPeakBytesAllocated.compare_exchange_weak(peak, bytes)) {}
+
+    if (!mOptions.lowMemory) {
+        mBytesAllocated = bytes;
+        return;
+    }
+    runInExecutor([&] {
+        if (mImpl) mImpl->releaseMemory();
+        for (const auto& impl : mRegionImpls) impl->releaseMemory();
+        if (mPreviewImpl) mPreviewImpl->releaseMemory();
+    });
+    mRegionOutput = std::vector<float>();
+    mPreviewBeauty = std::vector<float>();
+    mPreviewAlbedo = std::vector<float>();
+    mPreviewNormals = std::vector<float>();
+    mPreviewOutput = std::vector<float>();
+    mBytesAllocated = collectStats().stagingBytes;
+}
+
+DenoiserStats
+Denoiser::stats()
+{
+    waitForAsync();
+    return collectStats();
+}
+
+void
+Denoiser::resetStats()
+{
+    waitForAsync();
+    if (mImpl) mImpl->resetStats();
+    for (const auto& impl : mRegionImpls) impl->resetStats();
+    if (mPreviewImpl) mPreviewImpl->resetStats();
+    mLocalTimes = DenoiserTimes();
+    mRetiredStats = DenoiserStats();
+    mLastCall = DenoiserTimes();
+    mCalls = 0;
+    mPeakBytesAllocated = mBytesAllocated.load();
+}
+
+void
+Denoiser::logStats()
+{
+    const DenoiserStats s = stats();
+    scene_rdl2::logging::Logger::info("Denoiser stats: ", s.calls, " calls, last call pack ",
+                                      s.lastCall.pack * 1000.0, " ms, execute ",
+                                      s.lastCall.execute * 1000.0, " ms, unpack ",
+                                      s.lastCall.unpack * 1000.0, " ms");
+    scene_rdl2::logging::Logger::info("Denoiser stats: total pack ", s.total.pack, " s, execute ",
+                                      s.total.execute, " s, unpack ", s.total.unpack, " s, ",
+                                      s.bytesUploaded >> 20, " MB uploaded, ",
+                                      s.bytesDownloaded >> 20, " MB downloaded, ",
+                                      s.stagingBytes >> 20, " MB staging allocated, ",
+                                      s.guidesSkipped, " unchanged guides skipped");
+}
+
+bool
+DenoiseFuture::poll() const
+{
+    return mResult.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void
+DenoiseFuture::wait(std::string* errorMsg) const
+{
+    *errorMsg = mResult.get();
 }
 
 } // namespace denoiser
 } // namespace moonray
 
-#endif // MOONRAY_USE_OPTIX
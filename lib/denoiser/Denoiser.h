@@ -3,8 +3,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace moonray {
 namespace denoiser {
@@ -12,7 +17,10 @@ namespace denoiser {
 // We hide the details of this class behind an impl because we don't want to expose
 // all of the CUDA/Optix headers to the rest of Moonray.
 
+class AsyncWorker;
 class DenoiserImpl;
+class DirtyTileTracker;
+class TemporalStabilizer;
 
 enum DenoiserMode
 {
@@ -20,7 +28,247 @@ enum DenoiserMode
     METAL,
     OPEN_IMAGE_DENOISE,
     OPEN_IMAGE_DENOISE_CPU,
-    OPEN_IMAGE_DENOISE_CUDA
+    OPEN_IMAGE_DENOISE_CUDA,
+    // Edge-avoiding a-trous filter guided by albedo and normals.  No network and
+    // no startup cost, for live previews where OIDN is too slow.  On one 2 GHz core a
+    // 1080p frame with both guides takes about 80, 110 and 155 ms at the fast,
+    // balanced and high tiers, and 30 ms more when the guides changed since the last
+    // frame.  The work is split by rows across TBB threads, so even with perfect
+    // scaling single-digit milliseconds needs about 16 cores at the high tier and 9 at
+    // the fast one; the scaling has not been measured.
+    ATROUS
+};
+
+// Speed/quality trade-off of the denoising network, see Denoiser::setQuality()
+enum DenoiserQuality
+{
+    QUALITY_FAST,     // for interactive previews
+    QUALITY_BALANCED, // for interactive final frames
+    QUALITY_HIGH      // for final frames, OIDN's default
+};
+
+// Optional settings for constructing a Denoiser
+struct DenoiserOptions
+{
+    // Peak memory, in bytes, for the denoiser's staging buffers plus the backend's
+    // working memory.  0 means unlimited.  If a full-frame denoiser does not fit,
+    // the frame is processed in fixed-size overlapping tiles.  Each tile is padded
+    // by the overlap the backend reports for its receptive field, the same overlap
+    // OIDN uses for its own internal tiling, and all tiles share one exposure metered
+    // over the whole frame, so there are no seams.  The output is close to untiled
+    // denoising but not identical, because the network sees different context near
+    // tile borders.  How large the difference is with the real network has not been
+    // measured; the unit tests only bound it against a stand-in filter.
+    size_t memoryBudget = 0;
+
+    // Log the phase timings of every denoise call through scene_rdl2::logging
+    bool logStats = false;
+
+    // Stage float inputs and output as half precision in the backend's buffers.  The
+    // conversion is fused into packing, halving staging memory and upload traffic.
+    // Values are clamped to the half range (+-65504).  Has no effect where the backend
+    // reads the caller's float images in place.
+    bool halfStaging = false;
+
+    // Replace NaN, infinite and negative beauty values with 0 while packing, so that a
+    // single bad sample can't spread across a large area of the output.  Where the
+    // backend reads the caller's images in place, the cleaned beauty is written to the
+    // output image and denoised there.
+    bool sanitizeInput = false;
+
+    // Meter the log-average luminance of the beauty while packing it and scale the
+    // network's input so that it maps to middle grey: OIDN's inputScale, Optix's
+    // hdrIntensity.  Without it OIDN meters the image in a pass of its own and Optix
+    // doesn't scale at all, so very dark or bright frames denoise poorly.  Where
+    // nothing is packed on the host, OIDN's devices that read the caller's images in
+    // place meter them in a read-only pass and Optix meters on the GPU.  Tiled, banded
+    // and region denoising meter the whole frame first, with or without this option
+    // where OIDN would otherwise meter each piece, so that all pieces share one
+    // exposure.
+    bool autoExposure = false;
+
+    // Threading of the OIDN CPU device, which otherwise starts a thread for every core
+    // and pins them, oversubscribing the machine while render threads are running.
+    // numThreads 0 uses OIDN's default; with an executor, pass the concurrency of
+    // whatever it runs on.
+    // affinity -1 uses OIDN's default, 0 leaves threads unpinned and 1 pins them.
+    // What these settings and the executor below cost in render throughput and denoise
+    // latency while a renderer is running has not been measured on a multi-core
+    // machine; denoiser_bench -load measures it.
+    int numThreads = 0;
+    int affinity = -1;
+
+    // OIDN: use the process-wide device that every Denoiser with the same device type
+    // and thread settings shares, creating it if this is the first, rather than a
+    // device of its own.  Startup cost and the thread pool are then paid once per
+    // process rather than once per Denoiser; the device goes away with the last
+    // Denoiser using it.  OIDN serializes the work of a device, so while this is on,
+    // denoise calls of different Denoisers no longer overlap even when issued from
+    // different threads: each waits for the others' filters to finish.  Off by default
+    // so that Denoisers stay independent.  How much resident memory sharing saves has
+    // not been measured.  Either way, the backends a Denoiser creates for regions and
+    // previews run on its own device rather than starting more.
+    bool shareDevice = false;
+
+    // OIDN: file of trained filter weights (.tza) to use instead of the built-in ones.
+    // The file is mapped read-only and the mapping is shared by every Denoiser using
+    // the same path.  Empty uses the built-in weights.
+    std::string weightsPath;
+
+    // Create the backend on a background thread so that the constructor returns right
+    // away, see Denoiser::isReady().  Errors are then reported by waitUntilReady() and
+    // the denoise calls rather than by the constructor.
+    bool backgroundInit = false;
+
+    // Denoise a small zero image after creating the backend, so that the first real
+    // denoise doesn't pay for thread startup, kernel loading and filter initialization.
+    // The OIDN CPU device also initializes its filter for the frame size, assuming the
+    // RGBA layout of denoise().  Combine with backgroundInit to keep it off the
+    // caller's thread.
+    bool warmUp = false;
+
+    // Keep the denoiser's footprint to a minimum between calls, at the cost of
+    // allocating and filling the buffers again on every call: staging buffers, tile and
+    // band buffers, the scratch of denoiseRegion() and previews, and OIDN's parked
+    // quality filters are freed after each call.  Where the backend stages through its
+    // own buffers, one buffer holds the beauty in and the result out.  The buffers of
+    // denoiseAsync(), the history of denoiseTemporal() and the change tracking of
+    // denoiseIncremental() carry state from call to call and are kept.
+    bool lowMemory = false;
+
+    // Runs the denoiser's own parallel work (packing, unpacking, tiling, change
+    // tracking) in a caller-owned context, typically the renderer's task arena:
+    //     options.executor = [&arena](const std::function<void()>& func) {
+    //         arena.execute(func);
+    //     };
+    // A function rather than the arena keeps TBB out of this header.  OIDN runs the
+    // filter in an arena of its own, drawing on the same TBB worker pool when it
+    // shares the process's TBB runtime.  Whatever the executor refers to must outlive
+    // the Denoiser.  Empty runs the work on the calling thread's arena.
+    std::function<void(const std::function<void()>&)> executor;
+
+    // OIDN CPU only: number of devices that denoise horizontal bands of the frame in
+    // parallel.  Devices are assigned to NUMA nodes round-robin and each one's packing,
+    // staging buffers and thread count are kept to its node.  The filter itself runs on
+    // OIDN's own threads, which are not pinned: OIDN's affinity setting would put every
+    // device on the same cores, so it is off for banded devices, and the network's
+    // evaluation and working memory may land on any node.  -1 creates one device per
+    // NUMA node, 0 or 1 a single device.
+    int cpuDevices = 0;
+
+    // Initial quality tier and automatic tier selection, see Denoiser::setQuality() and
+    // Denoiser::setLatencyTarget()
+    DenoiserQuality quality = QUALITY_HIGH;
+    double latencyTarget = 0;
+
+    // Initial preview scale, see Denoiser::setPreviewScale()
+    int previewScale = 1;
+
+    // Weight of the previous frame in Denoiser::denoiseTemporal() where its history is
+    // fully accepted.  Higher values remove more flicker but follow lighting changes
+    // more slowly.
+    float temporalBlend = 0.8f;
+};
+
+// Seconds spent in each phase of denoising
+struct DenoiserTimes
+{
+    double pack = 0;    // converting/uploading the inputs into the backend's buffers
+    double execute = 0; // running the filter or network
+    double unpack = 0;  // converting/downloading the result into the output
+
+    double sum() const { return pack + execute + unpack; }
+};
+
+// Returned by Denoiser::stats().  Cumulative values count from construction or the
+// last resetStats().  Phases that overlap, as in denoiseBatch(), are each counted in
+// full.
+struct DenoiserStats
+{
+    DenoiserTimes lastCall;
+    DenoiserTimes total;
+    uint64_t calls = 0;
+    uint64_t bytesUploaded = 0;   // copied into staging or device buffers
+    uint64_t bytesDownloaded = 0; // copied out of staging or device buffers
+    size_t stagingBytes = 0;      // staging and device buffers currently allocated
+    uint64_t guidesSkipped = 0;   // unchanged guide images that were not packed or uploaded
+};
+
+// Memory layout of an InputImage or OutputImage.  Strides are in bytes.
+enum ImageLayout
+{
+    // Rows of pixels: pixel (x, y) at data + y * rowStride + x * pixelStride, with R, G
+    // and B in its first three floats
+    IMAGE_LAYOUT_LINEAR,
+    // Separate R, G and B planes (struct of arrays): channel c of pixel (x, y) at
+    // data + c * planeStride + y * rowStride + x * pixelStride
+    IMAGE_LAYOUT_PLANAR,
+    // Tiles of tileWidth x tileHeight pixels, as in Moonray's tiled framebuffers.  The
+    // pixels of a tile are stored together in rows of tileWidth pixels, tiles follow
+    // each other along a row of tiles, and rowStride is the stride between rows of
+    // tiles.  The tiles along the right and bottom edges are padded to full size.
+    IMAGE_LAYOUT_TILED
+};
+
+// Caller-owned float RGB(A) images for the strided denoise() overload.  Strides of 0
+// take defaults: a pixel stride of 0 means RGBA (16 bytes), or a single float for
+// planar images.  A row stride of 0 means width * pixel stride, or for tiled images
+// the size of a full row of tiles.  A plane stride of 0 means height * row stride.  A
+// sub-rectangle of a larger linear or planar framebuffer is addressed by pointing
+// data at its first pixel and passing the framebuffer's strides.  Backends untile or
+// deinterleave while packing the inputs into their own buffers and do the reverse
+// while unpacking the output, so no layout needs converting beforehand.
+struct InputImage
+{
+    const float *data = nullptr;
+    size_t pixelStride = 0;
+    size_t rowStride = 0;
+    ImageLayout layout = IMAGE_LAYOUT_LINEAR;
+    size_t planeStride = 0;
+    int tileWidth = 8;
+    int tileHeight = 8;
+};
+
+struct OutputImage
+{
+    float *data = nullptr;
+    size_t pixelStride = 0;
+    size_t rowStride = 0;
+    ImageLayout layout = IMAGE_LAYOUT_LINEAR;
+    size_t planeStride = 0;
+    int tileWidth = 8;
+    int tileHeight = 8;
+};
+
+// Rectangle of pixels [x0, x1) x [y0, y1)
+struct DenoiseRegion
+{
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+};
+
+// Handle to a denoise started with Denoiser::denoiseAsync()
+class DenoiseFuture
+{
+public:
+    DenoiseFuture() = default;
+
+    // True if this refers to a denoise that was started
+    bool valid() const { return mResult.valid(); }
+
+    // True once the denoise has finished.  Does not block.
+    bool poll() const;
+
+    // Blocks until the denoise has finished and reports any error in errorMsg
+    void wait(std::string* errorMsg) const;
+
+private:
+    friend class Denoiser;
+    explicit DenoiseFuture(std::shared_future<std::string> result) : mResult(std::move(result)) {}
+
+    std::shared_future<std::string> mResult; // error message, empty on success
 };
 
 class Denoiser
@@ -32,18 +280,186 @@ public:
              bool useAlbedo,
              bool useNormals,
              std::string* errorMsg);
+    Denoiser(DenoiserMode mode,
+             int width,
+             int height,
+             bool useAlbedo,
+             bool useNormals,
+             const DenoiserOptions& options,
+             std::string* errorMsg);
     ~Denoiser();
 
     // Copy is disabled
     Denoiser(const Denoiser& other) = delete;
     Denoiser &operator=(const Denoiser& other) = delete;
 
+    // True once the backend has been created and warmed up, or has failed to be.
+    // Does not block.  Only ever false with DenoiserOptions::backgroundInit; every
+    // other call waits for the backend first.
+    bool isReady() const;
+
+    // Blocks until isReady() and reports any error from creating the backend
+    void waitUntilReady(std::string* errorMsg);
+
+    // Unless noted otherwise, the denoise calls may be given the beauty input as their
+    // output to denoise in place.  For denoiseBatch() that is outputs[i] ==
+    // inputColors[i].
+
     void denoise(const float *inputBeauty,  // RGBA
                  const float *inputAlbedo,  // RGBA
                  const float *inputNormals, // RGBA
                  float *output,       // RGBA
                  std::string* errorMsg);
 
+    // Strided variant, for images in any ImageLayout.  Only the RGB channels of the
+    // output are written, so alpha is left untouched.  Devices that can access system
+    // memory (e.g. the OIDN CPU device) read and write linear images directly without
+    // any staging copies.  Preview scales above 1 need linear images.
+    void denoise(const InputImage& beauty,
+                 const InputImage& albedo,  // ignored unless useAlbedo()
+                 const InputImage& normals, // ignored unless useNormals()
+                 const OutputImage& output,
+                 std::string* errorMsg);
+
+    // Half precision variant.  Images are RGBA of IEEE 754 binary16 values stored as
+    // uint16_t.  OIDN binds them directly as HALF3 images and Optix as HALF4 layers, so
+    // no float conversion is done on the host.
+    void denoiseHalf(const uint16_t *inputBeauty,  // half RGBA
+                     const uint16_t *inputAlbedo,  // half RGBA
+                     const uint16_t *inputNormals, // half RGBA
+                     uint16_t *output,       // half RGBA
+                     std::string* errorMsg);
+
+    // Denoises numImages color images (e.g. the beauty and its light path AOVs) that
+    // share one albedo/normal pair.  The guides are prepared once and the same filter
+    // and buffers are reused for every image.  Each output takes alpha from its input.
+    void denoiseBatch(const float *inputAlbedo,  // RGBA
+                      const float *inputNormals, // RGBA
+                      int numImages,
+                      const float * const *inputColors, // numImages RGBA images
+                      float * const *outputs,           // numImages RGBA images
+                      std::string* errorMsg);
+
+    // Denoises only the given region of full-frame RGBA images and writes it into
+    // output, which is expected to hold the previous result everywhere else.  The
+    // region is padded by the backend's receptive field, and denoised with the exposure
+    // of the whole frame where the backend meters it, so it blends with its
+    // surroundings.  Latency scales with the padded region plus a read of the beauty
+    // for the exposure; when the region covers most of the frame a full denoise is done
+    // instead, which also refreshes the rest of output.
+    void denoiseRegion(const float *inputBeauty,  // RGBA
+                       const float *inputAlbedo,  // RGBA
+                       const float *inputNormals, // RGBA
+                       float *output,       // RGBA
+                       const DenoiseRegion& region,
+                       std::string* errorMsg);
+
+    // Like denoise(), but compares tiles of the inputs against the previous call and
+    // only denoises the ones that changed, compositing them into output together with
+    // the ring of pixels within the backend's receptive field around them.  The first
+    // call, and any call with a different output buffer than the previous one, denoises
+    // the whole frame.  Output must not be modified by the caller between calls, and
+    // cannot be inputBeauty, which is an error.
+    void denoiseIncremental(const float *inputBeauty,  // RGBA
+                            const float *inputAlbedo,  // RGBA
+                            const float *inputNormals, // RGBA
+                            float *output,       // RGBA
+                            std::string* errorMsg);
+
+    // denoise() followed by temporal stabilization against the previous
+    // denoiseTemporal() result, for animation sequences.  The previous result is
+    // reprojected along the motion vectors and blended in (see
+    // DenoiserOptions::temporalBlend) where its albedo and normals match this frame's,
+    // clamped to the range of each pixel's 3x3 neighbourhood so it cannot ghost.
+    // motion holds two floats per pixel, the offset in pixels (x, then y along
+    // increasing rows) from each pixel to where its surface was in the previous frame;
+    // null means nothing moved.  The first frame, and the first after resetTemporal()
+    // or reconfigure(), is not blended.
+    void denoiseTemporal(const float *inputBeauty,  // RGBA
+                         const float *inputAlbedo,  // RGBA
+                         const float *inputNormals, // RGBA
+                         const float *motion,       // XY
+                         float *output,       // RGBA
+                         std::string* errorMsg);
+
+    // Forgets the previous frame of denoiseTemporal(), e.g. at a camera cut
+    void resetTemporal();
+
+    // Copies the inputs into one of two staging slots and returns while the denoise
+    // runs on a background thread, so the caller may reuse its input buffers right away
+    // and the next frame can be staged while this one executes.  The output buffer must
+    // stay valid until the returned future completes.  Denoises run in call order, on
+    // one worker thread per Denoiser.  Their statistics, automatic quality switches and
+    // lowMemory frees are applied by later calls on the caller's thread; a quality
+    // switch waits for the backend to go idle, which costs one frame of overlap.
+    DenoiseFuture denoiseAsync(const float *inputBeauty,  // RGBA
+                               const float *inputAlbedo,  // RGBA
+                               const float *inputNormals, // RGBA
+                               float *output);      // RGBA
+
+    // Changes the image size and guide configuration.  Where the backend allows it, the
+    // device and filter are kept and only the buffers and image bindings are updated;
+    // otherwise the backend is rebuilt.  Outstanding async denoises are waited for.
+    void reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg);
+
+    // Quality tier of the following denoises.  OIDN maps it to the filter's "quality"
+    // parameter.  The filter of every tier that has been used is kept committed, so
+    // after the first switch to a tier, switching to it again is instant; each kept
+    // filter holds its own working memory.  The a-trous filter runs 1, 2 or 3
+    // iterations.  Optix has a single model and ignores it.
+    void setQuality(DenoiserQuality quality, std::string* errorMsg);
+    DenoiserQuality quality() const { return mOptions.quality; }
+
+    // Selects the tier automatically: after each full-frame denoise, the tier steps
+    // down when its measured execute time exceeds the target and steps up when the next
+    // tier is expected to fit.  Seconds per frame, 0 turns automatic selection off.
+    void setLatencyTarget(double seconds);
+    double latencyTarget() const { return mOptions.latencyTarget; }
+
+    // Declares the guides of the following denoise calls.  Callers that know when their
+    // albedo and normals change pass a new, nonzero generation then, e.g. the pass
+    // count while the guides still converge, and keep it while they stay the same.
+    // The guides are then packed, copied and uploaded only when the generation differs
+    // from that of the guides already staged, without reading them to find out.  0,
+    // the default, compares a 64-bit hash of each guide with the previous call's
+    // instead, which reads both guides on every call and, should two different guides
+    // ever hash alike, keeps denoising with the previous ones.  denoiseRegion() and
+    // denoiseIncremental() always hash the crops of the guides they denoise, and
+    // denoiseHalf() always packs and uploads its guides.  The guides are also staged
+    // again after reconfigure(), whatever the generation.
+    void setGuideGeneration(uint64_t generation) { mGuideGeneration = generation; }
+    uint64_t guideGeneration() const { return mGuideGeneration; }
+
+    // Preview mode for interactive feedback.  With a scale above 1, denoise(),
+    // its strided variant and denoiseAsync() box filter the beauty and guides down to
+    // 1/scale of the resolution (rounded up), denoise that with a second, smaller
+    // backend, and upsample the result edge-aware using the full-resolution albedo and
+    // normals, cutting execute time roughly by scale squared.  Without albedo the
+    // upsample is bilinear.  The smaller backend is created on first use and kept while
+    // previews are off, so toggling the scale between frames is cheap.  Other denoise
+    // calls and automatic quality selection always work at full resolution.
+    void setPreviewScale(int scale, std::string* errorMsg);
+    int previewScale() const { return mOptions.previewScale; }
+
+    // Timings, traffic and memory of this denoiser.  Waits for outstanding denoises
+    // started with denoiseAsync() so they are included.
+    DenoiserStats stats();
+    void resetStats();
+    // Writes stats() to the info log
+    void logStats();
+
+    // Bytes of staging, device and scratch memory the denoiser holds now, and the most
+    // it has held at the end of a call since construction or resetStats().  Working
+    // memory that OIDN allocates inside its filters is not reported by OIDN and is not
+    // included.  Both can be called from any thread at any time, e.g. by a memory
+    // governor; they report the state as of the last finished call.
+    size_t bytesAllocated() const { return mBytesAllocated; }
+    size_t peakBytesAllocated() const { return mPeakBytesAllocated; }
+
     DenoiserMode mode() const { return mMode; }
     int imageWidth() const;
     int imageHeight() const;
@@ -51,8 +467,136 @@ public:
     bool useNormals() const;
 
 private:
+    // owner is the main backend when creating a secondary one, see DenoiserFactory
+    std::unique_ptr<DenoiserImpl> createImpl(int width,
+                                             int height,
+                                             bool useAlbedo,
+                                             bool useNormals,
+                                             const DenoiserImpl* owner,
+                                             std::string* errorMsg) const;
+    void applyMemoryBudget(int width,
+                           int height,
+                           bool useAlbedo,
+                           bool useNormals,
+                           std::unique_ptr<DenoiserImpl>* impl,
+                           std::string* errorMsg) const;
+    // Creates and warms up mImpl, on the constructor's thread or in the background
+    void init(int width,
+              int height,
+              bool useAlbedo,
+              bool useNormals,
+              std::string* errorMsg);
+    void waitForInit() const;
+    // Waits for every denoiseAsync() and finishes them with finishAsync()
+    void waitForAsync();
+    // waitForAsync(), then reports a backend that could not be created
+    bool waitForBackend(std::string* errorMsg);
+    // Adds the denoiseAsync() calls that have finished to the statistics in call
+    // order, and once none is outstanding applies what waits for an idle backend
+    void finishAsync();
+    // True while a denoiseAsync() call is queued or running on the worker
+    bool asyncBusy() const;
+    // Runs func through mOptions.executor if one was given
+    void runInExecutor(const std::function<void()>& func) const;
+    // exposure is the exposure of the whole frame from regionExposure()
+    void denoiseRegionImpl(const float *inputBeauty,
+                           const float *inputAlbedo,
+                           const float *inputNormals,
+                           float *output,
+                           const DenoiseRegion& region,
+                           float exposure,
+                           std::string* errorMsg);
+    // Exposure that region backends are fixed to so that regions match the full-frame
+    // denoise, or 0 if the backend does not meter its images
+    float regionExposure(const float *inputBeauty);
+    void resetRegionState();
+    void denoisePreview(const float *inputBeauty,
+                        const float *inputAlbedo,
+                        const float *inputNormals,
+                        float *output,
+                        std::string* errorMsg);
+    void denoisePreview(const InputImage& beauty,
+                        const InputImage& albedo,
+                        const InputImage& normals,
+                        const OutputImage& output,
+                        std::string* errorMsg);
+    void retireImpl(std::unique_ptr<DenoiserImpl>* impl);
+    DenoiserStats collectStats() const;
+    // Cumulative times of all backends and of the work done here
+    DenoiserTimes collectTimes() const;
+    void endCall(const DenoiserTimes& before);
+    // Counts a finished call that took the given times
+    void recordCall(const DenoiserTimes& times);
+    // Updates bytesAllocated() and its peak, after freeing what lowMemory frees
+    void updateBytesAllocated();
+    // Automatic tier selection from the execute time of a full frame.  The switch is
+    // left in mPendingQuality while the backend is busy with denoiseAsync() calls.
+    void updateAutoQuality(double executeTime);
+    void applyPendingQuality();
+    void applyQuality(DenoiserQuality quality, std::string* errorMsg);
+
+    struct AsyncSlot;
+
     DenoiserMode mMode;
+    DenoiserOptions mOptions;
     std::unique_ptr<DenoiserImpl> mImpl;
+    uint64_t mGuideGeneration; // see setGuideGeneration()
+
+    // Background creation of mImpl with DenoiserOptions::backgroundInit.  Holds the
+    // error message, empty on success.
+    std::shared_future<std::string> mInit;
+
+    // Backends sized to padded regions for denoiseRegion(), created on first use,
+    // most recently used first
+    std::vector<std::unique_ptr<DenoiserImpl>> mRegionImpls;
+    std::vector<float> mRegionOutput;
+
+    // Backend at the preview resolution for preview denoising, created on first use,
+    // and the downsampled inputs and preview result (packed RGB)
+    std::unique_ptr<DenoiserImpl> mPreviewImpl;
+    std::vector<float> mPreviewBeauty;
+    std::vector<float> mPreviewAlbedo;
+    std::vector<float> mPreviewNormals;
+    std::vector<float> mPreviewOutput;
+    uint64_t mPreviewGuideGeneration; // of mPreviewAlbedo and mPreviewNormals, 0 if unknown
+
+    // History for denoiseTemporal()
+    std::unique_ptr<TemporalStabilizer> mTemporal;
+
+    // Work done here rather than in a backend: preview downsampling counts as pack,
+    // preview upsampling and temporal stabilization as unpack
+    DenoiserTimes mLocalTimes;
+
+    // Change tracking for denoiseIncremental()
+    std::unique_ptr<DirtyTileTracker> mDirtyTracker;
+    std::vector<DenoiseRegion> mDirtyRegions;
+    const float *mIncrementalOutput;
+
+    // Double-buffered staging for denoiseAsync(), and the thread its denoises run on
+    std::unique_ptr<AsyncSlot[]> mAsyncSlots;
+    int mNextAsyncSlot;
+    std::shared_future<std::string> mLastAsync;
+    std::unique_ptr<AsyncWorker> mWorker;
+
+    // Per-call statistics.  Backends keep their own cumulative counters, which are
+    // folded into mRetiredStats when a backend is replaced.
+    DenoiserTimes mLastCall;
+    uint64_t mCalls;
+    DenoiserStats mRetiredStats;
+
+    // How the backend was last set up ("created", "reconfigured in place" or
+    // "rebuilt") and how long that took, until the next call logs it together with its
+    // own time, which includes committing the filter for the new configuration
+    const char* mSetupKind;
+    double mSetupTime;
+
+    // Smoothed execute time of a full frame at each quality tier, 0 until measured
+    double mTierExecuteTime[QUALITY_HIGH + 1];
+    // Tier chosen by automatic selection but not yet switched to, -1 if none
+    int mPendingQuality;
+
+    std::atomic<size_t> mBytesAllocated;
+    std::atomic<size_t> mPeakBytesAllocated;
 };
 
 } // namespace denoiser
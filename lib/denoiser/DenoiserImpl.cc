@@ -0,0 +1,201 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "DenoiserImpl.h"
+#include "DirtyTileTracker.h"
+#include "PackKernels.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+void
+DenoiserImpl::denoiseHalf(const uint16_t *inputBeauty,
+                          const uint16_t *inputAlbedo,
+                          const uint16_t *inputNormals,
+                          uint16_t *output,
+                          std::string* errorMsg)
+{
+    const size_t numFloats = static_cast<size_t>(mWidth) * mHeight * 4;
+
+    auto convert = [&](const uint16_t* image, std::vector<float>& buffer) {
+        buffer.resize(numFloats);
+        convertHalfToFloat(image, buffer.data(), mWidth, mHeight);
+    };
+
+    std::vector<float> beautyRGBA, albedoRGBA, normalsRGBA;
+    {
+        PhaseTimer timer(&mTimes.pack);
+        convert(inputBeauty, beautyRGBA);
+        if (mUseAlbedo && inputAlbedo) convert(inputAlbedo, albedoRGBA);
+        if (mUseNormals && inputNormals) convert(inputNormals, normalsRGBA);
+    }
+
+    std::vector<float> outputRGBA(numFloats);
+    denoise(beautyRGBA.data(),
+            albedoRGBA.empty() ? nullptr : albedoRGBA.data(),
+            normalsRGBA.empty() ? nullptr : normalsRGBA.data(),
+            outputRGBA.data(),
+            errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    convertFloatToHalf(outputRGBA.data(), output, mWidth, mHeight);
+}
+
+void
+DenoiserImpl::denoiseStrided(const InputImage& beauty,
+                             const InputImage& albedo,
+                             const InputImage& normals,
+                             const OutputImage& output,
+                             std::string* errorMsg)
+{
+    const size_t numFloats = static_cast<size_t>(mWidth) * mHeight * 4;
+    const size_t rgbaStride = 4 * sizeof(float);
+
+    auto gather = [&](const InputImage& image, std::vector<float>& buffer) {
+        buffer.resize(numFloats);
+        copyImageRGB(imageView(image, mWidth, mHeight), 0, 0,
+                     imageView(buffer.data(), rgbaStride, mWidth * rgbaStride), 0, 0,
+                     mWidth, mHeight);
+    };
+
+    std::vector<float> beautyRGBA, albedoRGBA, normalsRGBA;
+    {
+        PhaseTimer timer(&mTimes.pack);
+        gather(beauty, beautyRGBA);
+        if (mUseAlbedo) gather(albedo, albedoRGBA);
+        if (mUseNormals) gather(normals, normalsRGBA);
+        mBytesUploaded += (1 + mUseAlbedo + mUseNormals) * numFloats * sizeof(float);
+    }
+
+    std::vector<float> outputRGBA(numFloats);
+    denoise(beautyRGBA.data(),
+            mUseAlbedo ? albedoRGBA.data() : nullptr,
+            mUseNormals ? normalsRGBA.data() : nullptr,
+            outputRGBA.data(),
+            errorMsg);
+    if (!errorMsg->empty()) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    copyImageRGB(imageView(outputRGBA.data(), rgbaStride, mWidth * rgbaStride), 0, 0,
+                 imageView(output, mWidth, mHeight), 0, 0,
+                 mWidth, mHeight);
+    mBytesDownloaded += numFloats * sizeof(float);
+}
+
+void
+DenoiserImpl::denoiseBatch(const float *inputAlbedo,
+                           const float *inputNormals,
+                           int numImages,
+                           const float * const *inputColors,
+                           float * const *outputs,
+                           std::string* errorMsg)
+{
+    for (int i = 0; i < numImages; i++) {
+        denoise(inputColors[i], inputAlbedo, inputNormals, outputs[i], errorMsg);
+        if (!errorMsg->empty()) {
+            return;
+        }
+    }
+}
+
+void
+DenoiserImpl::accumulateStats(DenoiserStats* stats) const
+{
+    stats->total.pack += mTimes.pack;
+    stats->total.execute += mTimes.execute;
+    stats->total.unpack += mTimes.unpack;
+    stats->bytesUploaded += mBytesUploaded;
+    stats->bytesDownloaded += mBytesDownloaded;
+    stats->stagingBytes += stagingBytes();
+    stats->guidesSkipped += mGuidesSkipped;
+}
+
+void
+DenoiserImpl::resetStats()
+{
+    mTimes = DenoiserTimes();
+    mBytesUploaded = 0;
+    mBytesDownloaded = 0;
+    mGuidesSkipped = 0;
+}
+
+float
+DenoiserImpl::exposureScale(const BeautyConditioning& conditioning) const
+{
+    if (mFixedExposure > 0.f) {
+        return mFixedExposure;
+    }
+    return mAutoExposure ? conditioning.exposureScale() : 0.f;
+}
+
+float
+DenoiserImpl::meterExposure(const ImageView& beauty) const
+{
+    if (mFixedExposure > 0.f) {
+        return mFixedExposure;
+    }
+    BeautyConditioning conditioning;
+    conditioning.meter = true;
+    conditionImage(beauty, mWidth, mHeight, &conditioning);
+    return conditioning.exposureScale();
+}
+
+bool
+DenoiserImpl::guideChanged(const ImageView& image, uint64_t *lastHash)
+{
+    if (!mGuideTracking) {
+        return true;
+    }
+    if (mGuideGeneration) {
+        if (mGuideGeneration == *lastHash) {
+            mGuidesSkipped++;
+            return false;
+        }
+        *lastHash = mGuideGeneration;
+        return true;
+    }
+
+    uint64_t hash = 0;
+    switch (image.layout) {
+    case IMAGE_LAYOUT_LINEAR:
+        hash = hashImage(image.data, image.pixelStride, image.rowStride, mWidth, mHeight);
+        break;
+    case IMAGE_LAYOUT_PLANAR:
+        for (int c = 0; c < 3; c++) {
+            const float *plane = reinterpret_cast<const float*>(
+                reinterpret_cast<const char*>(image.data) + c * image.planeStride);
+            hash = hash * 0x9e3779b97f4a7c15ull ^
+                   hashImage(plane, image.pixelStride, image.rowStride, mWidth, mHeight,
+                             sizeof(float));
+        }
+        break;
+    case IMAGE_LAYOUT_TILED: {
+        // A row of tiles is hashed as one row of pixels, padding included
+        const int tilesX = (mWidth + image.tileWidth - 1) / image.tileWidth;
+        const int tilesY = (mHeight + image.tileHeight - 1) / image.tileHeight;
+        hash = hashImage(image.data, image.pixelStride, image.rowStride,
+                         tilesX * image.tileWidth * image.tileHeight, tilesY);
+        break;
+    }
+    }
+    // 0 is reserved for unknown contents
+    hash = std::max<uint64_t>(1, hash);
+    if (hash == *lastHash) {
+        mGuidesSkipped++;
+        return false;
+    }
+    *lastHash = hash;
+    return true;
+}
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -3,11 +3,31 @@
 
 #pragma once
 
+#include "Denoiser.h"
+#include "PackKernels.h"
+
+#include <scene_rdl2/common/rec_time/RecTime.h>
+
+#include <memory>
 #include <string>
 
 namespace moonray {
 namespace denoiser {
 
+class SharedOIDNDevice;
+
+// Adds the time until the end of the scope to one of the DenoiserTimes phases
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(double* phase) : mPhase(phase) { mTimer.start(); }
+    ~PhaseTimer() { *mPhase += mTimer.end(); }
+
+private:
+    scene_rdl2::rec_time::RecTime mTimer;
+    double* mPhase;
+};
+
 class DenoiserImpl
 {
 public:
@@ -29,16 +49,183 @@ public:
                          float *output,       // RGBA
                          std::string* errorMsg) = 0;
 
+    // Half RGBA inputs and output.  The default implementation converts to float
+    // temporaries for denoise().  Backends with native half images should override it.
+    virtual void denoiseHalf(const uint16_t *inputBeauty,
+                             const uint16_t *inputAlbedo,
+                             const uint16_t *inputNormals,
+                             uint16_t *output,
+                             std::string* errorMsg);
+
+    // The default implementation gathers the images into temporary RGBA buffers for
+    // denoise() and scatters the RGB result back.  Backends that can bind strided
+    // images directly should override it.
+    virtual void denoiseStrided(const InputImage& beauty,
+                                const InputImage& albedo,
+                                const InputImage& normals,
+                                const OutputImage& output,
+                                std::string* errorMsg);
+
+    // Denoises numImages color images that share one albedo/normal pair.  The default
+    // implementation calls denoise() for each image; backends override it to prepare
+    // the guides only once.
+    virtual void denoiseBatch(const float *inputAlbedo,
+                              const float *inputNormals,
+                              int numImages,
+                              const float * const *inputColors,
+                              float * const *outputs,
+                              std::string* errorMsg);
+
+    // Changes the image size and guide configuration while keeping the device and
+    // filter.  Returns false if the backend cannot do this, in which case nothing has
+    // changed and the caller should create a new backend.  Errors are reported in
+    // errorMsg with a return value of true.
+    virtual bool reconfigure(int width,
+                             int height,
+                             bool useAlbedo,
+                             bool useNormals,
+                             std::string* errorMsg) { return false; }
+
+    // Padding in pixels a tile needs around the region it outputs so that adjacent
+    // tiles join without seams.
+    virtual int tileOverlap() const { return 0; }
+
+    // The OIDN device the backend runs on, which the secondary backends Denoiser
+    // creates for regions and previews reuse instead of starting devices of their
+    // own.  Null for backends without one.
+    virtual std::shared_ptr<SharedOIDNDevice> oidnDevice() const { return nullptr; }
+
+    // Limits the backend's internal working memory, if it supports a limit.
+    virtual void setMaxMemory(size_t bytes) {}
+
+    // Switches the quality tier used by the following denoises.  Backends with a
+    // single model ignore it.
+    virtual void setQuality(DenoiserQuality quality, std::string* errorMsg) {}
+
+    // Pays the one-time costs of the first denoise (thread startup, kernel loading,
+    // filter initialization) up front, without touching the caller's images or the
+    // statistics.  Backends without such costs leave it empty.
+    virtual void warmUp(std::string* errorMsg) {}
+
+    // With DenoiserOptions::lowMemory, called after every call to free the staging
+    // buffers that the next call allocates again.  Backends that wrap another backend
+    // forward it.
+    virtual void releaseMemory() {}
+
+    // Adds this backend's cumulative times and traffic to stats->total and the byte
+    // counters, and its allocated buffers to stats->stagingBytes.  Backends that wrap
+    // another backend include it.
+    virtual void accumulateStats(DenoiserStats* stats) const;
+    virtual void resetStats();
+
+    // True if each denoise scales the beauty by an exposure metered from that image,
+    // as DenoiserOptions::autoExposure does and OIDN does on its own.  Wrappers that
+    // denoise the frame in pieces then meter the whole frame and fix the exposure of
+    // their backends with setExposure(), so that the pieces match.
+    virtual bool autoExposes() const { return mAutoExposure; }
+
+    // Fixes the exposure scale of the following denoises instead of metering each
+    // beauty, 0 meters again
+    void setExposure(float scale) { mFixedExposure = scale; }
+
+    // Exposure scale of a whole beauty image, metered in a pass that only reads it
+    // unless the exposure is fixed
+    float meterExposure(const ImageView& beauty) const;
+
+    // Guide tracking skips packing and uploading an albedo or normal image that is the
+    // same as the one already in the backend's buffers.  Without a guide generation it
+    // costs a hash of each guide per call, so wrappers that feed a different part of
+    // the frame on every call (such as tiling) turn it off.
+    void setGuideTracking(bool enable)
+    {
+        mGuideTracking = enable;
+        invalidateGuides();
+    }
+
+    // Generation of the guides of the following denoise calls, see
+    // Denoiser::setGuideGeneration().  Only set on backends that are given the whole
+    // guides, or the same part of them, on every call; wrappers pass it on to such
+    // backends of their own.
+    virtual void setGuideGeneration(uint64_t generation)
+    {
+        if ((generation == 0) != (mGuideGeneration == 0)) {
+            // The keys of the guides in the buffers are hashes or generations, never mixed
+            invalidateGuides();
+        }
+        mGuideGeneration = generation;
+    }
+    uint64_t guideGeneration() const { return mGuideGeneration; }
+
     int imageWidth() const { return mWidth; }
     int imageHeight() const { return mHeight; }
     bool useAlbedo() const { return mUseAlbedo; }
     bool useNormals() const { return mUseNormals; }
 
 protected:
+    size_t pixelStride(size_t stride) const { return stride ? stride : 4 * sizeof(float); }
+    size_t rowStride(size_t pixelStride, size_t stride) const
+    {
+        return stride ? stride : mWidth * this->pixelStride(pixelStride);
+    }
+
+    // Staging and device memory currently allocated by this backend
+    virtual size_t stagingBytes() const { return 0; }
+
+    // Takes DenoiserOptions::sanitizeInput and autoExposure, for backends that
+    // condition the beauty while packing it
+    void setInputConditioning(const DenoiserOptions& options)
+    {
+        mSanitizeInput = options.sanitizeInput;
+        mAutoExposure = options.autoExposure;
+    }
+    // Conditioning to pack the beauty of the next denoise with
+    BeautyConditioning beautyConditioning() const
+    {
+        return { mSanitizeInput, mAutoExposure && mFixedExposure <= 0.f };
+    }
+    // Exposure scale to give the network for a beauty packed with conditioning: the
+    // fixed exposure if there is one, else the metered one with auto-exposure, else 0
+    float exposureScale(const BeautyConditioning& conditioning) const;
+
+    // Returns true if a guide image (RGB read, strides in bytes) differs from the one
+    // whose key is in *lastHash, i.e. it has to be packed and uploaded, and records its
+    // key: the guide generation if one is set, else a hash of the image.  Backends call
+    // invalidateGuides() whenever their guide buffers are reallocated or overwritten
+    // with anything else.
+    bool guideChanged(const ImageView& image, uint64_t *lastHash);
+    bool guideChanged(const float *image, size_t pixelStride, size_t rowStride,
+                      uint64_t *lastHash)
+    {
+        return guideChanged(imageView(image, pixelStride, rowStride), lastHash);
+    }
+    bool guideChanged(const float *image, uint64_t *lastHash)
+    {
+        return guideChanged(image, 4 * sizeof(float), mWidth * 4 * sizeof(float), lastHash);
+    }
+    void invalidateGuides()
+    {
+        mAlbedoHash = 0;
+        mNormalsHash = 0;
+    }
+
     int mWidth;
     int mHeight;
     bool mUseAlbedo;
     bool mUseNormals;
+
+    DenoiserTimes mTimes;
+    uint64_t mBytesUploaded = 0;
+    uint64_t mBytesDownloaded = 0;
+    uint64_t mGuidesSkipped = 0;
+
+    bool mSanitizeInput = false;
+    bool mAutoExposure = false;
+    float mFixedExposure = 0.f; // see setExposure()
+
+    bool mGuideTracking = true;
+    uint64_t mGuideGeneration = 0; // 0 if the guides are hashed
+    uint64_t mAlbedoHash = 0;  // keys of the guides in the backend's buffers, 0 if unknown
+    uint64_t mNormalsHash = 0;
 };
 
 } // namespace denoiser
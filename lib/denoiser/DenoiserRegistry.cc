@@ -0,0 +1,162 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "DenoiserRegistry.h"
+#include "AtrousDenoiserImpl.h"
+#include "BandedDenoiserImpl.h"
+#include "OIDNDenoiserImpl.h"
+#ifdef MOONRAY_USE_OPTIX
+#include "OptixDenoiserImpl.h"
+
+// This header must be included in exactly one .cc file for the link to succeed
+// #include <optix_function_table_definition.h>
+#endif
+
+#include <map>
+#include <mutex>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+std::shared_ptr<SharedOIDNDevice>
+ownerDevice(const DenoiserImpl* owner)
+{
+    return owner ? owner->oidnDevice() : nullptr;
+}
+
+DenoiserFactory
+oidnFactory(OIDNDeviceType deviceType)
+{
+    return [deviceType](int width, int height, bool useAlbedo, bool useNormals,
+                        const DenoiserOptions& options, const DenoiserImpl* owner,
+                        std::string* errorMsg) {
+        return std::unique_ptr<DenoiserImpl>(new OIDNDenoiserImpl(deviceType, width, height,
+                                                                  useAlbedo, useNormals, options,
+                                                                  ownerDevice(owner), errorMsg));
+    };
+}
+
+void
+registerBuiltinFactories(std::map<DenoiserMode, DenoiserFactory>* factories)
+{
+#ifdef MOONRAY_USE_OPTIX
+    (*factories)[OPTIX] = [](int width, int height, bool useAlbedo, bool useNormals,
+                             const DenoiserOptions& options, const DenoiserImpl* owner,
+                             std::string* errorMsg) {
+        return std::unique_ptr<DenoiserImpl>(new OptixDenoiserImpl(width, height, useAlbedo,
+                                                                   useNormals, options, errorMsg));
+    };
+    (*factories)[OPEN_IMAGE_DENOISE_CUDA] = oidnFactory(OIDN_DEVICE_TYPE_CUDA);
+#endif
+#ifdef PLATFORM_APPLE
+    (*factories)[METAL] = oidnFactory(OIDN_DEVICE_TYPE_METAL);
+#endif
+    (*factories)[OPEN_IMAGE_DENOISE] = oidnFactory(OIDN_DEVICE_TYPE_DEFAULT);
+
+    (*factories)[OPEN_IMAGE_DENOISE_CPU] = [](int width, int height, bool useAlbedo,
+                                              bool useNormals, const DenoiserOptions& options,
+                                              const DenoiserImpl* owner, std::string* errorMsg) {
+        const int numDevices = BandedDenoiserImpl::numDevices(options.cpuDevices);
+        if (numDevices > 1 && !owner) {
+            return std::unique_ptr<DenoiserImpl>(new BandedDenoiserImpl(width, height, useAlbedo,
+                                                                        useNormals, numDevices,
+                                                                        options, errorMsg));
+        }
+        return std::unique_ptr<DenoiserImpl>(new OIDNDenoiserImpl(OIDN_DEVICE_TYPE_CPU, width,
+                                                                  height, useAlbedo, useNormals,
+                                                                  options, ownerDevice(owner),
+                                                                  errorMsg));
+    };
+
+    (*factories)[ATROUS] = [](int width, int height, bool useAlbedo, bool useNormals,
+                              const DenoiserOptions& options, const DenoiserImpl* owner,
+                              std::string* errorMsg) {
+        return std::unique_ptr<DenoiserImpl>(new AtrousDenoiserImpl(width, height, useAlbedo,
+                                                                    useNormals, options));
+    };
+}
+
+struct Registry
+{
+    std::mutex mutex;
+    std::map<DenoiserMode, DenoiserFactory> factories;
+
+    Registry() { registerBuiltinFactories(&factories); }
+};
+
+Registry&
+registry()
+{
+    static Registry sRegistry;
+    return sRegistry;
+}
+
+} // namespace
+
+void
+registerDenoiserFactory(DenoiserMode mode, DenoiserFactory factory)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.factories[mode] = std::move(factory);
+}
+
+bool
+isDenoiserModeAvailable(DenoiserMode mode)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    return reg.factories.count(mode) != 0;
+}
+
+std::unique_ptr<DenoiserImpl>
+createDenoiserImpl(DenoiserMode mode,
+                   int width,
+                   int height,
+                   bool useAlbedo,
+                   bool useNormals,
+                   const DenoiserOptions& options,
+                   const DenoiserImpl* owner,
+                   std::string* errorMsg)
+{
+    DenoiserFactory factory;
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.factories.find(mode);
+        if (it != reg.factories.end()) {
+            factory = it->second;
+        }
+    }
+    if (!factory) {
+        *errorMsg = std::string(denoiserModeName(mode)) + " mode not supported in this build";
+        return nullptr;
+    }
+
+    std::unique_ptr<DenoiserImpl> impl = factory(width, height, useAlbedo, useNormals, options,
+                                                 owner, errorMsg);
+    if (!errorMsg->empty()) {
+        impl.reset();
+    }
+    return impl;
+}
+
+const char*
+denoiserModeName(DenoiserMode mode)
+{
+    switch (mode) {
+    case OPTIX:                   return "Optix";
+    case METAL:                   return "Metal";
+    case OPEN_IMAGE_DENOISE:      return "Open Image Denoise";
+    case OPEN_IMAGE_DENOISE_CPU:  return "Open Image Denoise CPU";
+    case OPEN_IMAGE_DENOISE_CUDA: return "Open Image Denoise CUDA";
+    case ATROUS:                  return "A-trous";
+    }
+    return "Unknown";
+}
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,57 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "DenoiserImpl.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+
+// Backends by DenoiserMode.  Denoiser creates its backends only through here, so a
+// new backend needs nothing more than a factory registered for its mode.  The
+// backends of this build (depending on MOONRAY_USE_OPTIX and the platform) are
+// registered on first use; see registerBuiltinFactories() in DenoiserRegistry.cc.
+
+// Creates a backend at the given image size, or at the tile size when Denoiser tiles
+// the frame to fit DenoiserOptions::memoryBudget.  owner is null for a Denoiser's
+// main backend.  For the secondary backends Denoiser creates for regions and previews
+// it is the main backend, whose device (see DenoiserImpl::oidnDevice()) they run on
+// whatever DenoiserOptions::shareDevice says, so a Denoiser never starts more than one
+// device and thread pool.  Secondary backends are never banded.  Failures are
+// reported in errorMsg, in which case the returned backend is discarded.
+using DenoiserFactory = std::function<std::unique_ptr<DenoiserImpl>(int width,
+                                                                    int height,
+                                                                    bool useAlbedo,
+                                                                    bool useNormals,
+                                                                    const DenoiserOptions& options,
+                                                                    const DenoiserImpl* owner,
+                                                                    std::string* errorMsg)>;
+
+// Registers the factory for mode, replacing any registered before.  Thread-safe.
+void registerDenoiserFactory(DenoiserMode mode, DenoiserFactory factory);
+
+// True if a backend is registered for mode
+bool isDenoiserModeAvailable(DenoiserMode mode);
+
+// Creates the backend registered for mode.  Returns null with errorMsg set if none
+// is registered or the factory fails.
+std::unique_ptr<DenoiserImpl> createDenoiserImpl(DenoiserMode mode,
+                                                 int width,
+                                                 int height,
+                                                 bool useAlbedo,
+                                                 bool useNormals,
+                                                 const DenoiserOptions& options,
+                                                 const DenoiserImpl* owner,
+                                                 std::string* errorMsg);
+
+// Human-readable name of a mode for log and error messages
+const char* denoiserModeName(DenoiserMode mode);
+
+} // namespace denoiser
+} // namespace moonray
+
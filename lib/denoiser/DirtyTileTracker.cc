@@ -0,0 +1,162 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "DirtyTileTracker.h"
+
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// One multiply per 8 bytes, which keeps the hash well below the cost of the copy
+// the denoise itself does.  Collisions only lead to a missed update of one tile.
+inline uint64_t
+hashRow(uint64_t h, const float *row, int numPixels)
+{
+    const size_t numWords = static_cast<size_t>(numPixels) * 4 * sizeof(float) / sizeof(uint64_t);
+    for (size_t i = 0; i < numWords; i++) {
+        uint64_t word;
+        std::memcpy(&word, reinterpret_cast<const char*>(row) + i * sizeof(uint64_t), sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Same as hashRow() for a byte range of any length
+inline uint64_t
+hashBytes(uint64_t h, const char *bytes, size_t numBytes)
+{
+    const size_t numWords = numBytes / sizeof(uint64_t);
+    for (size_t i = 0; i < numWords; i++) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + numWords * sizeof(uint64_t), numBytes % sizeof(uint64_t));
+    h = (h ^ tail ^ numBytes) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+}
+
+} // namespace
+
+uint64_t
+hashImage(const float *data, size_t pixelStride, size_t rowStride, int width, int height,
+          size_t pixelBytes)
+{
+    // Only the RGB of the last pixel in a row is read, so a strided image that ends
+    // at its last pixel is never read past
+    const size_t rowBytes = (width - 1) * pixelStride + pixelBytes;
+    constexpr int sBandHeight = 16;
+    const int numBands = (height + sBandHeight - 1) / sBandHeight;
+    std::vector<uint64_t> bandHashes(numBands);
+
+    tbb::parallel_for(0, numBands, [&](int band) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        const int y1 = std::min(height, (band + 1) * sBandHeight);
+        for (int y = band * sBandHeight; y < y1; y++) {
+            h = hashBytes(h, reinterpret_cast<const char*>(data) + y * rowStride, rowBytes);
+        }
+        bandHashes[band] = h;
+    });
+
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint64_t bandHash : bandHashes) {
+        h = (h ^ bandHash) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+void
+DirtyTileTracker::reset()
+{
+    mWidth = 0;
+    mHeight = 0;
+    mHashes.clear();
+}
+
+bool
+DirtyTileTracker::update(int width,
+                         int height,
+                         const float *beauty,
+                         const float *albedo,
+                         const float *normals,
+                         std::vector<DenoiseRegion>* dirtyRegions)
+{
+    dirtyRegions->clear();
+
+    const int tilesX = (width + sTileSize - 1) / sTileSize;
+    const int tilesY = (height + sTileSize - 1) / sTileSize;
+    std::vector<uint64_t> hashes(static_cast<size_t>(tilesX) * tilesY);
+
+    tbb::parallel_for(0, tilesY, [&](int ty) {
+        const int y0 = ty * sTileSize;
+        const int y1 = std::min(height, y0 + sTileSize);
+        for (int tx = 0; tx < tilesX; tx++) {
+            const int x0 = tx * sTileSize;
+            const int numPixels = std::min(width, x0 + sTileSize) - x0;
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (int y = y0; y < y1; y++) {
+                const size_t offset = (static_cast<size_t>(y) * width + x0) * 4;
+                h = hashRow(h, beauty + offset, numPixels);
+                if (albedo) h = hashRow(h, albedo + offset, numPixels);
+                if (normals) h = hashRow(h, normals + offset, numPixels);
+            }
+            hashes[static_cast<size_t>(ty) * tilesX + tx] = h;
+        }
+    });
+
+    const bool havePrevious = width == mWidth && height == mHeight;
+    mWidth = width;
+    mHeight = height;
+    mTilesX = tilesX;
+    mTilesY = tilesY;
+    mHashes.swap(hashes);
+    if (!havePrevious) {
+        return false;
+    }
+
+    // hashes now holds the previous frame.  Build one span of dirty tiles per tile
+    // row (first to last dirty tile) and extend the previous rectangle downwards
+    // while the span stays the same.
+    int openFirst = -1, openLast = -1;
+    for (int ty = 0; ty <= mTilesY; ty++) {
+        int first = -1, last = -1;
+        if (ty < mTilesY) {
+            for (int tx = 0; tx < mTilesX; tx++) {
+                const size_t i = static_cast<size_t>(ty) * mTilesX + tx;
+                if (mHashes[i] != hashes[i]) {
+                    if (first < 0) first = tx;
+                    last = tx;
+                }
+            }
+        }
+        if (openFirst >= 0 && (first != openFirst || last != openLast)) {
+            // Close the rectangle that ended on the previous tile row
+            dirtyRegions->back().y1 = std::min(height, ty * sTileSize);
+            openFirst = -1;
+        }
+        if (first >= 0 && openFirst < 0) {
+            DenoiseRegion region;
+            region.x0 = first * sTileSize;
+            region.x1 = std::min(width, (last + 1) * sTileSize);
+            region.y0 = ty * sTileSize;
+            dirtyRegions->push_back(region);
+            openFirst = first;
+            openLast = last;
+        }
+    }
+    return true;
+}
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,62 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "Denoiser.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+// Finds the parts of the input that changed since the previous frame by hashing
+// fixed-size tiles of the beauty and guide images.  Only the hashes are kept, not
+// the images themselves.
+
+class DirtyTileTracker
+{
+public:
+    static constexpr int sTileSize = 32;
+
+    DirtyTileTracker() : mWidth(0), mHeight(0) {}
+
+    // Hashes the inputs (RGBA, any of the guides may be null) and fills dirtyRegions
+    // with rectangles covering every tile that differs from the previous update().
+    // Tiles are merged into rectangles along rows and then down runs of rows with
+    // the same span.  Returns false if there is no previous frame to compare against,
+    // in which case everything is dirty and dirtyRegions is left empty.
+    bool update(int width,
+                int height,
+                const float *beauty,
+                const float *albedo,
+                const float *normals,
+                std::vector<DenoiseRegion>* dirtyRegions);
+
+    // Forgets the previous frame so the next update() reports everything as dirty
+    void reset();
+
+    size_t bytesAllocated() const { return mHashes.capacity() * sizeof(uint64_t); }
+
+private:
+    int mWidth;
+    int mHeight;
+    int mTilesX;
+    int mTilesY;
+    std::vector<uint64_t> mHashes;
+};
+
+// Hash of the RGB channels of a whole strided image (strides in bytes), using the
+// same hash as the tiles.  Bands of rows are hashed in parallel and combined in order.
+// pixelBytes is the number of bytes hashed per pixel, e.g. one float for a plane.
+uint64_t hashImage(const float *data,
+                   size_t pixelStride,
+                   size_t rowStride,
+                   int width,
+                   int height,
+                   size_t pixelBytes = 3 * sizeof(float));
+
+} // namespace denoiser
+} // namespace moonray
+
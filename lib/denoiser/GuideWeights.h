@@ -0,0 +1,46 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+namespace moonray {
+namespace denoiser {
+
+// How alike two pixels are by their albedo and normal guides, in [0, 1].  Used to
+// keep filtering from crossing the edges the guides show, when upsampling previews,
+// when reprojecting the previous frame and in the a-trous filter.  All pointers are
+// to RGB.
+
+// Falloff for albedoWeight() shared by all of them, a sigma of 0.1 in albedo
+constexpr float sAlbedoFalloff = 50.f;
+
+// 1 / (1 + falloff * squared RGB distance)^2, which falls off like a Gaussian with a
+// sigma of 1 / sqrt(2 * falloff) near zero distance but needs no exp()
+inline float
+albedoWeight(const float* a, const float* b, float falloff)
+{
+    const float dr = a[0] - b[0];
+    const float dg = a[1] - b[1];
+    const float db = a[2] - b[2];
+    const float w = 1.f / (1.f + falloff * (dr * dr + dg * dg + db * db));
+    return w * w;
+}
+
+// Cosine between the normals raised to the 16th power, 1 where either is zero.
+// lengthA is the squared length of a.  Works on the squared cosine to avoid a sqrt.
+inline float
+normalWeight(const float* a, float lengthA, const float* b)
+{
+    const float lengths = lengthA * (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+    if (lengths <= 0.f) {
+        return 1.f;
+    }
+    const float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    const float c2 = dot > 0.f ? dot * dot / lengths : 0.f;
+    const float c4 = c2 * c2;
+    const float c8 = c4 * c4;
+    return c8 * c8;
+}
+
+} // namespace denoiser
+} // namespace moonray
@@ -2,25 +2,76 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "OIDNDenoiserImpl.h"
+#include "OIDNDeviceCache.h"
+#include "OIDNWeightsCache.h"
+#include "PackKernels.h"
 
 #include <scene_rdl2/common/rec_time/RecTime.h>
 #include <scene_rdl2/render/logging/logging.h>
 
+#include <tbb/task_group.h>
+
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <string.h>
 
 namespace moonray {
 namespace denoiser {
 
+namespace {
+
+// Side of the image denoised by warmUp()
+constexpr int sWarmUpSize = 64;
+
+OIDNQuality
+oidnQuality(DenoiserQuality quality)
+{
+    switch (quality) {
+    case QUALITY_FAST:     return OIDN_QUALITY_FAST;
+    case QUALITY_BALANCED: return OIDN_QUALITY_BALANCED;
+    default:               return OIDN_QUALITY_HIGH;
+    }
+}
+
+size_t
+bytesPerPixel(OIDNFormat format)
+{
+    return format == OIDN_FORMAT_HALF3 ? 3 * sizeof(uint16_t) : 3 * sizeof(float);
+}
+
+} // namespace
+
 OIDNDenoiserImpl::OIDNDenoiserImpl(OIDNDeviceType deviceType,
                                    int width,
                                    int height,
                                    bool useAlbedo,
                                    bool useNormals,
+                                   const DenoiserOptions& options,
+                                   const std::shared_ptr<SharedOIDNDevice>& device,
                                    std::string* errorMsg) :
-    DenoiserImpl(width, height, useAlbedo, useNormals)
+    DenoiserImpl(width, height, useAlbedo, useNormals),
+    mDeviceType(deviceType),
+    mDevice(nullptr),
+    mFilter(nullptr),
+    mSystemMemorySupported(false),
+    mHalfStaging(options.halfStaging),
+    mStagingFormat(options.halfStaging ? OIDN_FORMAT_HALF3 : OIDN_FORMAT_FLOAT3),
+    mLowMemory(options.lowMemory),
+    mInputBeauty3(nullptr),
+    mInputAlbedo3(nullptr),
+    mInputNormals3(nullptr),
+    mOutput3(nullptr),
+    mBatchBeauty3(nullptr),
+    mBatchOutput3(nullptr),
+    mStagingCapacity(0),
+    mFilterDirty(true),
+    mInputScale(std::numeric_limits<float>::quiet_NaN()),
+    mQuality(options.quality),
+    mMaxMemoryMB(0)
 {
-    mDeviceType = deviceType;
+    setInputConditioning(options);
 
     switch (deviceType) {
     case OIDN_DEVICE_TYPE_DEFAULT:
@@ -43,45 +94,42 @@ OIDNDenoiserImpl::OIDNDenoiserImpl(OIDNDeviceType deviceType,
 
     const char* oidnErrorMessage;
 
-    mFilter = nullptr;
-    mDevice = oidnNewDevice(deviceType);
-    if (!mDevice) {
-        if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE) {
-            *errorMsg = oidnErrorMessage;
-        } else {
-            *errorMsg = "Unable to create OIDN Device";
-        }
+    mSharedDevice = device ? device :
+                    SharedOIDNDevice::acquire(deviceType, options.numThreads, options.affinity,
+                                              options.shareDevice, errorMsg);
+    if (!mSharedDevice) {
         return;
     }
-    oidnCommitDevice(mDevice);
+    mDevice = mSharedDevice->get();
 
-    mFilter = oidnNewFilter(mDevice, "RT");
+    if (!options.weightsPath.empty()) {
+        mWeights = MappedOIDNWeights::acquire(options.weightsPath, errorMsg);
+        if (!mWeights) {
+            return;
+        }
+    }
+
+    mFilter = newFilter(mQuality);
     if (!mFilter) {
         *errorMsg = "Unable to create OIDN Filter";
-        oidnReleaseDevice(mDevice);
         return;
     } 
-    oidnSetFilter1b(mFilter, "hdr", true);
-
-    size_t bufferSize = mWidth * mHeight * 3 * sizeof(float);
-
-    mInputBeauty3 = oidnNewBuffer(mDevice, bufferSize);
-    oidnSetFilterImage(mFilter, "color", mInputBeauty3, OIDN_FORMAT_FLOAT3, mWidth, mHeight, 0, 0, 0);
 
-    mOutput3 = oidnNewBuffer(mDevice, bufferSize);
-    oidnSetFilterImage(mFilter, "output", mOutput3, OIDN_FORMAT_FLOAT3, mWidth, mHeight, 0, 0, 0);
-    
-    if (mUseAlbedo) {
-        mInputAlbedo3 = oidnNewBuffer(mDevice, bufferSize);
-        oidnSetFilterImage(mFilter, "albedo", mInputAlbedo3, OIDN_FORMAT_FLOAT3, mWidth, mHeight, 0, 0, 0);
-    }
-
-    if (mUseNormals) {
-        mInputNormals3 = oidnNewBuffer(mDevice, bufferSize);
-        oidnSetFilterImage(mFilter, "normal", mInputNormals3, OIDN_FORMAT_FLOAT3, mWidth, mHeight, 0, 0, 0);
+    // Devices that can access system memory (always true for the CPU device) bind the
+    // caller's images directly at denoise time.  Everything else stages through device
+    // buffers, which are set up now so the filter can be committed up front.
+    mSystemMemorySupported = oidnGetDeviceBool(mDevice, "systemMemorySupported");
+    if (mSystemMemorySupported) {
+        scene_rdl2::logging::Logger::info("Open Image Denoise device supports system memory, "
+                                          "binding caller images directly");
+    } else {
+        if (!allocateStagingBuffers(errorMsg)) {
+            return;
+        }
+        bindStagingImages();
+        oidnCommitFilter(mFilter);
+        mFilterDirty = false;
     }
-    
-    oidnCommitFilter(mFilter);
 
     if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE) {
         *errorMsg = oidnErrorMessage;
@@ -110,13 +158,12 @@ OIDNDenoiserImpl::~OIDNDenoiserImpl()
         scene_rdl2::logging::Logger::info("Freeing Open Image Denoise denoiser (unknown device)");
     }
 
-    if (mInputBeauty3) oidnReleaseBuffer(mInputBeauty3);
-    if (mUseAlbedo && mInputAlbedo3) oidnReleaseBuffer(mInputAlbedo3);
-    if (mUseNormals && mInputNormals3) oidnReleaseBuffer(mInputNormals3);
-    if (mOutput3) oidnReleaseBuffer(mOutput3);
+    releaseStagingBuffers();
+    releaseBatchBuffers();
+    releaseParkedFilters();
 
     if (mFilter) oidnReleaseFilter(mFilter);
-    if (mDevice) oidnReleaseDevice(mDevice);
+    // mSharedDevice releases the device if this was its last user
 }
 
 void 
@@ -126,52 +173,872 @@ OIDNDenoiserImpl::denoise(const float *inputBeauty,
                           float *output,
                           std::string* errorMsg)
 {
-    float* mInputBeauty3Ptr = (float*)oidnGetBufferData(mInputBeauty3);
-    for (int i = 0; i < mWidth * mHeight; i++) {
-        mInputBeauty3Ptr[i * 3] = inputBeauty[i * 4];
-        mInputBeauty3Ptr[i * 3 + 1] = inputBeauty[i * 4 + 1];
-        mInputBeauty3Ptr[i * 3 + 2] = inputBeauty[i * 4 + 2];
+    if (mSystemMemorySupported) {
+        // The RGBA buffers are read and written in place as FLOAT3 images with a
+        // 16 byte pixel stride, so only the alpha channel needs copying afterwards.
+        const size_t rgbaStride = 4 * sizeof(float);
+        denoiseStrided({inputBeauty, rgbaStride, 0},
+                       {inputAlbedo, rgbaStride, 0},
+                       {inputNormals, rgbaStride, 0},
+                       {output, rgbaStride, 0},
+                       errorMsg);
+        if (errorMsg->empty() && output != inputBeauty) {
+            PhaseTimer timer(&mTimes.unpack);
+            copyAlpha(inputBeauty, output, mWidth, mHeight);
+        }
+        return;
     }
 
+    if (!setStagingFormat(floatStagingFormat(), errorMsg)) {
+        return;
+    }
 
-    if (mUseAlbedo) {
-        float* mInputAlbedo3Ptr = (float*)oidnGetBufferData(mInputAlbedo3);
-        for (int i = 0; i < mWidth * mHeight; i++) {
-            mInputAlbedo3Ptr[i * 3] = inputAlbedo[i * 4];
-            mInputAlbedo3Ptr[i * 3 + 1] = inputAlbedo[i * 4 + 1];
-            mInputAlbedo3Ptr[i * 3 + 2] = inputAlbedo[i * 4 + 2];
+    BeautyConditioning conditioning = beautyConditioning();
+    {
+        PhaseTimer timer(&mTimes.pack);
+        packInput(inputBeauty, mInputBeauty3, &conditioning);
+
+        if (mUseAlbedo && guideChanged(inputAlbedo, &mAlbedoHash)) {
+            packInput(inputAlbedo, mInputAlbedo3);
+        }
+
+        if (mUseNormals && guideChanged(inputNormals, &mNormalsHash)) {
+            packInput(inputNormals, mInputNormals3);
         }
     }
 
-    if (mUseNormals) {
-        float* mInputNormals3Ptr = (float*)oidnGetBufferData(mInputNormals3);
-        for (int i = 0; i < mWidth * mHeight; i++) {
-            mInputNormals3Ptr[i * 3] = inputNormals[i * 4];
-            mInputNormals3Ptr[i * 3 + 1] = inputNormals[i * 4 + 1];
-            mInputNormals3Ptr[i * 3 + 2] = inputNormals[i * 4 + 2];
+    setInputScale(exposureScale(conditioning));
+    if (!execute(errorMsg)) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    unpackOutput(stagingOutput(), inputBeauty, output);
+}
+
+void
+OIDNDenoiserImpl::denoiseHalf(const uint16_t *inputBeauty,
+                              const uint16_t *inputAlbedo,
+                              const uint16_t *inputNormals,
+                              uint16_t *output,
+                              std::string* errorMsg)
+{
+    if ((mUseAlbedo && !inputAlbedo) || (mUseNormals && !inputNormals)) {
+        *errorMsg = "Denoiser is configured for albedo/normals but none were provided";
+        return;
+    }
+
+    BeautyConditioning conditioning = beautyConditioning();
+    if (mSystemMemorySupported) {
+        // Bound in place as HALF3 images with an 8 byte pixel stride.  Sanitizing
+        // copies the beauty to the output and denoises it there.
+        const size_t pixelStride = 4 * sizeof(uint16_t);
+        const size_t rowStride = mWidth * pixelStride;
+        const uint16_t *color = conditioning.sanitize ? output : inputBeauty;
+        if (conditioning.enabled()) {
+            PhaseTimer timer(&mTimes.pack);
+            conditionHalfRGBA(inputBeauty, const_cast<uint16_t*>(color), mWidth, mHeight, &conditioning);
+        }
+        bindImage("color", color, pixelStride, rowStride, &mColorBinding, OIDN_FORMAT_HALF3);
+        if (mUseAlbedo) {
+            bindImage("albedo", inputAlbedo, pixelStride, rowStride, &mAlbedoBinding, OIDN_FORMAT_HALF3);
+        }
+        if (mUseNormals) {
+            bindImage("normal", inputNormals, pixelStride, rowStride, &mNormalBinding, OIDN_FORMAT_HALF3);
+        }
+        bindImage("output", output, pixelStride, rowStride, &mOutputBinding, OIDN_FORMAT_HALF3);
+        setInputScale(exposureScale(conditioning));
+        if (execute(errorMsg) && output != color) {
+            PhaseTimer timer(&mTimes.unpack);
+            copyAlphaHalf(inputBeauty, output, mWidth, mHeight);
         }
+        return;
     }
 
-    // scene_rdl2::rec_time::RecTime denoiseTimer;
-    // denoiseTimer.start();
+    if (!setStagingFormat(OIDN_FORMAT_HALF3, errorMsg)) {
+        return;
+    }
 
-    oidnExecuteFilter(mFilter);
+    // The guide buffers no longer hold float guides
+    invalidateGuides();
+
+    const size_t rgbBytes = mWidth * mHeight * 3 * sizeof(uint16_t);
+    {
+        PhaseTimer timer(&mTimes.pack);
+        packHalfRGBAtoRGB(inputBeauty, (uint16_t*)oidnGetBufferData(mInputBeauty3), mWidth, mHeight,
+                          &conditioning);
+        if (mUseAlbedo) {
+            packHalfRGBAtoRGB(inputAlbedo, (uint16_t*)oidnGetBufferData(mInputAlbedo3), mWidth, mHeight);
+        }
+        if (mUseNormals) {
+            packHalfRGBAtoRGB(inputNormals, (uint16_t*)oidnGetBufferData(mInputNormals3), mWidth, mHeight);
+        }
+        mBytesUploaded += (1 + mUseAlbedo + mUseNormals) * rgbBytes;
+    }
+
+    setInputScale(exposureScale(conditioning));
+    if (!execute(errorMsg)) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    unpackHalfRGBtoRGBA((const uint16_t*)oidnGetBufferData(stagingOutput()), inputBeauty, output,
+                        mWidth, mHeight);
+    mBytesDownloaded += rgbBytes;
+}
+
+void
+OIDNDenoiserImpl::denoiseStrided(const InputImage& beauty,
+                                 const InputImage& albedo,
+                                 const InputImage& normals,
+                                 const OutputImage& output,
+                                 std::string* errorMsg)
+{
+    if ((mUseAlbedo && !albedo.data) || (mUseNormals && !normals.data)) {
+        *errorMsg = "Denoiser is configured for albedo/normals but none were provided";
+        return;
+    }
+
+    const ImageView beautyView = imageView(beauty, mWidth, mHeight);
+    const ImageView albedoView = imageView(albedo, mWidth, mHeight);
+    const ImageView normalsView = imageView(normals, mWidth, mHeight);
+    const ImageView outputView = imageView(output, mWidth, mHeight);
+
+    if (mSystemMemorySupported) {
+        denoiseSystemMemory(beautyView, albedoView, normalsView, outputView, errorMsg);
+        return;
+    }
+
+    if (!setStagingFormat(floatStagingFormat(), errorMsg)) {
+        return;
+    }
+
+    // Untiling and deinterleaving happen here, as part of packing
+    const size_t rgbBytes = mWidth * mHeight * bytesPerPixel(mStagingFormat);
+    auto pack = [&](const ImageView& image, OIDNBuffer buffer, BeautyConditioning* conditioning) {
+        if (mStagingFormat == OIDN_FORMAT_HALF3) {
+            copyImageRGBToHalf(image, (uint16_t*)oidnGetBufferData(buffer), mWidth, mHeight,
+                               conditioning);
+        } else {
+            const size_t rgbStride = 3 * sizeof(float);
+            copyImageRGB(image, 0, 0,
+                         imageView((float*)oidnGetBufferData(buffer), rgbStride, mWidth * rgbStride), 0, 0,
+                         mWidth, mHeight, conditioning);
+        }
+        mBytesUploaded += rgbBytes;
+    };
+
+    BeautyConditioning conditioning = beautyConditioning();
+    {
+        PhaseTimer timer(&mTimes.pack);
+        pack(beautyView, mInputBeauty3, &conditioning);
+        if (mUseAlbedo && guideChanged(albedoView, &mAlbedoHash)) {
+            pack(albedoView, mInputAlbedo3, nullptr);
+        }
+        if (mUseNormals && guideChanged(normalsView, &mNormalsHash)) {
+            pack(normalsView, mInputNormals3, nullptr);
+        }
+    }
+
+    setInputScale(exposureScale(conditioning));
+    if (!execute(errorMsg)) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    if (mStagingFormat == OIDN_FORMAT_HALF3) {
+        copyImageRGBFromHalf((const uint16_t*)oidnGetBufferData(stagingOutput()), outputView,
+                             mWidth, mHeight);
+    } else {
+        const size_t rgbStride = 3 * sizeof(float);
+        copyImageRGB(imageView((const float*)oidnGetBufferData(stagingOutput()), rgbStride, mWidth * rgbStride), 0, 0,
+                     outputView, 0, 0, mWidth, mHeight);
+    }
+    mBytesDownloaded += rgbBytes;
+}
+
+void
+OIDNDenoiserImpl::denoiseSystemMemory(const ImageView& beauty,
+                                      const ImageView& albedo,
+                                      const ImageView& normals,
+                                      const ImageView& output,
+                                      std::string* errorMsg)
+{
+    // Linear images are bound as they are.  Other layouts are gathered into packed RGB
+    // scratch images, and the output is denoised in place in the color scratch and
+    // scattered from there.
+    const size_t rgbStride = 3 * sizeof(float);
+    const size_t scratchFloats = static_cast<size_t>(mWidth) * mHeight * 3;
+    const bool scatter = output.layout != IMAGE_LAYOUT_LINEAR;
+
+    auto bind = [&](const char *name, const ImageView& image, std::vector<float>& scratch,
+                    uint64_t *hash, ImageBinding *binding, BeautyConditioning *conditioning) {
+        if (image.layout == IMAGE_LAYOUT_LINEAR) {
+            bindImage(name, image.data, image.pixelStride, image.rowStride, binding);
+            return;
+        }
+        // The guide hashes describe the scratch images on these devices
+        const bool resized = scratch.size() != scratchFloats;
+        if (resized) {
+            scratch.resize(scratchFloats);
+        }
+        if (!hash || guideChanged(image, hash) || resized) {
+            copyImageRGB(image, 0, 0, imageView(scratch.data(), rgbStride, mWidth * rgbStride), 0, 0,
+                         mWidth, mHeight, conditioning);
+            mBytesUploaded += scratchFloats * sizeof(float);
+        }
+        bindImage(name, scratch.data(), rgbStride, mWidth * rgbStride, binding);
+    };
+
+    BeautyConditioning conditioning = beautyConditioning();
+    {
+        PhaseTimer timer(&mTimes.pack);
+        if (scatter && beauty.layout == IMAGE_LAYOUT_LINEAR) {
+            mLayoutColor.resize(scratchFloats);
+        }
+        if (beauty.layout == IMAGE_LAYOUT_LINEAR) {
+            const ImageView target = scatter ? imageView(mLayoutColor.data(), rgbStride, mWidth * rgbStride)
+                                             : output;
+            const ImageView color = conditionBeauty(beauty, target, &conditioning);
+            bindImage("color", color.data, color.pixelStride, color.rowStride, &mColorBinding);
+        } else {
+            bind("color", beauty, mLayoutColor, nullptr, &mColorBinding, &conditioning);
+        }
+        if (mUseAlbedo) {
+            bind("albedo", albedo, mLayoutAlbedo, &mAlbedoHash, &mAlbedoBinding, nullptr);
+        }
+        if (mUseNormals) {
+            bind("normal", normals, mLayoutNormals, &mNormalsHash, &mNormalBinding, nullptr);
+        }
+        if (scatter) {
+            bindImage("output", mLayoutColor.data(), rgbStride, mWidth * rgbStride, &mOutputBinding);
+        } else {
+            bindImage("output", output.data, output.pixelStride, output.rowStride, &mOutputBinding);
+        }
+    }
+
+    setInputScale(exposureScale(conditioning));
+    if (!execute(errorMsg) || !scatter) {
+        return;
+    }
+
+    PhaseTimer timer(&mTimes.unpack);
+    copyImageRGB(imageView(mLayoutColor.data(), rgbStride, mWidth * rgbStride), 0, 0,
+                 output, 0, 0, mWidth, mHeight);
+    mBytesDownloaded += scratchFloats * sizeof(float);
+}
+
+void
+OIDNDenoiserImpl::denoiseBatch(const float *inputAlbedo,
+                               const float *inputNormals,
+                               int numImages,
+                               const float * const *inputColors,
+                               float * const *outputs,
+                               std::string* errorMsg)
+{
+    if ((mUseAlbedo && !inputAlbedo) || (mUseNormals && !inputNormals)) {
+        *errorMsg = "Denoiser is configured for albedo/normals but none were provided";
+        return;
+    }
+    if (numImages <= 0) {
+        return;
+    }
+
+    const size_t rgbaStride = 4 * sizeof(float);
+    const size_t rgbaRowStride = mWidth * rgbaStride;
+    tbb::task_group alphaTasks;
+
+    if (mSystemMemorySupported) {
+        // The guides are bound once.  Only the color and output pointers change between
+        // images, which doesn't require the filter to be re-initialized.
+        if (mUseAlbedo) {
+            bindImage("albedo", inputAlbedo, rgbaStride, rgbaRowStride, &mAlbedoBinding);
+        }
+        if (mUseNormals) {
+            bindImage("normal", inputNormals, rgbaStride, rgbaRowStride, &mNormalBinding);
+        }
+        // The alpha copies may run concurrently, so each one times into its own slot
+        std::vector<double> alphaTimes(numImages, 0.0);
+        for (int i = 0; i < numImages; i++) {
+            BeautyConditioning conditioning = beautyConditioning();
+            ImageView color = imageView(inputColors[i], rgbaStride, rgbaRowStride);
+            if (conditioning.enabled()) {
+                PhaseTimer timer(&mTimes.pack);
+                color = conditionBeauty(color, imageView(outputs[i], rgbaStride, rgbaRowStride),
+                                        &conditioning);
+            }
+            bindImage("color", color.data, rgbaStride, rgbaRowStride, &mColorBinding);
+            bindImage("output", outputs[i], rgbaStride, rgbaRowStride, &mOutputBinding);
+            setInputScale(exposureScale(conditioning));
+            if (!execute(errorMsg)) {
+                break;
+            }
+            // Copy alpha while the next image is being filtered
+            if (outputs[i] != inputColors[i]) {
+                alphaTasks.run([=, &alphaTimes] {
+                    PhaseTimer timer(&alphaTimes[i]);
+                    copyAlpha(inputColors[i], outputs[i], mWidth, mHeight);
+                });
+            }
+        }
+        alphaTasks.wait();
+        for (double time : alphaTimes) {
+            mTimes.unpack += time;
+        }
+        return;
+    }
+
+    // With a single staging buffer the images go through denoise() one at a time,
+    // which still packs unchanged guides only once
+    if (mLowMemory) {
+        DenoiserImpl::denoiseBatch(inputAlbedo, inputNormals, numImages, inputColors, outputs,
+                                   errorMsg);
+        return;
+    }
+
+    // Staging path: the guides are packed once, and the color/output staging buffers
+    // are double-buffered so packing the next image and unpacking the previous one
+    // overlap with the filter execution.
+    if (!setStagingFormat(floatStagingFormat(), errorMsg)) {
+        return;
+    }
+    if (numImages > 1 && !allocateBatchBuffers(errorMsg)) {
+        return;
+    }
+    const OIDNBuffer colorBuffers[2] = { mInputBeauty3, mBatchBeauty3 };
+    const OIDNBuffer outputBuffers[2] = { mOutput3, mBatchOutput3 };
+    BeautyConditioning conditioning[2]; // of the image in each color buffer
+    tbb::task_group packTasks;
+
+    {
+        PhaseTimer timer(&mTimes.pack);
+        if (mUseAlbedo && guideChanged(inputAlbedo, &mAlbedoHash)) {
+            packInput(inputAlbedo, mInputAlbedo3);
+        }
+        if (mUseNormals && guideChanged(inputNormals, &mNormalsHash)) {
+            packInput(inputNormals, mInputNormals3);
+        }
+        conditioning[0] = beautyConditioning();
+        packInput(inputColors[0], colorBuffers[0], &conditioning[0]);
+    }
+    for (int i = 0; i < numImages; i++) {
+        const int slot = i & 1;
+        if (i + 1 < numImages) {
+            const int nextSlot = slot ^ 1;
+            packTasks.run([=, &conditioning] {
+                PhaseTimer timer(&mTimes.pack);
+                conditioning[nextSlot] = beautyConditioning();
+                packInput(inputColors[i + 1], colorBuffers[nextSlot], &conditioning[nextSlot]);
+            });
+        }
+        if (i > 0) {
+            bindStagingColor(colorBuffers[slot], outputBuffers[slot]);
+        }
+        setInputScale(exposureScale(conditioning[slot]));
+        const bool ok = execute(errorMsg);
+        packTasks.wait();
+        if (!ok) {
+            break;
+        }
+        // The unpack of the previous image reads the other output slot, which the
+        // next execute writes
+        alphaTasks.wait();
+        alphaTasks.run([=] {
+            PhaseTimer timer(&mTimes.unpack);
+            unpackOutput(outputBuffers[slot], inputColors[i], outputs[i]);
+        });
+    }
+    alphaTasks.wait();
+
+    // Leave the primary staging buffers bound for denoise()
+    if (numImages > 1) {
+        bindStagingColor(mInputBeauty3, mOutput3);
+    }
+}
+
+int
+OIDNDenoiserImpl::tileOverlap() const
+{
+    // The filter only reports its overlap once it has been committed, which for
+    // directly bound images happens on the first denoise() call
+    const int overlap = oidnGetFilterInt(mFilter, "tileOverlap");
+    return overlap > 0 ? overlap : sDefaultTileOverlap;
+}
+
+size_t
+OIDNDenoiserImpl::stagingBytes() const
+{
+    size_t numBuffers = 0;
+    for (OIDNBuffer buffer : { mInputBeauty3, mInputAlbedo3, mInputNormals3, mOutput3,
+                               mBatchBeauty3, mBatchOutput3 }) {
+        numBuffers += buffer != nullptr;
+    }
+    return numBuffers * mStagingCapacity +
+           (mLayoutColor.capacity() + mLayoutAlbedo.capacity() + mLayoutNormals.capacity()) * sizeof(float);
+}
+
+void
+OIDNDenoiserImpl::setMaxMemory(size_t bytes)
+{
+    mMaxMemoryMB = std::max<int>(1, bytes >> 20);
+    oidnSetFilterInt(mFilter, "maxMemoryMB", mMaxMemoryMB);
+    mFilterDirty = true;
+    releaseParkedFilters();
+}
+
+OIDNFilter
+OIDNDenoiserImpl::newFilter(DenoiserQuality quality)
+{
+    OIDNFilter filter = oidnNewFilter(mDevice, "RT");
+    if (filter) {
+        oidnSetFilterBool(filter, "hdr", true);
+        oidnSetFilterInt(filter, "quality", oidnQuality(quality));
+        if (mMaxMemoryMB > 0) {
+            oidnSetFilterInt(filter, "maxMemoryMB", mMaxMemoryMB);
+        }
+        if (mWeights) {
+            // OIDN reads the weights in place, so the mapping must outlive the filter
+            oidnSetSharedFilterData(filter, "weights", const_cast<void*>(mWeights->data()),
+                                    mWeights->size());
+        }
+    }
+    return filter;
+}
+
+void
+OIDNDenoiserImpl::setQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    if (quality == mQuality) {
+        return;
+    }
+
+    // Park the active filter with its bindings
+    ParkedFilter& current = mParkedFilters[mQuality];
+    current.filter = mFilter;
+    current.color = mColorBinding;
+    current.albedo = mAlbedoBinding;
+    current.normal = mNormalBinding;
+    current.output = mOutputBinding;
+    current.inputScale = mInputScale;
+    current.dirty = mFilterDirty;
+
+    ParkedFilter& next = mParkedFilters[quality];
+    if (next.filter) {
+        // Bindings that differ from the active ones are re-set by the next denoise,
+        // which only changes pointers and does not re-initialize the filter
+        mFilter = next.filter;
+        mColorBinding = next.color;
+        mAlbedoBinding = next.albedo;
+        mNormalBinding = next.normal;
+        mOutputBinding = next.output;
+        mInputScale = next.inputScale;
+        mFilterDirty = next.dirty;
+        next = ParkedFilter();
+        mQuality = quality;
+        return;
+    }
+
+    mFilter = newFilter(quality);
+    if (!mFilter) {
+        *errorMsg = "Unable to create OIDN Filter";
+        mFilter = current.filter;
+        current = ParkedFilter();
+        return;
+    }
+    mQuality = quality;
+    mInputScale = std::numeric_limits<float>::quiet_NaN();
+
+    // Bind the same images as the previous filter and commit right away, so the
+    // filter's initialization happens now rather than in the next denoise
+    if (mSystemMemorySupported) {
+        auto rebind = [&](const char *name, ImageBinding *binding) {
+            const ImageBinding previous = *binding;
+            *binding = ImageBinding();
+            if (previous.data) {
+                bindImage(name, previous.data, previous.pixelStride, previous.rowStride,
+                          binding, previous.format);
+            }
+        };
+        rebind("color", &mColorBinding);
+        rebind("albedo", &mAlbedoBinding);
+        rebind("normal", &mNormalBinding);
+        rebind("output", &mOutputBinding);
+    } else if (mInputBeauty3) {
+        bindStagingImages();
+    }
+    mFilterDirty = true;
+    if (mSystemMemorySupported ? mColorBinding.data != nullptr : mInputBeauty3 != nullptr) {
+        oidnCommitFilter(mFilter);
+        mFilterDirty = false;
+    }
+    // Commit errors are reported by the next execute()
+}
+
+void
+OIDNDenoiserImpl::warmUp(std::string* errorMsg)
+{
+    // A small image on a filter of its own starts the device's threads and loads its
+    // kernels and weights, which every filter on the device then reuses
+    const int width = std::min(mWidth, sWarmUpSize);
+    const int height = std::min(mHeight, sWarmUpSize);
+    const size_t bytes = width * height * 3 * sizeof(float);
+    OIDNFilter filter = newFilter(mQuality);
+    OIDNBuffer buffer = oidnNewBuffer(mDevice, bytes);
+    if (!filter || !buffer) {
+        *errorMsg = "Unable to create OIDN warm-up filter";
+    } else {
+        const std::vector<float> zeros(bytes / sizeof(float), 0.f);
+        oidnWriteBuffer(buffer, 0, bytes, zeros.data());
+        oidnSetFilterImage(filter, "color", buffer, OIDN_FORMAT_FLOAT3, width, height, 0, 0, 0);
+        if (mUseAlbedo) {
+            oidnSetFilterImage(filter, "albedo", buffer, OIDN_FORMAT_FLOAT3, width, height, 0, 0, 0);
+        }
+        if (mUseNormals) {
+            oidnSetFilterImage(filter, "normal", buffer, OIDN_FORMAT_FLOAT3, width, height, 0, 0, 0);
+        }
+        oidnSetFilterImage(filter, "output", buffer, OIDN_FORMAT_FLOAT3, width, height, 0, 0, 0);
+        oidnCommitFilter(filter);
+        oidnExecuteFilter(filter);
+    }
+    if (buffer) oidnReleaseBuffer(buffer);
+    if (filter) oidnReleaseFilter(filter);
+
+    // Then initialize mFilter if its bindings changed since it was last committed.
+    // Directly bound images are only known at the first denoise(), so they are committed
+    // for its RGBA layout; as long as the layout matches, that denoise then only swaps
+    // in the caller's pointers.  The filter doesn't read the images at commit, so the
+    // scratch memory is never touched.
+    if (errorMsg->empty() && mFilterDirty &&
+        (mSystemMemorySupported ? !mColorBinding.data : mInputBeauty3 != nullptr)) {
+        std::unique_ptr<float[]> scratch;
+        if (mSystemMemorySupported) {
+            const size_t rgbaStride = 4 * sizeof(float);
+            scratch.reset(new float[static_cast<size_t>(mWidth) * mHeight * 4]);
+            bindImage("color", scratch.get(), rgbaStride, mWidth * rgbaStride, &mColorBinding);
+            if (mUseAlbedo) {
+                bindImage("albedo", scratch.get(), rgbaStride, mWidth * rgbaStride, &mAlbedoBinding);
+            }
+            if (mUseNormals) {
+                bindImage("normal", scratch.get(), rgbaStride, mWidth * rgbaStride, &mNormalBinding);
+            }
+            bindImage("output", scratch.get(), rgbaStride, mWidth * rgbaStride, &mOutputBinding);
+        }
+        oidnCommitFilter(mFilter);
+        mFilterDirty = false;
+        if (scratch) {
+            // Make the next denoise rebind everything to the caller's images
+            mColorBinding.data = nullptr;
+            mAlbedoBinding.data = nullptr;
+            mNormalBinding.data = nullptr;
+            mOutputBinding.data = nullptr;
+        }
+    }
+
+    const char* oidnErrorMessage;
+    if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE && errorMsg->empty()) {
+        *errorMsg = oidnErrorMessage;
+    }
+}
+
+void
+OIDNDenoiserImpl::releaseMemory()
+{
+    // Parked filters each hold working memory of their own
+    releaseParkedFilters();
+    // The filter keeps pointers to the layout scratch, but every call binds it again
+    std::vector<float>().swap(mLayoutColor);
+    std::vector<float>().swap(mLayoutAlbedo);
+    std::vector<float>().swap(mLayoutNormals);
+    if (!mSystemMemorySupported) {
+        releaseStagingBuffers();
+        releaseBatchBuffers();
+    }
+    invalidateGuides();
+}
+
+void
+OIDNDenoiserImpl::releaseParkedFilters()
+{
+    for (ParkedFilter& parked : mParkedFilters) {
+        if (parked.filter) {
+            oidnReleaseFilter(parked.filter);
+        }
+        parked = ParkedFilter();
+    }
+}
+
+bool
+OIDNDenoiserImpl::reconfigure(int width,
+                              int height,
+                              bool useAlbedo,
+                              bool useNormals,
+                              std::string* errorMsg)
+{
+    const bool resized = width != mWidth || height != mHeight;
+
+    // Only the active filter follows the new configuration
+    releaseParkedFilters();
+
+    // Guides staged or bound for the old configuration are never reused, even when
+    // the staging buffers keep their size (e.g. transposed dimensions) and the caller
+    // keeps its guide generation
+    invalidateGuides();
+
+    // Guides that are switched off are unbound, but their staging buffers are kept in
+    // case they are switched back on
+    if (mUseAlbedo && !useAlbedo) {
+        oidnUnsetFilterImage(mFilter, "albedo");
+        mAlbedoBinding = ImageBinding();
+        mFilterDirty = true;
+    }
+    if (mUseNormals && !useNormals) {
+        oidnUnsetFilterImage(mFilter, "normal");
+        mNormalBinding = ImageBinding();
+        mFilterDirty = true;
+    }
+    const bool guidesAdded = (useAlbedo && !mUseAlbedo) || (useNormals && !mUseNormals);
+
+    mWidth = width;
+    mHeight = height;
+    mUseAlbedo = useAlbedo;
+    mUseNormals = useNormals;
+
+    if (mSystemMemorySupported) {
+        // Caller images are bound on the next denoise(); forget the old bindings so
+        // they are re-set with the new size
+        if (resized) {
+            mColorBinding = ImageBinding();
+            mAlbedoBinding = ImageBinding();
+            mNormalBinding = ImageBinding();
+            mOutputBinding = ImageBinding();
+        }
+    } else if (resized || guidesAdded) {
+        if (resized) {
+            releaseBatchBuffers();
+        }
+        if (!allocateStagingBuffers(errorMsg)) {
+            return true;
+        }
+        bindStagingImages();
+    }
+    return true;
+}
+
+bool
+OIDNDenoiserImpl::allocateStagingBuffers(std::string* errorMsg)
+{
+    const size_t bufferSize = mWidth * mHeight * bytesPerPixel(mStagingFormat);
+
+    // Called whenever the size or format of the staging images changes
+    invalidateGuides();
+    releaseParkedFilters();
+
+    if (bufferSize > mStagingCapacity) {
+        // Grow geometrically so a series of viewport resizes doesn't reallocate every time
+        const size_t capacity = std::max(bufferSize, mStagingCapacity + mStagingCapacity / 2);
+        releaseStagingBuffers();
+        releaseBatchBuffers();
+        mStagingCapacity = capacity;
+    }
+
+    auto allocate = [&](OIDNBuffer& buffer, bool needed) {
+        if (needed && !buffer) {
+            buffer = oidnNewBuffer(mDevice, mStagingCapacity);
+        }
+    };
+    allocate(mInputBeauty3, true);
+    allocate(mOutput3, !mLowMemory);
+    allocate(mInputAlbedo3, mUseAlbedo);
+    allocate(mInputNormals3, mUseNormals);
+
+    const char* oidnErrorMessage;
+    if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE) {
+        *errorMsg = oidnErrorMessage;
+        return false;
+    }
+    return true;
+}
+
+void
+OIDNDenoiserImpl::releaseStagingBuffers()
+{
+    for (OIDNBuffer* buffer : { &mInputBeauty3, &mInputAlbedo3, &mInputNormals3, &mOutput3 }) {
+        if (*buffer) {
+            oidnReleaseBuffer(*buffer);
+            *buffer = nullptr;
+        }
+    }
+    mStagingCapacity = 0;
+}
+
+bool
+OIDNDenoiserImpl::allocateBatchBuffers(std::string* errorMsg)
+{
+    // Same capacity as the primary staging buffers, allocated on the first batch
+    if (!mBatchBeauty3) mBatchBeauty3 = oidnNewBuffer(mDevice, mStagingCapacity);
+    if (!mBatchOutput3) mBatchOutput3 = oidnNewBuffer(mDevice, mStagingCapacity);
 
     const char* oidnErrorMessage;
     if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE) {
         *errorMsg = oidnErrorMessage;
+        return false;
+    }
+    return true;
+}
+
+void
+OIDNDenoiserImpl::releaseBatchBuffers()
+{
+    for (OIDNBuffer* buffer : { &mBatchBeauty3, &mBatchOutput3 }) {
+        if (*buffer) {
+            oidnReleaseBuffer(*buffer);
+            *buffer = nullptr;
+        }
+    }
+}
+
+void
+OIDNDenoiserImpl::bindStagingColor(OIDNBuffer color, OIDNBuffer output)
+{
+    bindStagingImage("color", color);
+    bindStagingImage("output", output);
+    mFilterDirty = true;
+}
+
+void
+OIDNDenoiserImpl::bindStagingImages()
+{
+    bindStagingImage("color", mInputBeauty3);
+    bindStagingImage("output", stagingOutput());
+    if (mUseAlbedo) {
+        bindStagingImage("albedo", mInputAlbedo3);
+    }
+    if (mUseNormals) {
+        bindStagingImage("normal", mInputNormals3);
+    }
+    mFilterDirty = true;
+}
+
+void
+OIDNDenoiserImpl::bindStagingImage(const char *name, OIDNBuffer buffer)
+{
+    // Devices that cannot hand out a pointer to their buffers keep the buffer bound,
+    // and with it allocated, until it is replaced
+    void *data = mLowMemory ? oidnGetBufferData(buffer) : nullptr;
+    if (data) {
+        oidnSetSharedFilterImage(mFilter, name, data, mStagingFormat, mWidth, mHeight, 0, 0, 0);
+    } else {
+        oidnSetFilterImage(mFilter, name, buffer, mStagingFormat, mWidth, mHeight, 0, 0, 0);
+    }
+}
+
+ImageView
+OIDNDenoiserImpl::conditionBeauty(const ImageView& beauty,
+                                  const ImageView& target,
+                                  BeautyConditioning* conditioning)
+{
+    if (conditioning->sanitize) {
+        copyImageRGB(beauty, 0, 0, target, 0, 0, mWidth, mHeight, conditioning);
+        return target;
+    }
+    if (conditioning->meter) {
+        conditionImage(beauty, mWidth, mHeight, conditioning);
+    }
+    return beauty;
+}
+
+void
+OIDNDenoiserImpl::setInputScale(float exposureScale)
+{
+    // Without an exposure scale OIDN's default of NaN meters the image in the filter
+    const float scale = exposureScale > 0.f ? exposureScale : std::numeric_limits<float>::quiet_NaN();
+    if (scale == mInputScale || (std::isnan(scale) && std::isnan(mInputScale))) {
         return;
     }
+    oidnSetFilterFloat(mFilter, "inputScale", scale);
+    mInputScale = scale;
+    mFilterDirty = true;
+}
+
+void
+OIDNDenoiserImpl::bindImage(const char *name,
+                            const void *data,
+                            size_t pixelStride,
+                            size_t rowStride,
+                            ImageBinding *binding,
+                            OIDNFormat format)
+{
+    if (binding->data == data &&
+        binding->pixelStride == pixelStride &&
+        binding->rowStride == rowStride &&
+        binding->format == format) {
+        return;
+    }
+
+    oidnSetSharedFilterImage(mFilter, name, const_cast<void*>(data), format,
+                             mWidth, mHeight, 0, pixelStride, rowStride);
+    binding->data = data;
+    binding->pixelStride = pixelStride;
+    binding->rowStride = rowStride;
+    binding->format = format;
+    mFilterDirty = true;
+}
+
+bool
+OIDNDenoiserImpl::setStagingFormat(OIDNFormat format, std::string* errorMsg)
+{
+    if (format == mStagingFormat && mInputBeauty3) {
+        return true;
+    }
+    // Switching formats re-initializes the filter on the next commit.  Buffers freed by
+    // releaseMemory() come back in the same format, which only swaps pointers.
+    mStagingFormat = format;
+    if (!allocateStagingBuffers(errorMsg)) {
+        return false;
+    }
+    bindStagingImages();
+    return true;
+}
 
-    // std::cerr << "OIDN denoise() elapsed time (s): " << denoiseTimer.end() << std::endl;
+void
+OIDNDenoiserImpl::packInput(const float *input, OIDNBuffer buffer, BeautyConditioning* conditioning)
+{
+    if (mStagingFormat == OIDN_FORMAT_HALF3) {
+        packRGBAtoRGBHalf(input, (uint16_t*)oidnGetBufferData(buffer), mWidth, mHeight, conditioning);
+    } else {
+        packRGBAtoRGB(input, (float*)oidnGetBufferData(buffer), mWidth, mHeight, conditioning);
+    }
+    mBytesUploaded += mWidth * mHeight * bytesPerPixel(mStagingFormat);
+}
+
+void
+OIDNDenoiserImpl::unpackOutput(OIDNBuffer buffer, const float *alphaSrc, float *output)
+{
+    if (mStagingFormat == OIDN_FORMAT_HALF3) {
+        unpackRGBHalftoRGBA((const uint16_t*)oidnGetBufferData(buffer), alphaSrc, output, mWidth, mHeight);
+    } else {
+        unpackRGBtoRGBA((const float*)oidnGetBufferData(buffer), alphaSrc, output, mWidth, mHeight);
+    }
+    mBytesDownloaded += mWidth * mHeight * bytesPerPixel(mStagingFormat);
+}
 
-    float* mOutput3Ptr = (float*)oidnGetBufferData(mOutput3);
-    for (int i = 0; i < mWidth * mHeight; i++) {
-        output[i * 4] = mOutput3Ptr[i * 3];
-        output[i * 4 + 1] = mOutput3Ptr[i * 3 + 1];
-        output[i * 4 + 2] = mOutput3Ptr[i * 3 + 2];
-        output[i * 4 + 3] = inputBeauty[i * 4 + 3];
+bool
+OIDNDenoiserImpl::execute(std::string* errorMsg)
+{
+    PhaseTimer timer(&mTimes.execute);
+    if (mFilterDirty) {
+        oidnCommitFilter(mFilter);
+        mFilterDirty = false;
+    }
+
+    oidnExecuteFilter(mFilter);
+
+    const char* oidnErrorMessage;
+    if (oidnGetDeviceError(mDevice, &oidnErrorMessage) != OIDN_ERROR_NONE) {
+        *errorMsg = oidnErrorMessage;
+        return false;
     }
+    return true;
 }
 
 } // namespace denoiser
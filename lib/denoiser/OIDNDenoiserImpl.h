@@ -6,20 +6,34 @@
 #include "DenoiserImpl.h"
 
 #include <OpenImageDenoise/oidn.h>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace moonray {
 namespace denoiser {
 
+class MappedOIDNWeights;
+class SharedOIDNDevice;
+
 class OIDNDenoiserImpl : public DenoiserImpl
 {
 public:
+    // Overlap tileOverlap() reports until the filter has been committed, covering the
+    // receptive field of the built-in networks
+    static constexpr int sDefaultTileOverlap = 128;
+
+    // Runs on device if given, else on the device SharedOIDNDevice::acquire() hands
+    // out for the options
     OIDNDenoiserImpl(OIDNDeviceType deviceType,
                      int width,
                      int height,
                      bool useAlbedo,
                      bool useNormals,
+                     const DenoiserOptions& options,
+                     const std::shared_ptr<SharedOIDNDevice>& device,
                      std::string* errorMsg);
     ~OIDNDenoiserImpl();
 
@@ -29,14 +43,160 @@ public:
                  float *output,       // RGBA
                  std::string* errorMsg) override;
 
+    void denoiseHalf(const uint16_t *inputBeauty,  // half RGBA
+                     const uint16_t *inputAlbedo,  // half RGBA
+                     const uint16_t *inputNormals, // half RGBA
+                     uint16_t *output,       // half RGBA
+                     std::string* errorMsg) override;
+
+    void denoiseStrided(const InputImage& beauty,
+                        const InputImage& albedo,
+                        const InputImage& normals,
+                        const OutputImage& output,
+                        std::string* errorMsg) override;
+
+    void denoiseBatch(const float *inputAlbedo,
+                      const float *inputNormals,
+                      int numImages,
+                      const float * const *inputColors,
+                      float * const *outputs,
+                      std::string* errorMsg) override;
+
+    bool reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg) override;
+
+    int tileOverlap() const override;
+    std::shared_ptr<SharedOIDNDevice> oidnDevice() const override { return mSharedDevice; }
+    // Without an input scale the filter meters every image itself
+    bool autoExposes() const override { return true; }
+    void setMaxMemory(size_t bytes) override;
+    void setQuality(DenoiserQuality quality, std::string* errorMsg) override;
+    void warmUp(std::string* errorMsg) override;
+    void releaseMemory() override;
+
+protected:
+    size_t stagingBytes() const override;
+
 private:
+    // What a filter image is currently bound to, so unchanged bindings are not
+    // re-set and the filter is only re-committed when something changed.
+    struct ImageBinding
+    {
+        const void *data = nullptr;
+        size_t pixelStride = 0;
+        size_t rowStride = 0;
+        OIDNFormat format = OIDN_FORMAT_UNDEFINED;
+    };
+
+    // A committed filter of a quality tier that is not active, with its bindings
+    struct ParkedFilter
+    {
+        OIDNFilter filter = nullptr;
+        ImageBinding color;
+        ImageBinding albedo;
+        ImageBinding normal;
+        ImageBinding output;
+        float inputScale = std::numeric_limits<float>::quiet_NaN();
+        bool dirty = true;
+    };
+
+    // New "RT" filter with the settings shared by every tier
+    OIDNFilter newFilter(DenoiserQuality quality);
+    // Parked filters are dropped whenever the size, guides, staging buffers or memory
+    // limit change, and recreated on the next switch to their tier
+    void releaseParkedFilters();
+
+    bool allocateStagingBuffers(std::string* errorMsg);
+    void releaseStagingBuffers();
+    bool allocateBatchBuffers(std::string* errorMsg);
+    void releaseBatchBuffers();
+    void bindStagingImages();
+    void bindStagingColor(OIDNBuffer color, OIDNBuffer output);
+    void bindStagingImage(const char *name, OIDNBuffer buffer);
+    // In low memory mode the beauty staging buffer also receives the output
+    OIDNBuffer stagingOutput() const { return mLowMemory ? mInputBeauty3 : mOutput3; }
+    // denoiseStrided() on a device that reads system memory
+    void denoiseSystemMemory(const ImageView& beauty,
+                             const ImageView& albedo,
+                             const ImageView& normals,
+                             const ImageView& output,
+                             std::string* errorMsg);
+    // On a device that reads system memory, conditions a linear beauty: metering reads
+    // it where it is, sanitizing writes the cleaned beauty to target, which is then
+    // denoised in place.  Returns the image to bind as the color.
+    ImageView conditionBeauty(const ImageView& beauty,
+                              const ImageView& target,
+                              BeautyConditioning* conditioning);
+    // Sets the filter's input scale for a denoise, see DenoiserImpl::exposureScale().
+    // Changing it takes a commit but does not re-initialize the filter.
+    void setInputScale(float exposureScale);
+    void bindImage(const char *name,
+                   const void *data,
+                   size_t pixelStride,
+                   size_t rowStride,
+                   ImageBinding *binding,
+                   OIDNFormat format = OIDN_FORMAT_FLOAT3);
+    // Staging buffers hold HALF3 or FLOAT3 images.  Changing the format rebinds them,
+    // which re-initializes the filter.
+    OIDNFormat floatStagingFormat() const { return mHalfStaging ? OIDN_FORMAT_HALF3 : OIDN_FORMAT_FLOAT3; }
+    bool setStagingFormat(OIDNFormat format, std::string* errorMsg);
+    // Float RGBA <-> staging buffer in the current staging format
+    void packInput(const float *input, OIDNBuffer buffer,
+                   BeautyConditioning* conditioning = nullptr);
+    void unpackOutput(OIDNBuffer buffer, const float *alphaSrc, float *output);
+    bool execute(std::string* errorMsg);
+
     OIDNDeviceType mDeviceType;
-    OIDNDevice mDevice;
+    std::shared_ptr<SharedOIDNDevice> mSharedDevice;
+    OIDNDevice mDevice; // mSharedDevice's
+
+    // Custom weights every filter is created with, null for the built-in ones
+    std::shared_ptr<const MappedOIDNWeights> mWeights;
+
     OIDNFilter mFilter;
+
+    // True when the device can read and write the caller's memory directly, in which
+    // case the staging buffers below are never allocated.
+    bool mSystemMemorySupported;
+
+    // Stage float inputs as HALF3, see DenoiserOptions::halfStaging
+    bool mHalfStaging;
+    OIDNFormat mStagingFormat;
+
+    // See DenoiserOptions::lowMemory.  Staging images are then bound by pointer, so
+    // that releasing the buffers between calls frees them even though the filter
+    // stays committed.
+    bool mLowMemory;
+
     OIDNBuffer mInputBeauty3;
     OIDNBuffer mInputAlbedo3;
     OIDNBuffer mInputNormals3;
-    OIDNBuffer mOutput3; 
+    OIDNBuffer mOutput3;
+    OIDNBuffer mBatchBeauty3; // second color/output pair for double-buffered batches
+    OIDNBuffer mBatchOutput3;
+    size_t mStagingCapacity; // bytes per staging buffer
+
+    ImageBinding mColorBinding;
+    ImageBinding mAlbedoBinding;
+    ImageBinding mNormalBinding;
+    ImageBinding mOutputBinding;
+
+    // Packed RGB copies of images in layouts the filter cannot bind, on devices that
+    // read system memory
+    std::vector<float> mLayoutColor;
+    std::vector<float> mLayoutAlbedo;
+    std::vector<float> mLayoutNormals;
+    bool mFilterDirty;
+    float mInputScale; // of mFilter, NaN for OIDN's own auto-exposure
+
+    // mFilter is the filter of mQuality.  Filters of tiers used before stay committed
+    // so switching back to them doesn't re-initialize anything.
+    DenoiserQuality mQuality;
+    ParkedFilter mParkedFilters[QUALITY_HIGH + 1];
+    int mMaxMemoryMB; // 0 for OIDN's default
 };
 
 } // namespace denoiser
@@ -0,0 +1,133 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "OIDNDeviceCache.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+struct DeviceKey
+{
+    OIDNDeviceType type;
+    int numThreads;
+    int affinity;
+
+    bool operator<(const DeviceKey& other) const
+    {
+        return std::tie(type, numThreads, affinity) <
+               std::tie(other.type, other.numThreads, other.affinity);
+    }
+};
+
+struct DeviceCache
+{
+    std::mutex mutex;
+    std::map<DeviceKey, std::weak_ptr<SharedOIDNDevice>> devices;
+};
+
+// Never destroyed, so devices still held by static objects can be released at exit
+DeviceCache&
+cache()
+{
+    static DeviceCache* sCache = new DeviceCache;
+    return *sCache;
+}
+
+OIDNDevice
+newDevice(OIDNDeviceType type, int numThreads, int affinity, std::string* errorMsg)
+{
+    const char* oidnErrorMessage;
+
+    OIDNDevice device = oidnNewDevice(type);
+    if (!device) {
+        if (oidnGetDeviceError(device, &oidnErrorMessage) != OIDN_ERROR_NONE) {
+            *errorMsg = oidnErrorMessage;
+        } else {
+            *errorMsg = "Unable to create OIDN Device";
+        }
+        return nullptr;
+    }
+
+    // Thread settings only apply to the CPU device.  The default device type is only
+    // resolved once the device exists, so ask it.
+    if (oidnGetDeviceInt(device, "type") == OIDN_DEVICE_TYPE_CPU) {
+        if (numThreads > 0) {
+            oidnSetDeviceInt(device, "numThreads", numThreads);
+        }
+        if (affinity >= 0) {
+            oidnSetDeviceBool(device, "setAffinity", affinity > 0);
+        }
+        scene_rdl2::logging::Logger::info("Open Image Denoise CPU device using ",
+                                          numThreads > 0 ? std::to_string(numThreads) : "all",
+                                          " threads, affinity ",
+                                          affinity < 0 ? "default" :
+                                          affinity > 0 ? "on" : "off");
+    }
+    oidnCommitDevice(device);
+
+    if (oidnGetDeviceError(device, &oidnErrorMessage) != OIDN_ERROR_NONE) {
+        *errorMsg = oidnErrorMessage;
+        oidnReleaseDevice(device);
+        return nullptr;
+    }
+    return device;
+}
+
+} // namespace
+
+SharedOIDNDevice::~SharedOIDNDevice()
+{
+    // Filters and buffers still alive hold their own references to the device, so
+    // OIDN only frees it once the last of them is released as well
+    oidnReleaseDevice(mDevice);
+}
+
+std::shared_ptr<SharedOIDNDevice>
+SharedOIDNDevice::acquire(OIDNDeviceType type,
+                          int numThreads,
+                          int affinity,
+                          bool share,
+                          std::string* errorMsg)
+{
+    if (!share) {
+        OIDNDevice device = newDevice(type, numThreads, affinity, errorMsg);
+        return std::shared_ptr<SharedOIDNDevice>(device ? new SharedOIDNDevice(device) : nullptr);
+    }
+
+    // Creating the device under the lock keeps two backends that ask at the same time
+    // from both creating one.  Entries of released devices are dropped here rather than
+    // on release, so releasing never takes the lock.
+    DeviceCache& devices = cache();
+    std::lock_guard<std::mutex> lock(devices.mutex);
+    for (auto it = devices.devices.begin(); it != devices.devices.end();) {
+        it = it->second.expired() ? devices.devices.erase(it) : std::next(it);
+    }
+    std::weak_ptr<SharedOIDNDevice>& entry = devices.devices[{ type, numThreads, affinity }];
+    std::shared_ptr<SharedOIDNDevice> shared = entry.lock();
+    if (shared) {
+        scene_rdl2::logging::Logger::info("Open Image Denoise device shared with ",
+                                          shared.use_count() - 1, " other backends");
+        return shared;
+    }
+
+    OIDNDevice device = newDevice(type, numThreads, affinity, errorMsg);
+    if (!device) {
+        return nullptr;
+    }
+    shared.reset(new SharedOIDNDevice(device));
+    entry = shared;
+    return shared;
+}
+
+} // namespace denoiser
+} // namespace moonray
+
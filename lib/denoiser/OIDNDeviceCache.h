@@ -0,0 +1,53 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <OpenImageDenoise/oidn.h>
+
+#include <memory>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+
+// Process-wide cache of committed OIDN devices.  Every OIDN backend asking for the
+// same device type and thread settings gets the same device, so a session with a
+// Denoiser per render output starts one device, with one thread pool, instead of one
+// per Denoiser.  Backends create their own filters and buffers on it.  The device is
+// released when the last backend holding it goes away, and a later request creates a
+// new one.
+//
+// OIDN serializes the work of a device, so denoises on a shared device run one at a
+// time even when issued from several threads.  Backends that must run concurrently,
+// like the NUMA bands, ask for unshared devices.
+
+class SharedOIDNDevice
+{
+public:
+    ~SharedOIDNDevice();
+
+    SharedOIDNDevice(const SharedOIDNDevice&) = delete;
+    SharedOIDNDevice& operator=(const SharedOIDNDevice&) = delete;
+
+    // Returns the device for these settings, creating and committing it if nobody
+    // holds one.  numThreads 0 and affinity -1 leave OIDN's defaults; both only apply
+    // to CPU devices.  With share false a new device is created that is never handed
+    // out to anyone else.  Returns null with errorMsg set on failure.
+    static std::shared_ptr<SharedOIDNDevice> acquire(OIDNDeviceType type,
+                                                     int numThreads,
+                                                     int affinity,
+                                                     bool share,
+                                                     std::string* errorMsg);
+
+    OIDNDevice get() const { return mDevice; }
+
+private:
+    explicit SharedOIDNDevice(OIDNDevice device) : mDevice(device) {}
+
+    OIDNDevice mDevice;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
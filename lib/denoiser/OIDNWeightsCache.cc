@@ -0,0 +1,112 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "OIDNWeightsCache.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// What the path referred to when it was mapped
+struct MappedFile
+{
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t modified;
+    std::weak_ptr<const MappedOIDNWeights> weights;
+
+    bool sameFile(const struct stat& status) const
+    {
+        return device == status.st_dev && inode == status.st_ino &&
+               size == status.st_size && modified == status.st_mtime;
+    }
+};
+
+struct WeightsCache
+{
+    std::mutex mutex;
+    std::map<std::string, MappedFile> files;
+};
+
+// Never destroyed, so weights still held by static objects can be released at exit
+WeightsCache&
+cache()
+{
+    static WeightsCache* sCache = new WeightsCache;
+    return *sCache;
+}
+
+} // namespace
+
+MappedOIDNWeights::~MappedOIDNWeights()
+{
+    munmap(mData, mSize);
+}
+
+std::shared_ptr<const MappedOIDNWeights>
+MappedOIDNWeights::acquire(const std::string& path, std::string* errorMsg)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *errorMsg = "Cannot open OIDN weights " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        *errorMsg = "Cannot read OIDN weights " + path;
+        close(fd);
+        return nullptr;
+    }
+
+    // Entries of released files are dropped here rather than on release, so releasing
+    // never takes the lock
+    WeightsCache& weights = cache();
+    std::lock_guard<std::mutex> lock(weights.mutex);
+    for (auto it = weights.files.begin(); it != weights.files.end();) {
+        it = it->second.weights.expired() ? weights.files.erase(it) : std::next(it);
+    }
+    MappedFile& entry = weights.files[path];
+    std::shared_ptr<const MappedOIDNWeights> mapped = entry.weights.lock();
+    if (mapped && entry.sameFile(status)) {
+        close(fd);
+        return mapped;
+    }
+
+    void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *errorMsg = "Cannot map OIDN weights " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    // Filters parse all of it at initialization
+    madvise(data, status.st_size, MADV_WILLNEED);
+
+    // Filters still holding a replaced file keep their own mapping of it
+    mapped.reset(new MappedOIDNWeights(data, status.st_size));
+    entry.device = status.st_dev;
+    entry.inode = status.st_ino;
+    entry.size = status.st_size;
+    entry.modified = status.st_mtime;
+    entry.weights = mapped;
+    scene_rdl2::logging::Logger::info("Mapped OIDN weights ", path, " (", status.st_size >> 10, " KB)");
+    return mapped;
+}
+
+} // namespace denoiser
+} // namespace moonray
+
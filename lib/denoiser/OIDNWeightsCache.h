@@ -0,0 +1,45 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+
+// Process-wide cache of OIDN weight files (.tza), mapped read-only.  Every filter
+// using the same file reads the same mapping, and since the mapping is shared with the
+// page cache, so does every other process on the machine that maps it.  OIDN still
+// converts the weights into its own layout when a filter is initialized, so only the
+// file data itself is shared.  A file is unmapped when the last filter using it goes
+// away; a file that was replaced on disk is mapped again.
+
+class MappedOIDNWeights
+{
+public:
+    ~MappedOIDNWeights();
+
+    MappedOIDNWeights(const MappedOIDNWeights&) = delete;
+    MappedOIDNWeights& operator=(const MappedOIDNWeights&) = delete;
+
+    // Returns the mapping of the file at path, mapping it if nobody holds it.  Returns
+    // null with errorMsg set on failure.
+    static std::shared_ptr<const MappedOIDNWeights> acquire(const std::string& path,
+                                                            std::string* errorMsg);
+
+    const void *data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    MappedOIDNWeights(void *data, size_t size) : mData(data), mSize(size) {}
+
+    void *mData;
+    size_t mSize;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -2,10 +2,12 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "OptixDenoiserImpl.h"
+#include "PackKernels.h"
 
 #include <scene_rdl2/common/rec_time/RecTime.h>
 #include <scene_rdl2/render/logging/logging.h>
 
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 
@@ -21,6 +23,9 @@ static void denoiserMessageCallback(unsigned int /*level*/,
     scene_rdl2::logging::Logger::info("Denoiser: ", message);
 }
 
+// Side of the image denoised by warmUp()
+static constexpr int sWarmUpSize = 64;
+
 bool
 getNVIDIADriverVersion(int* major, int* minor)
 {
@@ -38,23 +43,56 @@ getNVIDIADriverVersion(int* major, int* minor)
 }
 
 
+// Makes sure *ptr holds at least size bytes of device memory.  Buffers grow
+// geometrically so repeated resizes don't reallocate every time.
+template <typename T>
+bool
+growDeviceBuffer(T** ptr, size_t* capacity, size_t size)
+{
+    if (size <= *capacity) {
+        return true;
+    }
+    const size_t newCapacity = std::max(size, *capacity + *capacity / 2);
+    if (*ptr != nullptr) {
+        cudaFree(*ptr);
+        *ptr = nullptr;
+        *capacity = 0;
+    }
+    if (cudaMalloc(ptr, newCapacity) != cudaSuccess) {
+        return false;
+    }
+    *capacity = newCapacity;
+    return true;
+}
+
 OptixDenoiserImpl::OptixDenoiserImpl(int width,
                                      int height,
                                      bool useAlbedo,
                                      bool useNormals,
+                                     const DenoiserOptions& options,
                                      std::string* errorMsg) :
     DenoiserImpl(width, height, useAlbedo, useNormals),
+    mHalfStaging {options.halfStaging},
     mCudaStream {0},
     mContext {nullptr},
     mDenoiser {nullptr},
+    mDenoiserSizes {},
     mDenoiserState {nullptr},
+    mDenoiserStateCapacity {0},
     mScratch {nullptr},
+    mScratchCapacity {0},
     mDenoisedOutput {nullptr},
+    mDenoisedOutputCapacity {0},
     mInputBeauty {nullptr},
+    mInputBeautyCapacity {0},
     mInputAlbedo {nullptr},
-    mInputNormals {nullptr}
+    mInputAlbedoCapacity {0},
+    mInputNormals {nullptr},
+    mInputNormalsCapacity {0},
+    mIntensity {nullptr}
 {
     scene_rdl2::logging::Logger::info("Creating Optix denoiser");
+    setInputConditioning(options);
 
     if (!createOptixContext(denoiserMessageCallback,
                             &mCudaStream,
@@ -64,16 +102,50 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
         return;
     }
 
-    OptixDenoiserOptions optionsDenoiser = {};
-    if (useAlbedo) optionsDenoiser.guideAlbedo = 1;
-    if (useNormals) optionsDenoiser.guideNormal = 1;
+    setup(errorMsg);
+}
 
-    if (optixDenoiserCreate(mContext,
-                            OPTIX_DENOISER_MODEL_KIND_HDR,
-                            &optionsDenoiser,
-                            &mDenoiser) != OPTIX_SUCCESS) {
-        *errorMsg = "Unable to create the Optix denoiser";
-        return;
+bool
+OptixDenoiserImpl::reconfigure(int width,
+                               int height,
+                               bool useAlbedo,
+                               bool useNormals,
+                               std::string* errorMsg)
+{
+    // The guide configuration is baked into the Optix denoiser, so it is recreated
+    // if the guides change.  The CUDA stream and Optix context are always kept.
+    if (useAlbedo != mUseAlbedo || useNormals != mUseNormals) {
+        optixDenoiserDestroy(mDenoiser);
+        mDenoiser = nullptr;
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mUseAlbedo = useAlbedo;
+    mUseNormals = useNormals;
+
+    setup(errorMsg);
+    return true;
+}
+
+bool
+OptixDenoiserImpl::setup(std::string* errorMsg)
+{
+    // Buffers may be reallocated or resized below
+    invalidateGuides();
+
+    if (mDenoiser == nullptr) {
+        OptixDenoiserOptions optionsDenoiser = {};
+        if (mUseAlbedo) optionsDenoiser.guideAlbedo = 1;
+        if (mUseNormals) optionsDenoiser.guideNormal = 1;
+
+        if (optixDenoiserCreate(mContext,
+                                OPTIX_DENOISER_MODEL_KIND_HDR,
+                                &optionsDenoiser,
+                                &mDenoiser) != OPTIX_SUCCESS) {
+            *errorMsg = "Unable to create the Optix denoiser";
+            return false;
+        }
     }
 
     mDenoiserSizes = {}; // zero initialize
@@ -82,17 +154,20 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
                                             mHeight,
                                             &mDenoiserSizes) != OPTIX_SUCCESS) {
         *errorMsg = "Unable to compute denoiser memory resources";
-        return;
+        return false;
     }
 
-    if (cudaMalloc(&mDenoiserState, mDenoiserSizes.stateSizeInBytes) != cudaSuccess) {
+    if (!growDeviceBuffer(&mDenoiserState, &mDenoiserStateCapacity, mDenoiserSizes.stateSizeInBytes)) {
          *errorMsg = "Unable to allocate denoiser state";
-        return;
+        return false;
     }
 
-    if (cudaMalloc(&mScratch, mDenoiserSizes.withoutOverlapScratchSizeInBytes) != cudaSuccess) {
+    // The scratch also serves optixDenoiserComputeIntensity()
+    if (!growDeviceBuffer(&mScratch, &mScratchCapacity,
+                          std::max(mDenoiserSizes.withoutOverlapScratchSizeInBytes,
+                                   mDenoiserSizes.computeIntensitySizeInBytes))) {
          *errorMsg = "Unable to allocate denoiser scratch buffer";
-        return;       
+        return false;
     }
 
     if (optixDenoiserSetup(mDenoiser,
@@ -103,24 +178,39 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
                            reinterpret_cast<CUdeviceptr>(mScratch),
                            mDenoiserSizes.withoutOverlapScratchSizeInBytes) != OPTIX_SUCCESS) {
         *errorMsg = "Unable to setup denoiser";
-        return;       
+        return false;
     }
 
     mDenoiserParams = {};                 // zero initialize
     mDenoiserParams.denoiseAlpha = OPTIX_DENOISER_ALPHA_MODE_COPY; // don't denoise alpha
-    mDenoiserParams.hdrIntensity = 0;     // optional average log intensity image of input image, 
-                                          //  helps with very dark/bright images
+    if (mAutoExposure && !mIntensity && cudaMalloc(&mIntensity, sizeof(float)) != cudaSuccess) {
+        mIntensity = nullptr;
+        *errorMsg = "Unable to allocate denoiser intensity";
+        return false;
+    }
+    // optional average log intensity of the input image, helps with very dark/bright
+    // images.  Set for every denoise with DenoiserOptions::autoExposure, 0 otherwise.
+    mDenoiserParams.hdrIntensity = reinterpret_cast<CUdeviceptr>(mIntensity);
     mDenoiserParams.blendFactor = 0.f;    // show the denoised image only
     mDenoiserParams.hdrAverageColor = 0;  // used with OPTIX_DENOISER_MODEL_KIND_AOV
 
-    if (cudaMalloc(&mDenoisedOutput, sizeof(float4) * mWidth * mHeight) != cudaSuccess) {
+    return allocateImageBuffers(errorMsg);
+}
+
+bool
+OptixDenoiserImpl::allocateImageBuffers(std::string* errorMsg)
+{
+    // Half precision staging halves the image buffers
+    const size_t imageSize = (mHalfStaging ? 4 * sizeof(uint16_t) : sizeof(float4)) * mWidth * mHeight;
+
+    if (!growDeviceBuffer(&mDenoisedOutput, &mDenoisedOutputCapacity, imageSize)) {
          *errorMsg = "Unable to allocate denoiser output buffer";
-        return;
+        return false;
     }
 
-    if (cudaMalloc(&mInputBeauty, sizeof(float4) * mWidth * mHeight) != cudaSuccess) {
+    if (!growDeviceBuffer(&mInputBeauty, &mInputBeautyCapacity, imageSize)) {
          *errorMsg = "Unable to allocate denoiser input beauty buffer";
-        return;
+        return false;
     }
 
     // The layer specifies the input/output buffers and their formats
@@ -141,10 +231,10 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
     // The guide layer specifies the albedo/normal buffers and their formats
     mGuideLayer = {};
 
-    if (useAlbedo) {
-        if (cudaMalloc(&mInputAlbedo, sizeof(float4) * mWidth * mHeight) != cudaSuccess) {
+    if (mUseAlbedo) {
+        if (!growDeviceBuffer(&mInputAlbedo, &mInputAlbedoCapacity, imageSize)) {
             *errorMsg = "Unable to allocate denoiser input albedo buffer";
-            return;
+            return false;
         }
         mGuideLayer.albedo.data               = reinterpret_cast<CUdeviceptr>(mInputAlbedo);
         mGuideLayer.albedo.width              = mWidth;
@@ -153,10 +243,10 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
         mGuideLayer.albedo.pixelStrideInBytes = sizeof(float4);
         mGuideLayer.albedo.format             = OPTIX_PIXEL_FORMAT_FLOAT4;
     }
-    if (useNormals) {
-        if (cudaMalloc(&mInputNormals, sizeof(float4) * mWidth * mHeight) != cudaSuccess) {
+    if (mUseNormals) {
+        if (!growDeviceBuffer(&mInputNormals, &mInputNormalsCapacity, imageSize)) {
             *errorMsg = "Unable to allocate denoiser input normals buffer";
-            return;
+            return false;
         }
         mGuideLayer.normal.data               = reinterpret_cast<CUdeviceptr>(mInputNormals);
         mGuideLayer.normal.width              = mWidth;
@@ -165,6 +255,8 @@ OptixDenoiserImpl::OptixDenoiserImpl(int width,
         mGuideLayer.normal.pixelStrideInBytes = sizeof(float4);
         mGuideLayer.normal.format             = OPTIX_PIXEL_FORMAT_FLOAT4;
     }
+    setImageFormat(mHalfStaging ? OPTIX_PIXEL_FORMAT_HALF4 : OPTIX_PIXEL_FORMAT_FLOAT4);
+    return true;
 }
 
 OptixDenoiserImpl::~OptixDenoiserImpl()
@@ -191,6 +283,10 @@ OptixDenoiserImpl::~OptixDenoiserImpl()
         cudaFree(mScratch);
     }
 
+    if (mIntensity != 0) {
+        cudaFree(mIntensity);
+    }
+
     if (mDenoiserState != 0) {
         cudaFree(mDenoiserState);
     }
@@ -215,64 +311,307 @@ OptixDenoiserImpl::denoise(const float *inputBeauty,
                            float *output,
                            std::string* errorMsg)
 {
-    // scene_rdl2::rec_time::RecTime denoiseTimer;
-    // denoiseTimer.start();
+    if (!mInputBeauty && !allocateImageBuffers(errorMsg)) {
+        return;
+    }
+    setImageFormat(mHalfStaging ? OPTIX_PIXEL_FORMAT_HALF4 : OPTIX_PIXEL_FORMAT_FLOAT4);
+    if (!uploadGuides(inputAlbedo, inputNormals, false, errorMsg)) {
+        return;
+    }
+    denoiseBeauty(inputBeauty, output, false, errorMsg);
+}
 
-    // Copy the noisy input beauty to the GPU
-    if (cudaMemcpy((void*)mInputBeauty,
-                   inputBeauty,
-                   mWidth * mHeight * sizeof(float4),
-                   cudaMemcpyHostToDevice) != cudaSuccess) {
-        *errorMsg = "Denoiser failure copying input beauty";
+void
+OptixDenoiserImpl::denoiseHalf(const uint16_t *inputBeauty,
+                               const uint16_t *inputAlbedo,
+                               const uint16_t *inputNormals,
+                               uint16_t *output,
+                               std::string* errorMsg)
+{
+    if (!mInputBeauty && !allocateImageBuffers(errorMsg)) {
+        return;
+    }
+    // Half images are uploaded as they are
+    setImageFormat(OPTIX_PIXEL_FORMAT_HALF4);
+    if (!uploadGuides(inputAlbedo, inputNormals, true, errorMsg)) {
+        return;
+    }
+    denoiseBeauty(inputBeauty, output, true, errorMsg);
+}
+
+void
+OptixDenoiserImpl::denoiseBatch(const float *inputAlbedo,
+                                const float *inputNormals,
+                                int numImages,
+                                const float * const *inputColors,
+                                float * const *outputs,
+                                std::string* errorMsg)
+{
+    if (!mInputBeauty && !allocateImageBuffers(errorMsg)) {
+        return;
+    }
+    // The guides stay on the GPU for all of the images
+    setImageFormat(mHalfStaging ? OPTIX_PIXEL_FORMAT_HALF4 : OPTIX_PIXEL_FORMAT_FLOAT4);
+    if (!uploadGuides(inputAlbedo, inputNormals, false, errorMsg)) {
         return;
     }
- 
-    if (mInputAlbedo) {
-        // Copy the input albedo to the GPU
-        if (cudaMemcpy((void*)mInputAlbedo,
-                       inputAlbedo,
-                       mWidth * mHeight * sizeof(float4),
-                       cudaMemcpyHostToDevice) != cudaSuccess) {
-            *errorMsg = "Denoiser failure copying input albedo";
+    for (int i = 0; i < numImages; i++) {
+        if (!denoiseBeauty(inputColors[i], outputs[i], false, errorMsg)) {
             return;
         }
     }
+}
 
-    if (mInputNormals) {
-        // Copy the noisy input normals to the GPU
-        if (cudaMemcpy((void*)mInputNormals,
-                       inputNormals,
-                       mWidth * mHeight * sizeof(float4),
-                       cudaMemcpyHostToDevice) != cudaSuccess) {
-            *errorMsg = "Denoiser failure copying input normals";
-            return;            
+void
+OptixDenoiserImpl::setImageFormat(OptixPixelFormat format)
+{
+    const unsigned int pixelStride = format == OPTIX_PIXEL_FORMAT_HALF4 ? 4 * sizeof(uint16_t)
+                                                                       : sizeof(float4);
+    for (OptixImage2D* image : { &mLayer.input, &mLayer.output,
+                                 &mGuideLayer.albedo, &mGuideLayer.normal }) {
+        image->format = format;
+        image->pixelStrideInBytes = pixelStride;
+        image->rowStrideInBytes = mWidth * pixelStride;
+    }
+}
+
+bool
+OptixDenoiserImpl::upload(void *device, const void *input, bool halfInput,
+                          BeautyConditioning* conditioning)
+{
+    const size_t numPixels = static_cast<size_t>(mWidth) * mHeight;
+    const bool sanitize = conditioning && conditioning->sanitize;
+    if (halfInput) {
+        if (sanitize) {
+            mHostHalf.resize(numPixels * 4);
+            conditionHalfRGBA(static_cast<const uint16_t*>(input), mHostHalf.data(), mWidth, mHeight,
+                              conditioning);
+            input = mHostHalf.data();
         }
+        mBytesUploaded += numPixels * 4 * sizeof(uint16_t);
+        return cudaMemcpy(device, input, numPixels * 4 * sizeof(uint16_t),
+                          cudaMemcpyHostToDevice) == cudaSuccess;
+    }
+    if (mHalfStaging) {
+        // Convert on the host so only half as many bytes cross the bus
+        mHostHalf.resize(numPixels * 4);
+        convertFloatToHalf(static_cast<const float*>(input), mHostHalf.data(), mWidth, mHeight,
+                           conditioning);
+        mBytesUploaded += numPixels * 4 * sizeof(uint16_t);
+        return cudaMemcpy(device, mHostHalf.data(), numPixels * 4 * sizeof(uint16_t),
+                          cudaMemcpyHostToDevice) == cudaSuccess;
+    }
+    if (sanitize) {
+        mHostFloat.resize(numPixels * 4);
+        copyRGBA(static_cast<const float*>(input), mHostFloat.data(), mWidth, mHeight, conditioning);
+        input = mHostFloat.data();
+    }
+    mBytesUploaded += numPixels * sizeof(float4);
+    return cudaMemcpy(device, input, numPixels * sizeof(float4),
+                      cudaMemcpyHostToDevice) == cudaSuccess;
+}
+
+bool
+OptixDenoiserImpl::updateIntensity(const BeautyConditioning& conditioning,
+                                   bool halfInput,
+                                   std::string* errorMsg)
+{
+    if (conditioning.meter && !packsOnHost(conditioning, halfInput)) {
+        if (optixDenoiserComputeIntensity(mDenoiser, mCudaStream, &mLayer.input,
+                                          reinterpret_cast<CUdeviceptr>(mIntensity),
+                                          reinterpret_cast<CUdeviceptr>(mScratch),
+                                          mDenoiserSizes.computeIntensitySizeInBytes) != OPTIX_SUCCESS) {
+            *errorMsg = "Denoiser failure in optixDenoiserComputeIntensity()";
+            return false;
+        }
+        return true;
     }
+    const float scale = exposureScale(conditioning);
+    if (cudaMemcpy(mIntensity, &scale, sizeof(scale), cudaMemcpyHostToDevice) != cudaSuccess) {
+        *errorMsg = "Denoiser failure copying intensity";
+        return false;
+    }
+    return true;
+}
+
+bool
+OptixDenoiserImpl::download(void *output, const void *inputBeauty, bool halfInput)
+{
+    const size_t numPixels = static_cast<size_t>(mWidth) * mHeight;
+    if (halfInput) {
+        mBytesDownloaded += numPixels * 4 * sizeof(uint16_t);
+        return cudaMemcpy(output, mDenoisedOutput, numPixels * 4 * sizeof(uint16_t),
+                          cudaMemcpyDeviceToHost) == cudaSuccess;
+    }
+    if (mHalfStaging) {
+        mHostHalf.resize(numPixels * 4);
+        if (cudaMemcpy(mHostHalf.data(), mDenoisedOutput, numPixels * 4 * sizeof(uint16_t),
+                       cudaMemcpyDeviceToHost) != cudaSuccess) {
+            return false;
+        }
+        mBytesDownloaded += numPixels * 4 * sizeof(uint16_t);
+        // Alpha comes from the float input so it doesn't lose precision
+        float *out = static_cast<float*>(output);
+        convertHalfToFloat(mHostHalf.data(), out, mWidth, mHeight);
+        if (out != inputBeauty) {
+            copyAlpha(static_cast<const float*>(inputBeauty), out, mWidth, mHeight);
+        }
+        return true;
+    }
+    mBytesDownloaded += numPixels * sizeof(float4);
+    return cudaMemcpy(output, mDenoisedOutput, numPixels * sizeof(float4),
+                      cudaMemcpyDeviceToHost) == cudaSuccess;
+}
+
+bool
+OptixDenoiserImpl::uploadGuides(const void *inputAlbedo,
+                                const void *inputNormals,
+                                bool halfInput,
+                                std::string* errorMsg)
+{
+    PhaseTimer timer(&mTimes.pack);
+
+    // Guides that match what is already on the GPU are not copied again.  Half guides
+    // are always copied since the tracked hashes are of float guides.
+    auto changed = [&](const void *guide, uint64_t *lastHash) {
+        return halfInput || guideChanged(static_cast<const float*>(guide), lastHash);
+    };
+    if (halfInput) {
+        invalidateGuides();
+    }
+
+    // Copy the input albedo to the GPU
+    if (mUseAlbedo && changed(inputAlbedo, &mAlbedoHash) &&
+        !upload(mInputAlbedo, inputAlbedo, halfInput)) {
+        invalidateGuides();
+        *errorMsg = "Denoiser failure copying input albedo";
+        return false;
+    }
+
+    // Copy the noisy input normals to the GPU
+    if (mUseNormals && changed(inputNormals, &mNormalsHash) &&
+        !upload(mInputNormals, inputNormals, halfInput)) {
+        invalidateGuides();
+        *errorMsg = "Denoiser failure copying input normals";
+        return false;
+    }
+    return true;
+}
+
+bool
+OptixDenoiserImpl::denoiseBeauty(const void *inputBeauty,
+                                 void *output,
+                                 bool halfInput,
+                                 std::string* errorMsg)
+{
+    // Copy the noisy input beauty to the GPU
+    BeautyConditioning conditioning = beautyConditioning();
+    {
+        PhaseTimer timer(&mTimes.pack);
+        if (!upload(mInputBeauty, inputBeauty, halfInput, &conditioning)) {
+            *errorMsg = "Denoiser failure copying input beauty";
+            return false;
+        }
+        if (mAutoExposure && !updateIntensity(conditioning, halfInput, errorMsg)) {
+            return false;
+        }
+    }
+
+    {
+        PhaseTimer timer(&mTimes.execute);
+        if (optixDenoiserInvoke(mDenoiser, mCudaStream, &mDenoiserParams,
+                                reinterpret_cast<CUdeviceptr>(mDenoiserState),
+                                mDenoiserSizes.stateSizeInBytes,
+                                &mGuideLayer,
+                                &mLayer,
+                                1,  // numLayers 
+                                0,  // inputOffsetX
+                                0,  // inputOffsetY
+                                reinterpret_cast<CUdeviceptr>(mScratch),
+                                mDenoiserSizes.withoutOverlapScratchSizeInBytes) != OPTIX_SUCCESS) {
+            *errorMsg = "Denoiser failure in optixDenoiserInvoke()";
+            return false;
+        }
+        // The invoke is asynchronous.  Wait for it here so its time isn't attributed
+        // to the copy below.
+        cudaStreamSynchronize(mCudaStream);
+    }
+
+    // Copy the denoised output from the GPU to *output
+    PhaseTimer timer(&mTimes.unpack);
+    if (!download(output, inputBeauty, halfInput)) {
+        *errorMsg = "Denoiser failure copying output";
+        return false;
+    }
+    return true;
+}
+
+void
+OptixDenoiserImpl::releaseMemory()
+{
+    // The denoiser state and scratch stay, so no setup is needed to come back
+    for (float** buffer : { &mDenoisedOutput, &mInputBeauty, &mInputAlbedo, &mInputNormals }) {
+        if (*buffer) {
+            cudaFree(*buffer);
+            *buffer = nullptr;
+        }
+    }
+    mDenoisedOutputCapacity = 0;
+    mInputBeautyCapacity = 0;
+    mInputAlbedoCapacity = 0;
+    mInputNormalsCapacity = 0;
+    std::vector<uint16_t>().swap(mHostHalf);
+    std::vector<float>().swap(mHostFloat);
+    invalidateGuides();
+}
+
+void
+OptixDenoiserImpl::warmUp(std::string* errorMsg)
+{
+    if (!mInputBeauty && !allocateImageBuffers(errorMsg)) {
+        return;
+    }
+
+    // Invokes the denoiser on a zeroed corner of the device buffers so the first real
+    // invoke doesn't pay for loading its kernels.  Layers smaller than the size given
+    // to optixDenoiserSetup() are allowed.
+    const unsigned int width = std::min(mWidth, sWarmUpSize);
+    const unsigned int height = std::min(mHeight, sWarmUpSize);
+    OptixDenoiserLayer layer = mLayer;
+    OptixDenoiserGuideLayer guideLayer = mGuideLayer;
+    for (OptixImage2D* image : { &layer.input, &layer.output, &guideLayer.albedo, &guideLayer.normal }) {
+        if (image->data) {
+            cudaMemsetAsync(reinterpret_cast<void*>(image->data), 0,
+                            height * image->rowStrideInBytes, mCudaStream);
+            image->width = width;
+            image->height = height;
+        }
+    }
+    // The guide buffers no longer hold the last guides
+    invalidateGuides();
 
     if (optixDenoiserInvoke(mDenoiser, mCudaStream, &mDenoiserParams,
                             reinterpret_cast<CUdeviceptr>(mDenoiserState),
                             mDenoiserSizes.stateSizeInBytes,
-                            &mGuideLayer,
-                            &mLayer,
-                            1,  // numLayers 
+                            &guideLayer,
+                            &layer,
+                            1,  // numLayers
                             0,  // inputOffsetX
                             0,  // inputOffsetY
                             reinterpret_cast<CUdeviceptr>(mScratch),
-                            mDenoiserSizes.withoutOverlapScratchSizeInBytes) != OPTIX_SUCCESS) {
-        *errorMsg = "Denoiser failure in optixDenoiserInvoke()";
-        return;
-    }
-
-    // Copy the denoised output from the GPU to *output
-    if (cudaMemcpy(output,
-                   (void*)mDenoisedOutput,
-                   mWidth * mHeight * sizeof(float4),
-                   cudaMemcpyDeviceToHost) != cudaSuccess) { 
-        *errorMsg = "Denoiser failure copying output";
-        return;         
+                            mDenoiserSizes.withoutOverlapScratchSizeInBytes) != OPTIX_SUCCESS ||
+        cudaStreamSynchronize(mCudaStream) != cudaSuccess) {
+        *errorMsg = "Denoiser failure in warm-up optixDenoiserInvoke()";
     }
+}
 
-    // std::cerr << "Optix denoise() elapsed time (s): " << denoiseTimer.end() << std::endl;
+size_t
+OptixDenoiserImpl::stagingBytes() const
+{
+    return mDenoiserStateCapacity + mScratchCapacity + mDenoisedOutputCapacity +
+           mInputBeautyCapacity + mInputAlbedoCapacity + mInputNormalsCapacity +
+           mHostHalf.capacity() * sizeof(uint16_t) + mHostFloat.capacity() * sizeof(float) +
+           (mIntensity ? sizeof(float) : 0);
 }
 
 bool
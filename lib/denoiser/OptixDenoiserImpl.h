@@ -10,7 +10,9 @@
 #include <optix.h>
 #include <optix_stubs.h>
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace moonray {
 namespace denoiser {
@@ -22,6 +24,7 @@ public:
                       int height,
                       bool useAlbedo,
                       bool useNormals,
+                      const DenoiserOptions& options,
                       std::string* errorMsg);
     ~OptixDenoiserImpl();
 
@@ -31,6 +34,32 @@ public:
                  float *output,       // RGBA
                  std::string* errorMsg) override;
 
+    void denoiseHalf(const uint16_t *inputBeauty,  // half RGBA
+                     const uint16_t *inputAlbedo,  // half RGBA
+                     const uint16_t *inputNormals, // half RGBA
+                     uint16_t *output,       // half RGBA
+                     std::string* errorMsg) override;
+
+    void denoiseBatch(const float *inputAlbedo,
+                      const float *inputNormals,
+                      int numImages,
+                      const float * const *inputColors,
+                      float * const *outputs,
+                      std::string* errorMsg) override;
+
+    bool reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg) override;
+
+    int tileOverlap() const override { return mDenoiserSizes.overlapWindowSizeInPixels; }
+    void warmUp(std::string* errorMsg) override;
+    void releaseMemory() override;
+
+protected:
+    size_t stagingBytes() const override;
+
 private:
     bool createOptixContext(OptixLogCallback logCallback,
                             CUstream* cudaStream,
@@ -38,20 +67,66 @@ private:
                             std::string* deviceName,
                             std::string* errorMsg);
 
+    // Creates the Optix denoiser if needed and sizes its state and the image buffers
+    // for the current configuration
+    bool setup(std::string* errorMsg);
+    // Sizes the image buffers for the current configuration.  releaseMemory() frees
+    // them between calls in low memory mode.
+    bool allocateImageBuffers(std::string* errorMsg);
+
+    // Sets the format of all layers.  Half images are used for half inputs and for
+    // float inputs when staging in half precision.
+    void setImageFormat(OptixPixelFormat format);
+    // A beauty that is sanitized or converted to half is packed on the host, and
+    // conditioned there
+    bool packsOnHost(const BeautyConditioning& conditioning, bool halfInput) const
+    {
+        return conditioning.sanitize || (mHalfStaging && !halfInput);
+    }
+    bool upload(void *device,
+                const void *input,
+                bool halfInput,
+                BeautyConditioning* conditioning = nullptr);
+    // Sets the intensity hdrIntensity points to for the uploaded beauty, metering it on
+    // the GPU if it was not packed on the host
+    bool updateIntensity(const BeautyConditioning& conditioning,
+                         bool halfInput,
+                         std::string* errorMsg);
+    bool download(void *output, const void *inputBeauty, bool halfInput);
+    bool uploadGuides(const void *inputAlbedo,
+                      const void *inputNormals,
+                      bool halfInput,
+                      std::string* errorMsg);
+    bool denoiseBeauty(const void *inputBeauty,
+                       void *output,
+                       bool halfInput,
+                       std::string* errorMsg);
+
+    bool mHalfStaging;
+    std::vector<uint16_t> mHostHalf; // host side conversion buffer for half staging
+    std::vector<float> mHostFloat;   // host side copy of a sanitized float beauty
+
     CUstream mCudaStream;
     std::string mGPUDeviceName;
     OptixDeviceContext mContext;
     OptixDenoiser mDenoiser;
     OptixDenoiserSizes mDenoiserSizes;
     unsigned char* mDenoiserState;
+    size_t mDenoiserStateCapacity;
     unsigned char* mScratch;
+    size_t mScratchCapacity;
     OptixDenoiserParams mDenoiserParams;
     float* mDenoisedOutput;
+    size_t mDenoisedOutputCapacity;
     float* mInputBeauty;
+    size_t mInputBeautyCapacity;
     OptixDenoiserLayer mLayer;
     OptixDenoiserGuideLayer mGuideLayer;
     float* mInputAlbedo;
+    size_t mInputAlbedoCapacity;
     float* mInputNormals;
+    size_t mInputNormalsCapacity;
+    float* mIntensity; // input scale for hdrIntensity, see DenoiserOptions::autoExposure
 };
 
 } // namespace denoiser
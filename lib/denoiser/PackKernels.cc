@@ -0,0 +1,1355 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "PackKernels.h"
+#include "RowRanges.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/combinable.h>
+#include <tbb/parallel_for.h>
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// Pixels are conditioned in blocks of at most this many right after they are packed,
+// while they are still in the L1 cache
+constexpr size_t sConditionBlock = 1024;
+
+void
+packScalar(const float* src, float* dst, size_t numPixels)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        dst[i * 3]     = src[i * 4];
+        dst[i * 3 + 1] = src[i * 4 + 1];
+        dst[i * 3 + 2] = src[i * 4 + 2];
+    }
+}
+
+void
+unpackScalar(const float* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        const float alpha = alphaSrc[i * 4 + 3];
+        dst[i * 4]     = src[i * 3];
+        dst[i * 4 + 1] = src[i * 3 + 1];
+        dst[i * 4 + 2] = src[i * 3 + 2];
+        dst[i * 4 + 3] = alpha;
+    }
+}
+
+// 4 pixels per iteration: 4 RGBA loads -> 3 RGB stores
+__attribute__((target("sse4.1"))) void
+packSSE(const float* src, float* dst, size_t numPixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= numPixels; i += 4) {
+        const float* s = src + i * 4;
+        const __m128 p0 = _mm_loadu_ps(s);
+        const __m128 p1 = _mm_loadu_ps(s + 4);
+        const __m128 p2 = _mm_loadu_ps(s + 8);
+        const __m128 p3 = _mm_loadu_ps(s + 12);
+
+        // r0 g0 b0 r1
+        const __m128 o0 = _mm_blend_ps(p0, _mm_shuffle_ps(p1, p1, _MM_SHUFFLE(0, 0, 0, 0)), 0x8);
+        // g1 b1 r2 g2
+        const __m128 o1 = _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1, 0, 2, 1));
+        // b2 r3 g3 b3
+        const __m128 o2 = _mm_blend_ps(_mm_shuffle_ps(p3, p3, _MM_SHUFFLE(2, 1, 0, 0)),
+                                       _mm_shuffle_ps(p2, p2, _MM_SHUFFLE(2, 2, 2, 2)), 0x1);
+
+        float* d = dst + i * 3;
+        _mm_storeu_ps(d, o0);
+        _mm_storeu_ps(d + 4, o1);
+        _mm_storeu_ps(d + 8, o2);
+    }
+    packScalar(src + i * 4, dst + i * 3, numPixels - i);
+}
+
+// 4 pixels per iteration: 3 RGB loads -> 4 RGBA stores
+__attribute__((target("sse4.1"))) void
+unpackSSE(const float* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= numPixels; i += 4) {
+        const float* s = src + i * 3;
+        const __m128i a = _mm_castps_si128(_mm_loadu_ps(s));
+        const __m128i b = _mm_castps_si128(_mm_loadu_ps(s + 4));
+        const __m128i c = _mm_castps_si128(_mm_loadu_ps(s + 8));
+
+        const __m128 p0 = _mm_castsi128_ps(a);                         // r0 g0 b0 --
+        const __m128 p1 = _mm_castsi128_ps(_mm_alignr_epi8(b, a, 12)); // r1 g1 b1 --
+        const __m128 p2 = _mm_castsi128_ps(_mm_alignr_epi8(c, b, 8));  // r2 g2 b2 --
+        const __m128 p3 = _mm_castsi128_ps(_mm_alignr_epi8(c, c, 4));  // r3 g3 b3 --
+
+        const float* as = alphaSrc + i * 4;
+        float* d = dst + i * 4;
+        _mm_storeu_ps(d,      _mm_blend_ps(p0, _mm_loadu_ps(as),      0x8));
+        _mm_storeu_ps(d + 4,  _mm_blend_ps(p1, _mm_loadu_ps(as + 4),  0x8));
+        _mm_storeu_ps(d + 8,  _mm_blend_ps(p2, _mm_loadu_ps(as + 8),  0x8));
+        _mm_storeu_ps(d + 12, _mm_blend_ps(p3, _mm_loadu_ps(as + 12), 0x8));
+    }
+    unpackScalar(src + i * 3, alphaSrc + i * 4, dst + i * 4, numPixels - i);
+}
+
+// RGBA -> RGBA keeping the destination's alpha, 1 pixel per iteration
+__attribute__((target("sse4.1"))) void
+copyRGBSSE(const float* src, float* dst, size_t numPixels)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        _mm_storeu_ps(dst + i * 4, _mm_blend_ps(_mm_loadu_ps(src + i * 4), _mm_loadu_ps(dst + i * 4), 0x8));
+    }
+}
+
+// 8 pixels per iteration: 4 RGBA loads -> 3 RGB stores
+__attribute__((target("avx2"))) void
+packAVX2(const float* src, float* dst, size_t numPixels)
+{
+    // Indices are per destination lane, "7" marks a lane that is replaced by the blend
+    const __m256i i00 = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i i01 = _mm256_setr_epi32(7, 7, 7, 7, 7, 7, 0, 1);
+    const __m256i i11 = _mm256_setr_epi32(2, 4, 5, 6, 7, 7, 7, 7);
+    const __m256i i12 = _mm256_setr_epi32(7, 7, 7, 7, 0, 1, 2, 4);
+    const __m256i i22 = _mm256_setr_epi32(5, 6, 7, 7, 7, 7, 7, 7);
+    const __m256i i23 = _mm256_setr_epi32(7, 7, 0, 1, 2, 4, 5, 6);
+
+    size_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        const float* s = src + i * 4;
+        const __m256 v0 = _mm256_loadu_ps(s);
+        const __m256 v1 = _mm256_loadu_ps(s + 8);
+        const __m256 v2 = _mm256_loadu_ps(s + 16);
+        const __m256 v3 = _mm256_loadu_ps(s + 24);
+
+        const __m256 o0 = _mm256_blend_ps(_mm256_permutevar8x32_ps(v0, i00),
+                                          _mm256_permutevar8x32_ps(v1, i01), 0xc0);
+        const __m256 o1 = _mm256_blend_ps(_mm256_permutevar8x32_ps(v1, i11),
+                                          _mm256_permutevar8x32_ps(v2, i12), 0xf0);
+        const __m256 o2 = _mm256_blend_ps(_mm256_permutevar8x32_ps(v2, i22),
+                                          _mm256_permutevar8x32_ps(v3, i23), 0xfc);
+
+        float* d = dst + i * 3;
+        _mm256_storeu_ps(d, o0);
+        _mm256_storeu_ps(d + 8, o1);
+        _mm256_storeu_ps(d + 16, o2);
+    }
+    packScalar(src + i * 4, dst + i * 3, numPixels - i);
+}
+
+// 8 pixels per iteration: 3 RGB loads -> 4 RGBA stores
+__attribute__((target("avx2"))) void
+unpackAVX2(const float* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    const __m256i i0  = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i i1a = _mm256_setr_epi32(6, 7, 7, 7, 7, 7, 7, 7);
+    const __m256i i1b = _mm256_setr_epi32(0, 0, 0, 0, 1, 2, 3, 3);
+    const __m256i i2b = _mm256_setr_epi32(4, 5, 6, 6, 7, 7, 7, 7);
+    const __m256i i2c = _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 1, 1);
+    const __m256i i3  = _mm256_setr_epi32(2, 3, 4, 0, 5, 6, 7, 0);
+
+    size_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        const float* s = src + i * 3;
+        const __m256 a = _mm256_loadu_ps(s);
+        const __m256 b = _mm256_loadu_ps(s + 8);
+        const __m256 c = _mm256_loadu_ps(s + 16);
+
+        const __m256 p0 = _mm256_permutevar8x32_ps(a, i0);
+        const __m256 p1 = _mm256_blend_ps(_mm256_permutevar8x32_ps(a, i1a),
+                                          _mm256_permutevar8x32_ps(b, i1b), 0x74);
+        const __m256 p2 = _mm256_blend_ps(_mm256_permutevar8x32_ps(b, i2b),
+                                          _mm256_permutevar8x32_ps(c, i2c), 0x60);
+        const __m256 p3 = _mm256_permutevar8x32_ps(c, i3);
+
+        const float* as = alphaSrc + i * 4;
+        float* d = dst + i * 4;
+        _mm256_storeu_ps(d,      _mm256_blend_ps(p0, _mm256_loadu_ps(as),      0x88));
+        _mm256_storeu_ps(d + 8,  _mm256_blend_ps(p1, _mm256_loadu_ps(as + 8),  0x88));
+        _mm256_storeu_ps(d + 16, _mm256_blend_ps(p2, _mm256_loadu_ps(as + 16), 0x88));
+        _mm256_storeu_ps(d + 24, _mm256_blend_ps(p3, _mm256_loadu_ps(as + 24), 0x88));
+    }
+    unpackScalar(src + i * 3, alphaSrc + i * 4, dst + i * 4, numPixels - i);
+}
+
+// 16 pixels per iteration: 4 RGBA loads -> 3 RGB stores
+__attribute__((target("avx512f"))) void
+packAVX512(const float* src, float* dst, size_t numPixels)
+{
+    // Two-source permutes: indices 0-15 select from the first vector, 16-31 from the second
+    const __m512i i01 = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 16, 17, 18, 20);
+    const __m512i i12 = _mm512_setr_epi32(5, 6, 8, 9, 10, 12, 13, 14, 16, 17, 18, 20, 21, 22, 24, 25);
+    const __m512i i23 = _mm512_setr_epi32(10, 12, 13, 14, 16, 17, 18, 20, 21, 22, 24, 25, 26, 28, 29, 30);
+
+    size_t i = 0;
+    for (; i + 16 <= numPixels; i += 16) {
+        const float* s = src + i * 4;
+        const __m512 v0 = _mm512_loadu_ps(s);
+        const __m512 v1 = _mm512_loadu_ps(s + 16);
+        const __m512 v2 = _mm512_loadu_ps(s + 32);
+        const __m512 v3 = _mm512_loadu_ps(s + 48);
+
+        float* d = dst + i * 3;
+        _mm512_storeu_ps(d,      _mm512_permutex2var_ps(v0, i01, v1));
+        _mm512_storeu_ps(d + 16, _mm512_permutex2var_ps(v1, i12, v2));
+        _mm512_storeu_ps(d + 32, _mm512_permutex2var_ps(v2, i23, v3));
+    }
+    packScalar(src + i * 4, dst + i * 3, numPixels - i);
+}
+
+// 16 pixels per iteration: 3 RGB loads -> 4 RGBA stores
+__attribute__((target("avx512f"))) void
+unpackAVX512(const float* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    const __m512i i0  = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+    const __m512i i01 = _mm512_setr_epi32(12, 13, 14, 0, 15, 16, 17, 0, 18, 19, 20, 0, 21, 22, 23, 0);
+    const __m512i i12 = _mm512_setr_epi32(8, 9, 10, 0, 11, 12, 13, 0, 14, 15, 16, 0, 17, 18, 19, 0);
+    const __m512i i2  = _mm512_setr_epi32(4, 5, 6, 0, 7, 8, 9, 0, 10, 11, 12, 0, 13, 14, 15, 0);
+    const __mmask16 alphaMask = 0x8888;
+
+    size_t i = 0;
+    for (; i + 16 <= numPixels; i += 16) {
+        const float* s = src + i * 3;
+        const __m512 a = _mm512_loadu_ps(s);
+        const __m512 b = _mm512_loadu_ps(s + 16);
+        const __m512 c = _mm512_loadu_ps(s + 32);
+
+        const __m512 p0 = _mm512_permutexvar_ps(i0, a);
+        const __m512 p1 = _mm512_permutex2var_ps(a, i01, b);
+        const __m512 p2 = _mm512_permutex2var_ps(b, i12, c);
+        const __m512 p3 = _mm512_permutexvar_ps(i2, c);
+
+        const float* as = alphaSrc + i * 4;
+        float* d = dst + i * 4;
+        _mm512_storeu_ps(d,      _mm512_mask_blend_ps(alphaMask, p0, _mm512_loadu_ps(as)));
+        _mm512_storeu_ps(d + 16, _mm512_mask_blend_ps(alphaMask, p1, _mm512_loadu_ps(as + 16)));
+        _mm512_storeu_ps(d + 32, _mm512_mask_blend_ps(alphaMask, p2, _mm512_loadu_ps(as + 32)));
+        _mm512_storeu_ps(d + 48, _mm512_mask_blend_ps(alphaMask, p3, _mm512_loadu_ps(as + 48)));
+    }
+    unpackScalar(src + i * 3, alphaSrc + i * 4, dst + i * 4, numPixels - i);
+}
+
+// OIDN's auto-exposure cuts the image into bins of at most this many pixels a side,
+// spread evenly over its width and height, and averages the log2 of their mean
+// luminance.  Bins darker than sMeterThreshold are left out.
+constexpr int sMeterMaxBinSize = 16;
+constexpr float sMeterThreshold = 1e-8f;
+
+// Bins of a width x height image, in the same places as OIDN's
+struct MeterBins
+{
+    MeterBins(int width, int height) :
+        width(width),
+        height(height),
+        numBinsX((width + sMeterMaxBinSize - 1) / sMeterMaxBinSize),
+        numBinsY((height + sMeterMaxBinSize - 1) / sMeterMaxBinSize),
+        columnBin(width),
+        binEnd(numBinsX)
+    {
+        for (int binX = 0; binX < numBinsX; binX++) {
+            binEnd[binX] = binStart(binX + 1, width, numBinsX);
+            std::fill(columnBin.begin() + binStart(binX, width, numBinsX),
+                      columnBin.begin() + binEnd[binX], binX);
+        }
+    }
+
+    // First pixel of bin i of n along a side of size pixels
+    static int binStart(int i, int size, int n)
+    {
+        return static_cast<int>(static_cast<int64_t>(i) * size / n);
+    }
+
+    int width;
+    int height;
+    int numBinsX;
+    int numBinsY;
+    std::vector<int> columnBin; // bin of every column
+    std::vector<int> binEnd;    // column after every bin
+};
+
+// Metered sums of one task, which covers whole rows of bins.  Pixels are added in
+// scanline order from the first row of the task's first row of bins.
+struct MeterSums
+{
+    double log2Sum = 0;
+    uint64_t count = 0;
+
+    const MeterBins* bins = nullptr;
+    std::vector<float> luminance; // sums of the bins in the current row of bins
+    int x = 0;                    // column of the next pixel
+    int y = 0;                    // row of the next pixel
+    int binY = 0;                 // current row of bins
+
+    void begin(const MeterBins& layout, int firstBinY)
+    {
+        bins = &layout;
+        luminance.assign(layout.numBinsX, 0.f);
+        x = 0;
+        binY = firstBinY;
+        y = MeterBins::binStart(binY, layout.height, layout.numBinsY);
+    }
+
+    void add(float l) { addRun(l, 1); }
+
+    // Pixels from the next one to the end of its bin
+    int binLeft() const { return bins->binEnd[bins->columnBin[x]] - x; }
+
+    // Adds the summed luminance l of the next n pixels, which must all be in one bin
+    void addRun(float l, int n)
+    {
+        luminance[bins->columnBin[x]] += l;
+        x += n;
+        if (x == bins->width) {
+            x = 0;
+            if (++y == MeterBins::binStart(binY + 1, bins->height, bins->numBinsY)) {
+                finishBinRow();
+            }
+        }
+    }
+
+    // Adds the log2 mean luminance of the bins of the current row of bins and moves
+    // on to the next row of bins
+    void finishBinRow()
+    {
+        const int binHeight = MeterBins::binStart(binY + 1, bins->height, bins->numBinsY) -
+                              MeterBins::binStart(binY, bins->height, bins->numBinsY);
+        for (int binX = 0; binX < bins->numBinsX; binX++) {
+            const int binWidth = MeterBins::binStart(binX + 1, bins->width, bins->numBinsX) -
+                                 MeterBins::binStart(binX, bins->width, bins->numBinsX);
+            const float l = luminance[binX] / static_cast<float>(binWidth * binHeight);
+            if (l > sMeterThreshold) {
+                log2Sum += std::log2(l);
+                count++;
+            }
+            luminance[binX] = 0.f;
+        }
+        binY++;
+    }
+};
+
+inline float
+sanitizeValue(float v)
+{
+    // False for NaNs too
+    return v >= 0.f && v < std::numeric_limits<float>::infinity() ? v : 0.f;
+}
+
+// Luminance of a pixel as OIDN's auto-exposure meters it, with the channels clamped
+// to [0, FLT_MAX] and NaNs counted as 0
+inline float
+meteredLuminance(float r, float g, float b)
+{
+    auto clamp = [](float v) { return v > 0.f ? std::min(v, std::numeric_limits<float>::max()) : 0.f; };
+    return 0.212671f * clamp(r) + 0.715160f * clamp(g) + 0.072169f * clamp(b);
+}
+
+// Conditions numPixels interleaved pixels of pixelStride floats (3 or 4, RGB first).
+// sums is null when not metering.
+void
+conditionScalar(float* pixels, size_t pixelStride, size_t numPixels, bool sanitize, MeterSums* sums)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        float* p = pixels + i * pixelStride;
+        if (sanitize) {
+            p[0] = sanitizeValue(p[0]);
+            p[1] = sanitizeValue(p[1]);
+            p[2] = sanitizeValue(p[2]);
+        }
+        if (sums) {
+            sums->add(meteredLuminance(p[0], p[1], p[2]));
+        }
+    }
+}
+
+// 8 values per iteration for sanitizing, then the luminance of 8 pixels per iteration
+// gathered for metering
+__attribute__((target("avx2"))) void
+conditionAVX2(float* pixels, size_t pixelStride, size_t numPixels, bool sanitize, MeterSums* sums)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    if (sanitize) {
+        // With RGBA pixels, lanes 3 and 7 hold alpha and are kept as they are
+        const __m256 keep = pixelStride == 4 ?
+            _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1)) : zero;
+        const size_t count = numPixels * pixelStride;
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256 v = _mm256_loadu_ps(pixels + i);
+            const __m256 valid = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(v, infinity, _CMP_LT_OQ));
+            _mm256_storeu_ps(pixels + i, _mm256_and_ps(v, _mm256_or_ps(valid, keep)));
+        }
+        for (; i < count; i++) {
+            if (pixelStride == 3 || (i & 3) != 3) {
+                pixels[i] = sanitizeValue(pixels[i]);
+            }
+        }
+    }
+    if (!sums) {
+        return;
+    }
+
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                             _mm256_set1_epi32(static_cast<int>(pixelStride)));
+    const __m256 maxValue = _mm256_set1_ps(std::numeric_limits<float>::max());
+    // max() returns its second operand for NaNs, so they become 0
+    auto clamp = [&](__m256 v) { return _mm256_min_ps(_mm256_max_ps(v, zero), maxValue); };
+    alignas(32) float lanes[8];
+    size_t i = 0;
+    for (; i + 8 <= numPixels; i += 8) {
+        const float* p = pixels + i * pixelStride;
+        const __m256 r = clamp(_mm256_i32gather_ps(p, index, 4));
+        const __m256 g = clamp(_mm256_i32gather_ps(p + 1, index, 4));
+        const __m256 b = clamp(_mm256_i32gather_ps(p + 2, index, 4));
+        const __m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.212671f)),
+                                                     _mm256_mul_ps(g, _mm256_set1_ps(0.715160f))),
+                                       _mm256_mul_ps(b, _mm256_set1_ps(0.072169f)));
+        if (sums->binLeft() >= 8) {
+            // Bins are at least 8 pixels wide unless the image is narrower, so most runs
+            // of 8 pixels fall in one bin
+            __m128 sum = _mm_add_ps(_mm256_castps256_ps128(l), _mm256_extractf128_ps(l, 1));
+            sum = _mm_hadd_ps(sum, sum);
+            sum = _mm_hadd_ps(sum, sum);
+            sums->addRun(_mm_cvtss_f32(sum), 8);
+            continue;
+        }
+        _mm256_store_ps(lanes, l);
+        for (float lane : lanes) {
+            sums->add(lane);
+        }
+    }
+    conditionScalar(pixels + i * pixelStride, pixelStride, numPixels - i, false, sums);
+}
+
+// IEEE 754 binary16 conversions.  Values outside the half range, including
+// infinities, are clamped to +-65504 so they can't turn into infinities in the
+// network.  NaNs are kept.
+constexpr float sHalfMax = 65504.f;
+
+inline uint16_t
+floatToHalf(float f)
+{
+    if (!(f != f)) {
+        f = std::max(-sHalfMax, std::min(sHalfMax, f));
+    }
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x > 0x7f800000) {
+        return static_cast<uint16_t>(sign | 0x7e00); // NaN
+    }
+    if (x < 0x38800000) {
+        // Denormal or zero: shift the mantissa with the implicit bit into place and
+        // round to nearest even
+        if (x < 0x33000000) {
+            return static_cast<uint16_t>(sign);
+        }
+        const uint32_t exponent = x >> 23;
+        const uint32_t mantissa = (x & 0x7fffff) | 0x800000;
+        const uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    // Normal: rebias the exponent and round the mantissa to nearest even
+    uint32_t half = ((x - 0x38000000) >> 13);
+    const uint32_t remainder = x & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+inline float
+halfToFloat(uint16_t h)
+{
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0x1f) {
+        x = sign | 0x7f800000 | (mantissa << 13); // inf/NaN
+        if (mantissa) {
+            x |= 0x400000; // quiet NaNs like the hardware conversion
+        }
+    } else if (exponent) {
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa) {
+        // Denormal: normalize
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    } else {
+        x = sign;
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+void
+packHalfScalar(const float* src, uint16_t* dst, size_t numPixels)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        dst[i * 3]     = floatToHalf(src[i * 4]);
+        dst[i * 3 + 1] = floatToHalf(src[i * 4 + 1]);
+        dst[i * 3 + 2] = floatToHalf(src[i * 4 + 2]);
+    }
+}
+
+void
+unpackHalfScalar(const uint16_t* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    for (size_t i = 0; i < numPixels; i++) {
+        const float alpha = alphaSrc[i * 4 + 3];
+        dst[i * 4]     = halfToFloat(src[i * 3]);
+        dst[i * 4 + 1] = halfToFloat(src[i * 3 + 1]);
+        dst[i * 4 + 2] = halfToFloat(src[i * 3 + 2]);
+        dst[i * 4 + 3] = alpha;
+    }
+}
+
+// The F16C conversions are used at the AVX2 level and above; every CPU with AVX2
+// also has F16C.
+
+// 2 pixels per iteration: 8 floats -> 8 halves, alpha dropped with a byte shuffle.
+// Each 16 byte store writes 4 bytes into the next pixel, which the next iteration
+// overwrites, so the loop stops one pixel early and the scalar tail finishes.
+__attribute__((target("avx2,f16c"))) void
+packHalfF16C(const float* src, uint16_t* dst, size_t numPixels)
+{
+    const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+    const __m256 maxValue = _mm256_set1_ps(sHalfMax);
+    const __m256 minValue = _mm256_set1_ps(-sHalfMax);
+
+    size_t i = 0;
+    for (; i + 3 <= numPixels; i += 2) {
+        // min/max return the second operand for NaNs, which keeps NaNs as they are
+        const __m256 v = _mm256_max_ps(minValue, _mm256_min_ps(maxValue, _mm256_loadu_ps(src + i * 4)));
+        const __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(h, dropAlpha));
+    }
+    packHalfScalar(src + i * 4, dst + i * 3, numPixels - i);
+}
+
+// 2 pixels per iteration: 6 halves -> 8 floats with alpha blended in.  The 16 byte
+// load reads 2 halves past the second pixel, so the loop stops one pixel early.
+__attribute__((target("avx2,f16c"))) void
+unpackHalfF16C(const uint16_t* src, const float* alphaSrc, float* dst, size_t numPixels)
+{
+    const __m128i addAlpha = _mm_setr_epi8(0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+
+    size_t i = 0;
+    for (; i + 3 <= numPixels; i += 2) {
+        const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+        const __m256 v = _mm256_cvtph_ps(_mm_shuffle_epi8(h, addAlpha));
+        _mm256_storeu_ps(dst + i * 4, _mm256_blend_ps(v, _mm256_loadu_ps(alphaSrc + i * 4), 0x88));
+    }
+    unpackHalfScalar(src + i * 3, alphaSrc + i * 4, dst + i * 4, numPixels - i);
+}
+
+__attribute__((target("avx2,f16c"))) void
+floatToHalfF16C(const float* src, uint16_t* dst, size_t count)
+{
+    const __m256 maxValue = _mm256_set1_ps(sHalfMax);
+    const __m256 minValue = _mm256_set1_ps(-sHalfMax);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 v = _mm256_max_ps(minValue, _mm256_min_ps(maxValue, _mm256_loadu_ps(src + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < count; i++) {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+
+__attribute__((target("avx2,f16c"))) void
+halfToFloatF16C(const uint16_t* src, float* dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i,
+                         _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    }
+    for (; i < count; i++) {
+        dst[i] = halfToFloat(src[i]);
+    }
+}
+
+// forEachRowRange() for kernels that condition what they pack: func(firstRow, endRow,
+// sums) adds what it meters to *sums, and the sums of all tasks are added to
+// *conditioning once every row is done.  When metering, each task covers whole rows
+// of bins, so no bin is split between tasks.
+template <typename Func>
+void
+forEachRowRangeConditioned(int width, int height, BeautyConditioning* conditioning, const Func& func)
+{
+    if (!conditioning->meter) {
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            func(firstRow, endRow, nullptr);
+        });
+        return;
+    }
+    const MeterBins bins(width, height);
+    const size_t binRowsPerTask = std::max<size_t>(1, sMinPixelsPerTask /
+                                                      std::max(width * sMeterMaxBinSize, 1));
+    tbb::combinable<MeterSums> sums;
+    tbb::parallel_for(tbb::blocked_range<int>(0, bins.numBinsY, binRowsPerTask),
+        [&](const tbb::blocked_range<int>& binRows) {
+            MeterSums& taskSums = sums.local();
+            taskSums.begin(bins, binRows.begin());
+            func(MeterBins::binStart(binRows.begin(), height, bins.numBinsY),
+                 MeterBins::binStart(binRows.end(), height, bins.numBinsY), &taskSums);
+        });
+    sums.combine_each([&](const MeterSums& taskSums) {
+        conditioning->log2LuminanceSum += taskSums.log2Sum;
+        conditioning->meteredBins += taskSums.count;
+    });
+}
+
+void
+floatsToHalves(bool f16c, const float* src, uint16_t* dst, size_t count)
+{
+    if (f16c) {
+        floatToHalfF16C(src, dst, count);
+    } else {
+        for (size_t i = 0; i < count; i++) dst[i] = floatToHalf(src[i]);
+    }
+}
+
+void
+halvesToFloats(bool f16c, const uint16_t* src, float* dst, size_t count)
+{
+    if (f16c) {
+        halfToFloatF16C(src, dst, count);
+    } else {
+        for (size_t i = 0; i < count; i++) dst[i] = halfToFloat(src[i]);
+    }
+}
+
+// Conditions interleaved float pixels of pixelStride floats (3 or 4)
+void
+conditionPixels(SimdLevel level, const BeautyConditioning& conditioning, float* pixels,
+                size_t pixelStride, size_t numPixels, MeterSums* sums)
+{
+    MeterSums* meterSums = conditioning.meter ? sums : nullptr;
+    if (level >= SimdLevel::AVX2) {
+        conditionAVX2(pixels, pixelStride, numPixels, conditioning.sanitize, meterSums);
+    } else {
+        conditionScalar(pixels, pixelStride, numPixels, conditioning.sanitize, meterSums);
+    }
+}
+
+// Conditions interleaved half pixels of pixelStride halves (3 or 4).  Infinities, NaNs
+// and negative values are cleared without converting, metering converts blocks to
+// float.
+void
+conditionHalfPixels(SimdLevel level, const BeautyConditioning& conditioning, uint16_t* pixels,
+                    size_t pixelStride, size_t numPixels, MeterSums* sums)
+{
+    if (conditioning.sanitize) {
+        for (size_t i = 0; i < numPixels; i++) {
+            for (size_t c = 0; c < 3; c++) {
+                uint16_t& h = pixels[i * pixelStride + c];
+                if ((h & 0x7c00) == 0x7c00 || (h & 0x8000)) {
+                    h = 0;
+                }
+            }
+        }
+    }
+    if (conditioning.meter) {
+        const bool f16c = level >= SimdLevel::AVX2;
+        float block[sConditionBlock * 4];
+        for (size_t first = 0; first < numPixels; first += sConditionBlock) {
+            const size_t count = std::min(sConditionBlock, numPixels - first);
+            halvesToFloats(f16c, pixels + first * pixelStride, block, count * pixelStride);
+            conditionPixels(level, BeautyConditioning{false, true}, block, pixelStride, count, sums);
+        }
+    }
+}
+
+// A run of pixels in one row of an image, spaced stride bytes apart, with the address
+// of each channel of its first pixel
+struct Span
+{
+    char* channel[3];
+    size_t stride;
+    int length;
+
+    bool interleaved() const
+    {
+        return channel[1] == channel[0] + sizeof(float) && channel[2] == channel[1] + sizeof(float);
+    }
+};
+
+// The span starting at pixel (x, y) of at most maxLength pixels, cut at the end of a
+// tile
+Span
+spanAt(const ImageView& image, int x, int y, int maxLength)
+{
+    char* base = reinterpret_cast<char*>(image.data);
+    Span span;
+    span.stride = image.pixelStride;
+    span.length = maxLength;
+
+    char* pixel = nullptr;
+    size_t channelStride = sizeof(float);
+    switch (image.layout) {
+    case IMAGE_LAYOUT_LINEAR:
+        pixel = base + y * image.rowStride + x * image.pixelStride;
+        break;
+    case IMAGE_LAYOUT_PLANAR:
+        pixel = base + y * image.rowStride + x * image.pixelStride;
+        channelStride = image.planeStride;
+        break;
+    case IMAGE_LAYOUT_TILED: {
+        const int tw = image.tileWidth;
+        const int th = image.tileHeight;
+        const size_t tileBytes = static_cast<size_t>(tw) * th * image.pixelStride;
+        pixel = base + (y / th) * image.rowStride + (x / tw) * tileBytes +
+                ((y % th) * tw + x % tw) * image.pixelStride;
+        span.length = std::min(maxLength, tw - x % tw);
+        break;
+    }
+    }
+    for (int c = 0; c < 3; c++) {
+        span.channel[c] = pixel + c * channelStride;
+    }
+    return span;
+}
+
+// Copies the RGB of length pixels between two spans
+void
+copySpanRGB(SimdLevel level, const Span& src, const Span& dst, int length)
+{
+    const size_t rgbaStride = 4 * sizeof(float);
+    const size_t rgbStride = 3 * sizeof(float);
+    if (std::equal(src.channel, src.channel + 3, dst.channel) && src.stride == dst.stride) {
+        // Conditioning an image in place
+        return;
+    }
+    if (src.interleaved() && dst.interleaved()) {
+        const float* s = reinterpret_cast<const float*>(src.channel[0]);
+        float* d = reinterpret_cast<float*>(dst.channel[0]);
+        if (src.stride == rgbaStride && dst.stride == rgbStride) {
+            packRGBAtoRGBSpan(level, s, d, length);
+            return;
+        }
+        if (src.stride == rgbStride && dst.stride == rgbaStride) {
+            // Passing the destination as the alpha source preserves its alpha
+            unpackRGBtoRGBASpan(level, s, d, d, length);
+            return;
+        }
+        if (src.stride == rgbaStride && dst.stride == rgbaStride && level >= SimdLevel::SSE) {
+            copyRGBSSE(s, d, length);
+            return;
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        const char* s = src.channel[c];
+        char* d = dst.channel[c];
+        for (int i = 0; i < length; i++) {
+            *reinterpret_cast<float*>(d + i * dst.stride) =
+                *reinterpret_cast<const float*>(s + i * src.stride);
+        }
+    }
+}
+
+// Conditions the RGB of a span
+void
+conditionSpan(SimdLevel level, const BeautyConditioning& conditioning, const Span& span,
+              MeterSums* sums)
+{
+    if (span.interleaved() && (span.stride == 3 * sizeof(float) || span.stride == 4 * sizeof(float))) {
+        conditionPixels(level, conditioning, reinterpret_cast<float*>(span.channel[0]),
+                        span.stride / sizeof(float), span.length, sums);
+        return;
+    }
+    // Planar and other strided spans one pixel at a time
+    for (int i = 0; i < span.length; i++) {
+        float* channel[3];
+        float pixel[3];
+        for (int c = 0; c < 3; c++) {
+            channel[c] = reinterpret_cast<float*>(span.channel[c] + i * span.stride);
+            pixel[c] = *channel[c];
+        }
+        conditionScalar(pixel, 3, 1, conditioning.sanitize, conditioning.meter ? sums : nullptr);
+        if (conditioning.sanitize) {
+            for (int c = 0; c < 3; c++) {
+                *channel[c] = pixel[c];
+            }
+        }
+    }
+}
+
+} // namespace
+
+SimdLevel
+detectSimdLevel()
+{
+    static const SimdLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+        if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+        if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE;
+        return SimdLevel::SCALAR;
+    }();
+    return level;
+}
+
+const char*
+simdLevelName(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::SCALAR: return "scalar";
+    case SimdLevel::SSE:    return "SSE4.1";
+    case SimdLevel::AVX2:   return "AVX2";
+    case SimdLevel::AVX512: return "AVX-512";
+    }
+    return "unknown";
+}
+
+void
+packRGBAtoRGBSpan(SimdLevel level, const float* src, float* dst, size_t numPixels)
+{
+    switch (level) {
+    case SimdLevel::SCALAR: packScalar(src, dst, numPixels); break;
+    case SimdLevel::SSE:    packSSE(src, dst, numPixels);    break;
+    case SimdLevel::AVX2:   packAVX2(src, dst, numPixels);   break;
+    case SimdLevel::AVX512: packAVX512(src, dst, numPixels); break;
+    }
+}
+
+void
+unpackRGBtoRGBASpan(SimdLevel level, const float* src, const float* alphaSrc, float* dst,
+                    size_t numPixels)
+{
+    switch (level) {
+    case SimdLevel::SCALAR: unpackScalar(src, alphaSrc, dst, numPixels); break;
+    case SimdLevel::SSE:    unpackSSE(src, alphaSrc, dst, numPixels);    break;
+    case SimdLevel::AVX2:   unpackAVX2(src, alphaSrc, dst, numPixels);   break;
+    case SimdLevel::AVX512: unpackAVX512(src, alphaSrc, dst, numPixels); break;
+    }
+}
+
+float
+BeautyConditioning::exposureScale() const
+{
+    // Middle grey, as in OIDN's auto-exposure
+    constexpr float key = 0.18f;
+    if (!meteredBins) {
+        return 1.f;
+    }
+    return key / std::exp2(static_cast<float>(log2LuminanceSum / meteredBins));
+}
+
+void
+packRGBAtoRGB(const float* src, float* dst, int width, int height, BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    if (!conditioning || !conditioning->enabled()) {
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            const size_t first = static_cast<size_t>(firstRow) * width;
+            const size_t count = static_cast<size_t>(endRow - firstRow) * width;
+            packRGBAtoRGBSpan(level, src + first * 4, dst + first * 3, count);
+        });
+        return;
+    }
+    forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = static_cast<size_t>(firstRow) * width; i < end; i += sConditionBlock) {
+            const size_t count = std::min(sConditionBlock, end - i);
+            packRGBAtoRGBSpan(level, src + i * 4, dst + i * 3, count);
+            conditionPixels(level, *conditioning, dst + i * 3, 3, count, sums);
+        }
+    });
+}
+
+void
+unpackRGBtoRGBA(const float* src, const float* alphaSrc, float* dst, int width, int height)
+{
+    const SimdLevel level = detectSimdLevel();
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t count = static_cast<size_t>(endRow - firstRow) * width;
+        unpackRGBtoRGBASpan(level, src + first * 3, alphaSrc + first * 4, dst + first * 4, count);
+    });
+}
+
+void
+copyStridedRGB(const float* src, size_t srcPixelStride, size_t srcRowStride,
+               float* dst, size_t dstPixelStride, size_t dstRowStride,
+               int width, int height)
+{
+    copyImageRGB(imageView(src, srcPixelStride, srcRowStride), 0, 0,
+                 imageView(dst, dstPixelStride, dstRowStride), 0, 0,
+                 width, height);
+}
+
+namespace {
+
+template <typename Image>
+ImageView
+makeView(const Image& image, float* data, int width, int height)
+{
+    ImageView view;
+    view.data = data;
+    view.layout = image.layout;
+    if (image.layout == IMAGE_LAYOUT_TILED) {
+        view.tileWidth = image.tileWidth;
+        view.tileHeight = image.tileHeight;
+    }
+    const size_t defaultPixelStride = image.layout == IMAGE_LAYOUT_PLANAR ? sizeof(float)
+                                                                          : 4 * sizeof(float);
+    view.pixelStride = image.pixelStride ? image.pixelStride : defaultPixelStride;
+    if (image.rowStride) {
+        view.rowStride = image.rowStride;
+    } else if (image.layout == IMAGE_LAYOUT_TILED) {
+        const int tilesX = (width + view.tileWidth - 1) / view.tileWidth;
+        view.rowStride = static_cast<size_t>(tilesX) * view.tileWidth * view.tileHeight * view.pixelStride;
+    } else {
+        view.rowStride = width * view.pixelStride;
+    }
+    if (image.layout == IMAGE_LAYOUT_PLANAR) {
+        view.planeStride = image.planeStride ? image.planeStride : height * view.rowStride;
+    }
+    return view;
+}
+
+} // namespace
+
+ImageView
+imageView(const InputImage& image, int width, int height)
+{
+    return makeView(image, const_cast<float*>(image.data), width, height);
+}
+
+ImageView
+imageView(const OutputImage& image, int width, int height)
+{
+    return makeView(image, image.data, width, height);
+}
+
+ImageView
+imageView(const float* data, size_t pixelStride, size_t rowStride)
+{
+    ImageView view;
+    view.data = const_cast<float*>(data);
+    view.pixelStride = pixelStride;
+    view.rowStride = rowStride;
+    return view;
+}
+
+void
+copyImageRGB(const ImageView& src, int srcX, int srcY,
+             const ImageView& dst, int dstX, int dstY,
+             int width, int height, BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    const bool condition = conditioning && conditioning->enabled();
+    // Conditioned rows are copied in blocks, which are conditioned right after
+    const int maxSpan = condition ? static_cast<int>(sConditionBlock) : width;
+    auto copyRows = [&](int firstRow, int endRow, MeterSums* sums) {
+        for (int y = firstRow; y < endRow; y++) {
+            // Tiled rows break into spans at the tile edges of either image
+            for (int x = 0; x < width;) {
+                const Span s = spanAt(src, srcX + x, srcY + y, std::min(width - x, maxSpan));
+                const Span d = spanAt(dst, dstX + x, dstY + y, s.length);
+                copySpanRGB(level, s, d, d.length);
+                if (condition) {
+                    conditionSpan(level, *conditioning, d, sums);
+                }
+                x += d.length;
+            }
+        }
+    };
+    if (condition) {
+        forEachRowRangeConditioned(width, height, conditioning, copyRows);
+    } else {
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            copyRows(firstRow, endRow, nullptr);
+        });
+    }
+}
+
+void
+conditionImage(const ImageView& image, int width, int height, BeautyConditioning* conditioning)
+{
+    copyImageRGB(image, 0, 0, image, 0, 0, width, height, conditioning);
+}
+
+void
+copyImageRGBToHalf(const ImageView& src, uint16_t* dst, int width, int height,
+                   BeautyConditioning* conditioning)
+{
+    if (conditioning && conditioning->enabled()) {
+        // Blocks are gathered into packed float RGB, conditioned and then converted
+        const SimdLevel level = detectSimdLevel();
+        const bool f16c = level >= SimdLevel::AVX2;
+        forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+            float block[sConditionBlock * 3];
+            for (int y = firstRow; y < endRow; y++) {
+                for (int x = 0; x < width;) {
+                    const Span s = spanAt(src, x, y, std::min(width - x, static_cast<int>(sConditionBlock)));
+                    Span packed;
+                    for (int c = 0; c < 3; c++) {
+                        packed.channel[c] = reinterpret_cast<char*>(block + c);
+                    }
+                    packed.stride = 3 * sizeof(float);
+                    packed.length = s.length;
+                    copySpanRGB(level, s, packed, s.length);
+                    conditionPixels(level, *conditioning, block, 3, s.length, sums);
+                    floatsToHalves(f16c, block, dst + (static_cast<size_t>(y) * width + x) * 3, s.length * 3);
+                    x += s.length;
+                }
+            }
+        });
+        return;
+    }
+    if (src.layout == IMAGE_LAYOUT_LINEAR) {
+        copyStridedRGBToHalf(src.data, src.pixelStride, src.rowStride, dst, width, height);
+        return;
+    }
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        for (int y = firstRow; y < endRow; y++) {
+            for (int x = 0; x < width;) {
+                const Span s = spanAt(src, x, y, width - x);
+                uint16_t* d = dst + (static_cast<size_t>(y) * width + x) * 3;
+                if (s.interleaved() && s.stride == 4 * sizeof(float)) {
+                    const float* run = reinterpret_cast<const float*>(s.channel[0]);
+                    if (f16c) {
+                        packHalfF16C(run, d, s.length);
+                    } else {
+                        packHalfScalar(run, d, s.length);
+                    }
+                } else {
+                    for (int i = 0; i < s.length; i++) {
+                        for (int c = 0; c < 3; c++) {
+                            d[i * 3 + c] = floatToHalf(
+                                *reinterpret_cast<const float*>(s.channel[c] + i * s.stride));
+                        }
+                    }
+                }
+                x += s.length;
+            }
+        }
+    });
+}
+
+void
+copyImageRGBFromHalf(const uint16_t* src, const ImageView& dst, int width, int height)
+{
+    if (dst.layout == IMAGE_LAYOUT_LINEAR) {
+        copyStridedRGBFromHalf(src, dst.data, dst.pixelStride, dst.rowStride, width, height);
+        return;
+    }
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        for (int y = firstRow; y < endRow; y++) {
+            for (int x = 0; x < width;) {
+                const Span d = spanAt(dst, x, y, width - x);
+                const uint16_t* s = src + (static_cast<size_t>(y) * width + x) * 3;
+                if (d.interleaved() && d.stride == 4 * sizeof(float)) {
+                    // Passing the destination as the alpha source preserves its alpha
+                    float* run = reinterpret_cast<float*>(d.channel[0]);
+                    if (f16c) {
+                        unpackHalfF16C(s, run, run, d.length);
+                    } else {
+                        unpackHalfScalar(s, run, run, d.length);
+                    }
+                } else {
+                    for (int i = 0; i < d.length; i++) {
+                        for (int c = 0; c < 3; c++) {
+                            *reinterpret_cast<float*>(d.channel[c] + i * d.stride) =
+                                halfToFloat(s[i * 3 + c]);
+                        }
+                    }
+                }
+                x += d.length;
+            }
+        }
+    });
+}
+
+void
+copyRGBA(const float* src, float* dst, int width, int height, BeautyConditioning* conditioning)
+{
+    if (!conditioning || !conditioning->enabled()) {
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            const size_t first = static_cast<size_t>(firstRow) * width * 4;
+            const size_t count = static_cast<size_t>(endRow - firstRow) * width * 4;
+            std::memcpy(dst + first, src + first, count * sizeof(float));
+        });
+        return;
+    }
+    const SimdLevel level = detectSimdLevel();
+    forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = static_cast<size_t>(firstRow) * width; i < end; i += sConditionBlock) {
+            const size_t count = std::min(sConditionBlock, end - i);
+            std::memcpy(dst + i * 4, src + i * 4, count * 4 * sizeof(float));
+            conditionPixels(level, *conditioning, dst + i * 4, 4, count, sums);
+        }
+    });
+}
+
+void
+packRGBAtoRGBHalf(const float* src, uint16_t* dst, int width, int height,
+                  BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    const bool f16c = level >= SimdLevel::AVX2;
+    if (conditioning && conditioning->enabled()) {
+        // Blocks are packed to float RGB, conditioned and then converted
+        forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+            float block[sConditionBlock * 3];
+            const size_t end = static_cast<size_t>(endRow) * width;
+            for (size_t i = static_cast<size_t>(firstRow) * width; i < end; i += sConditionBlock) {
+                const size_t count = std::min(sConditionBlock, end - i);
+                packRGBAtoRGBSpan(level, src + i * 4, block, count);
+                conditionPixels(level, *conditioning, block, 3, count, sums);
+                floatsToHalves(f16c, block, dst + i * 3, count * 3);
+            }
+        });
+        return;
+    }
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t count = static_cast<size_t>(endRow - firstRow) * width;
+        if (f16c) {
+            packHalfF16C(src + first * 4, dst + first * 3, count);
+        } else {
+            packHalfScalar(src + first * 4, dst + first * 3, count);
+        }
+    });
+}
+
+void
+unpackRGBHalftoRGBA(const uint16_t* src, const float* alphaSrc, float* dst, int width, int height)
+{
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t count = static_cast<size_t>(endRow - firstRow) * width;
+        if (f16c) {
+            unpackHalfF16C(src + first * 3, alphaSrc + first * 4, dst + first * 4, count);
+        } else {
+            unpackHalfScalar(src + first * 3, alphaSrc + first * 4, dst + first * 4, count);
+        }
+    });
+}
+
+void
+packHalfRGBAtoRGB(const uint16_t* src, uint16_t* dst, int width, int height,
+                  BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    const bool condition = conditioning && conditioning->enabled();
+    auto packRows = [&](int firstRow, int endRow, MeterSums* sums) {
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t first = static_cast<size_t>(firstRow) * width; first < end; first += sConditionBlock) {
+            const size_t blockEnd = std::min(first + sConditionBlock, end);
+            for (size_t i = first; i < blockEnd; i++) {
+                dst[i * 3]     = src[i * 4];
+                dst[i * 3 + 1] = src[i * 4 + 1];
+                dst[i * 3 + 2] = src[i * 4 + 2];
+            }
+            if (condition) {
+                conditionHalfPixels(level, *conditioning, dst + first * 3, 3, blockEnd - first, sums);
+            }
+        }
+    };
+    if (condition) {
+        forEachRowRangeConditioned(width, height, conditioning, packRows);
+    } else {
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            packRows(firstRow, endRow, nullptr);
+        });
+    }
+}
+
+void
+unpackHalfRGBtoRGBA(const uint16_t* src, const uint16_t* alphaSrc, uint16_t* dst, int width, int height)
+{
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = first; i < end; i++) {
+            const uint16_t alpha = alphaSrc[i * 4 + 3];
+            dst[i * 4]     = src[i * 3];
+            dst[i * 4 + 1] = src[i * 3 + 1];
+            dst[i * 4 + 2] = src[i * 3 + 2];
+            dst[i * 4 + 3] = alpha;
+        }
+    });
+}
+
+void
+convertFloatToHalf(const float* src, uint16_t* dst, int width, int height,
+                   BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    const bool f16c = level >= SimdLevel::AVX2;
+    if (conditioning && conditioning->enabled()) {
+        // Blocks are copied, conditioned and then converted
+        forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+            float block[sConditionBlock * 4];
+            const size_t end = static_cast<size_t>(endRow) * width;
+            for (size_t i = static_cast<size_t>(firstRow) * width; i < end; i += sConditionBlock) {
+                const size_t count = std::min(sConditionBlock, end - i);
+                std::memcpy(block, src + i * 4, count * 4 * sizeof(float));
+                conditionPixels(level, *conditioning, block, 4, count, sums);
+                floatsToHalves(f16c, block, dst + i * 4, count * 4);
+            }
+        });
+        return;
+    }
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width * 4;
+        const size_t count = static_cast<size_t>(endRow - firstRow) * width * 4;
+        if (f16c) {
+            floatToHalfF16C(src + first, dst + first, count);
+        } else {
+            for (size_t i = 0; i < count; i++) dst[first + i] = floatToHalf(src[first + i]);
+        }
+    });
+}
+
+void
+convertHalfToFloat(const uint16_t* src, float* dst, int width, int height)
+{
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width * 4;
+        const size_t count = static_cast<size_t>(endRow - firstRow) * width * 4;
+        if (f16c) {
+            halfToFloatF16C(src + first, dst + first, count);
+        } else {
+            for (size_t i = 0; i < count; i++) dst[first + i] = halfToFloat(src[first + i]);
+        }
+    });
+}
+
+void
+copyAlphaHalf(const uint16_t* src, uint16_t* dst, int width, int height)
+{
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = first; i < end; i++) {
+            dst[i * 4 + 3] = src[i * 4 + 3];
+        }
+    });
+}
+
+void
+conditionHalfRGBA(const uint16_t* src, uint16_t* dst, int width, int height,
+                  BeautyConditioning* conditioning)
+{
+    const SimdLevel level = detectSimdLevel();
+    forEachRowRangeConditioned(width, height, conditioning, [&](int firstRow, int endRow, MeterSums* sums) {
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = static_cast<size_t>(firstRow) * width; i < end; i += sConditionBlock) {
+            const size_t count = std::min(sConditionBlock, end - i);
+            if (dst != src) {
+                std::memcpy(dst + i * 4, src + i * 4, count * 4 * sizeof(uint16_t));
+            }
+            // Only written to when sanitizing
+            conditionHalfPixels(level, *conditioning, dst + i * 4, 4, count, sums);
+        }
+    });
+}
+
+void
+copyStridedRGBToHalf(const float* src, size_t srcPixelStride, size_t srcRowStride,
+                     uint16_t* dst, int width, int height)
+{
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        for (int y = firstRow; y < endRow; y++) {
+            const char* s = reinterpret_cast<const char*>(src) + y * srcRowStride;
+            uint16_t* d = dst + static_cast<size_t>(y) * width * 3;
+            if (srcPixelStride == 4 * sizeof(float)) {
+                const float* row = reinterpret_cast<const float*>(s);
+                if (f16c) {
+                    packHalfF16C(row, d, width);
+                } else {
+                    packHalfScalar(row, d, width);
+                }
+            } else {
+                for (int x = 0; x < width; x++) {
+                    const float* sp = reinterpret_cast<const float*>(s + x * srcPixelStride);
+                    d[x * 3]     = floatToHalf(sp[0]);
+                    d[x * 3 + 1] = floatToHalf(sp[1]);
+                    d[x * 3 + 2] = floatToHalf(sp[2]);
+                }
+            }
+        }
+    });
+}
+
+void
+copyStridedRGBFromHalf(const uint16_t* src, float* dst, size_t dstPixelStride,
+                       size_t dstRowStride, int width, int height)
+{
+    const bool f16c = detectSimdLevel() >= SimdLevel::AVX2;
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        for (int y = firstRow; y < endRow; y++) {
+            const uint16_t* s = src + static_cast<size_t>(y) * width * 3;
+            char* d = reinterpret_cast<char*>(dst) + y * dstRowStride;
+            if (dstPixelStride == 4 * sizeof(float)) {
+                // Passing the destination as the alpha source preserves its alpha
+                float* row = reinterpret_cast<float*>(d);
+                if (f16c) {
+                    unpackHalfF16C(s, row, row, width);
+                } else {
+                    unpackHalfScalar(s, row, row, width);
+                }
+            } else {
+                for (int x = 0; x < width; x++) {
+                    float* dp = reinterpret_cast<float*>(d + x * dstPixelStride);
+                    dp[0] = halfToFloat(s[x * 3]);
+                    dp[1] = halfToFloat(s[x * 3 + 1]);
+                    dp[2] = halfToFloat(s[x * 3 + 2]);
+                }
+            }
+        }
+    });
+}
+
+void
+copyAlpha(const float* src, float* dst, int width, int height)
+{
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        const size_t first = static_cast<size_t>(firstRow) * width;
+        const size_t end = static_cast<size_t>(endRow) * width;
+        for (size_t i = first; i < end; i++) {
+            dst[i * 4 + 3] = src[i * 4 + 3];
+        }
+    });
+}
+
+} // namespace denoiser
+} // namespace moonray
+
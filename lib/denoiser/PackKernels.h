@@ -0,0 +1,218 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "Denoiser.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace moonray {
+namespace denoiser {
+
+// Conversion kernels between the caller's RGBA framebuffers and the tightly packed
+// RGB staging buffers used by the OIDN backend.  The instruction set is picked at
+// runtime from what the CPU supports, independently of the compile-time
+// MOONRAY_DENOISER_TARGET_ARCHITECTURE setting.
+
+enum class SimdLevel
+{
+    SCALAR,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+// Best instruction set supported by the running CPU (computed once)
+SimdLevel detectSimdLevel();
+const char* simdLevelName(SimdLevel level);
+
+// Conditioning of the beauty image while it is packed, see
+// DenoiserOptions::sanitizeInput and autoExposure.  The kernels that take one replace
+// NaN, infinite and negative RGB values with 0 if sanitize is set, and if meter is set
+// add the log2 mean luminance of the image's bins to the sums, see exposureScale().
+// Both happen on blocks of pixels right after they are packed, while they are still
+// in the cache.  Alpha is never touched.
+struct BeautyConditioning
+{
+    bool sanitize = false;
+    bool meter = false;
+
+    double log2LuminanceSum = 0;
+    uint64_t meteredBins = 0;
+
+    bool enabled() const { return sanitize || meter; }
+
+    // Scale that brings the metered log-average luminance to middle grey (0.18), as
+    // OIDN's auto-exposure computes its input scale: the image is cut into bins of at
+    // most 16x16 pixels spread evenly over it, and the log2 of the mean luminance of
+    // every bin brighter than 1e-8 is averaged.  1 if no bin was metered.
+    float exposureScale() const;
+};
+
+// Copies the RGB channels of width * height RGBA pixels into a packed RGB buffer.
+// Rows are processed in parallel.
+void packRGBAtoRGB(const float* src,  // RGBA
+                   float* dst,        // RGB
+                   int width,
+                   int height,
+                   BeautyConditioning* conditioning = nullptr);
+
+// Expands width * height packed RGB pixels into an RGBA buffer, taking alpha from
+// alphaSrc.  alphaSrc may be the same buffer as dst.  Rows are processed in parallel.
+void unpackRGBtoRGBA(const float* src,       // RGB
+                     const float* alphaSrc,  // RGBA
+                     float* dst,             // RGBA
+                     int width,
+                     int height);
+
+// Copies the RGB channels between two strided images (strides in bytes) and leaves
+// everything else in the destination, such as alpha, untouched.  Rows converting
+// between RGBA and packed RGB use the SIMD kernels.  Rows are processed in parallel.
+void copyStridedRGB(const float* src,
+                    size_t srcPixelStride,
+                    size_t srcRowStride,
+                    float* dst,
+                    size_t dstPixelStride,
+                    size_t dstRowStride,
+                    int width,
+                    int height);
+
+// An image in any ImageLayout with the default strides of an InputImage or
+// OutputImage resolved.  Views of input images are only read.
+struct ImageView
+{
+    float* data = nullptr;
+    ImageLayout layout = IMAGE_LAYOUT_LINEAR;
+    size_t pixelStride = 0;
+    size_t rowStride = 0;
+    size_t planeStride = 0;
+    int tileWidth = 1;
+    int tileHeight = 1;
+};
+
+// Views of width x height images
+ImageView imageView(const InputImage& image, int width, int height);
+ImageView imageView(const OutputImage& image, int width, int height);
+// View of a linear image
+ImageView imageView(const float* data, size_t pixelStride, size_t rowStride);
+
+// Copies the RGB channels of a width x height window at (srcX, srcY) in src to
+// (dstX, dstY) in dst, converting between the layouts on the way, and leaves
+// everything else in dst, such as alpha, untouched.  Runs of RGBA and packed RGB
+// pixels use the SIMD kernels.  Rows are processed in parallel.
+void copyImageRGB(const ImageView& src,
+                  int srcX,
+                  int srcY,
+                  const ImageView& dst,
+                  int dstX,
+                  int dstY,
+                  int width,
+                  int height,
+                  BeautyConditioning* conditioning = nullptr);
+
+// Conditions a width x height image in place.  With only metering it is just read.
+void conditionImage(const ImageView& image,
+                    int width,
+                    int height,
+                    BeautyConditioning* conditioning);
+
+// copyImageRGB() between a whole image and packed half RGB
+void copyImageRGBToHalf(const ImageView& src,
+                        uint16_t* dst,     // half RGB
+                        int width,
+                        int height,
+                        BeautyConditioning* conditioning = nullptr);
+void copyImageRGBFromHalf(const uint16_t* src, // half RGB
+                          const ImageView& dst,
+                          int width,
+                          int height);
+
+// Copies width * height RGBA pixels.  Rows are processed in parallel.
+void copyRGBA(const float* src,
+              float* dst,
+              int width,
+              int height,
+              BeautyConditioning* conditioning = nullptr);
+
+// Copies the alpha channel of width * height RGBA pixels.  Rows are processed in parallel.
+void copyAlpha(const float* src,  // RGBA
+               float* dst,        // RGBA
+               int width,
+               int height);
+
+// Half precision (IEEE 754 binary16, stored as uint16_t) variants.  Conversions
+// from float round to nearest even and clamp to the half range (+-65504).  Rows are
+// processed in parallel.
+void packRGBAtoRGBHalf(const float* src,  // float RGBA
+                       uint16_t* dst,     // half RGB
+                       int width,
+                       int height,
+                       BeautyConditioning* conditioning = nullptr);
+void unpackRGBHalftoRGBA(const uint16_t* src,   // half RGB
+                         const float* alphaSrc, // float RGBA, may be dst
+                         float* dst,            // float RGBA
+                         int width,
+                         int height);
+void packHalfRGBAtoRGB(const uint16_t* src,  // half RGBA
+                       uint16_t* dst,        // half RGB
+                       int width,
+                       int height,
+                       BeautyConditioning* conditioning = nullptr);
+void unpackHalfRGBtoRGBA(const uint16_t* src,      // half RGB
+                         const uint16_t* alphaSrc, // half RGBA, may be dst
+                         uint16_t* dst,            // half RGBA
+                         int width,
+                         int height);
+void convertFloatToHalf(const float* src,  // float RGBA
+                        uint16_t* dst,     // half RGBA
+                        int width,
+                        int height,
+                        BeautyConditioning* conditioning = nullptr);
+void convertHalfToFloat(const uint16_t* src, // half RGBA
+                        float* dst,          // float RGBA
+                        int width,
+                        int height);
+void copyAlphaHalf(const uint16_t* src,  // half RGBA
+                   uint16_t* dst,        // half RGBA
+                   int width,
+                   int height);
+// Copies width * height half RGBA pixels to dst while conditioning them.  dst may be
+// src, in which case the pixels are conditioned in place, or only read when metering.
+void conditionHalfRGBA(const uint16_t* src,
+                       uint16_t* dst,
+                       int width,
+                       int height,
+                       BeautyConditioning* conditioning);
+
+// copyStridedRGB() between a strided float image and packed half RGB
+void copyStridedRGBToHalf(const float* src,
+                          size_t srcPixelStride,
+                          size_t srcRowStride,
+                          uint16_t* dst,     // half RGB
+                          int width,
+                          int height);
+void copyStridedRGBFromHalf(const uint16_t* src, // half RGB
+                            float* dst,
+                            size_t dstPixelStride,
+                            size_t dstRowStride,
+                            int width,
+                            int height);
+
+// Single-threaded kernels for an explicit instruction set.  Used by the parallel
+// entry points above and exposed for benchmarking.  The level must be supported
+// by the running CPU.
+void packRGBAtoRGBSpan(SimdLevel level,
+                       const float* src,
+                       float* dst,
+                       size_t numPixels);
+void unpackRGBtoRGBASpan(SimdLevel level,
+                         const float* src,
+                         const float* alphaSrc,
+                         float* dst,
+                         size_t numPixels);
+
+} // namespace denoiser
+} // namespace moonray
+
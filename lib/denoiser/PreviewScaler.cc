@@ -0,0 +1,173 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "PreviewScaler.h"
+#include "GuideWeights.h"
+#include "RowRanges.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// Every tap keeps this fraction of its bilinear weight, so a pixel whose guides
+// match none of its preview neighbours (a feature thinner than a preview pixel)
+// falls back to bilinear instead of dividing by zero
+constexpr float sMinGuideWeight = 1e-3f;
+
+inline const float*
+pixelAt(const float* data, size_t pixelStride, size_t rowStride, int x, int y)
+{
+    return reinterpret_cast<const float*>(reinterpret_cast<const char*>(data) +
+                                          y * rowStride + x * pixelStride);
+}
+
+inline float*
+pixelAt(float* data, size_t pixelStride, size_t rowStride, int x, int y)
+{
+    return reinterpret_cast<float*>(reinterpret_cast<char*>(data) + y * rowStride + x * pixelStride);
+}
+
+// Preview samples on either side of a full-resolution row or column and the weight
+// of the second one
+struct Taps
+{
+    int i0;
+    int i1;
+    float t;
+};
+
+inline Taps
+previewTaps(int i, int scale, int previewSize)
+{
+    const float f = (i + 0.5f) / scale - 0.5f;
+    Taps taps;
+    taps.i0 = static_cast<int>(std::floor(f));
+    taps.t = f - taps.i0;
+    if (taps.i0 < 0) {
+        taps.i0 = 0;
+        taps.t = 0.f;
+    }
+    taps.i1 = std::min(taps.i0 + 1, previewSize - 1);
+    return taps;
+}
+
+} // namespace
+
+void
+downsampleToRGB(const float* src,
+                size_t srcPixelStride,
+                size_t srcRowStride,
+                int width,
+                int height,
+                int scale,
+                float* dst)
+{
+    const int previewWidth = previewSize(width, scale);
+    const int previewHeight = previewSize(height, scale);
+    forEachRowRange(width * scale, previewHeight, [&](int firstRow, int endRow) {
+        for (int py = firstRow; py < endRow; py++) {
+            const int y0 = py * scale;
+            const int y1 = std::min(y0 + scale, height);
+            float* out = dst + static_cast<size_t>(py) * previewWidth * 3;
+            for (int px = 0; px < previewWidth; px++) {
+                const int x0 = px * scale;
+                const int x1 = std::min(x0 + scale, width);
+                float r = 0.f, g = 0.f, b = 0.f;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        const float* p = pixelAt(src, srcPixelStride, srcRowStride, x, y);
+                        r += p[0];
+                        g += p[1];
+                        b += p[2];
+                    }
+                }
+                const float norm = 1.f / ((x1 - x0) * (y1 - y0));
+                out[px * 3 + 0] = r * norm;
+                out[px * 3 + 1] = g * norm;
+                out[px * 3 + 2] = b * norm;
+            }
+        }
+    });
+}
+
+void
+upsampleGuided(const float* src,
+               const float* previewAlbedo,
+               const float* previewNormals,
+               const float* albedo,
+               size_t albedoPixelStride,
+               size_t albedoRowStride,
+               const float* normals,
+               size_t normalsPixelStride,
+               size_t normalsRowStride,
+               int scale,
+               float* dst,
+               size_t dstPixelStride,
+               size_t dstRowStride,
+               int width,
+               int height)
+{
+    const int previewWidth = previewSize(width, scale);
+    const int previewHeight = previewSize(height, scale);
+    const bool useAlbedo = albedo && previewAlbedo;
+    const bool useNormals = normals && previewNormals;
+
+    // Every row uses the same column taps
+    std::vector<Taps> columns(width);
+    for (int x = 0; x < width; x++) {
+        columns[x] = previewTaps(x, scale, previewWidth);
+    }
+
+    forEachRowRange(width, height, [&](int firstRow, int endRow) {
+        for (int y = firstRow; y < endRow; y++) {
+            const Taps row = previewTaps(y, scale, previewHeight);
+            const int py[2] = { row.i0, row.i1 };
+            const float wy[2] = { 1.f - row.t, row.t };
+
+            for (int x = 0; x < width; x++) {
+                const int px[2] = { columns[x].i0, columns[x].i1 };
+                const float wx[2] = { 1.f - columns[x].t, columns[x].t };
+
+                const float* a = useAlbedo ?
+                    pixelAt(albedo, albedoPixelStride, albedoRowStride, x, y) : nullptr;
+                const float* n = useNormals ?
+                    pixelAt(normals, normalsPixelStride, normalsRowStride, x, y) : nullptr;
+                const float lengthN = useNormals ? n[0] * n[0] + n[1] * n[1] + n[2] * n[2] : 0.f;
+
+                float r = 0.f, g = 0.f, b = 0.f, weightSum = 0.f;
+                for (int j = 0; j < 2; j++) {
+                    for (int i = 0; i < 2; i++) {
+                        const size_t tap = (static_cast<size_t>(py[j]) * previewWidth + px[i]) * 3;
+                        float guide = 1.f;
+                        if (useAlbedo) {
+                            guide *= albedoWeight(a, previewAlbedo + tap, sAlbedoFalloff);
+                        }
+                        if (useNormals) {
+                            guide *= normalWeight(n, lengthN, previewNormals + tap);
+                        }
+                        const float w = wx[i] * wy[j] * (guide + sMinGuideWeight);
+                        r += w * src[tap + 0];
+                        g += w * src[tap + 1];
+                        b += w * src[tap + 2];
+                        weightSum += w;
+                    }
+                }
+
+                float* out = pixelAt(dst, dstPixelStride, dstRowStride, x, y);
+                const float norm = 1.f / weightSum;
+                out[0] = r * norm;
+                out[1] = g * norm;
+                out[2] = b * norm;
+            }
+        }
+    });
+}
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,56 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstddef>
+
+namespace moonray {
+namespace denoiser {
+
+// Resampling for reduced-resolution preview denoising.  The inputs are box filtered
+// down to 1/scale resolution, denoised there, and the result is brought back to full
+// resolution with a joint bilateral upsample that takes its edges from the
+// full-resolution albedo and normals.  Strides are in bytes.
+
+// Size of the reduced image
+inline int previewSize(int size, int scale) { return (size + scale - 1) / scale; }
+
+// Averages the RGB channels of scale x scale blocks of a width x height image into a
+// packed RGB image of previewSize(width) x previewSize(height) pixels.  Blocks at the
+// right and bottom edges average the pixels they cover.  Rows are processed in
+// parallel.
+void downsampleToRGB(const float* src,
+                     size_t srcPixelStride,
+                     size_t srcRowStride,
+                     int width,
+                     int height,
+                     int scale,
+                     float* dst); // packed RGB
+
+// Writes the RGB channels of a width x height image upsampled from the packed RGB
+// preview src.  Each pixel blends the four nearest preview pixels with bilinear
+// weights, scaled down where the preview pixel's albedo or normal differs from the
+// pixel's own, so edges follow the full-resolution guides instead of the preview
+// grid.  previewAlbedo/previewNormals are the downsampled guides (packed RGB) and
+// albedo/normals the full-resolution ones; a null pair is not used, and with
+// neither this is a plain bilinear upsample.  Rows are processed in parallel.
+void upsampleGuided(const float* src, // packed RGB
+                    const float* previewAlbedo,
+                    const float* previewNormals,
+                    const float* albedo,
+                    size_t albedoPixelStride,
+                    size_t albedoRowStride,
+                    const float* normals,
+                    size_t normalsPixelStride,
+                    size_t normalsRowStride,
+                    int scale,
+                    float* dst,
+                    size_t dstPixelStride,
+                    size_t dstRowStride,
+                    int width,
+                    int height);
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,36 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <cstddef>
+
+namespace moonray {
+namespace denoiser {
+
+// Rows are handed out to tasks in chunks of at least this many pixels so the
+// scheduling overhead stays small next to the work on them
+constexpr size_t sMinPixelsPerTask = 16384;
+
+// Calls func(firstRow, endRow) for chunks of rows of a width x height image in
+// parallel.  Chunks hold at least minRows rows where the image has them, for work
+// that has to redo some rows at the edges of every chunk.
+template <typename Func>
+void
+forEachRowRange(int width, int height, const Func& func, int minRows = 1)
+{
+    // Ranges are only split in halves while they are larger than the grain
+    const size_t minGrain = minRows > 1 ? 2 * static_cast<size_t>(minRows) : 1;
+    const size_t rowsPerTask = std::max(minGrain, sMinPixelsPerTask / std::max(width, 1));
+    tbb::parallel_for(tbb::blocked_range<int>(0, height, rowsPerTask),
+        [&](const tbb::blocked_range<int>& rows) {
+            func(rows.begin(), rows.end());
+        });
+}
+
+} // namespace denoiser
+} // namespace moonray
@@ -0,0 +1,175 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TemporalStabilizer.h"
+#include "GuideWeights.h"
+#include "PackKernels.h"
+#include "RowRanges.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+void
+TemporalStabilizer::apply(int width,
+                          int height,
+                          const float *albedo,
+                          const float *normals,
+                          const float *motion,
+                          float blend,
+                          float *output)
+{
+    const size_t numFloats = static_cast<size_t>(width) * height * 3;
+    mCurrent.resize(numFloats);
+    packRGBAtoRGB(output, mCurrent.data(), width, height);
+
+    if (mValid && width == mWidth && height == mHeight) {
+        mResult.resize(numFloats);
+        const bool useAlbedo = albedo && !mAlbedo.empty();
+        const bool useNormals = normals && !mNormals.empty();
+
+        const size_t rowFloats = static_cast<size_t>(width) * 3;
+        forEachRowRange(width, height, [&](int firstRow, int endRow) {
+            // Row scratch.  The min/max and blend loops run over contiguous packed RGB
+            // so they vectorize; only the reprojection gathers pixel by pixel.
+            std::vector<float> rowMin[3], rowMax[3];
+            for (int i = 0; i < 3; i++) {
+                rowMin[i].resize(rowFloats);
+                rowMax[i].resize(rowFloats);
+            }
+            std::vector<float> lo(rowFloats), hi(rowFloats), history(rowFloats), alpha(rowFloats);
+
+            // Horizontal 3-pixel min/max of a row of mCurrent into slot
+            auto horizontal = [&](int y, int slot) {
+                const float *row = &mCurrent[static_cast<size_t>(y) * rowFloats];
+                float *mn = rowMin[slot].data();
+                float *mx = rowMax[slot].data();
+                for (size_t k = 0; k < rowFloats; k++) {
+                    const float left = row[k >= 3 ? k - 3 : k];
+                    const float right = row[k + 3 < rowFloats ? k + 3 : k];
+                    mn[k] = std::min(std::min(left, row[k]), right);
+                    mx[k] = std::max(std::max(left, row[k]), right);
+                }
+            };
+            for (int y = std::max(firstRow - 1, 0); y <= std::min(firstRow, height - 1); y++) {
+                horizontal(y, (y + 3) % 3);
+            }
+
+            for (int y = firstRow; y < endRow; y++) {
+                if (y + 1 < height) {
+                    horizontal(y + 1, (y + 1) % 3);
+                }
+                const int above = (std::max(y - 1, 0)) % 3;
+                const int below = (std::min(y + 1, height - 1)) % 3;
+                const int middle = y % 3;
+                for (size_t k = 0; k < rowFloats; k++) {
+                    lo[k] = std::min(std::min(rowMin[above][k], rowMin[middle][k]), rowMin[below][k]);
+                    hi[k] = std::max(std::max(rowMax[above][k], rowMax[middle][k]), rowMax[below][k]);
+                }
+
+                // Bilinear lookup of the history at the previous position.  Each tap is
+                // weighted by how well its guides match the current pixel's, and the
+                // fraction of weight that survives is the confidence.
+                for (int x = 0; x < width; x++) {
+                    const size_t pixel = static_cast<size_t>(y) * width + x;
+                    const float hx = x + (motion ? motion[pixel * 2] : 0.f);
+                    const float hy = y + (motion ? motion[pixel * 2 + 1] : 0.f);
+                    float h[3] = { 0.f, 0.f, 0.f };
+                    float confidence = 0.f;
+                    if (hx > -0.5f && hx < width - 0.5f && hy > -0.5f && hy < height - 0.5f) {
+                        const int x0 = static_cast<int>(std::floor(hx));
+                        const int y0 = static_cast<int>(std::floor(hy));
+                        const float tx = hx - x0;
+                        const float ty = hy - y0;
+                        const float *a = useAlbedo ? albedo + pixel * 4 : nullptr;
+                        const float *n = useNormals ? normals + pixel * 4 : nullptr;
+                        const float lengthN = n ? n[0] * n[0] + n[1] * n[1] + n[2] * n[2] : 0.f;
+
+                        float bilinearSum = 0.f;
+                        float weightSum = 0.f;
+                        for (int j = 0; j < 2; j++) {
+                            const int tapY = y0 + j;
+                            const float wy = j ? ty : 1.f - ty;
+                            if (tapY < 0 || tapY >= height || wy == 0.f) continue;
+                            for (int i = 0; i < 2; i++) {
+                                const int tapX = x0 + i;
+                                const float wx = i ? tx : 1.f - tx;
+                                if (tapX < 0 || tapX >= width || wx == 0.f) continue;
+                                const size_t tap = (static_cast<size_t>(tapY) * width + tapX) * 3;
+                                float w = wx * wy;
+                                bilinearSum += w;
+                                if (a) w *= albedoWeight(a, &mAlbedo[tap], sAlbedoFalloff);
+                                if (n) w *= normalWeight(n, lengthN, &mNormals[tap]);
+                                h[0] += w * mHistory[tap + 0];
+                                h[1] += w * mHistory[tap + 1];
+                                h[2] += w * mHistory[tap + 2];
+                                weightSum += w;
+                            }
+                        }
+                        if (weightSum > 0.f) {
+                            const float norm = 1.f / weightSum;
+                            h[0] *= norm;
+                            h[1] *= norm;
+                            h[2] *= norm;
+                            confidence = weightSum / bilinearSum;
+                        }
+                    }
+                    const float pixelAlpha = blend * confidence;
+                    for (int c = 0; c < 3; c++) {
+                        history[x * 3 + c] = h[c];
+                        alpha[x * 3 + c] = pixelAlpha;
+                    }
+                }
+
+                // Clamp the history to the neighbourhood range and blend
+                const float *current = &mCurrent[static_cast<size_t>(y) * rowFloats];
+                float *result = &mResult[static_cast<size_t>(y) * rowFloats];
+                for (size_t k = 0; k < rowFloats; k++) {
+                    const float clamped = std::min(std::max(history[k], lo[k]), hi[k]);
+                    result[k] = current[k] + alpha[k] * (clamped - current[k]);
+                }
+                float *out = output + static_cast<size_t>(y) * width * 4;
+                for (int x = 0; x < width; x++) {
+                    out[x * 4 + 0] = result[x * 3 + 0];
+                    out[x * 4 + 1] = result[x * 3 + 1];
+                    out[x * 4 + 2] = result[x * 3 + 2];
+                }
+            }
+        });
+        mHistory.swap(mResult);
+    } else {
+        mHistory.swap(mCurrent);
+    }
+
+    // Guides of this frame for rejecting the history next frame
+    if (albedo) {
+        mAlbedo.resize(numFloats);
+        packRGBAtoRGB(albedo, mAlbedo.data(), width, height);
+    } else {
+        mAlbedo.clear();
+    }
+    if (normals) {
+        mNormals.resize(numFloats);
+        packRGBAtoRGB(normals, mNormals.data(), width, height);
+    } else {
+        mNormals.clear();
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mValid = true;
+}
+
+size_t
+TemporalStabilizer::bytesAllocated() const
+{
+    return (mCurrent.capacity() + mHistory.capacity() + mResult.capacity() +
+            mAlbedo.capacity() + mNormals.capacity()) * sizeof(float);
+}
+
+} // namespace denoiser
+} // namespace moonray
+
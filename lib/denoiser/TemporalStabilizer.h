@@ -0,0 +1,57 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+// Removes frame-to-frame flicker from a sequence of denoised frames.  The previous
+// result is reprojected along per-pixel motion vectors and blended into the current
+// one.  History is rejected where the reprojected guides disagree with the current
+// ones (disocclusions, fast shading changes) and clamped to the range of the current
+// pixel's neighbourhood so it cannot ghost.  Keeps the previous result and guides as
+// packed RGB.
+
+class TemporalStabilizer
+{
+public:
+    TemporalStabilizer() : mWidth(0), mHeight(0), mValid(false) {}
+
+    // Stabilizes the RGB channels of output (RGBA, the denoised current frame) in
+    // place and records the result as the history for the next frame.  albedo and
+    // normals are RGBA and may be null.  motion holds two floats per pixel, the offset
+    // in pixels from each pixel to where its surface was in the previous frame; null
+    // means no motion.  blend is the weight of fully accepted history.  The first
+    // frame, and any frame of a different size than the last, passes through.
+    void apply(int width,
+               int height,
+               const float *albedo,
+               const float *normals,
+               const float *motion,
+               float blend,
+               float *output);
+
+    // Forgets the history, e.g. at a camera cut
+    void reset() { mValid = false; }
+
+    size_t bytesAllocated() const;
+
+private:
+    int mWidth;
+    int mHeight;
+    bool mValid;
+
+    std::vector<float> mCurrent;  // this frame before blending
+    std::vector<float> mHistory;  // previous result
+    std::vector<float> mResult;   // this frame's result, swapped into mHistory
+    std::vector<float> mAlbedo;   // previous guides, empty if not given
+    std::vector<float> mNormals;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,318 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TiledDenoiserImpl.h"
+#include "PackKernels.h"
+
+#include <scene_rdl2/render/logging/logging.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace moonray {
+namespace denoiser {
+
+namespace {
+
+// Tile dimensions are kept to multiples of this so they line up with the
+// downsampling levels of the networks.
+constexpr int sTileAlignment = 16;
+
+// Origin of the tile that outputs the region starting at regionStart, padded by
+// overlap and kept inside the image
+int
+tileOrigin(int regionStart, int overlap, int tileSize, int imageSize)
+{
+    return std::max(0, std::min(regionStart - overlap, imageSize - tileSize));
+}
+
+} // namespace
+
+TiledDenoiserImpl::TiledDenoiserImpl(int width,
+                                     int height,
+                                     bool useAlbedo,
+                                     bool useNormals,
+                                     const DenoiserOptions& options,
+                                     std::unique_ptr<DenoiserImpl> tileImpl,
+                                     std::string* errorMsg) :
+    DenoiserImpl(width, height, useAlbedo, useNormals),
+    mMemoryBudget(options.memoryBudget),
+    mLowMemory(options.lowMemory),
+    mTileImpl(std::move(tileImpl))
+{
+    setInputConditioning(options);
+    // Every tile brings different guides
+    mTileImpl->setGuideTracking(false);
+    setupTiles(errorMsg);
+}
+
+bool
+TiledDenoiserImpl::reconfigure(int width,
+                               int height,
+                               bool useAlbedo,
+                               bool useNormals,
+                               std::string* errorMsg)
+{
+    int tileWidth, tileHeight;
+    chooseTileSize(width, height, useAlbedo, useNormals, mMemoryBudget, &tileWidth, &tileHeight);
+    if (!mTileImpl->reconfigure(tileWidth, tileHeight, useAlbedo, useNormals, errorMsg)) {
+        return false;
+    }
+    if (!errorMsg->empty()) {
+        return true;
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mUseAlbedo = useAlbedo;
+    mUseNormals = useNormals;
+    setupTiles(errorMsg);
+    return true;
+}
+
+void
+TiledDenoiserImpl::setupTiles(std::string* errorMsg)
+{
+    const int tileWidth = mTileImpl->imageWidth();
+    const int tileHeight = mTileImpl->imageHeight();
+    mOverlap = mTileImpl->tileOverlap();
+
+    // No padding is needed along a dimension the tile already spans completely
+    mStepX = tileWidth == mWidth ? mWidth : tileWidth - 2 * mOverlap;
+    mStepY = tileHeight == mHeight ? mHeight : tileHeight - 2 * mOverlap;
+    if (mStepX <= 0 || mStepY <= 0) {
+        *errorMsg = "Memory budget too small for tiles of " + std::to_string(tileWidth) + "x" +
+                    std::to_string(tileHeight) + " with an overlap of " + std::to_string(mOverlap);
+        return;
+    }
+
+    scene_rdl2::logging::Logger::info("Denoising in ", tileWidth, "x", tileHeight, " tiles with ",
+                                      mOverlap, " pixels of overlap");
+
+    allocateTiles();
+}
+
+void
+TiledDenoiserImpl::allocateTiles()
+{
+    const size_t tileFloats = static_cast<size_t>(mTileImpl->imageWidth()) * mTileImpl->imageHeight() * 4;
+    mTileBeauty.resize(tileFloats);
+    mTileOutput.resize(mLowMemory ? 0 : tileFloats);
+    mTileAlbedo.resize(mUseAlbedo ? tileFloats : 0);
+    mTileNormals.resize(mUseNormals ? tileFloats : 0);
+}
+
+void
+TiledDenoiserImpl::releaseMemory()
+{
+    std::vector<float>().swap(mTileBeauty);
+    std::vector<float>().swap(mTileAlbedo);
+    std::vector<float>().swap(mTileNormals);
+    std::vector<float>().swap(mTileOutput);
+    std::vector<HeldRow>().swap(mHeldRows);
+    mTileImpl->releaseMemory();
+}
+
+void
+TiledDenoiserImpl::setQuality(DenoiserQuality quality, std::string* errorMsg)
+{
+    const int overlap = mTileImpl->tileOverlap();
+    mTileImpl->setQuality(quality, errorMsg);
+    // Tiers may differ in their receptive field
+    if (errorMsg->empty() && mTileImpl->tileOverlap() != overlap) {
+        setupTiles(errorMsg);
+    }
+}
+
+void
+TiledDenoiserImpl::accumulateStats(DenoiserStats* stats) const
+{
+    DenoiserImpl::accumulateStats(stats);
+    mTileImpl->accumulateStats(stats);
+}
+
+void
+TiledDenoiserImpl::resetStats()
+{
+    DenoiserImpl::resetStats();
+    mTileImpl->resetStats();
+}
+
+size_t
+TiledDenoiserImpl::stagingBytes() const
+{
+    size_t held = 0;
+    for (const HeldRow& row : mHeldRows) {
+        held += row.rgb.capacity();
+    }
+    return (mTileBeauty.capacity() + mTileAlbedo.capacity() + mTileNormals.capacity() +
+            mTileOutput.capacity() + held) * sizeof(float);
+}
+
+void
+TiledDenoiserImpl::chooseTileSize(int width,
+                                  int height,
+                                  bool useAlbedo,
+                                  bool useNormals,
+                                  size_t memoryBudget,
+                                  int* tileWidth,
+                                  int* tileHeight)
+{
+    // RGBA float tile buffers for beauty and output plus the optional guides
+    const size_t bytesPerPixel = 4 * sizeof(float) * (2 + useAlbedo + useNormals);
+    const size_t maxPixels = memoryBudget / 2 / bytesPerPixel;
+
+    *tileWidth = width;
+    *tileHeight = height;
+    if (maxPixels >= static_cast<size_t>(width) * height) {
+        return;
+    }
+
+    auto align = [](size_t size) {
+        return static_cast<int>(std::max<size_t>(sTileAlignment, size / sTileAlignment * sTileAlignment));
+    };
+
+    // Prefer square tiles, but use the full width or height when that is the
+    // smaller dimension so the image is only split in one direction
+    const int side = align(static_cast<size_t>(std::sqrt(static_cast<double>(maxPixels))));
+    if (side >= width) {
+        *tileHeight = std::min(height, align(maxPixels / width));
+    } else if (side >= height) {
+        *tileWidth = std::min(width, align(maxPixels / height));
+    } else {
+        *tileWidth = side;
+        *tileHeight = side;
+    }
+}
+
+void
+TiledDenoiserImpl::denoise(const float *inputBeauty,
+                           const float *inputAlbedo,
+                           const float *inputNormals,
+                           float *output,
+                           std::string* errorMsg)
+{
+    denoiseStrided({inputBeauty}, {inputAlbedo}, {inputNormals}, {output}, errorMsg);
+    if (errorMsg->empty() && output != inputBeauty) {
+        PhaseTimer timer(&mTimes.unpack);
+        copyAlpha(inputBeauty, output, mWidth, mHeight);
+    }
+}
+
+void
+TiledDenoiserImpl::flushHeldRows(int tileRow, const OutputImage& output)
+{
+    const size_t heldPixelStride = 3 * sizeof(float);
+    const ImageView outputView = imageView(output, mWidth, mHeight);
+
+    PhaseTimer timer(&mTimes.unpack);
+    for (HeldRow& row : mHeldRows) {
+        if (row.rgb.empty() || row.y + row.height > tileRow) {
+            continue;
+        }
+        copyImageRGB(imageView(row.rgb.data(), heldPixelStride, mWidth * heldPixelStride), 0, 0,
+                     outputView, 0, row.y,
+                     mWidth, row.height);
+        row.rgb.clear();
+    }
+}
+
+void
+TiledDenoiserImpl::denoiseStrided(const InputImage& beauty,
+                                  const InputImage& albedo,
+                                  const InputImage& normals,
+                                  const OutputImage& output,
+                                  std::string* errorMsg)
+{
+    if (mTileBeauty.empty()) {
+        allocateTiles();
+    }
+
+    const int tileWidth = mTileImpl->imageWidth();
+    const int tileHeight = mTileImpl->imageHeight();
+    const size_t tilePixelStride = 4 * sizeof(float);
+    const size_t tileRowStride = tileWidth * tilePixelStride;
+    float *tileOutput = mLowMemory ? mTileBeauty.data() : mTileOutput.data();
+
+    const ImageView beautyView = imageView(beauty, mWidth, mHeight);
+    const ImageView albedoView = imageView(albedo, mWidth, mHeight);
+    const ImageView normalsView = imageView(normals, mWidth, mHeight);
+    if (mTileImpl->autoExposes()) {
+        // Tiles metered on their own would each get a different exposure, which shows
+        // as seams
+        PhaseTimer timer(&mTimes.pack);
+        mTileImpl->setExposure(meterExposure(beautyView));
+    }
+    auto gather = [&](const ImageView& image, std::vector<float>& tile, int tx, int ty) {
+        copyImageRGB(image, tx, ty, imageView(tile.data(), tilePixelStride, tileRowStride), 0, 0,
+                     tileWidth, tileHeight);
+    };
+
+    // Denoising in place, the padding of a tile would read pixels the tiles above it
+    // already wrote, so the regions are held back a row of tiles at a time
+    const bool inPlace = output.data == beauty.data;
+    const size_t heldPixelStride = 3 * sizeof(float);
+
+    for (int y = 0; y < mHeight; y += mStepY) {
+        const int ty = tileOrigin(y, mOverlap, tileHeight, mHeight);
+        const int regionHeight = std::min(mStepY, mHeight - y);
+
+        // The target of this row's regions: the output, or a free held row
+        ImageView regionRows = imageView(output, mWidth, mHeight);
+        int regionY = y;
+        if (inPlace) {
+            auto held = std::find_if(mHeldRows.begin(), mHeldRows.end(),
+                                     [](const HeldRow& row) { return row.rgb.empty(); });
+            if (held == mHeldRows.end()) {
+                held = mHeldRows.insert(mHeldRows.end(), HeldRow());
+            }
+            held->y = y;
+            held->height = regionHeight;
+            held->rgb.resize(static_cast<size_t>(mWidth) * regionHeight * 3);
+            regionRows = imageView(held->rgb.data(), heldPixelStride, mWidth * heldPixelStride);
+            regionY = 0;
+        }
+
+        for (int x = 0; x < mWidth; x += mStepX) {
+            const int tx = tileOrigin(x, mOverlap, tileWidth, mWidth);
+            const int regionWidth = std::min(mStepX, mWidth - x);
+
+            {
+                PhaseTimer timer(&mTimes.pack);
+                gather(beautyView, mTileBeauty, tx, ty);
+                if (mUseAlbedo) gather(albedoView, mTileAlbedo, tx, ty);
+                if (mUseNormals) gather(normalsView, mTileNormals, tx, ty);
+                mBytesUploaded += (1 + mUseAlbedo + mUseNormals) * tileWidth * tileHeight * tilePixelStride;
+            }
+
+            mTileImpl->denoise(mTileBeauty.data(),
+                               mUseAlbedo ? mTileAlbedo.data() : nullptr,
+                               mUseNormals ? mTileNormals.data() : nullptr,
+                               tileOutput,
+                               errorMsg);
+            if (!errorMsg->empty()) {
+                for (HeldRow& row : mHeldRows) {
+                    row.rgb.clear();
+                }
+                return;
+            }
+
+            // Write back only the unpadded region
+            PhaseTimer timer(&mTimes.unpack);
+            copyImageRGB(imageView(tileOutput, tilePixelStride, tileRowStride), x - tx, y - ty,
+                         regionRows, x, regionY,
+                         regionWidth, regionHeight);
+            mBytesDownloaded += regionWidth * regionHeight * tilePixelStride;
+        }
+
+        if (inPlace) {
+            const int next = y + mStepY;
+            flushHeldRows(next < mHeight ? tileOrigin(next, mOverlap, tileHeight, mHeight) : mHeight,
+                          output);
+        }
+    }
+}
+
+} // namespace denoiser
+} // namespace moonray
+
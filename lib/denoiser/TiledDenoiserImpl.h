@@ -0,0 +1,108 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "DenoiserImpl.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+
+// Denoises a frame by streaming overlapping tiles through a backend that was created
+// at the tile size, so that peak memory follows the tile size instead of the frame
+// size.  Each tile is padded by the backend's tileOverlap() on every side that is not
+// an image edge and only the unpadded region is written to the output.
+
+class TiledDenoiserImpl : public DenoiserImpl
+{
+public:
+    // tileImpl must have been created with dimensions from chooseTileSize() for
+    // options.memoryBudget
+    TiledDenoiserImpl(int width,
+                      int height,
+                      bool useAlbedo,
+                      bool useNormals,
+                      const DenoiserOptions& options,
+                      std::unique_ptr<DenoiserImpl> tileImpl,
+                      std::string* errorMsg);
+
+    void denoise(const float *inputBeauty,  // RGBA
+                 const float *inputAlbedo,  // RGBA
+                 const float *inputNormals, // RGBA
+                 float *output,       // RGBA
+                 std::string* errorMsg) override;
+
+    void denoiseStrided(const InputImage& beauty,
+                        const InputImage& albedo,
+                        const InputImage& normals,
+                        const OutputImage& output,
+                        std::string* errorMsg) override;
+
+    bool reconfigure(int width,
+                     int height,
+                     bool useAlbedo,
+                     bool useNormals,
+                     std::string* errorMsg) override;
+
+    int tileOverlap() const override { return mTileImpl->tileOverlap(); }
+    std::shared_ptr<SharedOIDNDevice> oidnDevice() const override { return mTileImpl->oidnDevice(); }
+    bool autoExposes() const override { return mTileImpl->autoExposes(); }
+    void setQuality(DenoiserQuality quality, std::string* errorMsg) override;
+    void warmUp(std::string* errorMsg) override { mTileImpl->warmUp(errorMsg); }
+    void releaseMemory() override;
+
+    void accumulateStats(DenoiserStats* stats) const override;
+    void resetStats() override;
+
+    // Half of the budget goes to the tile staging buffers, the other half is left for
+    // the backend's working memory.  Returns the full frame size if it fits.
+    static void chooseTileSize(int width,
+                               int height,
+                               bool useAlbedo,
+                               bool useNormals,
+                               size_t memoryBudget,
+                               int* tileWidth,
+                               int* tileHeight);
+
+protected:
+    size_t stagingBytes() const override;
+
+private:
+    void setupTiles(std::string* errorMsg);
+    void allocateTiles();
+    // Writes the held rows that no tile from tileRow on reads to the output
+    void flushHeldRows(int tileRow, const OutputImage& output);
+
+    // A region row of an in-place denoise, held back until no later tile reads the
+    // input under it
+    struct HeldRow
+    {
+        int y;
+        int height;
+        std::vector<float> rgb; // packed
+    };
+
+    size_t mMemoryBudget;
+    bool mLowMemory;
+    std::unique_ptr<DenoiserImpl> mTileImpl;
+    int mOverlap;
+    int mStepX; // size of the region each tile outputs
+    int mStepY;
+
+    // Fixed-size RGBA tile buffers, reused for every tile so the backend bindings
+    // never change.  In low memory mode the backend denoises mTileBeauty in place and
+    // there is no mTileOutput.
+    std::vector<float> mTileBeauty;
+    std::vector<float> mTileAlbedo;
+    std::vector<float> mTileNormals;
+    std::vector<float> mTileOutput;
+    std::vector<HeldRow> mHeldRows;
+};
+
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,680 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestDenoiser.h"
+
+#include <mcrt_denoise/denoiser/Denoiser.h>
+#include <mcrt_denoise/denoiser/PackKernels.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+namespace {
+
+// Not multiples of any SIMD width or row block, so every kernel runs its tail code
+const int sWidth = 250;
+const int sHeight = 170;
+
+// Fits tiles of about 90x90 pixels with both guides
+const size_t sTiledBudget = 1 << 20;
+
+// Exposure scale of OIDN's auto-exposure, computed the slow way: bins of at most 16x16
+// pixels spread evenly over the image, the mean luminance of each with the channels
+// clamped at 0, and middle grey over the exponential of the mean log2 of the bins
+// brighter than 1e-8
+float
+binnedExposure(const std::vector<float>& rgba, int width, int height)
+{
+    const int binsX = (width + 15) / 16;
+    const int binsY = (height + 15) / 16;
+    double log2Sum = 0;
+    int count = 0;
+    for (int by = 0; by < binsY; by++) {
+        for (int bx = 0; bx < binsX; bx++) {
+            const int x0 = bx * width / binsX;
+            const int x1 = (bx + 1) * width / binsX;
+            const int y0 = by * height / binsY;
+            const int y1 = (by + 1) * height / binsY;
+            double sum = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    const float* p = &rgba[(static_cast<size_t>(y) * width + x) * 4];
+                    auto clamp = [](float v) { return v > 0.f ? v : 0.f; };
+                    sum += 0.212671 * clamp(p[0]) + 0.715160 * clamp(p[1]) + 0.072169 * clamp(p[2]);
+                }
+            }
+            const double l = sum / ((x1 - x0) * (y1 - y0));
+            if (l > 1e-8) {
+                log2Sum += std::log2(l);
+                count++;
+            }
+        }
+    }
+    return count ? static_cast<float>(0.18 / std::exp2(log2Sum / count)) : 1.f;
+}
+
+// Checked-in golden statistics of one denoise, see imageStatistics()
+struct GoldenStatistics
+{
+    int oidnVersion = 0; // that recorded them
+    std::vector<double> values;
+};
+
+// Reads "<name> <OIDN version> <statistics...>" lines, skipping blank lines and #
+// comments
+std::map<std::string, GoldenStatistics>
+readGoldens(const std::string& path)
+{
+    std::map<std::string, GoldenStatistics> goldens;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        GoldenStatistics golden;
+        if (!(fields >> name >> golden.oidnVersion)) {
+            continue;
+        }
+        double value;
+        while (fields >> value) {
+            golden.values.push_back(value);
+        }
+        goldens[name] = golden;
+    }
+    return goldens;
+}
+
+// Adds or replaces one entry, keeping the comments and the other entries
+void
+recordGolden(const std::string& path, const std::string& name, const GoldenStatistics& golden)
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.compare(0, name.size() + 1, name + " ") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+    std::ostringstream entry;
+    entry << name << ' ' << golden.oidnVersion << std::setprecision(9);
+    for (double value : golden.values) {
+        entry << ' ' << value;
+    }
+    lines.push_back(entry.str());
+
+    std::ofstream file(path);
+    for (const std::string& line : lines) {
+        file << line << '\n';
+    }
+}
+
+// RGBA pixels of region, row by row
+std::vector<float>
+crop(const std::vector<float>& image, const DenoiseRegion& region)
+{
+    std::vector<float> pixels;
+    for (int y = region.y0; y < region.y1; y++) {
+        const auto row = image.begin() + (static_cast<size_t>(y) * sWidth + region.x0) * 4;
+        pixels.insert(pixels.end(), row, row + (region.x1 - region.x0) * 4);
+    }
+    return pixels;
+}
+
+// True if a and b are the same outside region
+bool
+sameOutside(const std::vector<float>& a, const std::vector<float>& b, const DenoiseRegion& region)
+{
+    for (int y = 0; y < sHeight; y++) {
+        for (int x = 0; x < sWidth; x++) {
+            const bool inside = x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1;
+            const size_t i = (static_cast<size_t>(y) * sWidth + x) * 4;
+            if (!inside && std::memcmp(&a[i], &b[i], 4 * sizeof(float))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+void
+TestDenoiser::setUp()
+{
+    mImages = makeTestImages(sWidth, sHeight);
+}
+
+void
+TestDenoiser::tearDown()
+{
+}
+
+void
+TestDenoiser::testPackKernels()
+{
+    const std::vector<float>& rgba = mImages.beauty;
+    const size_t numPixels = static_cast<size_t>(sWidth) * sHeight;
+
+    std::vector<float> expectedRGB(numPixels * 3);
+    for (size_t i = 0; i < numPixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            expectedRGB[i * 3 + c] = rgba[i * 4 + c];
+        }
+    }
+
+    for (SimdLevel level : { SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+        if (level > detectSimdLevel()) break;
+        const std::string name = simdLevelName(level);
+
+        // Odd pixel counts leave a different tail for every vector width
+        for (size_t count : { numPixels, numPixels - 1, size_t(7), size_t(1) }) {
+            std::vector<float> rgb(count * 3, -1.f);
+            packRGBAtoRGBSpan(level, rgba.data(), rgb.data(), count);
+            CPPUNIT_ASSERT_MESSAGE(name + " pack",
+                std::equal(rgb.begin(), rgb.end(), expectedRGB.begin()));
+
+            std::vector<float> result(count * 4, -1.f);
+            unpackRGBtoRGBASpan(level, rgb.data(), mImages.clean.data(), result.data(), count);
+            for (size_t i = 0; i < count; i++) {
+                for (size_t c = 0; c < 3; c++) {
+                    CPPUNIT_ASSERT_MESSAGE(name + " unpack", result[i * 4 + c] == rgba[i * 4 + c]);
+                }
+                CPPUNIT_ASSERT_MESSAGE(name + " unpack alpha",
+                                       result[i * 4 + 3] == mImages.clean[i * 4 + 3]);
+            }
+        }
+    }
+
+    // Parallel entry points, unpacking over the alpha source
+    std::vector<float> rgb(numPixels * 3);
+    packRGBAtoRGB(rgba.data(), rgb.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(rgb == expectedRGB);
+    std::vector<float> result = mImages.clean;
+    unpackRGBtoRGBA(rgb.data(), result.data(), result.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(maxDifferenceRGB(result, rgba) == 0.f);
+    CPPUNIT_ASSERT(sameAlpha(result, mImages.clean));
+
+    // Strided copies leave the destination's alpha alone
+    std::vector<float> strided(numPixels * 4, -1.f);
+    copyStridedRGB(rgb.data(), 3 * sizeof(float), sWidth * 3 * sizeof(float),
+                   strided.data(), 4 * sizeof(float), sWidth * 4 * sizeof(float),
+                   sWidth, sHeight);
+    CPPUNIT_ASSERT(maxDifferenceRGB(strided, rgba) == 0.f);
+    for (size_t i = 3; i < strided.size(); i += 4) {
+        CPPUNIT_ASSERT(strided[i] == -1.f);
+    }
+}
+
+void
+TestDenoiser::testHalfPackKernels()
+{
+    const std::vector<float>& rgba = mImages.beauty;
+    const size_t numPixels = static_cast<size_t>(sWidth) * sHeight;
+
+    std::vector<uint16_t> rgbHalf(numPixels * 3);
+    packRGBAtoRGBHalf(rgba.data(), rgbHalf.data(), sWidth, sHeight);
+    for (size_t i = 0; i < numPixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            CPPUNIT_ASSERT(rgbHalf[i * 3 + c] == floatToHalf(rgba[i * 4 + c]));
+        }
+    }
+
+    std::vector<float> result = mImages.clean;
+    unpackRGBHalftoRGBA(rgbHalf.data(), result.data(), result.data(), sWidth, sHeight);
+    for (size_t i = 0; i < numPixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            CPPUNIT_ASSERT(result[i * 4 + c] == halfToFloat(rgbHalf[i * 3 + c]));
+        }
+    }
+    CPPUNIT_ASSERT(sameAlpha(result, mImages.clean));
+
+    // Half RGBA round trip, which is exact for values that are already halves
+    std::vector<uint16_t> rgbaHalf(numPixels * 4);
+    convertFloatToHalf(rgba.data(), rgbaHalf.data(), sWidth, sHeight);
+    std::vector<float> asFloat(numPixels * 4);
+    convertHalfToFloat(rgbaHalf.data(), asFloat.data(), sWidth, sHeight);
+    std::vector<uint16_t> roundTrip(numPixels * 4);
+    convertFloatToHalf(asFloat.data(), roundTrip.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(roundTrip == rgbaHalf);
+
+    // Half RGBA <-> half RGB
+    std::vector<uint16_t> packed(numPixels * 3);
+    packHalfRGBAtoRGB(rgbaHalf.data(), packed.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(packed == rgbHalf);
+    std::vector<uint16_t> unpacked(numPixels * 4, 0);
+    copyAlphaHalf(rgbaHalf.data(), unpacked.data(), sWidth, sHeight);
+    unpackHalfRGBtoRGBA(packed.data(), unpacked.data(), unpacked.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(unpacked == rgbaHalf);
+}
+
+void
+TestDenoiser::testExposureMetering()
+{
+    // A black corner, whose bins are left out, and a few bad samples, which count as 0
+    std::vector<float> rgba = mImages.beauty;
+    for (int y = 0; y < 40; y++) {
+        std::fill(rgba.begin() + static_cast<size_t>(y) * sWidth * 4,
+                  rgba.begin() + (static_cast<size_t>(y) * sWidth + 60) * 4, 0.f);
+    }
+    rgba[(100 * sWidth + 100) * 4] = std::numeric_limits<float>::quiet_NaN();
+    rgba[(120 * sWidth + 200) * 4 + 1] = -1e6f;
+    const float expected = binnedExposure(rgba, sWidth, sHeight);
+    CPPUNIT_ASSERT(expected != 1.f);
+
+    const size_t numPixels = static_cast<size_t>(sWidth) * sHeight;
+    auto checkMetered = [&](const std::string& name, const BeautyConditioning& conditioning,
+                            float tolerance) {
+        const float scale = conditioning.exposureScale();
+        CPPUNIT_ASSERT_MESSAGE(name + " meters " + std::to_string(scale) + " rather than " +
+                               std::to_string(expected),
+                               std::abs(scale - expected) <= tolerance * expected);
+    };
+
+    // The pass that only reads, on every layout
+    std::vector<float> planar(numPixels * 3);
+    // Tiles of 8x8 pixels, the last ones padded
+    const size_t tilesX = (sWidth + 7) / 8;
+    std::vector<float> tiled(tilesX * ((sHeight + 7) / 8) * 64 * 4);
+    for (int y = 0; y < sHeight; y++) {
+        for (int x = 0; x < sWidth; x++) {
+            const size_t i = static_cast<size_t>(y) * sWidth + x;
+            const size_t tile = (y / 8) * tilesX + x / 8;
+            for (size_t c = 0; c < 4; c++) {
+                if (c < 3) planar[c * numPixels + i] = rgba[i * 4 + c];
+                tiled[(tile * 64 + (y % 8) * 8 + x % 8) * 4 + c] = rgba[i * 4 + c];
+            }
+        }
+    }
+    const InputImage images[] = {
+        { rgba.data() },
+        { planar.data(), 0, 0, IMAGE_LAYOUT_PLANAR },
+        { tiled.data(), 0, 0, IMAGE_LAYOUT_TILED },
+    };
+    for (const InputImage& image : images) {
+        BeautyConditioning conditioning;
+        conditioning.meter = true;
+        conditionImage(imageView(image, sWidth, sHeight), sWidth, sHeight, &conditioning);
+        checkMetered("conditionImage() layout " + std::to_string(image.layout), conditioning, 1e-5f);
+    }
+
+    // Metered while packing, in float and in half
+    BeautyConditioning conditioning;
+    conditioning.meter = true;
+    std::vector<float> rgb(numPixels * 3);
+    packRGBAtoRGB(rgba.data(), rgb.data(), sWidth, sHeight, &conditioning);
+    checkMetered("packRGBAtoRGB()", conditioning, 1e-5f);
+
+    conditioning = BeautyConditioning();
+    conditioning.meter = true;
+    std::vector<uint16_t> rgbHalf(numPixels * 3);
+    packRGBAtoRGBHalf(rgba.data(), rgbHalf.data(), sWidth, sHeight, &conditioning);
+    checkMetered("packRGBAtoRGBHalf()", conditioning, 1e-5f);
+
+    std::vector<uint16_t> rgbaHalf(numPixels * 4);
+    convertFloatToHalf(rgba.data(), rgbaHalf.data(), sWidth, sHeight);
+    conditioning = BeautyConditioning();
+    conditioning.meter = true;
+    packHalfRGBAtoRGB(rgbaHalf.data(), rgbHalf.data(), sWidth, sHeight, &conditioning);
+    checkMetered("packHalfRGBAtoRGB()", conditioning, 1e-3f);
+}
+
+void
+TestDenoiser::checkGolden(bool useAlbedo, bool useNormals)
+{
+    std::string errorMsg;
+    const std::vector<float> golden = referenceDenoise(mImages, useAlbedo, useNormals, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, useAlbedo, useNormals, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    const float* albedo = guide(mImages.albedo, useAlbedo);
+    const float* normals = guide(mImages.normals, useNormals);
+
+    std::vector<float> output(mImages.beauty.size());
+    denoiser.denoise(mImages.beauty.data(), albedo, normals, output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, golden) <= sGoldenTolerance);
+
+    // Again, with the guides already in the backend's buffers
+    std::fill(output.begin(), output.end(), 0.f);
+    denoiser.denoise(mImages.beauty.data(), albedo, normals, output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, golden) <= sGoldenTolerance);
+
+    // In place
+    std::vector<float> inPlace = mImages.beauty;
+    denoiser.denoise(inPlace.data(), albedo, normals, inPlace.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(inPlace, golden) <= sGoldenTolerance);
+
+    // Packed RGB output through the strided API
+    std::vector<float> rgb(mImages.beauty.size() / 4 * 3);
+    OutputImage rgbOutput;
+    rgbOutput.data = rgb.data();
+    rgbOutput.pixelStride = 3 * sizeof(float);
+    denoiser.denoise(InputImage{mImages.beauty.data()}, InputImage{albedo}, InputImage{normals},
+                     rgbOutput, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::fill(output.begin(), output.end(), 0.f);
+    unpackRGBtoRGBA(rgb.data(), output.data(), output.data(), sWidth, sHeight);
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, golden) <= sGoldenTolerance);
+}
+
+void
+TestDenoiser::testGoldenNoGuides()
+{
+    checkGolden(false, false);
+}
+
+void
+TestDenoiser::testGoldenAlbedo()
+{
+    checkGolden(true, false);
+}
+
+void
+TestDenoiser::testGoldenAlbedoNormals()
+{
+    checkGolden(true, true);
+}
+
+void
+TestDenoiser::testGoldenStatistics()
+{
+    const char* recordPath = std::getenv("DENOISER_GOLDEN_RECORD");
+    const char* path = recordPath ? recordPath : std::getenv("DENOISER_GOLDEN_STATS");
+    const std::map<std::string, GoldenStatistics> goldens =
+        path ? readGoldens(path) : std::map<std::string, GoldenStatistics>();
+
+    const struct
+    {
+        const char* name;
+        bool useAlbedo;
+        bool useNormals;
+    } configurations[] = {
+        { "no_guides", false, false },
+        { "albedo", true, false },
+        { "albedo_normals", true, true },
+    };
+    for (const auto& configuration : configurations) {
+        std::string errorMsg;
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight,
+                          configuration.useAlbedo, configuration.useNormals, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        std::vector<float> output(mImages.beauty.size());
+        denoiser.denoise(mImages.beauty.data(), guide(mImages.albedo, configuration.useAlbedo),
+                         guide(mImages.normals, configuration.useNormals), output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+        GoldenStatistics measured;
+        measured.oidnVersion = oidnVersion();
+        measured.values = imageStatistics(output, sWidth, sHeight);
+        if (recordPath) {
+            recordGolden(recordPath, configuration.name, measured);
+            continue;
+        }
+
+        // Goldens only mean something for the OIDN release they were recorded with, so a
+        // checkout without them skips the comparison rather than failing it
+        const auto golden = goldens.find(configuration.name);
+        if (golden == goldens.end()) {
+            std::printf("No golden statistics for %s in %s, not checked.  Record them with the "
+                        "pinned OIDN by running with DENOISER_GOLDEN_RECORD set to that file.\n",
+                        configuration.name, path ? path : "DENOISER_GOLDEN_STATS");
+            continue;
+        }
+        CPPUNIT_ASSERT(golden->second.values.size() == measured.values.size());
+        for (size_t i = 0; i < measured.values.size(); i++) {
+            const double difference = std::abs(measured.values[i] - golden->second.values[i]);
+            CPPUNIT_ASSERT_MESSAGE(std::string(configuration.name) + " statistic " +
+                                   std::to_string(i) + " is off by " + std::to_string(difference) +
+                                   " with OIDN " + std::to_string(measured.oidnVersion) +
+                                   ", recorded with OIDN " +
+                                   std::to_string(golden->second.oidnVersion),
+                                   difference <= sGoldenTolerance);
+        }
+    }
+}
+
+void
+TestDenoiser::checkAlphaPassThrough(bool useAlbedo, bool useNormals)
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, useAlbedo, useNormals, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    const float* albedo = guide(mImages.albedo, useAlbedo);
+    const float* normals = guide(mImages.normals, useNormals);
+
+    std::vector<float> output(mImages.beauty.size(), -1.f);
+    denoiser.denoise(mImages.beauty.data(), albedo, normals, output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+
+    std::vector<float> inPlace = mImages.beauty;
+    denoiser.denoise(inPlace.data(), albedo, normals, inPlace.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(sameAlpha(inPlace, mImages.beauty));
+
+    // Each output of a batch takes alpha from its own input
+    std::vector<float> second = mImages.clean;
+    std::vector<float> secondOutput(second.size(), -1.f);
+    std::fill(output.begin(), output.end(), -1.f);
+    const float* colors[] = { mImages.beauty.data(), second.data() };
+    float* outputs[] = { output.data(), secondOutput.data() };
+    denoiser.denoiseBatch(albedo, normals, 2, colors, outputs, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+    CPPUNIT_ASSERT(sameAlpha(secondOutput, mImages.clean));
+
+    // The strided API leaves the output's alpha untouched
+    std::fill(output.begin(), output.end(), -1.f);
+    denoiser.denoise(InputImage{mImages.beauty.data()}, InputImage{albedo}, InputImage{normals},
+                     OutputImage{output.data()}, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    for (size_t i = 3; i < output.size(); i += 4) {
+        CPPUNIT_ASSERT(output[i] == -1.f);
+    }
+
+    // Half images
+    std::vector<uint16_t> beautyHalf(mImages.beauty.size());
+    std::vector<uint16_t> albedoHalf(mImages.albedo.size());
+    std::vector<uint16_t> normalsHalf(mImages.normals.size());
+    for (size_t i = 0; i < beautyHalf.size(); i++) {
+        beautyHalf[i] = floatToHalf(mImages.beauty[i]);
+        albedoHalf[i] = floatToHalf(mImages.albedo[i]);
+        normalsHalf[i] = floatToHalf(mImages.normals[i]);
+    }
+    std::vector<uint16_t> outputHalf(beautyHalf.size(), 0xffff);
+    denoiser.denoiseHalf(beautyHalf.data(), useAlbedo ? albedoHalf.data() : nullptr,
+                         useNormals ? normalsHalf.data() : nullptr, outputHalf.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    for (size_t i = 3; i < outputHalf.size(); i += 4) {
+        CPPUNIT_ASSERT(outputHalf[i] == beautyHalf[i]);
+    }
+}
+
+void
+TestDenoiser::testAlphaPassThrough()
+{
+    checkAlphaPassThrough(false, false);
+    checkAlphaPassThrough(true, true);
+}
+
+void
+TestDenoiser::testNoiseReduction()
+{
+    // A loose check that the network denoises at all, which a broken OIDN upgrade or
+    // mismatched guides would fail even when the golden images agree
+    const double noisyError = rmseRGB(mImages.beauty, mImages.clean);
+    for (bool useGuides : { false, true }) {
+        std::string errorMsg;
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, useGuides, useGuides, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        std::vector<float> output(mImages.beauty.size());
+        denoiser.denoise(mImages.beauty.data(), guide(mImages.albedo, useGuides),
+                         guide(mImages.normals, useGuides), output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(rmseRGB(output, mImages.clean) < 0.5 * noisyError);
+    }
+}
+
+void
+TestDenoiser::testTiledMatchesUntiled()
+{
+    std::string errorMsg;
+    Denoiser untiled(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> expected(mImages.beauty.size());
+    untiled.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                    expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // The default metering of the backend, and auto-exposure metered while packing
+    for (bool autoExposure : { false, true }) {
+        DenoiserOptions options;
+        options.memoryBudget = sTiledBudget;
+        options.autoExposure = autoExposure;
+        Denoiser tiled(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        std::vector<float> output(mImages.beauty.size());
+        tiled.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                      output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(relativeRMSE(output, expected) <= sPieceTolerance);
+        CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+    }
+}
+
+void
+TestDenoiser::testRegionMatchesFullFrame()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> previous(mImages.beauty.size());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     previous.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // Brighten the beauty, so a region metered on its own would stand out
+    std::vector<float> beauty = mImages.beauty;
+    for (size_t i = 0; i < beauty.size(); i++) {
+        if (i % 4 != 3) beauty[i] *= 1.5f;
+    }
+    std::vector<float> expected(beauty.size());
+    denoiser.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // Regions of different sizes, each away from the image edges and small enough not
+    // to fall back to a full denoise, and one of them twice to reuse its backend
+    const DenoiseRegion regions[] = { { 100, 60, 120, 76 }, { 30, 100, 42, 140 },
+                                      { 150, 20, 190, 30 }, { 100, 60, 120, 76 } };
+    for (const DenoiseRegion& region : regions) {
+        std::vector<float> output = previous;
+        denoiser.denoiseRegion(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                               output.data(), region, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(relativeRMSE(crop(output, region), crop(expected, region)) <= sPieceTolerance);
+        CPPUNIT_ASSERT(sameOutside(output, previous, region));
+        CPPUNIT_ASSERT(sameAlpha(output, beauty));
+    }
+}
+
+void
+TestDenoiser::testIncrementalMatchesFullFrame()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    Denoiser reference(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // The first call denoises the whole frame
+    std::vector<float> beauty = mImages.beauty;
+    std::vector<float> output(beauty.size());
+    std::vector<float> expected(beauty.size());
+    denoiser.denoiseIncremental(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                                output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    reference.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                      expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, expected) <= sGoldenTolerance);
+
+    // Then only a changed patch, as more samples land in it
+    const DenoiseRegion patch = { 60, 40, 80, 56 };
+    for (int y = patch.y0; y < patch.y1; y++) {
+        for (int x = patch.x0; x < patch.x1; x++) {
+            const size_t i = (static_cast<size_t>(y) * sWidth + x) * 4;
+            for (size_t c = 0; c < 3; c++) {
+                beauty[i + c] = mImages.clean[i + c];
+            }
+        }
+    }
+    denoiser.denoiseIncremental(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                                output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    reference.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                      expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(relativeRMSE(output, expected) <= sPieceTolerance);
+    CPPUNIT_ASSERT(relativeRMSE(crop(output, patch), crop(expected, patch)) <= sPieceTolerance);
+
+    // A change up to the edges of a whole tracked tile also changes the output in a
+    // ring of clean tiles around it, which has to be refreshed as well
+    const DenoiseRegion tile = { 64, 96, 96, 128 };
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const size_t i = (static_cast<size_t>(y) * sWidth + x) * 4;
+            for (size_t c = 0; c < 3; c++) {
+                beauty[i + c] = mImages.clean[i + c];
+            }
+        }
+    }
+    denoiser.denoiseIncremental(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                                output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    reference.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                      expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    const int ring = 4;
+    const DenoiseRegion ringSides[] = {
+        { tile.x0 - ring, tile.y0 - ring, tile.x1 + ring, tile.y0 },
+        { tile.x0 - ring, tile.y1, tile.x1 + ring, tile.y1 + ring },
+        { tile.x0 - ring, tile.y0, tile.x0, tile.y1 },
+        { tile.x1, tile.y0, tile.x1 + ring, tile.y1 }
+    };
+    for (const DenoiseRegion& side : ringSides) {
+        CPPUNIT_ASSERT(relativeRMSE(crop(output, side), crop(expected, side)) <= sPieceTolerance);
+    }
+
+    // Incremental denoising keeps the previous output, so it cannot be in place
+    denoiser.denoiseIncremental(beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                                beauty.data(), &errorMsg);
+    CPPUNIT_ASSERT(!errorMsg.empty());
+}
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
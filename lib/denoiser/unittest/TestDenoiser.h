@@ -0,0 +1,64 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "TestImages.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+// Correctness of the OIDN CPU backend and the pack kernels.  Two kinds of goldens:
+// images rendered through OIDN's own API at test time, which catch anything the
+// library's staging, binding and copy loops change on the way, and statistics of the
+// output checked in from a pinned OIDN (DENOISER_GOLDEN_STATS), which catch a change
+// in OIDN itself.  Set DENOISER_GOLDEN_RECORD to a file to record the statistics again
+// after an intended OIDN upgrade.
+class TestDenoiser : public CppUnit::TestFixture
+{
+public:
+    void setUp() override;
+    void tearDown() override;
+
+    void testPackKernels();
+    void testHalfPackKernels();
+    void testExposureMetering();
+    void testGoldenNoGuides();
+    void testGoldenAlbedo();
+    void testGoldenAlbedoNormals();
+    void testGoldenStatistics();
+    void testAlphaPassThrough();
+    void testNoiseReduction();
+    void testTiledMatchesUntiled();
+    void testRegionMatchesFullFrame();
+    void testIncrementalMatchesFullFrame();
+
+    CPPUNIT_TEST_SUITE(TestDenoiser);
+    CPPUNIT_TEST(testPackKernels);
+    CPPUNIT_TEST(testHalfPackKernels);
+    CPPUNIT_TEST(testExposureMetering);
+    CPPUNIT_TEST(testGoldenNoGuides);
+    CPPUNIT_TEST(testGoldenAlbedo);
+    CPPUNIT_TEST(testGoldenAlbedoNormals);
+    CPPUNIT_TEST(testGoldenStatistics);
+    CPPUNIT_TEST(testAlphaPassThrough);
+    CPPUNIT_TEST(testNoiseReduction);
+    CPPUNIT_TEST(testTiledMatchesUntiled);
+    CPPUNIT_TEST(testRegionMatchesFullFrame);
+    CPPUNIT_TEST(testIncrementalMatchesFullFrame);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void checkGolden(bool useAlbedo, bool useNormals);
+    void checkAlphaPassThrough(bool useAlbedo, bool useNormals);
+
+    TestImages mImages;
+};
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
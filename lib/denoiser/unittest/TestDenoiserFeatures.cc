@@ -0,0 +1,746 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestDenoiserFeatures.h"
+
+#include <mcrt_denoise/denoiser/Denoiser.h>
+
+#include <cmath>
+#include <limits>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+namespace {
+
+// Not multiples of any SIMD width, row block or tile size
+const int sWidth = 250;
+const int sHeight = 170;
+
+// Fits tiles of about 90x90 pixels with both guides
+const size_t sTiledBudget = 1 << 20;
+
+// Largest RMS difference of a half precision denoise from the float denoise of the
+// same half values, relative to the RMS value of the image: the rounding of the
+// output to half precision
+const double sHalfTolerance = 1e-3;
+
+// True if output is much closer to the clean image than the noisy beauty is
+bool
+reducesNoise(const TestImages& images, const std::vector<float>& output)
+{
+    return rmseRGB(output, images.clean) < 0.5 * rmseRGB(images.beauty, images.clean);
+}
+
+// RGB planes of an RGBA image
+std::vector<float>
+toPlanar(const std::vector<float>& image)
+{
+    const size_t numPixels = image.size() / 4;
+    std::vector<float> planes(numPixels * 3);
+    for (size_t i = 0; i < numPixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            planes[c * numPixels + i] = image[i * 4 + c];
+        }
+    }
+    return planes;
+}
+
+std::vector<float>
+fromPlanar(const std::vector<float>& planes)
+{
+    const size_t numPixels = planes.size() / 3;
+    std::vector<float> image(numPixels * 4, 0.f);
+    for (size_t i = 0; i < numPixels; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            image[i * 4 + c] = planes[c * numPixels + i];
+        }
+    }
+    return image;
+}
+
+// Offset in floats of pixel (x, y) of an RGBA image in tiles of tileWidth x tileHeight
+size_t
+tiledOffset(int x, int y, int tileWidth, int tileHeight)
+{
+    const size_t tilesX = (sWidth + tileWidth - 1) / tileWidth;
+    const size_t tile = (y / tileHeight) * tilesX + x / tileWidth;
+    return (tile * tileWidth * tileHeight + (y % tileHeight) * tileWidth + x % tileWidth) * 4;
+}
+
+std::vector<float>
+toTiled(const std::vector<float>& image, int tileWidth, int tileHeight)
+{
+    const size_t tilesX = (sWidth + tileWidth - 1) / tileWidth;
+    const size_t tilesY = (sHeight + tileHeight - 1) / tileHeight;
+    std::vector<float> tiled(tilesX * tilesY * tileWidth * tileHeight * 4, 0.f);
+    for (int y = 0; y < sHeight; y++) {
+        for (int x = 0; x < sWidth; x++) {
+            const size_t offset = tiledOffset(x, y, tileWidth, tileHeight);
+            for (size_t c = 0; c < 4; c++) {
+                tiled[offset + c] = image[(static_cast<size_t>(y) * sWidth + x) * 4 + c];
+            }
+        }
+    }
+    return tiled;
+}
+
+std::vector<float>
+fromTiled(const std::vector<float>& tiled, int tileWidth, int tileHeight)
+{
+    std::vector<float> image(static_cast<size_t>(sWidth) * sHeight * 4);
+    for (int y = 0; y < sHeight; y++) {
+        for (int x = 0; x < sWidth; x++) {
+            const size_t offset = tiledOffset(x, y, tileWidth, tileHeight);
+            for (size_t c = 0; c < 4; c++) {
+                image[(static_cast<size_t>(y) * sWidth + x) * 4 + c] = tiled[offset + c];
+            }
+        }
+    }
+    return image;
+}
+
+} // namespace
+
+void
+TestDenoiserFeatures::setUp()
+{
+    mImages = makeTestImages(sWidth, sHeight);
+    mExpected = plainDenoise(mImages.beauty);
+}
+
+void
+TestDenoiserFeatures::tearDown()
+{
+}
+
+std::vector<float>
+TestDenoiserFeatures::plainDenoise(const std::vector<float>& beauty)
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> output(beauty.size());
+    denoiser.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(), output.data(),
+                     &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    return output;
+}
+
+void
+TestDenoiserFeatures::testInPlace()
+{
+    for (size_t memoryBudget : { size_t(0), sTiledBudget }) {
+        std::string errorMsg;
+        DenoiserOptions options;
+        options.memoryBudget = memoryBudget;
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+        std::vector<float> output(mImages.beauty.size());
+        denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                         output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(relativeRMSE(output, mExpected) <= sPieceTolerance);
+
+        // In place must give the same result as out of place, tiled or not
+        std::vector<float> inPlace = mImages.beauty;
+        denoiser.denoise(inPlace.data(), mImages.albedo.data(), mImages.normals.data(),
+                         inPlace.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(inPlace, output) <= sGoldenTolerance);
+        CPPUNIT_ASSERT(sameAlpha(inPlace, mImages.beauty));
+
+        inPlace = mImages.beauty;
+        denoiser.denoise(InputImage{inPlace.data()}, InputImage{mImages.albedo.data()},
+                         InputImage{mImages.normals.data()}, OutputImage{inPlace.data()}, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(inPlace, output) <= sGoldenTolerance);
+        CPPUNIT_ASSERT(sameAlpha(inPlace, mImages.beauty));
+    }
+}
+
+void
+TestDenoiserFeatures::testLowMemory()
+{
+    std::string errorMsg;
+    Denoiser normal(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> output(mImages.beauty.size());
+    normal.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                   output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    DenoiserOptions options;
+    options.lowMemory = true;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // Twice, so the second call allocates and fills the freed buffers again
+    for (int i = 0; i < 2; i++) {
+        std::fill(output.begin(), output.end(), 0.f);
+        denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                         output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+        CPPUNIT_ASSERT(denoiser.bytesAllocated() <= normal.bytesAllocated());
+    }
+
+    std::vector<float> inPlace = mImages.beauty;
+    denoiser.denoise(inPlace.data(), mImages.albedo.data(), mImages.normals.data(),
+                     inPlace.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(inPlace, mExpected) <= sGoldenTolerance);
+    CPPUNIT_ASSERT(sameAlpha(inPlace, mImages.beauty));
+}
+
+void
+TestDenoiserFeatures::testLayouts()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // Planar
+    {
+        const std::vector<float> beauty = toPlanar(mImages.beauty);
+        const std::vector<float> albedo = toPlanar(mImages.albedo);
+        const std::vector<float> normals = toPlanar(mImages.normals);
+        std::vector<float> output(beauty.size());
+        auto input = [](const std::vector<float>& planes) {
+            InputImage image;
+            image.data = planes.data();
+            image.layout = IMAGE_LAYOUT_PLANAR;
+            return image;
+        };
+        OutputImage planarOutput;
+        planarOutput.data = output.data();
+        planarOutput.layout = IMAGE_LAYOUT_PLANAR;
+        denoiser.denoise(input(beauty), input(albedo), input(normals), planarOutput, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(fromPlanar(output), mExpected) <= sGoldenTolerance);
+    }
+
+    // Tiled, with tiles that don't divide the image
+    for (int tileSize : { 8, 16 }) {
+        const std::vector<float> beauty = toTiled(mImages.beauty, tileSize, tileSize);
+        const std::vector<float> albedo = toTiled(mImages.albedo, tileSize, tileSize);
+        const std::vector<float> normals = toTiled(mImages.normals, tileSize, tileSize);
+        std::vector<float> output(beauty.size(), -1.f);
+        auto input = [&](const std::vector<float>& tiles) {
+            InputImage image;
+            image.data = tiles.data();
+            image.layout = IMAGE_LAYOUT_TILED;
+            image.tileWidth = tileSize;
+            image.tileHeight = tileSize;
+            return image;
+        };
+        OutputImage tiledOutput;
+        tiledOutput.data = output.data();
+        tiledOutput.layout = IMAGE_LAYOUT_TILED;
+        tiledOutput.tileWidth = tileSize;
+        tiledOutput.tileHeight = tileSize;
+        denoiser.denoise(input(beauty), input(albedo), input(normals), tiledOutput, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(fromTiled(output, tileSize, tileSize), mExpected) <=
+                       sGoldenTolerance);
+    }
+
+    // A sub-rectangle of a larger framebuffer, which must be left alone around it
+    {
+        const int frameWidth = sWidth + 7;
+        const int frameHeight = sHeight + 3;
+        const int x0 = 5;
+        const int y0 = 2;
+        auto embed = [&](const std::vector<float>& image) {
+            std::vector<float> frame(static_cast<size_t>(frameWidth) * frameHeight * 4, -1.f);
+            for (int y = 0; y < sHeight; y++) {
+                std::copy(image.begin() + static_cast<size_t>(y) * sWidth * 4,
+                          image.begin() + static_cast<size_t>(y + 1) * sWidth * 4,
+                          frame.begin() + (static_cast<size_t>(y + y0) * frameWidth + x0) * 4);
+            }
+            return frame;
+        };
+        const size_t origin = (static_cast<size_t>(y0) * frameWidth + x0) * 4;
+        const size_t rowStride = frameWidth * 4 * sizeof(float);
+        const std::vector<float> beauty = embed(mImages.beauty);
+        const std::vector<float> albedo = embed(mImages.albedo);
+        const std::vector<float> normals = embed(mImages.normals);
+        std::vector<float> frame(beauty.size(), -1.f);
+        auto input = [&](const std::vector<float>& image) {
+            return InputImage{image.data() + origin, 0, rowStride};
+        };
+        denoiser.denoise(input(beauty), input(albedo), input(normals),
+                         OutputImage{frame.data() + origin, 0, rowStride}, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+        std::vector<float> output(mExpected.size());
+        for (int y = 0; y < frameHeight; y++) {
+            for (int x = 0; x < frameWidth; x++) {
+                const float* pixel = &frame[(static_cast<size_t>(y) * frameWidth + x) * 4];
+                if (x >= x0 && x < x0 + sWidth && y >= y0 && y < y0 + sHeight) {
+                    std::copy(pixel, pixel + 4,
+                              output.begin() + (static_cast<size_t>(y - y0) * sWidth + x - x0) * 4);
+                } else {
+                    for (int c = 0; c < 4; c++) {
+                        CPPUNIT_ASSERT(pixel[c] == -1.f);
+                    }
+                }
+            }
+        }
+        CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+    }
+}
+
+void
+TestDenoiserFeatures::testBatch()
+{
+    std::vector<float> brighter = mImages.beauty;
+    for (size_t i = 0; i < brighter.size(); i++) {
+        if (i % 4 != 3) brighter[i] *= 2.f;
+    }
+    const std::vector<float> expectedBrighter = plainDenoise(brighter);
+
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> first(mImages.beauty.size());
+    std::vector<float> second(mImages.beauty.size());
+    const float* colors[] = { mImages.beauty.data(), brighter.data() };
+    float* outputs[] = { first.data(), second.data() };
+    denoiser.denoiseBatch(mImages.albedo.data(), mImages.normals.data(), 2, colors, outputs,
+                          &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(first, mExpected) <= sGoldenTolerance);
+    CPPUNIT_ASSERT(maxDifferenceRGB(second, expectedBrighter) <= sGoldenTolerance);
+
+    // In place
+    first = mImages.beauty;
+    second = brighter;
+    const float* inPlaceColors[] = { first.data(), second.data() };
+    denoiser.denoiseBatch(mImages.albedo.data(), mImages.normals.data(), 2, inPlaceColors, outputs,
+                          &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(first, mExpected) <= sGoldenTolerance);
+    CPPUNIT_ASSERT(maxDifferenceRGB(second, expectedBrighter) <= sGoldenTolerance);
+}
+
+void
+TestDenoiserFeatures::testAsync()
+{
+    constexpr int numFrames = 4;
+    std::vector<std::vector<float>> beauties;
+    std::vector<std::vector<float>> expected;
+    for (int i = 0; i < numFrames; i++) {
+        std::vector<float> beauty = mImages.beauty;
+        for (size_t j = 0; j < beauty.size(); j++) {
+            if (j % 4 != 3) beauty[j] *= 1.f + 0.25f * i;
+        }
+        expected.push_back(plainDenoise(beauty));
+        beauties.push_back(std::move(beauty));
+    }
+
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // The input buffer is overwritten as soon as each call returns, as a renderer
+    // reusing its framebuffer would
+    std::vector<float> input(mImages.beauty.size());
+    std::vector<std::vector<float>> outputs(numFrames, std::vector<float>(input.size()));
+    std::vector<DenoiseFuture> futures;
+    for (int i = 0; i < numFrames; i++) {
+        input = beauties[i];
+        futures.push_back(denoiser.denoiseAsync(input.data(), mImages.albedo.data(),
+                                                mImages.normals.data(), outputs[i].data()));
+        std::fill(input.begin(), input.end(), -1.f);
+    }
+    for (int i = 0; i < numFrames; i++) {
+        futures[i].wait(&errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(futures[i].poll());
+        CPPUNIT_ASSERT(maxDifferenceRGB(outputs[i], expected[i]) <= sGoldenTolerance);
+        CPPUNIT_ASSERT(sameAlpha(outputs[i], beauties[i]));
+    }
+    CPPUNIT_ASSERT(denoiser.stats().calls == numFrames);
+}
+
+void
+TestDenoiserFeatures::testReconfigure()
+{
+    const int width = 160;
+    const int height = 120;
+    const TestImages images = makeTestImages(width, height);
+
+    std::string errorMsg;
+    Denoiser fresh(OPEN_IMAGE_DENOISE_CPU, width, height, true, false, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> expected(images.beauty.size());
+    fresh.denoise(images.beauty.data(), images.albedo.data(), nullptr, expected.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> output(mImages.beauty.size());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // To another size and guide configuration, and back
+    denoiser.reconfigure(width, height, true, false, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(denoiser.imageWidth() == width && denoiser.imageHeight() == height);
+    CPPUNIT_ASSERT(denoiser.useAlbedo() && !denoiser.useNormals());
+    output.assign(images.beauty.size(), 0.f);
+    denoiser.denoise(images.beauty.data(), images.albedo.data(), nullptr, output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, expected) <= sGoldenTolerance);
+
+    denoiser.reconfigure(sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    output.assign(mImages.beauty.size(), 0.f);
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+}
+
+void
+TestDenoiserFeatures::testHalf()
+{
+    // The float reference denoises the same values the half images hold
+    auto toHalf = [](const std::vector<float>& image) {
+        std::vector<uint16_t> half(image.size());
+        for (size_t i = 0; i < image.size(); i++) {
+            half[i] = floatToHalf(image[i]);
+        }
+        return half;
+    };
+    auto toFloat = [](const std::vector<uint16_t>& half) {
+        std::vector<float> image(half.size());
+        for (size_t i = 0; i < half.size(); i++) {
+            image[i] = halfToFloat(half[i]);
+        }
+        return image;
+    };
+    const std::vector<uint16_t> beauty = toHalf(mImages.beauty);
+    const std::vector<uint16_t> albedo = toHalf(mImages.albedo);
+    const std::vector<uint16_t> normals = toHalf(mImages.normals);
+
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    const std::vector<float> beautyFloat = toFloat(beauty);
+    const std::vector<float> albedoFloat = toFloat(albedo);
+    const std::vector<float> normalsFloat = toFloat(normals);
+    std::vector<float> expected(beautyFloat.size());
+    denoiser.denoise(beautyFloat.data(), albedoFloat.data(), normalsFloat.data(), expected.data(),
+                     &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    std::vector<uint16_t> output(beauty.size());
+    denoiser.denoiseHalf(beauty.data(), albedo.data(), normals.data(), output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(relativeRMSE(toFloat(output), expected) <= sHalfTolerance);
+    for (size_t i = 3; i < output.size(); i += 4) {
+        CPPUNIT_ASSERT(output[i] == beauty[i]);
+    }
+
+    // Float images staged as half
+    DenoiserOptions options;
+    options.halfStaging = true;
+    Denoiser staged(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> stagedOutput(beautyFloat.size());
+    staged.denoise(beautyFloat.data(), albedoFloat.data(), normalsFloat.data(), stagedOutput.data(),
+                   &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(relativeRMSE(stagedOutput, expected) <= sHalfTolerance);
+}
+
+void
+TestDenoiserFeatures::testQuality()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(denoiser.quality() == QUALITY_HIGH);
+
+    std::vector<float> output(mImages.beauty.size());
+    for (DenoiserQuality quality : { QUALITY_FAST, QUALITY_BALANCED }) {
+        denoiser.setQuality(quality, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(denoiser.quality() == quality);
+        denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                         output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(reducesNoise(mImages, output));
+    }
+
+    // Back to the kept filter of the default tier
+    denoiser.setQuality(QUALITY_HIGH, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+}
+
+void
+TestDenoiserFeatures::testPreview()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    denoiser.setPreviewScale(2, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> output(mImages.beauty.size(), -1.f);
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(reducesNoise(mImages, output));
+    CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+
+    denoiser.setPreviewScale(1, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+}
+
+void
+TestDenoiserFeatures::testTemporal()
+{
+    std::string errorMsg;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // The first frame is not blended, and blending a still frame into an identical one
+    // changes nothing
+    std::vector<float> output(mImages.beauty.size());
+    for (int frame = 0; frame < 3; frame++) {
+        denoiser.denoiseTemporal(mImages.beauty.data(), mImages.albedo.data(),
+                                 mImages.normals.data(), nullptr, output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+        CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+    }
+
+    // A changed frame after a cut is the plain denoise of that frame
+    std::vector<float> brighter = mImages.beauty;
+    for (size_t i = 0; i < brighter.size(); i++) {
+        if (i % 4 != 3) brighter[i] *= 2.f;
+    }
+    denoiser.resetTemporal();
+    denoiser.denoiseTemporal(brighter.data(), mImages.albedo.data(), mImages.normals.data(),
+                             nullptr, output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, plainDenoise(brighter)) <= sGoldenTolerance);
+}
+
+void
+TestDenoiserFeatures::testBands()
+{
+    std::string errorMsg;
+    DenoiserOptions options;
+    options.cpuDevices = 2;
+    Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    std::vector<float> output(mImages.beauty.size());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(relativeRMSE(output, mExpected) <= sPieceTolerance);
+    CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+}
+
+void
+TestDenoiserFeatures::testAtrous()
+{
+    std::string errorMsg;
+    Denoiser denoiser(ATROUS, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // A much weaker filter than the network, so it only has to reduce the noise at all
+    std::vector<float> output(mImages.beauty.size());
+    denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(rmseRGB(output, mImages.clean) < rmseRGB(mImages.beauty, mImages.clean));
+    CPPUNIT_ASSERT(sameAlpha(output, mImages.beauty));
+
+    std::vector<float> inPlace = mImages.beauty;
+    denoiser.denoise(inPlace.data(), mImages.albedo.data(), mImages.normals.data(),
+                     inPlace.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(inPlace, output) == 0.f);
+}
+
+void
+TestDenoiserFeatures::testSanitizeAndExposure()
+{
+    std::string errorMsg;
+    DenoiserOptions options;
+    options.sanitizeInput = true;
+    Denoiser sanitizing(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    // Nothing to clean in the test images
+    std::vector<float> output(mImages.beauty.size());
+    sanitizing.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                       output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(maxDifferenceRGB(output, mExpected) <= sGoldenTolerance);
+
+    // A few bad samples must not spread
+    std::vector<float> beauty = mImages.beauty;
+    beauty[(40 * sWidth + 40) * 4] = std::numeric_limits<float>::quiet_NaN();
+    beauty[(80 * sWidth + 120) * 4 + 1] = std::numeric_limits<float>::infinity();
+    beauty[(120 * sWidth + 200) * 4 + 2] = -1e6f;
+    sanitizing.denoise(beauty.data(), mImages.albedo.data(), mImages.normals.data(), output.data(),
+                       &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    for (size_t i = 0; i < output.size(); i++) {
+        CPPUNIT_ASSERT(std::isfinite(output[i]));
+    }
+    CPPUNIT_ASSERT(reducesNoise(mImages, output));
+
+    // Metered while packing rather than by OIDN
+    options = DenoiserOptions();
+    options.autoExposure = true;
+    Denoiser exposing(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    exposing.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                     output.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    CPPUNIT_ASSERT(relativeRMSE(output, mExpected) <= sPieceTolerance);
+}
+
+void
+TestDenoiserFeatures::testGuideGeneration()
+{
+    // Other guides for the second generation, so stale guides would show
+    TestImages other = makeTestImages(sWidth, sHeight);
+    for (size_t i = 0; i < other.albedo.size(); i++) {
+        if (i % 4 != 3) other.albedo[i] = 1.f - other.albedo[i];
+    }
+    std::string errorMsg;
+    Denoiser plain(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    std::vector<float> expectedOther(mImages.beauty.size());
+    plain.denoise(mImages.beauty.data(), other.albedo.data(), mImages.normals.data(),
+                  expectedOther.data(), &errorMsg);
+    CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+    auto check = [&](Denoiser& denoiser, float tolerance) {
+        std::vector<float> output(mImages.beauty.size());
+        std::vector<float> reference(mImages.beauty.size());
+        for (int pass = 0; pass < 2; pass++) {
+            const bool second = pass == 1;
+            const float *albedo = second ? other.albedo.data() : mImages.albedo.data();
+            const std::vector<float>& expected = second ? expectedOther : mExpected;
+            denoiser.setGuideGeneration(pass + 1);
+            // Twice per generation, the second time with the guides staged already
+            for (int i = 0; i < 2; i++) {
+                denoiser.denoise(mImages.beauty.data(), albedo, mImages.normals.data(),
+                                 output.data(), &errorMsg);
+                CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+                CPPUNIT_ASSERT(relativeRMSE(output, expected) <= tolerance);
+                denoiser.denoiseAsync(mImages.beauty.data(), albedo, mImages.normals.data(),
+                                      reference.data()).wait(&errorMsg);
+                CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+                CPPUNIT_ASSERT(maxDifferenceRGB(reference, output) <= sGoldenTolerance);
+            }
+        }
+    };
+
+    {
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        check(denoiser, sGoldenTolerance);
+    }
+    {
+        DenoiserOptions options;
+        options.cpuDevices = 2;
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        check(denoiser, sPieceTolerance);
+    }
+    {
+        // Previews keep their downsampled guides, which must follow the generation
+        std::vector<float> previewOther(mImages.beauty.size());
+        std::vector<float> output(mImages.beauty.size());
+        DenoiserOptions options;
+        options.previewScale = 2;
+        Denoiser reference(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        reference.denoise(mImages.beauty.data(), other.albedo.data(), mImages.normals.data(),
+                          previewOther.data(), &errorMsg);
+        denoiser.setGuideGeneration(1);
+        denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                         output.data(), &errorMsg);
+        denoiser.setGuideGeneration(2);
+        for (int i = 0; i < 2; i++) {
+            denoiser.denoise(mImages.beauty.data(), other.albedo.data(), mImages.normals.data(),
+                             output.data(), &errorMsg);
+            CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+            CPPUNIT_ASSERT(maxDifferenceRGB(output, previewOther) <= sGoldenTolerance);
+        }
+    }
+
+    // Reconfiguring stages the guides again under the same generation, both for
+    // transposed dimensions, which keep the size of the buffers, and for a guide
+    // switched off and back on
+    TestImages transposed = makeTestImages(sHeight, sWidth);
+    TestImages transposedOther = makeTestImages(sHeight, sWidth);
+    for (size_t i = 0; i < transposedOther.albedo.size(); i++) {
+        if (i % 4 != 3) transposedOther.albedo[i] = 1.f - transposedOther.albedo[i];
+    }
+    for (int scale = 1; scale <= 2; scale++) {
+        DenoiserOptions options;
+        options.previewScale = scale;
+        std::vector<float> expected(transposed.beauty.size());
+        std::vector<float> expectedOther(transposed.beauty.size());
+        std::vector<float> output(transposed.beauty.size());
+        Denoiser reference(OPEN_IMAGE_DENOISE_CPU, sHeight, sWidth, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        reference.denoise(transposed.beauty.data(), transposed.albedo.data(), transposed.normals.data(),
+                          expected.data(), &errorMsg);
+        reference.denoise(transposed.beauty.data(), transposedOther.albedo.data(),
+                          transposed.normals.data(), expectedOther.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, sWidth, sHeight, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        denoiser.setGuideGeneration(1);
+        denoiser.denoise(mImages.beauty.data(), mImages.albedo.data(), mImages.normals.data(),
+                         output.data(), &errorMsg);
+        denoiser.reconfigure(sHeight, sWidth, true, true, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        denoiser.denoise(transposed.beauty.data(), transposed.albedo.data(), transposed.normals.data(),
+                         output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(output, expected) <= sGoldenTolerance);
+
+        denoiser.reconfigure(sHeight, sWidth, false, true, &errorMsg);
+        denoiser.denoise(transposed.beauty.data(), nullptr, transposed.normals.data(),
+                         output.data(), &errorMsg);
+        denoiser.reconfigure(sHeight, sWidth, true, true, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        denoiser.denoise(transposed.beauty.data(), transposedOther.albedo.data(),
+                         transposed.normals.data(), output.data(), &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        CPPUNIT_ASSERT(maxDifferenceRGB(output, expectedOther) <= sGoldenTolerance);
+    }
+}
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
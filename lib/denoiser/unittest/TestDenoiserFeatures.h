@@ -0,0 +1,69 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include "TestImages.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+// The Denoiser's other entry points and options, each checked against plain denoise()
+// of the same inputs on the OIDN CPU backend.  Calls that only move data around (in
+// place, lowMemory, layouts, batches, async, reconfigure, guide generations) must
+// match it to the golden tolerance; calls that change what the network sees (half
+// precision, previews, bands, auto-exposure) to a looser one, and the quality tiers,
+// a-trous filter and sanitizing must still reduce the noise.
+class TestDenoiserFeatures : public CppUnit::TestFixture
+{
+public:
+    void setUp() override;
+    void tearDown() override;
+
+    void testInPlace();
+    void testLowMemory();
+    void testLayouts();
+    void testBatch();
+    void testAsync();
+    void testReconfigure();
+    void testHalf();
+    void testQuality();
+    void testPreview();
+    void testTemporal();
+    void testBands();
+    void testAtrous();
+    void testSanitizeAndExposure();
+    void testGuideGeneration();
+
+    CPPUNIT_TEST_SUITE(TestDenoiserFeatures);
+    CPPUNIT_TEST(testInPlace);
+    CPPUNIT_TEST(testLowMemory);
+    CPPUNIT_TEST(testLayouts);
+    CPPUNIT_TEST(testBatch);
+    CPPUNIT_TEST(testAsync);
+    CPPUNIT_TEST(testReconfigure);
+    CPPUNIT_TEST(testHalf);
+    CPPUNIT_TEST(testQuality);
+    CPPUNIT_TEST(testPreview);
+    CPPUNIT_TEST(testTemporal);
+    CPPUNIT_TEST(testBands);
+    CPPUNIT_TEST(testAtrous);
+    CPPUNIT_TEST(testSanitizeAndExposure);
+    CPPUNIT_TEST(testGuideGeneration);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    // Plain denoise() of beauty with both guides
+    std::vector<float> plainDenoise(const std::vector<float>& beauty);
+
+    TestImages mImages;
+    std::vector<float> mExpected; // plainDenoise() of mImages.beauty
+};
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
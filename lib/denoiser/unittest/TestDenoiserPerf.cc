@@ -0,0 +1,212 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestDenoiserPerf.h"
+#include "TestImages.h"
+
+#include <mcrt_denoise/denoiser/Denoiser.h>
+#include <mcrt_denoise/denoiser/PackKernels.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+namespace {
+
+const int sPackIterations = 10;
+const int sDenoiseIterations = 3;
+const double sDefaultThreshold = 0.25;
+
+// Reads "<name> <milliseconds>" lines, skipping blank lines and # comments
+std::map<std::string, double>
+readTimings(const std::string& path)
+{
+    std::map<std::string, double> timings;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        double ms;
+        if (fields >> name >> ms) {
+            timings[name] = ms;
+        }
+    }
+    return timings;
+}
+
+// Adds or replaces one timing, keeping the others so that a file collects the
+// timings of every test
+void
+recordTiming(const std::string& path, const std::string& name, double ms)
+{
+    std::map<std::string, double> timings = readTimings(path);
+    timings[name] = ms;
+    std::ofstream file(path);
+    file << "# Recorded by mcrt_denoise_denoiser_perf_tests, in milliseconds\n";
+    for (const auto& timing : timings) {
+        file << timing.first << ' ' << timing.second << '\n';
+    }
+}
+
+} // namespace
+
+void
+TestDenoiserPerf::setUp()
+{
+    if (const char* path = std::getenv("DENOISER_PERF_BASELINE")) {
+        mBaseline = readTimings(path);
+    }
+    const char* threshold = std::getenv("DENOISER_PERF_THRESHOLD");
+    mThreshold = threshold ? std::atof(threshold) : sDefaultThreshold;
+    if (const char* path = std::getenv("DENOISER_PERF_RECORD")) {
+        mRecordPath = path;
+    }
+}
+
+void
+TestDenoiserPerf::tearDown()
+{
+}
+
+void
+TestDenoiserPerf::check(const std::string& name, int iterations, const std::function<void()>& func)
+{
+    func(); // warm up caches, the TBB thread pool and the OIDN filter
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    const double ms = best * 1e3;
+
+    if (!mRecordPath.empty()) {
+        recordTiming(mRecordPath, name, ms);
+    }
+
+    const auto baseline = mBaseline.find(name);
+    if (baseline == mBaseline.end()) {
+        std::printf("%-32s %10.3f ms (no baseline, not checked).  Record one on this machine "
+                    "by running with DENOISER_PERF_RECORD set to DENOISER_PERF_BASELINE.\n",
+                    name.c_str(), ms);
+        return;
+    }
+    const double limit = baseline->second * (1. + mThreshold);
+    std::printf("%-32s %10.3f ms, baseline %10.3f ms, limit %10.3f ms\n",
+                name.c_str(), ms, baseline->second, limit);
+    CPPUNIT_ASSERT_MESSAGE(name + " took " + std::to_string(ms) + " ms, more than the limit of " +
+                           std::to_string(limit) + " ms",
+                           ms <= limit);
+}
+
+void
+TestDenoiserPerf::timePack(const std::string& resolution, int width, int height)
+{
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    std::vector<float> rgba(numPixels * 4);
+    for (size_t i = 0; i < rgba.size(); i++) {
+        rgba[i] = static_cast<float>(i % 1021) / 1021.f;
+    }
+    std::vector<float> rgb(numPixels * 3);
+    std::vector<uint16_t> rgbHalf(numPixels * 3);
+    std::vector<float> result = rgba;
+
+    check("pack_rgba_to_rgb_" + resolution, sPackIterations, [&] {
+        packRGBAtoRGB(rgba.data(), rgb.data(), width, height);
+    });
+    check("unpack_rgb_to_rgba_" + resolution, sPackIterations, [&] {
+        unpackRGBtoRGBA(rgb.data(), result.data(), result.data(), width, height);
+    });
+    check("pack_rgba_to_rgb_half_" + resolution, sPackIterations, [&] {
+        packRGBAtoRGBHalf(rgba.data(), rgbHalf.data(), width, height);
+    });
+    check("unpack_rgb_half_to_rgba_" + resolution, sPackIterations, [&] {
+        unpackRGBHalftoRGBA(rgbHalf.data(), result.data(), result.data(), width, height);
+    });
+}
+
+void
+TestDenoiserPerf::timeDenoise(const std::string& resolution, int width, int height)
+{
+    const TestImages images = makeTestImages(width, height);
+    std::vector<float> output(images.beauty.size());
+
+    for (bool useGuides : { true, false }) {
+        std::string errorMsg;
+        Denoiser denoiser(OPEN_IMAGE_DENOISE_CPU, width, height, useGuides, useGuides, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        check(std::string(useGuides ? "denoise_" : "denoise_no_guides_") + resolution,
+              sDenoiseIterations, [&] {
+            denoiser.denoise(images.beauty.data(),
+                             useGuides ? images.albedo.data() : nullptr,
+                             useGuides ? images.normals.data() : nullptr,
+                             output.data(), &errorMsg);
+        });
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    }
+}
+
+void
+TestDenoiserPerf::testAtrous1080p()
+{
+    const int width = 1920;
+    const int height = 1080;
+    const TestImages images = makeTestImages(width, height);
+    std::vector<float> output(images.beauty.size());
+
+    const char* names[] = { "atrous_fast_1080p", "atrous_balanced_1080p", "atrous_high_1080p" };
+    for (DenoiserQuality quality : { QUALITY_FAST, QUALITY_BALANCED, QUALITY_HIGH }) {
+        std::string errorMsg;
+        DenoiserOptions options;
+        options.quality = quality;
+        Denoiser denoiser(ATROUS, width, height, true, true, options, &errorMsg);
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+        check(names[quality], sDenoiseIterations, [&] {
+            denoiser.denoise(images.beauty.data(), images.albedo.data(), images.normals.data(),
+                             output.data(), &errorMsg);
+        });
+        CPPUNIT_ASSERT_MESSAGE(errorMsg, errorMsg.empty());
+    }
+}
+
+void
+TestDenoiserPerf::testPack1080p()
+{
+    timePack("1080p", 1920, 1080);
+}
+
+void
+TestDenoiserPerf::testPack4K()
+{
+    timePack("4k", 3840, 2160);
+}
+
+void
+TestDenoiserPerf::testDenoise1080p()
+{
+    timeDenoise("1080p", 1920, 1080);
+}
+
+void
+TestDenoiserPerf::testDenoise4K()
+{
+    timeDenoise("4k", 3840, 2160);
+}
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
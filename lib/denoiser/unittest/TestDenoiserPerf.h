@@ -0,0 +1,58 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+// Timed tests of the pack/unpack kernels, of end-to-end denoise() on the OIDN CPU
+// device at 1080p and 4K, and of the a-trous filter's tiers at 1080p.  Each timing is
+// the best of several runs, and fails if it is more than DENOISER_PERF_THRESHOLD (a
+// fraction, 0.25 by default) slower than its entry in the DENOISER_PERF_BASELINE file.
+// A timing without an entry is only printed.  When DENOISER_PERF_RECORD names a file,
+// every timing is written to it to record a new baseline.  ctest sets the baseline and
+// threshold from the *_PERF_BASELINE and *_PERF_THRESHOLD CMake cache variables.
+class TestDenoiserPerf : public CppUnit::TestFixture
+{
+public:
+    void setUp() override;
+    void tearDown() override;
+
+    void testPack1080p();
+    void testPack4K();
+    void testDenoise1080p();
+    void testDenoise4K();
+    void testAtrous1080p();
+
+    CPPUNIT_TEST_SUITE(TestDenoiserPerf);
+    CPPUNIT_TEST(testPack1080p);
+    CPPUNIT_TEST(testPack4K);
+    CPPUNIT_TEST(testDenoise1080p);
+    CPPUNIT_TEST(testDenoise4K);
+    CPPUNIT_TEST(testAtrous1080p);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void timePack(const std::string& resolution, int width, int height);
+    void timeDenoise(const std::string& resolution, int width, int height);
+
+    // Times func and checks the best time against the baseline of name
+    void check(const std::string& name, int iterations, const std::function<void()>& func);
+
+    std::map<std::string, double> mBaseline; // milliseconds by test name
+    double mThreshold;
+    std::string mRecordPath;
+};
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
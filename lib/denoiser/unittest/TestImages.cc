@@ -0,0 +1,243 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestImages.h"
+
+#include <OpenImageDenoise/oidn.h>
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+namespace {
+
+// Uniform value in [0, 1) from a hash of the pixel and channel
+float
+hashUniform(int x, int y, int c)
+{
+    uint32_t h = static_cast<uint32_t>(x) * 0x8da6b343u ^
+                 static_cast<uint32_t>(y) * 0xd8163841u ^
+                 static_cast<uint32_t>(c) * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return static_cast<float>(h >> 8) * (1.f / 16777216.f);
+}
+
+} // namespace
+
+TestImages
+makeTestImages(int width, int height)
+{
+    TestImages images;
+    images.width = width;
+    images.height = height;
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    images.clean.resize(numPixels * 4);
+    images.beauty.resize(numPixels * 4);
+    images.albedo.resize(numPixels * 4);
+    images.normals.resize(numPixels * 4);
+
+    const float radius = 0.3f * height;
+    const float centerX = 0.6f * width;
+    const float centerY = 0.45f * height;
+    const float light[3] = { 0.4f, 0.5f, 0.768f };
+    const float halfway[3] = { 0.21f, 0.26f, 0.94f };
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const size_t i = (static_cast<size_t>(y) * width + x) * 4;
+            float albedo[3];
+            float normal[3] = { 0.f, 0.f, 1.f };
+            float shade = 0.2f + 0.8f * (y + 0.5f) / height;
+            float highlight = 0.f;
+            float alpha = static_cast<float>((x * 7 + y * 3) % 16) / 15.f;
+
+            const float dx = (x + 0.5f - centerX) / radius;
+            const float dy = (y + 0.5f - centerY) / radius;
+            const float d2 = dx * dx + dy * dy;
+            if (d2 < 1.f) {
+                normal[0] = dx;
+                normal[1] = -dy;
+                normal[2] = std::sqrt(1.f - d2);
+                albedo[0] = 0.8f;
+                albedo[1] = 0.2f;
+                albedo[2] = 0.1f;
+                shade = std::max(0.f, normal[0] * light[0] + normal[1] * light[1] +
+                                      normal[2] * light[2]);
+                highlight = 4.f * std::pow(std::max(0.f, normal[0] * halfway[0] +
+                                                         normal[1] * halfway[1] +
+                                                         normal[2] * halfway[2]), 40.f);
+                alpha = 1.f;
+            } else if ((x * 12 / width) % 2) {
+                albedo[0] = 0.7f;
+                albedo[1] = 0.6f;
+                albedo[2] = 0.5f;
+            } else {
+                albedo[0] = 0.3f;
+                albedo[1] = 0.35f;
+                albedo[2] = 0.45f;
+            }
+
+            for (int c = 0; c < 3; c++) {
+                const float clean = albedo[c] * shade + highlight;
+                // Roughly gaussian relative noise from the sum of four uniforms
+                const float noise = hashUniform(x, y, c) + hashUniform(x, y, c + 3) +
+                                    hashUniform(x, y, c + 6) + hashUniform(x, y, c + 9) - 2.f;
+                images.clean[i + c] = clean;
+                images.beauty[i + c] = clean * std::max(0.f, 1.f + noise);
+                images.albedo[i + c] = albedo[c];
+                images.normals[i + c] = normal[c];
+            }
+            images.clean[i + 3] = alpha;
+            images.beauty[i + 3] = alpha;
+            images.albedo[i + 3] = 1.f;
+            images.normals[i + 3] = 0.f;
+        }
+    }
+    return images;
+}
+
+std::vector<float>
+referenceDenoise(const TestImages& images,
+                 bool useAlbedo,
+                 bool useNormals,
+                 std::string* errorMsg)
+{
+    const size_t width = images.width;
+    const size_t height = images.height;
+    const size_t pixelStride = 4 * sizeof(float);
+    const size_t rowStride = width * pixelStride;
+    std::vector<float> output(width * height * 4, 0.f);
+
+    OIDNDevice device = oidnNewDevice(OIDN_DEVICE_TYPE_CPU);
+    oidnCommitDevice(device);
+    OIDNFilter filter = oidnNewFilter(device, "RT");
+    oidnSetSharedFilterImage(filter, "color", const_cast<float*>(images.beauty.data()),
+                             OIDN_FORMAT_FLOAT3, width, height, 0, pixelStride, rowStride);
+    if (useAlbedo) {
+        oidnSetSharedFilterImage(filter, "albedo", const_cast<float*>(images.albedo.data()),
+                                 OIDN_FORMAT_FLOAT3, width, height, 0, pixelStride, rowStride);
+    }
+    if (useNormals) {
+        oidnSetSharedFilterImage(filter, "normal", const_cast<float*>(images.normals.data()),
+                                 OIDN_FORMAT_FLOAT3, width, height, 0, pixelStride, rowStride);
+    }
+    oidnSetSharedFilterImage(filter, "output", output.data(),
+                             OIDN_FORMAT_FLOAT3, width, height, 0, pixelStride, rowStride);
+    oidnSetFilterBool(filter, "hdr", true);
+    oidnSetFilterInt(filter, "quality", OIDN_QUALITY_HIGH);
+    oidnCommitFilter(filter);
+    oidnExecuteFilter(filter);
+
+    const char* message = nullptr;
+    if (oidnGetDeviceError(device, &message) != OIDN_ERROR_NONE) {
+        *errorMsg = message ? message : "Unknown OIDN error";
+        output.clear();
+    }
+    oidnReleaseFilter(filter);
+    oidnReleaseDevice(device);
+    return output;
+}
+
+int
+oidnVersion()
+{
+    OIDNDevice device = oidnNewDevice(OIDN_DEVICE_TYPE_CPU);
+    const int version = oidnGetDeviceInt(device, "version");
+    oidnReleaseDevice(device);
+    return version;
+}
+
+std::vector<double>
+imageStatistics(const std::vector<float>& image, int width, int height)
+{
+    constexpr int gridSize = 4;
+    std::vector<double> statistics(3 + gridSize * gridSize, 0.0);
+    std::vector<size_t> cellPixels(gridSize * gridSize, 0);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float* pixel = &image[(static_cast<size_t>(y) * width + x) * 4];
+            for (int c = 0; c < 3; c++) {
+                statistics[c] += pixel[c];
+            }
+            const int cell = y * gridSize / height * gridSize + x * gridSize / width;
+            statistics[3 + cell] += 0.2126 * pixel[0] + 0.7152 * pixel[1] + 0.0722 * pixel[2];
+            cellPixels[cell]++;
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        statistics[c] /= static_cast<double>(width) * height;
+    }
+    for (int cell = 0; cell < gridSize * gridSize; cell++) {
+        statistics[3 + cell] /= cellPixels[cell];
+    }
+    return statistics;
+}
+
+float
+maxDifferenceRGB(const std::vector<float>& a, const std::vector<float>& b)
+{
+    float maxDifference = 0.f;
+    for (size_t i = 0; i < a.size(); i += 4) {
+        for (size_t c = 0; c < 3; c++) {
+            maxDifference = std::max(maxDifference, std::abs(a[i + c] - b[i + c]));
+        }
+    }
+    return maxDifference;
+}
+
+double
+rmseRGB(const std::vector<float>& a, const std::vector<float>& b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i += 4) {
+        for (size_t c = 0; c < 3; c++) {
+            const double difference = a[i + c] - b[i + c];
+            sum += difference * difference;
+        }
+    }
+    return std::sqrt(sum / (a.size() / 4 * 3));
+}
+
+double
+relativeRMSE(const std::vector<float>& a, const std::vector<float>& b)
+{
+    return rmseRGB(a, b) / rmseRGB(b, std::vector<float>(b.size(), 0.f));
+}
+
+bool
+sameAlpha(const std::vector<float>& a, const std::vector<float>& b)
+{
+    for (size_t i = 3; i < a.size(); i += 4) {
+        if (std::memcmp(&a[i], &b[i], sizeof(float))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint16_t
+floatToHalf(float value)
+{
+    return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+}
+
+float
+halfToFloat(uint16_t value)
+{
+    return _cvtsh_ss(value);
+}
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
@@ -0,0 +1,75 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace moonray {
+namespace denoiser {
+namespace unittest {
+
+// Largest difference from the golden images: the same OIDN filter on the same device
+// type, which may still split its work differently between the two devices
+constexpr float sGoldenTolerance = 1e-4f;
+
+// Largest RMS difference from plain denoise() for a frame denoised in pieces, relative
+// to the RMS value of the image.  See DenoiserOptions::memoryBudget.
+constexpr double sPieceTolerance = 0.01;
+
+// A synthetic frame: a lit sphere and a striped wall under a soft gradient, with a
+// bright highlight above 1 so the HDR path is exercised.  All images are RGBA.  The
+// noise is generated from a hash of the pixel, so the images are the same on every
+// platform and standard library.
+struct TestImages
+{
+    int width = 0;
+    int height = 0;
+    std::vector<float> clean;   // noise-free beauty
+    std::vector<float> beauty;  // noisy beauty, with a different alpha in every pixel
+    std::vector<float> albedo;
+    std::vector<float> normals;
+};
+
+TestImages makeTestImages(int width, int height);
+
+// The golden image: the beauty denoised through OIDN's own API on the CPU device with
+// the filter settings of OIDNDenoiserImpl, written as RGBA with alpha 0.  Returns an
+// empty vector and sets errorMsg if OIDN fails.
+std::vector<float> referenceDenoise(const TestImages& images,
+                                    bool useAlbedo,
+                                    bool useNormals,
+                                    std::string* errorMsg);
+
+// Version of the OIDN library linked at run time, as major * 10000 + minor * 100 + patch
+int oidnVersion();
+
+// Statistics of a denoised RGBA image that the checked-in goldens record: the mean of
+// each RGB channel, then the mean luminance of each cell of a 4x4 grid, row by row
+std::vector<double> imageStatistics(const std::vector<float>& image, int width, int height);
+
+// Compare only the RGB channels of two RGBA images of the same size
+float maxDifferenceRGB(const std::vector<float>& a, const std::vector<float>& b);
+double rmseRGB(const std::vector<float>& a, const std::vector<float>& b);
+// rmseRGB() relative to the RMS value of b
+double relativeRMSE(const std::vector<float>& a, const std::vector<float>& b);
+// True if the alpha channels of two RGBA images are bit for bit the same
+bool sameAlpha(const std::vector<float>& a, const std::vector<float>& b);
+
+// image, or null for a guide that is not used
+inline const float* guide(const std::vector<float>& image, bool use)
+{
+    return use ? image.data() : nullptr;
+}
+
+// Float <-> IEEE 754 binary16 conversion with round to nearest even, for half test
+// images independent of the kernels under test
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
+
+} // namespace unittest
+} // namespace denoiser
+} // namespace moonray
+
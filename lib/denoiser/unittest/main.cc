@@ -0,0 +1,15 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestDenoiser.h"
+#include "TestDenoiserFeatures.h"
+
+#include <scene_rdl2/pdevunit/pdevunit.h>
+
+int
+main(int argc, char *argv[])
+{
+    CPPUNIT_TEST_SUITE_REGISTRATION(moonray::denoiser::unittest::TestDenoiser);
+    CPPUNIT_TEST_SUITE_REGISTRATION(moonray::denoiser::unittest::TestDenoiserFeatures);
+    return pdevunit::run(argc, argv);
+}
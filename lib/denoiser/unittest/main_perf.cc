@@ -0,0 +1,13 @@
+// Copyright 2023-2024 DreamWorks Animation LLC
+// SPDX-License-Identifier: Apache-2.0
+
+#include "TestDenoiserPerf.h"
+
+#include <scene_rdl2/pdevunit/pdevunit.h>
+
+int
+main(int argc, char *argv[])
+{
+    CPPUNIT_TEST_SUITE_REGISTRATION(moonray::denoiser::unittest::TestDenoiserPerf);
+    return pdevunit::run(argc, argv);
+}